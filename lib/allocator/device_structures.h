@@ -100,9 +100,14 @@ struct pr_db_superblock {
 	uint64_t big_log_start_segment_dev_offt;
 	uint64_t big_log_offt_in_start_segment;
 	struct lsn last_lsn;
+	/*node sizes chosen at creation of the DB*/
+	uint32_t leaf_size[MAX_LEVELS];
+	uint32_t index_node_size[MAX_LEVELS];
 	uint32_t db_name_size;
 	uint32_t id; //in the array
 	uint32_t valid;
+	/*segment with the range tombstones of each device level tree, zero if it has none*/
+	uint64_t range_tombstones[MAX_LEVELS][NUM_TREES_PER_LEVEL];
 } __attribute__((packed, aligned(4096)));
 
 struct pr_superblock_array {
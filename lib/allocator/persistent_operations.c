@@ -17,6 +17,7 @@
 #include "../btree/gc.h"
 #include "../btree/kv_pairs.h"
 #include "../btree/lsn.h"
+#include "../btree/range_tombstone.h"
 #include "../common/common.h"
 #include "device_structures.h"
 #include "log_structures.h"
@@ -40,6 +41,34 @@ struct log_info {
 	uint64_t size;
 };
 
+/*Copies the trees of a device level to the superblock, trees without a root are zeroed*/
+static void pr_copy_level_info(struct db_descriptor *db_desc, uint8_t level_id)
+{
+	struct level_descriptor *level = &db_desc->levels[level_id];
+	struct pr_db_superblock *superblock = db_desc->db_superblock;
+	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+		struct node_header *root = level->root_w[tree_id] ? level->root_w[tree_id] : level->root_r[tree_id];
+		if (!root) {
+			superblock->root_r[level_id][tree_id] = 0;
+			superblock->first_segment[level_id][tree_id] = 0;
+			superblock->last_segment[level_id][tree_id] = 0;
+			superblock->offset[level_id][tree_id] = 0;
+			superblock->level_size[level_id][tree_id] = 0;
+			superblock->range_tombstones[level_id][tree_id] = 0;
+			continue;
+		}
+		assert(level->first_segment[tree_id]);
+		superblock->root_r[level_id][tree_id] = ABSOLUTE_ADDRESS(root);
+		superblock->first_segment[level_id][tree_id] = ABSOLUTE_ADDRESS(level->first_segment[tree_id]);
+		superblock->last_segment[level_id][tree_id] = ABSOLUTE_ADDRESS(level->last_segment[tree_id]);
+		superblock->offset[level_id][tree_id] = level->offset[tree_id];
+		superblock->level_size[level_id][tree_id] = level->level_size[tree_id];
+		superblock->range_tombstones[level_id][tree_id] =
+			level->range_tombstones[tree_id] ? level->range_tombstones[tree_id]->dev_offt : 0;
+		log_debug("Writing root[%u][%u] = %p", level_id, tree_id, (void *)root);
+	}
+}
+
 /**
  *<new_persistent_design>*/
 static void pr_flush_allocation_log_and_level_info(struct db_descriptor *db_desc, uint8_t src_level_id,
@@ -53,39 +82,12 @@ static void pr_flush_allocation_log_and_level_info(struct db_descriptor *db_desc
 	db_desc->db_superblock->allocation_log.size = rul_log.size;
 	db_desc->db_superblock->allocation_log.txn_id = rul_log.txn_id;
 
-	/*zero out Li*/
-	if (src_level_id) {
-		db_desc->db_superblock->root_r[src_level_id][0] = 0;
-		db_desc->db_superblock->first_segment[src_level_id][0] = 0;
-		db_desc->db_superblock->last_segment[src_level_id][0] = 0;
-		db_desc->db_superblock->offset[src_level_id][0] = 0;
-		db_desc->db_superblock->level_size[src_level_id][0] = 0;
-		db_desc->db_superblock->root_r[src_level_id][0] = 0;
-	}
-
-	if (dst_level_id) {
-		/*new info about my level*/
-		db_desc->db_superblock->root_r[dst_level_id][0] =
-			ABSOLUTE_ADDRESS(db_desc->levels[dst_level_id].root_r[tree_id]);
-
-		db_desc->db_superblock->first_segment[dst_level_id][0] =
-			ABSOLUTE_ADDRESS(db_desc->levels[dst_level_id].first_segment[tree_id]);
-		log_debug("Persist %u first was %lu", dst_level_id,
-			  ABSOLUTE_ADDRESS(db_desc->levels[dst_level_id].first_segment[tree_id]));
-		assert(db_desc->levels[dst_level_id].first_segment[tree_id]);
-
-		db_desc->db_superblock->last_segment[dst_level_id][0] =
-			ABSOLUTE_ADDRESS(db_desc->levels[dst_level_id].last_segment[tree_id]);
-
-		db_desc->db_superblock->offset[dst_level_id][0] = db_desc->levels[dst_level_id].offset[tree_id];
-
-		db_desc->db_superblock->level_size[dst_level_id][0] = db_desc->levels[dst_level_id].level_size[tree_id];
-		log_debug("Writing root[%u][%u] = %p", dst_level_id, tree_id,
-			  (void *)db_desc->levels[dst_level_id].root_r[tree_id]);
+	/*device levels keep their sorted runs in their trees, zero out Li and write the new Li+1*/
+	if (src_level_id)
+		pr_copy_level_info(db_desc, src_level_id);
 
-		db_desc->db_superblock->root_r[dst_level_id][0] =
-			ABSOLUTE_ADDRESS(db_desc->levels[dst_level_id].root_r[tree_id]);
-	}
+	if (dst_level_id)
+		pr_copy_level_info(db_desc, dst_level_id);
 
 	pr_flush_db_superblock(db_desc);
 }
@@ -289,10 +291,13 @@ update_superblock:
 }
 
 /**
- * Persists the results of a compaction from Li to Li+1 where i >= 1.
+ * Persists the results of a compaction from Li to Li+1 where i >= 1. The
+ * trees of both levels are written as they are in memory, so the compaction
+ * installs the new Li+1 before it calls it.
  * @param db_desc the descriptor of the database @param level_id the id of
  * level i+1
- * @param tree_id
+ * @param tree_id the tree of level i+1 whose transaction holds the
+ * allocations of the compaction
  */
 void pr_flush_compaction(struct db_descriptor *db_desc, uint8_t level_id, uint8_t tree_id)
 {
@@ -528,6 +533,9 @@ void validate_garbage_blob_bytes(struct large_log_segment_gc_entry *test_garbage
 	{
 		/* Suprresses possible null pointer dereference of cppcheck*/
 		assert(current_option);
+		/*big log segments are tracked from their allocation, only the ones with garbage count*/
+		if (!current_option->garbage_bytes)
+			continue;
 		++count_entries;
 		count_bytes += current_option->garbage_bytes;
 	}
@@ -565,6 +573,17 @@ static struct segment_array *find_N_last_blobs(struct db_descriptor *db_desc, ui
 		switch (log_entry->op_type) {
 		case RUL_LARGE_LOG_ALLOCATE:
 			//log_info("Found allocation for BIG log");
+			HASH_FIND(hh, garbage_bytes_for_blobs, &log_entry->dev_offt, sizeof(log_entry->dev_offt), node);
+			if (!node) {
+				node = calloc(1, sizeof(struct large_log_segment_gc_entry));
+				node->segment_dev_offt = log_entry->dev_offt;
+				node->heap_id = GC_NOT_A_VICTIM;
+				HASH_ADD(hh, garbage_bytes_for_blobs, segment_dev_offt, sizeof(log_entry->dev_offt),
+					 node);
+			}
+			/*the age of the segment for GC counts from its append*/
+			node->append_clock = log_entry->log_clock;
+
 			if (log_entry->dev_offt == start_segment_offt)
 				start_tracing_segments = 1;
 
@@ -587,6 +606,12 @@ static struct segment_array *find_N_last_blobs(struct db_descriptor *db_desc, ui
 			HASH_FIND_PTR(root_blob_entry, &log_entry->dev_offt, b_entry);
 			if (b_entry != NULL)
 				segments->segments[b_entry->array_id] = 0;
+			/*a freed segment holds no garbage to reclaim*/
+			HASH_FIND(hh, garbage_bytes_for_blobs, &log_entry->dev_offt, sizeof(log_entry->dev_offt), node);
+			if (node) {
+				HASH_DEL(garbage_bytes_for_blobs, node);
+				free(node);
+			}
 			break;
 		}
 		case BLOB_GARBAGE_BYTES:
@@ -601,6 +626,9 @@ static struct segment_array *find_N_last_blobs(struct db_descriptor *db_desc, ui
 				temp_segment_entry->segment_dev_offt = log_entry->dev_offt;
 				temp_segment_entry->garbage_bytes = log_entry->blob_garbage_bytes;
 				temp_segment_entry->segment_moved = 0;
+				/*no allocation entry was replayed for the segment, it counts as the oldest*/
+				temp_segment_entry->append_clock = 0;
+				temp_segment_entry->heap_id = GC_NOT_A_VICTIM;
 
 				HASH_ADD(hh, garbage_bytes_for_blobs, segment_dev_offt, sizeof(log_entry->dev_offt),
 					 temp_segment_entry);
@@ -624,6 +652,12 @@ static struct segment_array *find_N_last_blobs(struct db_descriptor *db_desc, ui
 	if (garbage_bytes_for_blobs) {
 		validate_garbage_blob_bytes(garbage_bytes_for_blobs);
 		db_desc->segment_ht = garbage_bytes_for_blobs;
+		/*the recovered garbage totals and append clocks order the GC victims as before the restart*/
+		struct large_log_segment_gc_entry *tmp_segment = NULL;
+		HASH_ITER(hh, garbage_bytes_for_blobs, node, tmp_segment)
+		{
+			gc_update_victim(db_desc, node);
+		}
 	}
 
 	HASH_ITER(hh, root_blob_entry, current_entry, tmp)
@@ -651,6 +685,8 @@ struct log_cursor {
 	enum log_type type;
 	uint8_t valid;
 	uint8_t tombstone : 1;
+	uint8_t range_delete : 1;
+	uint8_t single_delete : 1;
 };
 
 static char *get_position_in_segment(struct log_cursor *cursor)
@@ -666,6 +702,8 @@ void prepare_cursor_op(struct log_cursor *cursor)
 
 	cursor->entry.par_kv = (struct kv_splice *)get_position_in_segment(cursor);
 	cursor->tombstone = is_tombstone_kv_pair(kv_pair);
+	cursor->range_delete = is_range_delete_kv_pair(kv_pair);
+	cursor->single_delete = is_single_delete_kv_pair(kv_pair);
 	cursor->offt_in_segment += get_kv_size(cursor->entry.par_kv);
 }
 
@@ -860,6 +898,22 @@ void recover_L0(struct db_descriptor *db_desc)
 		else if (compare_lsns(&cursor[SMALL_LOG]->entry.lsn, &cursor[BIG_LOG]->entry.lsn) < 0)
 			choice = SMALL_LOG;
 
+		if (cursor[choice]->range_delete) {
+			/*the key of a range delete holds the start and the end of the range*/
+			struct key_splice *start = (struct key_splice *)get_key_offset_in_kv(kvs[choice]->par_kv);
+			struct key_splice *end = (struct key_splice *)(get_key_splice_key_offset(start) +
+									get_key_splice_key_size(start));
+			const char *range_error = delete_key_range(
+				&handle, get_key_splice_key_offset(start), get_key_splice_key_size(start),
+				get_key_splice_key_offset(end), get_key_splice_key_size(end));
+			if (range_error) {
+				log_fatal("Range delete failed reason = %s, exiting", range_error);
+				BUG_ON();
+			}
+			kvs[choice] = get_next_log_entry(cursor[choice]);
+			continue;
+		}
+
 		char *error_message = NULL;
 		int32_t key_size = get_key_size(kvs[choice]->par_kv);
 		void *key = get_key_offset_in_kv(kvs[choice]->par_kv);
@@ -867,6 +921,8 @@ void recover_L0(struct db_descriptor *db_desc)
 		void *value = get_value_offset_in_kv(kvs[choice]->par_kv, kvs[choice]->par_kv->key_size);
 
 		request_type op_type = !cursor[choice]->tombstone ? insertOp : deleteOp;
+		if (cursor[choice]->single_delete)
+			op_type = singleDeleteOp;
 		insert_key_value(&handle, key, value, key_size, value_size, op_type, error_message);
 
 		if (error_message) {
@@ -49,7 +49,8 @@ struct rul_log_entry {
 	uint64_t txn_id;
 	uint64_t dev_offt;
 	uint32_t blob_garbage_bytes;
-	char pad[4];
+	/*for big log allocations, the log clock of GC when the segment became the tail*/
+	uint32_t log_clock;
 	enum rul_op_type op_type;
 	uint32_t size;
 } __attribute__((packed));
@@ -17,6 +17,7 @@
 #include "../btree/btree.h"
 #include "../btree/conf.h"
 #include "../btree/index_node.h"
+#include "../btree/io_limiter.h"
 #include "../btree/kv_pairs.h"
 #include "../btree/set_options.h"
 #include "../scanner/scanner.h"
@@ -25,10 +26,12 @@
 #include <log.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #define PAR_MAX_PREALLOCATED_SIZE 256
-#define NUM_OF_OPTIONS 5
+#define NUM_OF_OPTIONS 30
 
 char *par_format(char *device_name, uint32_t max_regions_num)
 {
@@ -53,7 +56,7 @@ const char *par_close(par_handle handle)
 enum kv_category get_kv_category(int32_t key_size, int32_t value_size, request_type operation,
 				 const char **error_message)
 {
-	if (paddingOp == operation || unknownOp == operation) {
+	if (deleteRangeOp == operation || paddingOp == operation || unknownOp == operation) {
 		*error_message = "Unknown operation provided %d";
 		return BIG_INLOG;
 	}
@@ -61,12 +64,48 @@ enum kv_category get_kv_category(int32_t key_size, int32_t value_size, request_t
 	return calculate_KV_category(key_size, value_size, operation);
 }
 
+/*In TTL mode values are stored followed by the time they expire at*/
+static struct par_put_metadata par_put_with_expiry(par_handle handle, struct par_key_value *key_value,
+						   uint64_t expiry, const char **error_message)
+{
+	int32_t value_size = key_value->v.val_size + KV_EXPIRY_SIZE;
+	char buf[PAR_MAX_PREALLOCATED_SIZE];
+	char *value = value_size > PAR_MAX_PREALLOCATED_SIZE ? malloc(value_size) : buf;
+	if (!value) {
+		log_fatal("Malloc failed");
+		BUG_ON();
+	}
+	memcpy(value, key_value->v.val_buffer, key_value->v.val_size);
+	set_value_expiry(value, value_size, expiry);
+	struct par_put_metadata metadata = insert_key_value((db_handle *)handle, (char *)key_value->k.data, value,
+							    key_value->k.size, value_size, insertOp, *error_message);
+	if (value != buf)
+		free(value);
+	return metadata;
+}
+
 struct par_put_metadata par_put(par_handle handle, struct par_key_value *key_value, const char **error_message)
 {
+	if (((db_handle *)handle)->db_options.options[TTL_MODE].value)
+		return par_put_with_expiry(handle, key_value, 0, error_message);
 	return insert_key_value((db_handle *)handle, (char *)key_value->k.data, (char *)key_value->v.val_buffer,
 				key_value->k.size, key_value->v.val_size, insertOp, *error_message);
 }
 
+struct par_put_metadata par_put_with_ttl(par_handle handle, struct par_key_value *key_value, uint32_t ttl_sec,
+					 const char **error_message)
+{
+	if (!((db_handle *)handle)->db_options.options[TTL_MODE].value) {
+		*error_message = "TTL_MODE is not set for the DB";
+		struct par_put_metadata invalid_put_metadata = { .lsn = UINT64_MAX,
+								 .offset_in_log = UINT64_MAX,
+								 .key_value_category = SMALL_INPLACE };
+		return invalid_put_metadata;
+	}
+	uint64_t expiry = ttl_sec ? (uint64_t)time(NULL) + ttl_sec : 0;
+	return par_put_with_expiry(handle, key_value, expiry, error_message);
+}
+
 /**
  * Execute a put request of the key given a kv_formated key_value
  * @param handle, the db handle that we initiated with db open
@@ -75,6 +114,16 @@ struct par_put_metadata par_put(par_handle handle, struct par_key_value *key_val
  * */
 struct par_put_metadata par_put_serialized(par_handle handle, char *serialized_key_value, const char **error_message)
 {
+	if (((db_handle *)handle)->db_options.options[TTL_MODE].value) {
+		/*the value is rebuilt with the expiry time that reads and compaction filters expect*/
+		struct kv_splice *kv = (struct kv_splice *)serialized_key_value;
+		int32_t key_size = get_key_size(kv);
+		struct par_key_value key_value = { .k.size = key_size,
+						   .k.data = get_key_offset_in_kv(kv),
+						   .v.val_size = get_value_size(kv),
+						   .v.val_buffer = get_value_offset_in_kv(kv, key_size) };
+		return par_put_with_expiry(handle, &key_value, 0, error_message);
+	}
 	return serialized_insert_key_value((db_handle *)handle, serialized_key_value, *error_message);
 }
 
@@ -93,6 +142,36 @@ static inline int par_serialize_to_key_format(struct par_key *key, char **buf, i
 	return ret;
 }
 
+/*Gets report their latency to the background I/O limiter, which may tune its rate from it*/
+static void par_find_key(struct db_handle *hd, struct lookup_operation *get_op)
+{
+	struct io_limiter *io_limiter = hd->db_desc->io_limiter;
+	if (0 == io_limiter->target_latency_usec) {
+		find_key(get_op);
+		return;
+	}
+	uint64_t start = io_limiter_get_usec();
+	find_key(get_op);
+	io_limiter_report_latency(io_limiter, io_limiter_get_usec() - start);
+}
+
+/*In TTL mode the expiry time of the value is stripped and expired KVs are not found*/
+static void par_strip_expiry(struct db_handle *hd, struct lookup_operation *get_op, bool allocated)
+{
+	if (!hd->db_options.options[TTL_MODE].value || !get_op->found || get_op->buffer_overflow)
+		return;
+	if (!is_value_expired(get_op->buffer_to_pack_kv, get_op->size, time(NULL))) {
+		get_op->size = get_value_size_without_expiry(get_op->size);
+		return;
+	}
+	get_op->found = 0;
+	get_op->size = 0;
+	if (allocated) {
+		free(get_op->buffer_to_pack_kv);
+		get_op->buffer_to_pack_kv = NULL;
+	}
+}
+
 void par_get(par_handle handle, struct par_key *key, struct par_value *value, const char **error_message)
 {
 	if (value == NULL) {
@@ -120,7 +199,8 @@ void par_get(par_handle handle, struct par_key *key, struct par_value *value, co
 	get_op.buffer_to_pack_kv = (char *)value->val_buffer;
 	get_op.size = value->val_buffer_size;
 
-	find_key(&get_op);
+	par_find_key(hd, &get_op);
+	par_strip_expiry(hd, &get_op, NULL == value->val_buffer);
 	if (malloced)
 		free(key_buf);
 
@@ -156,7 +236,8 @@ void par_get_serialized(par_handle handle, char *key_serialized, struct par_valu
 	get_op.buffer_to_pack_kv = (char *)value->val_buffer;
 	get_op.size = value->val_buffer_size;
 
-	find_key(&get_op);
+	par_find_key(hd, &get_op);
+	par_strip_expiry(hd, &get_op, NULL == value->val_buffer);
 
 	if (!get_op.found)
 		*error_message = "key not found";
@@ -176,6 +257,8 @@ par_ret_code par_exists(par_handle handle, struct par_key *key)
 	int malloced = par_serialize_to_key_format(key, &key_buf, PAR_MAX_PREALLOCATED_SIZE);
 
 	struct db_handle *hd = (struct db_handle *)handle;
+	/*the expiry time of the value decides if it exists in TTL mode*/
+	uint8_t ttl_mode = hd->db_options.options[TTL_MODE].value != 0;
 	/*Prepare lookup reply*/
 	struct lookup_operation get_op = { .db_desc = hd->db_desc,
 					   .key_buf = key_buf,
@@ -183,9 +266,12 @@ par_ret_code par_exists(par_handle handle, struct par_key *key)
 					   .size = 0,
 					   .buffer_overflow = 1,
 					   .found = 0,
-					   .retrieve = 0 };
+					   .retrieve = ttl_mode };
 
 	find_key(&get_op);
+	par_strip_expiry(hd, &get_op, true);
+	if (get_op.found && ttl_mode)
+		free(get_op.buffer_to_pack_kv);
 	if (malloced)
 		free(key_buf);
 
@@ -201,6 +287,18 @@ void par_delete(par_handle handle, struct par_key *key, const char **error_messa
 	insert_key_value(hd, (void *)key->data, "empty", key->size, 0, deleteOp, *error_message);
 }
 
+void par_single_delete(par_handle handle, struct par_key *key, const char **error_message)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	insert_key_value(hd, (void *)key->data, "empty", key->size, 0, singleDeleteOp, *error_message);
+}
+
+void par_delete_range(par_handle handle, struct par_key *start, struct par_key *end, const char **error_message)
+{
+	*error_message = delete_key_range((db_handle *)handle, (void *)start->data, start->size, (void *)end->data,
+					  end->size);
+}
+
 /*scanner staff*/
 
 struct par_scanner {
@@ -212,6 +310,36 @@ struct par_scanner {
 	char *kv_buf;
 };
 
+/*Copies the KV the scanner points to, false if it has expired in TTL mode*/
+static bool par_fetch_scanner_kv(struct par_scanner *par_s)
+{
+	struct scannerHandle *scanner_hd = par_s->sc;
+	struct bt_kv_log_address log_address = { .addr = scanner_hd->keyValue, .tail_id = UINT8_MAX, .in_tail = 0 };
+	if (!scanner_hd->kv_level_id && BIG_INLOG == scanner_hd->kv_cat)
+		log_address = bt_get_kv_log_address(&scanner_hd->db->db_desc->big_log,
+						    ABSOLUTE_ADDRESS(scanner_hd->keyValue));
+
+	uint32_t kv_size = get_kv_size((struct kv_splice *)log_address.addr);
+	if (kv_size > par_s->buf_size) {
+		//log_info("Space not enough needing %u got %u", kv_size, par_s->buf_size);
+		if (par_s->allocated)
+			free(par_s->kv_buf);
+
+		par_s->buf_size = kv_size;
+		par_s->allocated = 1;
+		par_s->kv_buf = calloc(1, par_s->buf_size);
+	}
+	memcpy(par_s->kv_buf, log_address.addr, kv_size);
+	if (log_address.in_tail)
+		bt_done_with_value_log_address(&scanner_hd->db->db_desc->big_log, &log_address);
+
+	if (!scanner_hd->db->db_options.options[TTL_MODE].value)
+		return true;
+	struct kv_splice *kv_buf = (struct kv_splice *)par_s->kv_buf;
+	return !is_value_expired(get_value_offset_in_kv(kv_buf, get_key_size(kv_buf)), get_value_size(kv_buf),
+				 time(NULL));
+}
+
 par_scanner par_init_scanner(par_handle handle, struct par_key *key, par_seek_mode mode, const char **error_message)
 {
 	if (key && key->size + sizeof(key->size) > PAR_MAX_PREALLOCATED_SIZE) {
@@ -261,24 +389,12 @@ par_scanner par_init_scanner(par_handle handle, struct par_key *key, par_seek_mo
 		return p_scanner;
 	}
 
-	struct bt_kv_log_address log_address = { .addr = scanner->keyValue, .tail_id = UINT8_MAX, .in_tail = 0 };
-	if (!scanner->kv_level_id && BIG_INLOG == scanner->kv_cat)
-		log_address =
-			bt_get_kv_log_address(&scanner->db->db_desc->big_log, ABSOLUTE_ADDRESS(scanner->keyValue));
-
-	uint32_t kv_size = get_kv_size((struct kv_splice *)log_address.addr);
-	if (kv_size > p_scanner->buf_size) {
-		//log_info("Space not enougn needing %u got %u", kv_size, par_s->buf_size);
-		if (p_scanner->allocated)
-			free(p_scanner->kv_buf);
-		p_scanner->buf_size = kv_size;
-		p_scanner->allocated = 1;
-		p_scanner->kv_buf = calloc(1, p_scanner->buf_size);
+	while (!par_fetch_scanner_kv(p_scanner)) {
+		if (!get_next(scanner)) {
+			p_scanner->valid = 0;
+			break;
+		}
 	}
-	memcpy(p_scanner->kv_buf, log_address.addr, kv_size);
-	if (log_address.in_tail)
-		bt_done_with_value_log_address(&scanner->db->db_desc->big_log, &log_address);
-
 	return p_scanner;
 }
 
@@ -297,29 +413,12 @@ int par_get_next(par_scanner sc)
 {
 	struct par_scanner *par_s = (struct par_scanner *)sc;
 	struct scannerHandle *scanner_hd = par_s->sc;
-	if (!get_next(scanner_hd)) {
-		par_s->valid = 0;
-		return 0;
-	}
-
-	struct bt_kv_log_address log_address = { .addr = scanner_hd->keyValue, .tail_id = UINT8_MAX, .in_tail = 0 };
-	if (!scanner_hd->kv_level_id && BIG_INLOG == scanner_hd->kv_cat)
-		log_address = bt_get_kv_log_address(&scanner_hd->db->db_desc->big_log,
-						    ABSOLUTE_ADDRESS(scanner_hd->keyValue));
-
-	uint32_t kv_size = get_kv_size((struct kv_splice *)log_address.addr);
-	if (kv_size > par_s->buf_size) {
-		//log_info("Space not enough needing %u got %u", kv_size, par_s->buf_size);
-		if (par_s->allocated)
-			free(par_s->kv_buf);
-
-		par_s->buf_size = kv_size;
-		par_s->allocated = 1;
-		par_s->kv_buf = calloc(1, par_s->buf_size);
-	}
-	memcpy(par_s->kv_buf, log_address.addr, kv_size);
-	if (log_address.in_tail)
-		bt_done_with_value_log_address(&scanner_hd->db->db_desc->big_log, &log_address);
+	do {
+		if (!get_next(scanner_hd)) {
+			par_s->valid = 0;
+			return 0;
+		}
+	} while (!par_fetch_scanner_kv(par_s));
 	return 1;
 }
 
@@ -344,6 +443,8 @@ struct par_value par_get_value(par_scanner sc)
 	struct par_value val = { .val_size = get_value_size(kv_buf),
 				 .val_buffer = get_value_offset_in_kv(kv_buf, get_key_size(kv_buf)),
 				 .val_buffer_size = get_value_size(kv_buf) };
+	if (par_s->sc->db->db_options.options[TTL_MODE].value)
+		val.val_size = get_value_size_without_expiry(val.val_size);
 
 	return val;
 }
@@ -357,12 +458,59 @@ par_ret_code par_sync(par_handle handle)
 	return PAR_FAILURE;
 }
 
+uint32_t par_get_compaction_scores(par_handle handle, double *scores, uint32_t num_levels)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	uint32_t level_id = 0;
+	for (; level_id < num_levels && level_id < MAX_LEVELS; ++level_id)
+		scores[level_id] = hd->db_desc->levels[level_id].compaction_score;
+	return level_id;
+}
+
+void par_flush(par_handle handle)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	comp_request_flush(hd->db_desc);
+}
+
+void par_compact_range(par_handle handle, struct par_key *start, struct par_key *end)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	comp_request_range_compaction(hd->db_desc, start, end);
+}
+
+void par_get_compaction_progress(par_handle handle, struct par_compaction_progress *progress)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	comp_get_manual_progress(hd->db_desc, progress);
+}
+
+void par_set_bg_io_rate(par_handle handle, uint64_t bytes_per_sec)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	io_limiter_set_rate(hd->db_desc->io_limiter, bytes_per_sec);
+}
+
+uint64_t par_get_bg_io_rate(par_handle handle)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	return io_limiter_get_rate(hd->db_desc->io_limiter);
+}
+
+void par_set_compaction_filter(par_handle handle, par_compaction_filter filter, void *context)
+{
+	struct db_handle *hd = (struct db_handle *)handle;
+	hd->db_desc->compaction_filter_context = context;
+	hd->db_desc->compaction_filter = filter;
+}
+
 /**
  * Create, populate and return a buffer containing the default db_options values from option.yml file. Callers can modify the buffer at will.
  * @retval Array with NUM_OF_OPTIONS sizeo of struct options_desc
  */
 struct par_options_desc *par_get_default_options(void)
 {
+	_Static_assert(FULL_KEYS_IN_LEAVES + 1 == NUM_OF_OPTIONS, "NUM_OF_OPTIONS does not match par_options");
 	struct par_options_desc *default_db_options =
 		(struct par_options_desc *)calloc(NUM_OF_OPTIONS, sizeof(struct par_options_desc));
 
@@ -387,12 +535,65 @@ struct par_options_desc *par_get_default_options(void)
 	check_option(dboptions, "gc_interval", &option);
 	uint64_t gc_interval = option->value.count;
 
+	check_option(dboptions, "leaf_compression", &option);
+	uint64_t leaf_compression = option->value.count;
+
+	check_option(dboptions, "leaf_cache_size", &option);
+	uint64_t leaf_cache_size = MB(option->value.count);
+
+	check_option(dboptions, "subcompactions", &option);
+	uint64_t subcompactions = option->value.count;
+
+	check_option(dboptions, "bg_threads", &option);
+	uint64_t bg_threads = option->value.count;
+
+	check_option(dboptions, "partition_size", &option);
+	uint64_t partition_size = MB(option->value.count);
+
+	check_option(dboptions, "level_runs", &option);
+	uint64_t level_runs = option->value.count;
+
+	check_option(dboptions, "bg_io_rate", &option);
+	uint64_t bg_io_rate = MB(option->value.count);
+
+	check_option(dboptions, "bg_io_target_latency", &option);
+	uint64_t bg_io_target_latency = option->value.count;
+
+	check_option(dboptions, "ttl_mode", &option);
+	uint64_t ttl_mode = option->value.count;
+
+	check_option(dboptions, "full_keys_in_leaves", &option);
+	uint64_t full_keys_in_leaves = option->value.count;
+
+	/*leaf and index node sizes are given in KB*/
+	char option_name[64];
+	for (int level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+		snprintf(option_name, sizeof(option_name), "level%d_leaf_size", level_id);
+		check_option(dboptions, option_name, &option);
+		default_db_options[LEVEL0_LEAF_SIZE + level_id].value = KB(option->value.count);
+		if (0 == level_id)
+			continue;
+		snprintf(option_name, sizeof(option_name), "level%d_index_node_size", level_id);
+		check_option(dboptions, option_name, &option);
+		default_db_options[LEVEL1_INDEX_NODE_SIZE + level_id - 1].value = KB(option->value.count);
+	}
+
 	//fill default_db_options based on the default values
 	default_db_options[LEVEL0_SIZE].value = level0_size;
 	default_db_options[GROWTH_FACTOR].value = growth_factor;
 	default_db_options[LEVEL_MEDIUM_INPLACE].value = level_medium_inplace;
 	default_db_options[MEDIUM_LOG_LRU_CACHE_SIZE].value = LRU_cache_size;
 	default_db_options[GC_INTERVAL].value = gc_interval;
+	default_db_options[LEAF_COMPRESSION].value = leaf_compression;
+	default_db_options[LEAF_CACHE_SIZE].value = leaf_cache_size;
+	default_db_options[SUBCOMPACTIONS].value = subcompactions;
+	default_db_options[BG_THREADS].value = bg_threads;
+	default_db_options[PARTITION_SIZE].value = partition_size;
+	default_db_options[LEVEL_RUNS].value = level_runs;
+	default_db_options[BG_IO_RATE].value = bg_io_rate;
+	default_db_options[BG_IO_TARGET_LATENCY].value = bg_io_target_latency;
+	default_db_options[TTL_MODE].value = ttl_mode;
+	default_db_options[FULL_KEYS_IN_LEAVES].value = full_keys_in_leaves;
 
 	return default_db_options;
 }
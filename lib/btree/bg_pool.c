@@ -0,0 +1,156 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include "bg_pool.h"
+#include "../common/common.h"
+#include "conf.h"
+#include "io_limiter.h"
+#include <assert.h>
+#include <log.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+struct bg_job {
+	bg_job_func func;
+	void *args;
+	struct bg_job *next;
+};
+
+struct bg_queue {
+	struct bg_job *head;
+	struct bg_job *tail;
+};
+
+/*The pool of the process, protected by its lock*/
+static struct bg_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct bg_queue queue[BG_NUM_PRIORITIES];
+	pthread_t *workers;
+	uint32_t num_workers;
+	uint32_t reference_count;
+	uint8_t stop;
+} bg_pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/*Caller holds the lock*/
+static struct bg_job *bg_pool_dequeue(void)
+{
+	for (int priority = 0; priority < BG_NUM_PRIORITIES; ++priority) {
+		struct bg_queue *queue = &bg_pool.queue[priority];
+		struct bg_job *job = queue->head;
+		if (!job)
+			continue;
+		queue->head = job->next;
+		if (!queue->head)
+			queue->tail = NULL;
+		return job;
+	}
+	return NULL;
+}
+
+static void *bg_pool_worker(void *args)
+{
+	(void)args;
+	pthread_setname_np(pthread_self(), "bg_worker");
+	/*compactions and the GC yield the device to foreground requests*/
+	io_limiter_set_background_priority();
+	MUTEX_LOCK(&bg_pool.lock);
+	while (1) {
+		struct bg_job *job = bg_pool_dequeue();
+		if (!job) {
+			/*the queues are empty, so the jobs submitted before the last put are done*/
+			if (bg_pool.stop)
+				break;
+			pthread_cond_wait(&bg_pool.cond, &bg_pool.lock);
+			continue;
+		}
+		MUTEX_UNLOCK(&bg_pool.lock);
+		job->func(job->args);
+		free(job);
+		MUTEX_LOCK(&bg_pool.lock);
+	}
+	MUTEX_UNLOCK(&bg_pool.lock);
+	return NULL;
+}
+
+void bg_pool_get(uint32_t num_threads)
+{
+	MUTEX_LOCK(&bg_pool.lock);
+	if (bg_pool.reference_count++) {
+		MUTEX_UNLOCK(&bg_pool.lock);
+		return;
+	}
+
+	bg_pool.num_workers = num_threads ? num_threads : 1;
+	bg_pool.stop = 0;
+	bg_pool.workers = calloc(bg_pool.num_workers, sizeof(pthread_t));
+	if (!bg_pool.workers) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	for (uint32_t i = 0; i < bg_pool.num_workers; ++i) {
+		if (pthread_create(&bg_pool.workers[i], NULL, bg_pool_worker, NULL) != 0) {
+			log_fatal("Failed to start background worker");
+			BUG_ON();
+		}
+	}
+	log_info("Started background pool with %u workers", bg_pool.num_workers);
+	MUTEX_UNLOCK(&bg_pool.lock);
+}
+
+void bg_pool_put(void)
+{
+	MUTEX_LOCK(&bg_pool.lock);
+	assert(bg_pool.reference_count > 0);
+	if (--bg_pool.reference_count) {
+		MUTEX_UNLOCK(&bg_pool.lock);
+		return;
+	}
+	bg_pool.stop = 1;
+	pthread_cond_broadcast(&bg_pool.cond);
+	MUTEX_UNLOCK(&bg_pool.lock);
+
+	for (uint32_t i = 0; i < bg_pool.num_workers; ++i) {
+		if (pthread_join(bg_pool.workers[i], NULL) != 0) {
+			log_fatal("Failed to join background worker");
+			BUG_ON();
+		}
+	}
+	free(bg_pool.workers);
+	bg_pool.workers = NULL;
+	log_info("Stopped background pool");
+}
+
+void bg_pool_submit(bg_job_func func, void *args, enum bg_job_priority priority)
+{
+	struct bg_job *job = calloc(1, sizeof(struct bg_job));
+	if (!job) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	job->func = func;
+	job->args = args;
+
+	MUTEX_LOCK(&bg_pool.lock);
+	assert(bg_pool.reference_count > 0 && !bg_pool.stop);
+	struct bg_queue *queue = &bg_pool.queue[priority];
+	if (queue->tail)
+		queue->tail->next = job;
+	else
+		queue->head = job;
+	queue->tail = job;
+	pthread_cond_signal(&bg_pool.cond);
+	MUTEX_UNLOCK(&bg_pool.lock);
+}
@@ -0,0 +1,44 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef BG_POOL_H
+#define BG_POOL_H
+#include <stdint.h>
+
+/*Workers always run the queued job of the highest priority, the first one comes first*/
+enum bg_job_priority { BG_L0_COMPACTION_PRIORITY = 0, BG_COMPACTION_PRIORITY, BG_GC_PRIORITY, BG_NUM_PRIORITIES };
+
+typedef void (*bg_job_func)(void *args);
+
+/**
+ * Takes a reference to the background pool of the process that runs the
+ * compactions and the garbage collection of all the DBs. Every open DB holds
+ * one. The first reference starts the pool with num_threads workers, later
+ * ones share it whatever their num_threads. Callers serialize bg_pool_get
+ * and bg_pool_put, DBs take and drop their reference under init_lock.
+ */
+void bg_pool_get(uint32_t num_threads);
+
+/**
+ * Drops a reference to the pool. The last one waits for the queued jobs to
+ * complete and stops the workers.
+ */
+void bg_pool_put(void);
+
+/**
+ * Queues func(args) for a worker of the pool. Jobs must not block waiting for
+ * other jobs, which may be queued behind them while all the workers are busy.
+ */
+void bg_pool_submit(bg_job_func func, void *args, enum bg_job_priority priority);
+
+#endif
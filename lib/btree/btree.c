@@ -20,11 +20,17 @@
 #include "../common/common.h"
 #include "../include/parallax/parallax.h"
 #include "../include/parallax/structures.h"
+#include "../scanner/scanner.h"
+#include "bg_pool.h"
 #include "conf.h"
 #include "dynamic_leaf.h"
 #include "gc.h"
 #include "index_node.h"
+#include "io_limiter.h"
+#include "leaf_cache.h"
 #include "lsn.h"
+#include "medium_log_LRU_cache.h"
+#include "range_tombstone.h"
 #include "segment_allocator.h"
 
 #include <assert.h>
@@ -497,6 +503,19 @@ static void restore_db(struct db_descriptor *db_desc, uint32_t region_idx)
 				db_desc->levels[level_id].root_r[tree_id] = NULL;
 
 			db_desc->levels[level_id].root_w[tree_id] = db_desc->levels[level_id].root_r[tree_id];
+			/*L0 trees get their range tombstones back from the log*/
+			db_desc->levels[level_id].range_tombstones[tree_id] = NULL;
+			uint64_t range_tombstones_offt = superblock->range_tombstones[level_id][tree_id];
+			if (level_id && range_tombstones_offt) {
+				struct range_tombstones *range_tombstones =
+					rt_deserialize(REAL_ADDRESS(range_tombstones_offt), SEGMENT_SIZE);
+				if (!range_tombstones) {
+					log_fatal("Corrupted range tombstones of level[%u][%u]", level_id, tree_id);
+					BUG_ON();
+				}
+				range_tombstones->dev_offt = range_tombstones_offt;
+				db_desc->levels[level_id].range_tombstones[tree_id] = range_tombstones;
+			}
 			if (db_desc->levels[level_id].root_r[tree_id])
 				log_info("Restored root[%u][%u] = %p", level_id, tree_id,
 					 (void *)db_desc->levels[level_id].root_r[tree_id]);
@@ -550,13 +569,58 @@ static db_descriptor *get_db_from_volume(char *volume_name, char *db_name, par_d
 	return db_desc;
 }
 
+static const char *bt_check_node_sizes(par_db_options *db_options)
+{
+	for (uint8_t level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+		uint64_t leaf_size = db_options->options[LEVEL0_LEAF_SIZE + level_id].value;
+		if (leaf_size < PAGE_SIZE || leaf_size > MAX_LEAF_SIZE || leaf_size % PAGE_SIZE)
+			return "Leaf size must be a multiple of 4 KB that fits in a segment";
+		if (0 == level_id)
+			continue;
+		uint64_t index_node_size = db_options->options[LEVEL1_INDEX_NODE_SIZE + level_id - 1].value;
+		if (index_node_size < INDEX_NODE_SIZE || index_node_size > INDEX_NODE_MAX_SIZE ||
+		    index_node_size % PAGE_SIZE)
+			return "Index node size must be a multiple of 4 KB between 8 KB and 64 KB";
+	}
+	return NULL;
+}
+
+/**
+ * Node sizes are a property of the on device format of the DB. They are
+ * taken from the options when the DB is created and from the superblock
+ * afterwards. Volumes formatted before node sizes were kept in the superblock
+ * have a different superblock and leaf layout and must be formatted again.
+ */
+static void bt_init_node_sizes(struct db_descriptor *db_desc, par_db_options *db_options, bool new_db)
+{
+	struct pr_db_superblock *superblock = db_desc->db_superblock;
+	if (new_db) {
+		for (uint8_t level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+			superblock->leaf_size[level_id] = db_options->options[LEVEL0_LEAF_SIZE + level_id].value;
+			superblock->index_node_size[level_id] =
+				level_id > 0 ? db_options->options[LEVEL1_INDEX_NODE_SIZE + level_id - 1].value :
+					       INDEX_NODE_SIZE;
+		}
+	}
+
+	if (0 == superblock->leaf_size[0]) {
+		log_fatal("DB: %s has no node sizes in its superblock, its volume must be formatted again",
+			  superblock->db_name);
+		BUG_ON();
+	}
+
+	for (uint8_t level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+		db_desc->levels[level_id].leaf_size = superblock->leaf_size[level_id];
+		db_desc->levels[level_id].index_node_size = superblock->index_node_size[level_id];
+		log_info("DB: %s level %u leaf size %u index node size %u", superblock->db_name, level_id,
+			 db_desc->levels[level_id].leaf_size, db_desc->levels[level_id].index_node_size);
+	}
+}
+
 db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_options *db_options,
 			    const char **error_message)
 {
 	struct db_handle *handle = NULL;
-	const uint32_t leaf_size_per_level[10] = { LEVEL0_LEAF_SIZE, LEVEL1_LEAF_SIZE, LEVEL2_LEAF_SIZE,
-						   LEVEL3_LEAF_SIZE, LEVEL4_LEAF_SIZE, LEVEL5_LEAF_SIZE,
-						   LEVEL6_LEAF_SIZE, LEVEL7_LEAF_SIZE };
 	struct db_descriptor *db = NULL;
 
 	log_info("Using Volume name = %s to open db with name = %s", volume_desc->volume_name, db_options->db_name);
@@ -579,6 +643,10 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 		goto exit;
 	}
 
+	*error_message = bt_check_node_sizes(db_options);
+	if (*error_message)
+		goto exit;
+
 	struct db_descriptor *db_desc =
 		get_db_from_volume(volume_desc->volume_name, (char *)db_options->db_name, db_options->create_flag);
 	if (!db_desc) {
@@ -594,6 +662,8 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 	}
 
 	db_desc->level_medium_inplace = db_options->options[LEVEL_MEDIUM_INPLACE].value;
+	/*get_db_from_volume marks only new DBs dirty*/
+	bt_init_node_sizes(db_desc, db_options, db_desc->dirty);
 	handle = calloc(1, sizeof(db_handle));
 	handle->db_desc = db_desc;
 	handle->volume_desc = db_desc->db_volume;
@@ -607,6 +677,10 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 	/*init soft state for all levels*/
 	for (uint8_t level_id = 1; level_id < MAX_LEVELS; level_id++) {
 		init_leaf_sizes_perlevel(&handle->db_desc->levels[level_id]);
+		/*leaves are self describing, levels may hold both formats when the option changes across opens*/
+		handle->db_desc->levels[level_id].compress_leaves =
+			handle->db_options.options[LEAF_COMPRESSION].value &&
+			level_id > handle->db_desc->level_medium_inplace;
 
 		handle->db_desc->levels[level_id].max_level_size =
 			handle->db_desc->levels[level_id - 1].max_level_size * growth_factor;
@@ -614,6 +688,10 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 		log_info("DB:Level %d max_total_size %lu", level_id, handle->db_desc->levels[level_id].max_level_size);
 	}
 	handle->db_desc->levels[MAX_LEVELS - 1].max_level_size = UINT64_MAX;
+	handle->db_desc->leaf_cache = leaf_cache_create(handle->db_options.options[LEAF_CACHE_SIZE].value);
+	handle->db_desc->medium_log_LRU_cache = init_LRU(handle);
+	handle->db_desc->io_limiter = io_limiter_create(handle->db_options.options[BG_IO_RATE].value,
+							handle->db_options.options[BG_IO_TARGET_LATENCY].value);
 	handle->db_desc->reference_count = 1;
 
 	MUTEX_INIT(&handle->db_desc->compaction_lock, NULL);
@@ -624,6 +702,7 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 	handle->db_desc->compaction_count = 0;
 	handle->db_desc->is_compaction_daemon_sleeping = 0;
 	handle->db_desc->segment_ht = NULL;
+	handle->db_desc->gc_victims = NULL;
 #if MEASURE_MEDIUM_INPLACE
 	db_desc->count_medium_inplace = 0;
 #endif
@@ -647,7 +726,6 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 		/*check again which tree should be active*/
 		handle->db_desc->levels[level_id].active_tree = 0;
 		handle->db_desc->levels[level_id].level_id = level_id;
-		handle->db_desc->levels[level_id].leaf_size = leaf_size_per_level[level_id];
 		handle->db_desc->levels[level_id].scanner_epoch = 0;
 #if MEASURE_SST_USED_SPACE
 		db_desc->levels[level_id].avg_leaf_used_space = 0;
@@ -667,8 +745,9 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 	_Static_assert(BIG_INLOG < 4, "KV categories number cannot be "
 				      "stored in 2 bits, increase "
 				      "key_category");
-	_Static_assert(sizeof(struct bt_dynamic_leaf_slot_array) == 2,
-		       "Dynamic slot array is not 2 bytes, are you sure you want to continue?");
+	_Static_assert(sizeof(struct bt_dynamic_leaf_slot_array) == 3,
+		       "Dynamic slot array is not 3 bytes, are you sure you want to continue?");
+	_Static_assert(MAX_LEAF_SIZE < (1 << 21), "Slot array index cannot address the whole leaf");
 	_Static_assert(sizeof(struct segment_header) == 4096, "Segment header not page aligned!");
 	_Static_assert(LOG_TAIL_NUM_BUFS >= 2, "Minimum number of in memory log buffers!");
 
@@ -677,14 +756,11 @@ db_handle *internal_db_open(struct volume_descriptor *volume_desc, par_db_option
 	klist_add_first(volume_desc->open_databases, handle->db_desc, handle->db_options.db_name, NULL);
 	handle->db_desc->db_state = DB_OPEN;
 
-	log_info("Opened DB %s starting its compaction daemon", handle->db_options.db_name);
+	log_info("Opened DB %s, its compactions run in the background pool", handle->db_options.db_name);
 
-	sem_init(&handle->db_desc->compaction_daemon_interrupts, PTHREAD_PROCESS_PRIVATE, 0);
-
-	if (pthread_create(&(handle->db_desc->compaction_daemon), NULL, compaction_daemon, (void *)handle) != 0) {
-		log_fatal("Failed to start compaction_daemon for db %s", handle->db_options.db_name);
-		BUG_ON();
-	}
+	bg_pool_get(handle->db_options.options[BG_THREADS].value);
+	MUTEX_INIT(&handle->db_desc->compaction_scheduler_lock, NULL);
+	handle->db_desc->compaction_handle = handle;
 
 	handle->db_desc->gc_scanning_db = false;
 	if (!volume_desc->gc_thread_spawned) {
@@ -781,12 +857,12 @@ const char *db_close(db_handle *handle)
 		spin_loop(&(handle->db_desc->levels[level_id].active_operations), 0);
 	}
 
+	/*a scheduling pass in progress completes first, the ones after it start no compactions*/
+	MUTEX_LOCK(&handle->db_desc->compaction_scheduler_lock);
 	handle->db_desc->db_state = DB_TERMINATE_COMPACTION_DAEMON;
-	sem_post(&handle->db_desc->compaction_daemon_interrupts);
-	while (handle->db_desc->db_state != DB_IS_CLOSING)
-		usleep(50);
+	MUTEX_UNLOCK(&handle->db_desc->compaction_scheduler_lock);
 
-	log_info("Ok compaction daemon exited continuing the close sequence of DB:%s",
+	log_info("Ok compaction scheduling stopped continuing the close sequence of DB:%s",
 		 handle->db_desc->db_superblock->db_name);
 
 	/* Release the locks for all levels to allow pending compactions to complete. */
@@ -814,6 +890,10 @@ const char *db_close(db_handle *handle)
 	}
 	pr_flush_L0(handle->db_desc, handle->db_desc->levels[0].active_tree);
 
+	/*compaction jobs are done but their last scheduling passes may still be queued*/
+	while (handle->db_desc->bg_jobs)
+		usleep(50);
+
 	log_info("All pending compactions done for DB:%s", handle->db_desc->db_superblock->db_name);
 
 	destroy_log_buffer(&handle->db_desc->big_log);
@@ -825,6 +905,12 @@ const char *db_close(db_handle *handle)
 	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id)
 		seg_free_level(handle->db_desc, 0, 0, tree_id);
 
+	/*the range tombstones of device levels stay in their segments*/
+	for (uint8_t level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+		for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id)
+			rt_destroy(handle->db_desc->levels[level_id].range_tombstones[tree_id]);
+	}
+
 	for (uint8_t i = 0; i < MAX_LEVELS; ++i) {
 		if (pthread_rwlock_destroy(&handle->db_desc->levels[i].guard_of_level.rx_lock)) {
 			log_fatal("Failed to destroy guard of level lock");
@@ -832,6 +918,10 @@ const char *db_close(db_handle *handle)
 		}
 		destroy_level_locktable(handle->db_desc, i);
 	}
+	leaf_cache_destroy(handle->db_desc->leaf_cache);
+	gc_destroy_victims(handle->db_desc);
+	destroy_LRU(handle->db_desc->medium_log_LRU_cache);
+	io_limiter_destroy(handle->db_desc->io_limiter);
 	// memset(handle->db_desc, 0x00, sizeof(struct db_descriptor));
 	if (pthread_cond_destroy(&handle->db_desc->client_barrier) != 0) {
 		log_fatal("Failed to destroy condition variable");
@@ -839,7 +929,10 @@ const char *db_close(db_handle *handle)
 		BUG_ON();
 	}
 
+	pthread_mutex_destroy(&handle->db_desc->compaction_scheduler_lock);
+
 	free(handle->db_desc);
+	bg_pool_put();
 finish:
 
 	MUTEX_UNLOCK(&init_lock);
@@ -872,7 +965,7 @@ void wait_for_available_level0_tree(db_handle *handle, uint8_t level_id, uint8_t
 			}
 
 			MUTEX_LOCK(&handle->db_desc->client_barrier_lock);
-			sem_post(&handle->db_desc->compaction_daemon_interrupts);
+			schedule_compactions(handle->db_desc);
 
 			if (pthread_cond_wait(&handle->db_desc->client_barrier,
 					      &handle->db_desc->client_barrier_lock) != 0) {
@@ -895,9 +988,9 @@ void wait_for_available_level0_tree(db_handle *handle, uint8_t level_id, uint8_t
 
 enum kv_category calculate_KV_category(uint32_t key_size, uint32_t value_size, request_type op_type)
 {
-	assert(op_type == insertOp || op_type == deleteOp);
+	assert(op_type == insertOp || op_type == deleteOp || op_type == deleteRangeOp || op_type == singleDeleteOp);
 
-	if (op_type == deleteOp) {
+	if (op_type == deleteOp || op_type == deleteRangeOp || op_type == singleDeleteOp) {
 		assert(key_size && 0 == value_size);
 		return SMALL_INPLACE;
 	}
@@ -964,9 +1057,11 @@ struct par_put_metadata insert_key_value(db_handle *handle, void *key, void *val
 	/*prepare the request*/
 	ins_req.metadata.handle = handle;
 	ins_req.key_value_buf = kv_pair;
-	ins_req.metadata.tombstone = op_type == deleteOp;
+	ins_req.metadata.tombstone = op_type == deleteOp || op_type == singleDeleteOp;
 	ins_req.metadata.tombstone ? set_tombstone((struct kv_splice *)ins_req.key_value_buf) :
 				     set_non_tombstone((struct kv_splice *)ins_req.key_value_buf);
+	if (op_type == singleDeleteOp)
+		set_single_delete((struct kv_splice *)ins_req.key_value_buf);
 	set_key((struct kv_splice *)kv_pair, key, key_size);
 	set_value((struct kv_splice *)kv_pair, value, value_size);
 	ins_req.metadata.cat = calculate_KV_category(key_size, value_size, op_type);
@@ -987,6 +1082,69 @@ struct par_put_metadata insert_key_value(db_handle *handle, void *key, void *val
 	return ins_req.metadata.put_op_metadata;
 }
 
+const char *delete_key_range(db_handle *handle, void *start, int32_t start_size, void *end, int32_t end_size)
+{
+	const char *error_message = insert_error_handling(handle, start_size, 0);
+	if (!error_message)
+		error_message = insert_error_handling(handle, end_size, 0);
+	if (error_message)
+		return error_message;
+	if (rt_key_cmp(start, start_size, end, end_size) >= 0)
+		return "Range start should be smaller than the range end";
+
+	/*the log record keeps the start and the end of the range as consecutive key splices*/
+	char range_buf[2 * (sizeof(struct key_splice) + MAX_KEY_SIZE)];
+	struct key_splice *start_key = (struct key_splice *)range_buf;
+	set_key_size_of_key_splice(start_key, start_size);
+	set_key_splice_key_offset(start_key, start);
+	struct key_splice *end_key = (struct key_splice *)&range_buf[sizeof(struct key_splice) + start_size];
+	set_key_size_of_key_splice(end_key, end_size);
+	set_key_splice_key_offset(end_key, end);
+	int32_t range_size = 2 * sizeof(struct key_splice) + start_size + end_size;
+
+	/*range tombstones delete the keys of older trees, the keys of the active tree get tombstones of their own*/
+	uint32_t num_keys = 0;
+	char *keys = scanner_get_L0_keys(handle, start_key, end_key, &num_keys);
+	char *key = keys;
+	for (uint32_t i = 0; i < num_keys; ++i) {
+		struct key_splice *key_splice = (struct key_splice *)key;
+		insert_key_value(handle, get_key_splice_key_offset(key_splice), "empty",
+				 get_key_splice_key_size(key_splice), 0, deleteOp, error_message);
+		key += sizeof(struct key_splice) + get_key_splice_key_size(key_splice);
+	}
+	free(keys);
+
+	char kv_buf[KV_MAX_SIZE];
+	struct kv_splice *kv = (struct kv_splice *)kv_buf;
+	set_range_delete(kv);
+	set_key(kv, range_buf, range_size);
+
+	bt_insert_req ins_req = { .metadata.handle = handle,
+				  .key_value_buf = kv_buf,
+				  .metadata.level_id = 0,
+				  .metadata.key_format = KV_FORMAT,
+				  .metadata.append_to_log = 1 };
+	ins_req.metadata.cat = calculate_KV_category(range_size, 0, deleteRangeOp);
+	log_operation log_op = { .metadata = &ins_req.metadata,
+				 .optype_tolog = deleteRangeOp,
+				 .ins_req = &ins_req,
+				 .is_compaction = false };
+
+	struct db_descriptor *db_desc = handle->db_desc;
+	db_desc->dirty = 1;
+	/*the range tombstone and its log record take the active tree that the lookups see*/
+	RWLOCK_WRLOCK(&db_desc->levels[0].guard_of_level.rx_lock);
+	spin_loop(&db_desc->levels[0].active_operations, 0);
+	uint8_t active_tree = db_desc->levels[0].active_tree;
+	ins_req.metadata.tree_id = active_tree;
+	append_key_value_to_log(&log_op);
+	if (!db_desc->levels[0].range_tombstones[active_tree])
+		db_desc->levels[0].range_tombstones[active_tree] = rt_create();
+	rt_add(db_desc->levels[0].range_tombstones[active_tree], start, start_size, end, end_size);
+	RWLOCK_UNLOCK(&db_desc->levels[0].guard_of_level.rx_lock);
+	return NULL;
+}
+
 struct par_put_metadata serialized_insert_key_value(db_handle *handle, const char *serialized_key_value,
 						    const char *error_message)
 {
@@ -1061,12 +1219,24 @@ static void pr_copy_kv_to_tail(struct pr_log_ticket *ticket)
 		struct kv_splice *kv_pair_dst = (struct kv_splice *)&ticket->tail->buf[offt];
 		struct kv_splice *kv_pair_src = (struct kv_splice *)ticket->req->ins_req->key_value_buf;
 		ticket->req->optype_tolog == insertOp ? set_non_tombstone(kv_pair_dst) : set_tombstone(kv_pair_dst);
+		if (is_single_delete_kv_pair(kv_pair_src))
+			set_single_delete(kv_pair_dst);
 		set_key(kv_pair_dst, get_key_offset_in_kv(kv_pair_src), get_key_size(kv_pair_src));
 		set_value(kv_pair_dst, get_value_offset_in_kv(kv_pair_src, get_key_size(kv_pair_src)),
 			  get_value_size(kv_pair_src));
 		ticket->op_size = get_lsn_size() + get_kv_size(kv_pair_dst);
 		break;
 	}
+	case deleteRangeOp: {
+		memcpy(&ticket->tail->buf[offt], &ticket->lsn, get_lsn_size());
+		offt += get_lsn_size();
+		struct kv_splice *kv_pair_dst = (struct kv_splice *)&ticket->tail->buf[offt];
+		struct kv_splice *kv_pair_src = (struct kv_splice *)ticket->req->ins_req->key_value_buf;
+		set_range_delete(kv_pair_dst);
+		set_key(kv_pair_dst, get_key_offset_in_kv(kv_pair_src), get_key_size(kv_pair_src));
+		ticket->op_size = get_lsn_size() + get_kv_size(kv_pair_dst);
+		break;
+	}
 	case paddingOp:
 		ticket->op_size = 0;
 		if (offset_in_seg) {
@@ -1237,6 +1407,9 @@ static void bt_add_blob(struct db_descriptor *db_desc, struct log_descriptor *lo
 		BUG_ON();
 	}
 
+	if (BIG_LOG == log_desc->log_type)
+		gc_add_log_segment(db_desc, ABSOLUTE_ADDRESS(next_tail_seg), gc_get_log_clock(db_desc));
+
 	//struct segment_header *curr_tail_seg =
 	//	(struct segment_header *)log_desc->tail[curr_tail_id % LOG_TAIL_NUM_BUFS]->buf;
 	struct log_tail *next_tail = log_desc->tail[next_tail_id % LOG_TAIL_NUM_BUFS];
@@ -1432,6 +1605,27 @@ int find_key_in_bloom_filter(db_descriptor *db_desc, int level_id, char *key)
 	return -1;
 }
 
+/*Raises the range tombstone rank of a lookup to the newest tree of the level with a range that holds its key*/
+static void bt_update_range_tombstone_rank(struct lookup_operation *get_op, uint8_t level_id)
+{
+	struct level_descriptor *level = &get_op->db_desc->levels[level_id];
+	struct key_splice *key = (struct key_splice *)get_op->key_buf;
+	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+		uint32_t rank = rt_get_tree_rank(get_op->db_desc->levels[0].active_tree, level_id, tree_id);
+		if (rank > get_op->range_tombstone_rank &&
+		    rt_covers(level->range_tombstones[tree_id], get_key_splice_key_offset(key),
+			      get_key_splice_key_size(key)))
+			get_op->range_tombstone_rank = rank;
+	}
+}
+
+/*True if a range tombstone of a newer tree deletes the key of the lookup in this tree*/
+static bool bt_is_range_deleted(struct lookup_operation *get_op, uint8_t level_id, uint8_t tree_id)
+{
+	return get_op->range_tombstone_rank > rt_get_tree_rank(get_op->db_desc->levels[0].active_tree, level_id,
+								 tree_id);
+}
+
 static inline void lookup_in_tree(struct lookup_operation *get_op, int level_id, int tree_id)
 {
 	node_header *son_node = NULL;
@@ -1440,6 +1634,7 @@ static inline void lookup_in_tree(struct lookup_operation *get_op, int level_id,
 	lock_table *prev = NULL;
 	lock_table *curr = NULL;
 	struct node_header *root = NULL;
+	struct bt_dynamic_leaf_node *cached_leaf = NULL;
 	struct db_descriptor *db_desc = get_op->db_desc;
 	struct key_splice *search_key_buf = (struct key_splice *)get_op->key_buf;
 
@@ -1477,11 +1672,11 @@ static inline void lookup_in_tree(struct lookup_operation *get_op, int level_id,
 		void *key = get_key_splice_key_offset(search_key_buf);
 		ret_result = find_key_in_dynamic_leaf((struct bt_dynamic_leaf_node *)curr_node, db_desc, key, key_size,
 						      level_id);
-		get_op->tombstone = ret_result.tombstone;
+		get_op->tombstone = ret_result.tombstone || bt_is_range_deleted(get_op, level_id, tree_id);
 		goto deser;
 	}
 
-	while (curr_node && curr_node->type != leafNode) {
+	while (curr_node && curr_node->type != leafNode && curr_node->type != compressedLeafNode) {
 		curr = _find_position((const lock_table **)db_desc->levels[level_id].level_lock_table, curr_node);
 
 		if (RWLOCK_RDLOCK(&curr->rx_lock) != 0)
@@ -1513,11 +1708,18 @@ static inline void lookup_in_tree(struct lookup_operation *get_op, int level_id,
 	if (RWLOCK_UNLOCK(&prev->rx_lock) != 0)
 		BUG_ON();
 
+	struct bt_dynamic_leaf_node *leaf = (struct bt_dynamic_leaf_node *)curr_node;
+	if (curr_node->type == compressedLeafNode) {
+		/*pinned until the value is copied*/
+		cached_leaf = leaf_cache_get(db_desc->leaf_cache, (struct bt_compressed_leaf_node *)curr_node, level_id,
+					     db_desc->levels[level_id].leaf_size);
+		leaf = cached_leaf;
+	}
+
 	int32_t key_size = get_key_splice_key_size(search_key_buf);
 	void *key = get_key_splice_key_offset(search_key_buf);
-	ret_result =
-		find_key_in_dynamic_leaf((struct bt_dynamic_leaf_node *)curr_node, db_desc, key, key_size, level_id);
-	get_op->tombstone = ret_result.tombstone;
+	ret_result = find_key_in_dynamic_leaf(leaf, db_desc, key, key_size, level_id);
+	get_op->tombstone = ret_result.tombstone || bt_is_range_deleted(get_op, level_id, tree_id);
 
 // TODO The meaning of deser is not clear enough, rename accordingly
 deser:
@@ -1580,6 +1782,9 @@ check_if_done_with_value_log:
 		bt_done_with_value_log_address(&db_desc->big_log, &kv_pair);
 
 exit:
+	if (cached_leaf)
+		leaf_cache_put(db_desc->leaf_cache, cached_leaf);
+
 	if (RWLOCK_UNLOCK(&curr->rx_lock) != 0)
 		BUG_ON();
 
@@ -1602,6 +1807,9 @@ void find_key(struct lookup_operation *get_op)
 	__sync_fetch_and_add(&db_desc->levels[0].active_operations, 1);
 	uint8_t tree_id = db_desc->levels[0].active_tree;
 	uint8_t base = tree_id;
+	/*levels are searched from the newest, so the range tombstones of newer trees are known when the key is found*/
+	get_op->range_tombstone_rank = 0;
+	bt_update_range_tombstone_rank(get_op, 0);
 
 	while (1) {
 		/*first look the current active tree of the level*/
@@ -1630,10 +1838,16 @@ void find_key(struct lookup_operation *get_op)
 		if (RWLOCK_RDLOCK(&db_desc->levels[level_id].guard_of_level.rx_lock) != 0)
 			BUG_ON();
 		__sync_fetch_and_add(&db_desc->levels[level_id].active_operations, 1);
-
-		get_op->found = 0;
-		get_op->tombstone = 0;
-		lookup_in_tree(get_op, level_id, 0);
+		bt_update_range_tombstone_rank(get_op, level_id);
+
+		/*the runs of a device level take its trees from the oldest to the newest*/
+		for (int run_tree_id = NUM_TREES_PER_LEVEL - 1; run_tree_id >= 0; --run_tree_id) {
+			get_op->found = 0;
+			get_op->tombstone = 0;
+			lookup_in_tree(get_op, level_id, run_tree_id);
+			if (get_op->found)
+				break;
+		}
 		if (get_op->found) {
 			if (RWLOCK_UNLOCK(&db_desc->levels[level_id].guard_of_level.rx_lock) != 0)
 				BUG_ON();
@@ -1651,6 +1865,173 @@ finish:
 		get_op->found = 0;
 }
 
+/*The leaf that find_keys keeps read locked while the following keys of the batch fall in it*/
+struct bt_ordered_leaf {
+	lock_table *lock;
+	struct bt_dynamic_leaf_node *leaf;
+	/*the decompressed copy of a compressed leaf, pinned until the leaf is released*/
+	struct bt_dynamic_leaf_node *cached_leaf;
+};
+
+static void bt_release_ordered_leaf(struct db_descriptor *db_desc, struct bt_ordered_leaf *ordered_leaf)
+{
+	if (ordered_leaf->cached_leaf)
+		leaf_cache_put(db_desc->leaf_cache, ordered_leaf->cached_leaf);
+
+	if (RWLOCK_UNLOCK(&ordered_leaf->lock->rx_lock) != 0)
+		BUG_ON();
+
+	ordered_leaf->lock = NULL;
+	ordered_leaf->leaf = NULL;
+	ordered_leaf->cached_leaf = NULL;
+}
+
+/*Descends from root to the leaf of key with lock coupling as lookup_in_tree does and keeps the leaf read locked*/
+static void bt_lock_leaf_of_key(struct db_descriptor *db_desc, node_header *root, int level_id,
+				struct key_splice *key, struct bt_ordered_leaf *ordered_leaf)
+{
+	lock_table *prev = NULL;
+	lock_table *curr = NULL;
+	node_header *curr_node = root;
+
+	while (curr_node->type != leafNode && curr_node->type != compressedLeafNode &&
+	       curr_node->type != leafRootNode) {
+		curr = _find_position((const lock_table **)db_desc->levels[level_id].level_lock_table, curr_node);
+		if (RWLOCK_RDLOCK(&curr->rx_lock) != 0)
+			BUG_ON();
+
+		if (prev && RWLOCK_UNLOCK(&prev->rx_lock) != 0)
+			BUG_ON();
+
+		uint64_t child_offset = index_binary_search((struct index_node *)curr_node, (char *)key, KEY_TYPE);
+		prev = curr;
+		curr_node = (node_header *)REAL_ADDRESS(child_offset);
+	}
+
+	curr = _find_position((const lock_table **)db_desc->levels[level_id].level_lock_table, curr_node);
+	if (RWLOCK_RDLOCK(&curr->rx_lock) != 0)
+		BUG_ON();
+
+	if (prev && RWLOCK_UNLOCK(&prev->rx_lock) != 0)
+		BUG_ON();
+
+	ordered_leaf->lock = curr;
+	ordered_leaf->leaf = (struct bt_dynamic_leaf_node *)curr_node;
+	ordered_leaf->cached_leaf = NULL;
+	if (curr_node->type == compressedLeafNode) {
+		struct bt_compressed_leaf_node *compressed_leaf = (struct bt_compressed_leaf_node *)curr_node;
+		ordered_leaf->cached_leaf = leaf_cache_get(db_desc->leaf_cache, compressed_leaf, level_id,
+							   db_desc->levels[level_id].leaf_size);
+		ordered_leaf->leaf = ordered_leaf->cached_leaf;
+	}
+}
+
+/*Looks up in a tree the keys of the batch that newer trees do not hold, descending only when a key leaves the leaf*/
+static void bt_find_keys_in_tree(struct lookup_operation *get_ops, uint32_t num_ops, int level_id, int tree_id)
+{
+	struct db_descriptor *db_desc = get_ops[0].db_desc;
+	node_header *root = db_desc->levels[level_id].root_w[tree_id];
+	if (!root)
+		root = db_desc->levels[level_id].root_r[tree_id];
+	if (!root)
+		return;
+
+	struct bt_ordered_leaf ordered_leaf = { .lock = NULL, .leaf = NULL, .cached_leaf = NULL };
+	for (uint32_t i = 0; i < num_ops; ++i) {
+		struct lookup_operation *get_op = &get_ops[i];
+		if (get_op->found)
+			continue;
+
+		struct key_splice *key = (struct key_splice *)get_op->key_buf;
+		char *key_data = get_key_splice_key_offset(key);
+		int32_t key_size = get_key_splice_key_size(key);
+		struct find_result ret_result = { .kv = NULL, .past_last_key = 1 };
+		if (ordered_leaf.leaf)
+			ret_result = find_key_in_dynamic_leaf(ordered_leaf.leaf, db_desc, key_data, key_size, level_id);
+
+		/*keys are sorted, a key that is not past the last key of the leaf belongs to it*/
+		if (!ret_result.kv && ret_result.past_last_key) {
+			if (ordered_leaf.leaf)
+				bt_release_ordered_leaf(db_desc, &ordered_leaf);
+			bt_lock_leaf_of_key(db_desc, root, level_id, key, &ordered_leaf);
+			ret_result = find_key_in_dynamic_leaf(ordered_leaf.leaf, db_desc, key_data, key_size, level_id);
+		}
+
+		if (!ret_result.kv)
+			continue;
+
+		if (ret_result.key_type != KV_INPLACE && ret_result.key_type != KV_INLOG) {
+			log_fatal("Corrupted KV location");
+			BUG_ON();
+		}
+
+		get_op->found = 1;
+		get_op->tombstone = ret_result.tombstone || bt_is_range_deleted(get_op, level_id, tree_id);
+		get_op->key_device_address = ret_result.kv;
+		if (ret_result.key_type == KV_INLOG) {
+			uint64_t kv_dev_offt = 0;
+			memcpy(&kv_dev_offt, ret_result.kv, sizeof(kv_dev_offt));
+			get_op->key_device_address = (char *)kv_dev_offt;
+		}
+		if (get_op->tombstone)
+			get_op->key_device_address = NULL;
+	}
+
+	if (ordered_leaf.leaf)
+		bt_release_ordered_leaf(db_desc, &ordered_leaf);
+}
+
+void find_keys(struct lookup_operation *get_ops, uint32_t num_ops)
+{
+	if (!num_ops)
+		return;
+
+	struct db_descriptor *db_desc = get_ops[0].db_desc;
+	for (uint32_t i = 0; i < num_ops; ++i) {
+		assert(get_ops[i].db_desc == db_desc && !get_ops[i].retrieve);
+		get_ops[i].found = 0;
+		get_ops[i].tombstone = 0;
+		get_ops[i].buffer_overflow = 0;
+		get_ops[i].key_device_address = NULL;
+		get_ops[i].range_tombstone_rank = 0;
+	}
+
+	if (DB_IS_CLOSING == db_desc->db_state) {
+		log_warn("Sorry DB: %s is closing", db_desc->db_superblock->db_name);
+		return;
+	}
+
+	/*levels and their trees are searched from the newest as in find_key*/
+	for (uint8_t level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+		if (RWLOCK_RDLOCK(&db_desc->levels[level_id].guard_of_level.rx_lock) != 0)
+			BUG_ON();
+		__sync_fetch_and_add(&db_desc->levels[level_id].active_operations, 1);
+
+		for (uint32_t i = 0; i < num_ops; ++i) {
+			if (!get_ops[i].found)
+				bt_update_range_tombstone_rank(&get_ops[i], level_id);
+		}
+
+		if (0 == level_id) {
+			uint8_t tree_id = db_desc->levels[0].active_tree;
+			for (uint8_t i = 0; i < NUM_TREES_PER_LEVEL; ++i)
+				bt_find_keys_in_tree(get_ops, num_ops, 0, (tree_id + i) % NUM_TREES_PER_LEVEL);
+		} else {
+			for (int tree_id = NUM_TREES_PER_LEVEL - 1; tree_id >= 0; --tree_id)
+				bt_find_keys_in_tree(get_ops, num_ops, level_id, tree_id);
+		}
+
+		if (RWLOCK_UNLOCK(&db_desc->levels[level_id].guard_of_level.rx_lock) != 0)
+			BUG_ON();
+		__sync_fetch_and_sub(&db_desc->levels[level_id].active_operations, 1);
+	}
+
+	for (uint32_t i = 0; i < num_ops; ++i) {
+		if (get_ops[i].found && get_ops[i].tombstone)
+			get_ops[i].found = 0;
+	}
+}
+
 int insert_KV_at_leaf(bt_insert_req *ins_req, node_header *leaf)
 {
 	db_descriptor *db_desc = ins_req->metadata.handle->db_desc;
@@ -41,6 +41,8 @@ struct lookup_operation {
 	char *buffer_to_pack_kv; /*in-out variable*/
 	char *key_device_address; /*out variable*/
 	int32_t size; /*in-out variable*/
+	/*rank of the newest tree with a range tombstone that holds the key, the key is deleted in older trees*/
+	uint32_t range_tombstone_rank;
 	uint8_t buffer_overflow : 1; /*out variable*/
 	uint8_t found : 1; /*out variable*/
 	uint8_t tombstone : 1;
@@ -70,6 +72,37 @@ typedef struct segment_header {
 	nodeType_t nodetype;
 } __attribute__((packed, aligned(4096))) segment_header;
 
+/*The pivots of all the partitions of a device level fit in the INDEX_NODE_MAX_SIZE root of the level*/
+#define MAX_LEVEL_PARTITIONS 64
+#define LEVEL_PARTITION_MAGIC 0x5041525449544e53UL
+
+/**
+ * Key range partition of a device level. Each partition is a B-tree with its
+ * own segment chain, from first_segment_offt up to last_segment_offt whose
+ * next segment is NULL, so compactions rewrite only the partitions their
+ * source overlaps.
+ */
+struct level_partition {
+	uint64_t first_segment_offt;
+	uint64_t last_segment_offt;
+	uint64_t root_offt;
+	/*bytes of the segments of the partition*/
+	uint64_t offset;
+	uint64_t level_size;
+} __attribute__((packed));
+
+/**
+ * A device level of more than one partition has a root segment of its own.
+ * The table of its partitions follows the segment header and the root of the
+ * level, with a pivot per partition, follows the table.
+ */
+struct level_partition_table {
+	uint64_t magic;
+	uint32_t num_partitions;
+	struct level_partition partitions[MAX_LEVEL_PARTITIONS];
+} __attribute__((packed, aligned(4096)));
+_Static_assert(sizeof(struct level_partition_table) == 4096, "Partition table must fit in a block");
+
 /*Note IN stands for Internal Node*/
 typedef struct IN_log_header {
 	nodeType_t type;
@@ -85,12 +118,12 @@ struct bt_static_leaf_slot_array {
 };
 
 struct bt_dynamic_leaf_slot_array {
-	// The index points to the location of the kv pair in the leaf.
-	uint16_t index : 13;
-	uint16_t key_category : 2;
+	// The index points to the location of the kv pair in the leaf, 21 bits address leaves up to a segment.
+	uint32_t index : 21;
+	uint32_t key_category : 2;
 	// Tombstone notifies if the key is deleted.
-	uint16_t tombstone : 1;
-};
+	uint32_t tombstone : 1;
+} __attribute__((packed));
 
 struct key_compare {
 	char *key;
@@ -119,6 +152,16 @@ struct bt_dynamic_leaf_node {
 	struct node_header header;
 } __attribute__((packed));
 
+/*A device level leaf compressed as a whole, it occupies node_size bytes of its segment*/
+struct bt_compressed_leaf_node {
+	nodeType_t type;
+	uint32_t node_size;
+	/*the header and slot array of the leaf, its KV log follows them in the compressed data*/
+	uint32_t uncompressed_front_size;
+	uint32_t uncompressed_size;
+	char data[];
+} __attribute__((packed));
+
 typedef struct leaf_node {
 	struct node_header header;
 	uint64_t pointer[LN_LENGTH];
@@ -128,16 +171,11 @@ typedef struct leaf_node {
 
 enum bsearch_status { INSERT = 0, FOUND = 1, ERROR = 2 };
 
-/* Possible options for these defines are multiples of 4KB but they should not be more than BUFFER_SEGMENT_SIZE*/
+/* Leaf sizes are set per level through the options, they are multiples of 4KB and a leaf must fit in a segment*/
 #define PAGE_SIZE 4096
-#define LEVEL0_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL1_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL2_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL3_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL4_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL5_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL6_LEAF_SIZE (PAGE_SIZE * 2)
-#define LEVEL7_LEAF_SIZE (PAGE_SIZE * 2)
+#define MAX_LEAF_SIZE (SEGMENT_SIZE - sizeof(struct segment_header))
+/*Buffer size to rebuild an in place KV of a prefix compressed leaf*/
+#define LEAF_KV_INPLACE_MAX_SIZE (MAX_KV_IN_PLACE_SIZE + sizeof(struct kv_splice))
 
 /*
  * db_descriptor is a soft state descriptor per open database. superindex
@@ -168,7 +206,6 @@ typedef struct level_descriptor {
 #if ENABLE_BLOOM_FILTERS
 	struct bloom bloom_filter[NUM_TREES_PER_LEVEL];
 #endif
-	pthread_t compaction_thread[NUM_TREES_PER_LEVEL];
 	lock_table *level_lock_table[MAX_HEIGHT];
 	node_header *root_r[NUM_TREES_PER_LEVEL];
 	node_header *root_w[NUM_TREES_PER_LEVEL];
@@ -176,6 +213,8 @@ typedef struct level_descriptor {
 	segment_header *first_segment[NUM_TREES_PER_LEVEL];
 	segment_header *last_segment[NUM_TREES_PER_LEVEL];
 	uint64_t offset[NUM_TREES_PER_LEVEL];
+	/*range tombstones of each tree, NULL if it has none*/
+	struct range_tombstones *range_tombstones[NUM_TREES_PER_LEVEL];
 	/*needed for L0 scanner tiering colission*/
 	uint64_t epoch[NUM_TREES_PER_LEVEL];
 	uint64_t scanner_epoch;
@@ -197,8 +236,16 @@ typedef struct level_descriptor {
 	/*info for trimming medium_log, used only in L_{n-1}*/
 	uint64_t medium_in_place_max_segment_id;
 	uint64_t medium_in_place_segment_dev_offt;
+	/*write stats of the compactions into this level, bandwidth in MB/s*/
+	uint64_t compaction_bytes_written;
+	uint64_t last_compaction_write_bw;
+	/*set by the compaction scheduler, 1 and above means that the level waits for a compaction*/
+	double compaction_score;
 	uint32_t leaf_size;
+	uint32_t index_node_size;
 	char tree_status[NUM_TREES_PER_LEVEL];
+	/*compactions into this level write compressed leaves*/
+	uint8_t compress_leaves;
 	uint8_t active_tree;
 	uint8_t level_id;
 	char in_recovery_mode;
@@ -240,23 +287,36 @@ typedef struct db_descriptor {
 	pthread_mutex_t flush_L0_lock;
 	/*</new_persistent_design>*/
 
-	sem_t compaction_daemon_interrupts;
+	/*serializes the compaction scheduling passes of the DB*/
+	pthread_mutex_t compaction_scheduler_lock;
 	sem_t compaction_sem;
 	sem_t compaction_daemon_sem;
 	uint64_t blocked_clients;
 	uint64_t compaction_count;
 	pthread_t compaction_thread;
-	pthread_t compaction_daemon;
 	pthread_t gc_thread;
+	/*handle of the compaction scheduling passes, the one that opened the DB*/
+	struct db_handle *compaction_handle;
 	struct log_descriptor big_log;
 	struct log_descriptor medium_log;
 	struct log_descriptor small_log;
 	struct lsn_factory lsn_factory;
 	// A hash table containing every segment that has at least 1 byte of garbage data in the large log.
 	struct large_log_segment_gc_entry *segment_ht;
+	/*the segments of segment_ht that GC has not moved, ordered by cost-benefit*/
+	struct gc_victim_heap *gc_victims;
 	uint64_t gc_last_segment_id;
 	uint64_t gc_count_segments;
 	uint64_t gc_keys_transferred;
+	/*decompressed copies of the compressed leaves of all levels*/
+	struct leaf_cache *leaf_cache;
+	/*chunks of the medium log that compactions transfer in place*/
+	struct chunk_LRU_cache *medium_log_LRU_cache;
+	/*paces the device I/O of the compactions and the GC of the DB*/
+	struct io_limiter *io_limiter;
+	/*runs on the KVs the compactions merge, see par_set_compaction_filter*/
+	par_compaction_filter compaction_filter;
+	void *compaction_filter_context;
 	/*L0 recovery log info*/
 	uint64_t small_log_start_segment_dev_offt;
 	uint64_t small_log_start_offt_in_segment;
@@ -265,9 +325,22 @@ typedef struct db_descriptor {
 	unsigned int level_medium_inplace;
 	int is_compaction_daemon_sleeping;
 	int32_t reference_count;
+	/*jobs of the DB in the background pool, db_close waits for them*/
+	uint32_t bg_jobs;
 	int32_t group_id;
 	int32_t group_index;
 	bool gc_scanning_db;
+	/*a scheduling pass is queued and has not looked at the levels yet*/
+	uint8_t compaction_scheduler_queued;
+	uint8_t next_L0_tree_to_compact;
+	/*manual compactions, protected by the scheduler lock: L0 trees to compact in order regardless of their size*/
+	uint8_t manual_L0_trees;
+	/*the data manual compactions move continues down to this level*/
+	uint8_t manual_target_level;
+	/*device levels to compact regardless of their score, a bit per level*/
+	uint32_t manual_levels;
+	uint32_t manual_running;
+	uint32_t manual_completed;
 	enum db_status db_state;
 	char dirty;
 } db_descriptor;
@@ -314,7 +387,29 @@ void pr_flush_compaction(struct db_descriptor *db_desc, uint8_t level_id, uint8_
 db_handle *db_open(par_db_options *db_options, const char **error_message);
 const char *db_close(db_handle *handle);
 
-void *compaction_daemon(void *args);
+/**
+ * Queues a compaction scheduling pass of the DB in the background pool. The
+ * pass starts the compactions that the sizes of the levels call for. Requests
+ * that find a pass already queued are covered by it.
+ */
+void schedule_compactions(struct db_descriptor *db_desc);
+
+/**
+ * Makes the compaction scheduler compact the L0 trees up to the active one
+ * into L1 whatever their size. Returns without waiting for the compactions.
+ */
+void comp_request_flush(struct db_descriptor *db_desc);
+
+/**
+ * Makes the compaction scheduler push the keys in [start, end] down to the
+ * last level that holds data. L0 is compacted whole, device levels only if
+ * they hold keys in the range, and the data they move continues level by
+ * level. NULL start or end leave the range open. Returns without waiting.
+ */
+void comp_request_range_compaction(struct db_descriptor *db_desc, struct par_key *start, struct par_key *end);
+
+/*Fills progress with the manual compactions of the DB that wait, run, or completed*/
+void comp_get_manual_progress(struct db_descriptor *db_desc, struct par_compaction_progress *progress);
 
 typedef struct bt_mutate_req {
 	struct par_put_metadata put_op_metadata;
@@ -425,10 +520,28 @@ struct par_put_metadata insert_key_value(db_handle *handle, void *key, void *val
  * */
 struct par_put_metadata serialized_insert_key_value(db_handle *handle, const char *serialized_key_value,
 						    const char *error_message);
+
+/**
+ * Deletes the keys in [start, end). The keys of the active L0 tree get
+ * tombstones and a range tombstone of the active tree deletes the keys of the
+ * older trees and levels.
+ * @return the error message if any otherwise NULL on success
+ */
+const char *delete_key_range(db_handle *handle, void *start, int32_t start_size, void *end, int32_t end_size);
 const char *btree_insert_key_value(bt_insert_req *ins_req) __attribute__((warn_unused_result));
 
 void *append_key_value_to_log(log_operation *req);
 void find_key(struct lookup_operation *get_op);
+
+/**
+ * Looks up a batch of keys in one pass over the levels. Each level is guarded
+ * once for the whole batch and its trees are walked in key order, so keys that
+ * fall in the same leaf share the descent and the leaf. Only for lookups that
+ * do not retrieve the value, e.g. the validity checks of GC.
+ * @param get_ops: lookups of the same DB sorted by their key in ascending order
+ * @param num_ops: number of lookups
+ */
+void find_keys(struct lookup_operation *get_ops, uint32_t num_ops);
 int8_t delete_key(db_handle *handle, void *key, uint32_t size);
 
 void init_key_cmp(struct key_compare *key_cmp, void *key_buf, char key_format);
@@ -19,10 +19,13 @@ typedef enum {
 	internalNode = 790393380,
 	rootNode = 742729384,
 	leafRootNode = 748939994, /*special case for a newly created tree*/
+	compressedLeafNode = 623145386, /*device level leaf stored compressed*/
 	paddedSpace = 55400000,
 	invalid
 } nodeType_t;
 
+#define LEAF_PREFIX_MAX_SIZE (34)
+
 /*leaf or internal node metadata, place always in the first 4KB data block*/
 typedef struct node_header {
 	/*internal or leaf node*/
@@ -39,8 +42,17 @@ typedef struct node_header {
 		uint32_t leaf_log_size;
 	};
 	int32_t num_entries;
-	/*pad to be exacly one cache line*/
-	char pad[36];
+	union {
+		/*pad to be exacly one cache line*/
+		char pad[36];
+		/*Device level leaves keep the prefix shared by all of their keys here, in place KVs omit it*/
+		struct {
+			uint8_t leaf_prefix_size;
+			/*separated KVs of the device level leaf keep their full key after their log pointer*/
+			uint8_t leaf_full_keys;
+			char leaf_prefix[LEAF_PREFIX_MAX_SIZE];
+		};
+	};
 
 } __attribute__((packed)) node_header;
 #endif
@@ -24,14 +24,20 @@
 #include "../common/common.h"
 #include "../scanner/min_max_heap.h"
 #include "../scanner/scanner.h"
+#include "bg_pool.h"
 #include "btree.h"
 #include "conf.h"
 #include "dynamic_leaf.h"
 #include "gc.h"
 #include "index_node.h"
+#include "io_limiter.h"
+#include "leaf_cache.h"
 #include "medium_log_LRU_cache.h"
+#include "range_tombstone.h"
 #include "segment_allocator.h"
+#include <aio.h>
 #include <assert.h>
+#include <errno.h>
 #include <log.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -41,6 +47,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <uthash.h>
 // IWYU pragma: no_forward_declare index_node
@@ -77,23 +84,10 @@ static void comp_medium_log_set_max_segment_id(struct comp_level_write_cursor *c
 		  max_segment_id, max_segment_offt);
 }
 
-static void fetch_segment_chunk(struct comp_level_write_cursor *c, uint64_t log_chunk_dev_offt, char *segment_buf,
-				ssize_t size)
+/*Records the medium log segment of a chunk, the transfer to in place trims the log up to the last one*/
+static void comp_medium_log_track_segment(struct comp_level_write_cursor *c, uint64_t log_chunk_dev_offt,
+					  char *segment_buf)
 {
-	off_t dev_offt = log_chunk_dev_offt;
-	ssize_t bytes_to_read = 0;
-
-	while (bytes_to_read < size) {
-		ssize_t bytes = pread(c->handle->db_desc->db_volume->vol_fd, &segment_buf[bytes_to_read],
-				      size - bytes_to_read, dev_offt + bytes_to_read);
-		if (bytes == -1) {
-			log_fatal("Failed to read error code");
-			perror("Error");
-			BUG_ON();
-		}
-		bytes_to_read += bytes;
-	}
-
 	if (c->level_id != c->handle->db_desc->level_medium_inplace)
 		return;
 
@@ -129,28 +123,29 @@ static void fetch_segment_chunk(struct comp_level_write_cursor *c, uint64_t log_
 		HASH_ADD_PTR(c->medium_log_segment_map, dev_offt, entry);
 }
 
-static char *fetch_kv_from_LRU(struct write_dynamic_leaf_args *args, struct comp_level_write_cursor *c)
+/**
+ * Returns a medium KV out of the chunk of the medium log that holds it. The
+ * chunk stays pinned in the cache until the cursor fetches its next medium KV
+ * or closes.
+ */
+static char *fetch_kv_from_LRU(struct comp_level_write_cursor *c, uint64_t kv_dev_offt)
 {
 	char *segment_chunk = NULL, *kv_in_seg = NULL;
 	uint64_t segment_offset, which_chunk, segment_chunk_offt;
-	segment_offset = ABSOLUTE_ADDRESS(args->kv_dev_offt) - (ABSOLUTE_ADDRESS(args->kv_dev_offt) % SEGMENT_SIZE);
+	segment_offset = ABSOLUTE_ADDRESS(kv_dev_offt) - (ABSOLUTE_ADDRESS(kv_dev_offt) % SEGMENT_SIZE);
 
-	which_chunk = (ABSOLUTE_ADDRESS(args->kv_dev_offt) % SEGMENT_SIZE) / LOG_CHUNK_SIZE;
+	which_chunk = (ABSOLUTE_ADDRESS(kv_dev_offt) % SEGMENT_SIZE) / LOG_CHUNK_SIZE;
 
 	segment_chunk_offt = segment_offset + (which_chunk * LOG_CHUNK_SIZE);
 
-	if (!chunk_exists_in_LRU(c->medium_log_LRU_cache, segment_chunk_offt)) {
-		if (posix_memalign((void **)&segment_chunk, ALIGNMENT_SIZE, LOG_CHUNK_SIZE + KB(4)) != 0) {
-			log_fatal("MEMALIGN FAILED");
-			BUG_ON();
-		}
-		fetch_segment_chunk(c, segment_chunk_offt, segment_chunk, LOG_CHUNK_SIZE + KB(4));
-		add_to_LRU(c->medium_log_LRU_cache, segment_chunk_offt, segment_chunk);
-	} else
-		segment_chunk = get_chunk_from_LRU(c->medium_log_LRU_cache, segment_chunk_offt);
+	segment_chunk = get_chunk_from_LRU(c->medium_log_LRU_cache, segment_chunk_offt);
+	if (c->medium_log_chunk)
+		put_chunk_to_LRU(c->medium_log_LRU_cache, c->medium_log_chunk);
+	if (segment_chunk != c->medium_log_chunk)
+		comp_medium_log_track_segment(c, segment_chunk_offt, segment_chunk);
+	c->medium_log_chunk = segment_chunk;
 
-	kv_in_seg =
-		&segment_chunk[(ABSOLUTE_ADDRESS(args->kv_dev_offt) % SEGMENT_SIZE) - (which_chunk * LOG_CHUNK_SIZE)];
+	kv_in_seg = &segment_chunk[(ABSOLUTE_ADDRESS(kv_dev_offt) % SEGMENT_SIZE) - (which_chunk * LOG_CHUNK_SIZE)];
 
 	return kv_in_seg;
 }
@@ -171,7 +166,20 @@ static uint32_t comp_calc_offt_in_seg(char *buffer_start, char *addr)
 
 struct compaction_roots {
 	struct node_header *src_root;
+	/*root of the oldest dst run the compaction merges, NULL if it merges none*/
 	struct node_header *dst_root;
+	/*sorted runs the compaction merges, the oldest first*/
+	struct node_header *src_runs[NUM_TREES_PER_LEVEL];
+	struct node_header *dst_runs[NUM_TREES_PER_LEVEL];
+	uint8_t num_src_runs;
+	uint8_t num_dst_runs;
+	/*range tombstones of the merged trees, the keys of older merged trees they hold are dropped*/
+	struct rt_ranked_list range_tombstones[2 * NUM_TREES_PER_LEVEL];
+	uint32_t num_range_tombstones;
+	/*active tree of L0 when the lists were ranked*/
+	uint8_t L0_active_tree;
+	/*no older keys remain below the new run*/
+	uint8_t drop_deleted;
 };
 
 static void comp_write_segment(char *buffer, uint64_t dev_offt, uint32_t buf_offt, uint32_t size, int fd)
@@ -234,16 +242,141 @@ static void comp_write_segment(char *buffer, uint64_t dev_offt, uint32_t buf_off
 	}
 }
 
-static void comp_init_dynamic_leaf(struct bt_dynamic_leaf_node *leaf)
+static uint64_t comp_get_usec(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		log_fatal("clock_gettime failed");
+		perror("Reason");
+		BUG_ON();
+	}
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static char *comp_alloc_segment_buf(void)
+{
+	char *segment_buf = NULL;
+	if (posix_memalign((void **)&segment_buf, ALIGNMENT, SEGMENT_SIZE) != 0) {
+		log_fatal("Posix memalign failed");
+		perror("Reason: ");
+		BUG_ON();
+	}
+	return segment_buf;
+}
+
+/*Waits for an asynchronous I/O of the compaction and returns the bytes it transferred*/
+static ssize_t comp_wait_aio(struct aiocb *aiocb)
+{
+	const struct aiocb *aiocb_list[1] = { aiocb };
+	int error = 0;
+	while (EINPROGRESS == (error = aio_error(aiocb))) {
+		if (aio_suspend(aiocb_list, 1, NULL) != 0 && errno != EINTR) {
+			log_fatal("Failed to wait for async I/O at %lu", aiocb->aio_offset);
+			perror("Reason");
+			BUG_ON();
+		}
+	}
+	if (error) {
+		log_fatal("Async I/O at %lu failed: %s", aiocb->aio_offset, strerror(error));
+		BUG_ON();
+	}
+	return aio_return(aiocb);
+}
+
+/*Waits for the oldest write in flight, its buffer becomes free*/
+static void comp_reap_write(struct comp_write_behind *write_behind)
+{
+	assert(write_behind->num_pending > 0);
+	struct aiocb *aiocb = &write_behind->aiocb[write_behind->head];
+	char *segment_buf = write_behind->pending_buf[write_behind->head];
+	uint64_t start = comp_get_usec();
+	ssize_t bytes_written = comp_wait_aio(aiocb);
+	/*a short write is completed synchronously*/
+	if (bytes_written < SEGMENT_SIZE)
+		comp_write_segment(segment_buf, aiocb->aio_offset, bytes_written, SEGMENT_SIZE, write_behind->fd);
+	write_behind->write_usec += comp_get_usec() - start;
+	write_behind->bytes_written += SEGMENT_SIZE;
+	write_behind->head = (write_behind->head + 1) % COMP_WRITE_BEHIND_SEGMENTS;
+	--write_behind->num_pending;
+	write_behind->free_buf[write_behind->num_free++] = segment_buf;
+}
+
+static struct comp_write_behind *comp_start_write_behind(int fd, struct io_limiter *io_limiter)
+{
+	struct comp_write_behind *write_behind = calloc(1, sizeof(struct comp_write_behind));
+	if (!write_behind) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	for (uint32_t i = 0; i < COMP_WRITE_BEHIND_SEGMENTS; ++i)
+		write_behind->free_buf[write_behind->num_free++] = comp_alloc_segment_buf();
+	write_behind->fd = fd;
+	write_behind->io_limiter = io_limiter;
+	return write_behind;
+}
+
+/*Waits for the writes in flight of the cursor and adds them to its stats*/
+static void comp_stop_write_behind(struct comp_level_write_cursor *c)
+{
+	struct comp_write_behind *write_behind = c->write_behind;
+	while (write_behind->num_pending)
+		comp_reap_write(write_behind);
+	assert(COMP_WRITE_BEHIND_SEGMENTS == write_behind->num_free);
+	c->bytes_written += write_behind->bytes_written;
+	c->write_usec += write_behind->write_usec;
+	for (uint32_t i = 0; i < COMP_WRITE_BEHIND_SEGMENTS; ++i)
+		free(write_behind->free_buf[i]);
+	free(write_behind);
+	c->write_behind = NULL;
+}
+
+/*Issues the write of the full segment of a height, the cursor continues in a buffer already written*/
+static void comp_write_full_segment(struct comp_level_write_cursor *c, uint32_t height)
+{
+	struct comp_write_behind *write_behind = c->write_behind;
+	if (0 == write_behind->num_free)
+		comp_reap_write(write_behind);
+
+	uint32_t tail = (write_behind->head + write_behind->num_pending) % COMP_WRITE_BEHIND_SEGMENTS;
+	struct aiocb *aiocb = &write_behind->aiocb[tail];
+	memset(aiocb, 0x00, sizeof(struct aiocb));
+	aiocb->aio_fildes = write_behind->fd;
+	aiocb->aio_offset = c->last_segment_btree_level_offt[height];
+	aiocb->aio_buf = c->segment_buf[height];
+	aiocb->aio_nbytes = SEGMENT_SIZE;
+	io_limiter_request(write_behind->io_limiter, SEGMENT_SIZE);
+	if (aio_write(aiocb)) {
+		log_fatal("Failed to issue the write of segment %lu", aiocb->aio_offset);
+		perror("Reason");
+		BUG_ON();
+	}
+	write_behind->pending_buf[tail] = c->segment_buf[height];
+	++write_behind->num_pending;
+	c->segment_buf[height] = write_behind->free_buf[--write_behind->num_free];
+}
+
+static void comp_init_dynamic_leaf(struct bt_dynamic_leaf_node *leaf, uint8_t full_keys)
 {
 	leaf->header.type = leafNode;
 	leaf->header.num_entries = 0;
 	leaf->header.fragmentation = 0;
 
 	leaf->header.leaf_log_size = 0;
+	leaf->header.leaf_prefix_size = 0;
+	leaf->header.leaf_full_keys = full_keys;
 	leaf->header.height = 0;
 }
 
+static void *comp_alloc_leaf_buf(uint32_t leaf_size)
+{
+	void *leaf_buf = calloc(1, leaf_size);
+	if (!leaf_buf) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	return leaf_buf;
+}
+
 static void comp_init_read_cursor(struct comp_level_read_cursor *c, db_handle *handle, uint32_t level_id,
 				  uint32_t tree_id, int fd)
 {
@@ -259,6 +392,190 @@ static void comp_init_read_cursor(struct comp_level_read_cursor *c, db_handle *h
 	c->state = COMP_CUR_FETCH_NEXT_SEGMENT;
 }
 
+static void comp_pread_segment(int fd, char *segment_buf, uint64_t dev_offt, uint32_t buf_offt)
+{
+	//	log_info("Reading level segment from dev_offt: %llu", dev_offt);
+	ssize_t bytes_read = buf_offt;
+	while (bytes_read < SEGMENT_SIZE) {
+		ssize_t bytes = pread(fd, &segment_buf[bytes_read], SEGMENT_SIZE - bytes_read, dev_offt + bytes_read);
+		if (-1 == bytes) {
+			log_fatal("Failed to read error code");
+			perror("Error");
+			BUG_ON();
+		}
+		bytes_read += bytes;
+	}
+}
+
+/*Issues the read of the next segment of the level if none is in flight and a buffer is free*/
+static void comp_read_ahead_next(struct comp_read_ahead *read_ahead)
+{
+	if (read_ahead->reading || COMP_READ_AHEAD_SEGMENTS == read_ahead->num_ready || 0 == read_ahead->next_dev_offt)
+		return;
+
+	/*the buffer of the cursor precedes head, it is never among the free ones*/
+	uint32_t slot = (read_ahead->head + read_ahead->num_ready) % (COMP_READ_AHEAD_SEGMENTS + 1);
+	struct aiocb *aiocb = &read_ahead->aiocb;
+	memset(aiocb, 0x00, sizeof(struct aiocb));
+	aiocb->aio_fildes = read_ahead->fd;
+	aiocb->aio_offset = read_ahead->next_dev_offt;
+	aiocb->aio_buf = read_ahead->segment_buf[slot];
+	aiocb->aio_nbytes = SEGMENT_SIZE;
+	io_limiter_request(read_ahead->io_limiter, SEGMENT_SIZE);
+	if (aio_read(aiocb)) {
+		log_fatal("Failed to issue the read of segment %lu", aiocb->aio_offset);
+		perror("Reason");
+		BUG_ON();
+	}
+	read_ahead->reading = 1;
+}
+
+/*Makes the segment of the read in flight ready, false if there is none or it is in progress and wait is false*/
+static bool comp_read_ahead_complete(struct comp_read_ahead *read_ahead, bool wait)
+{
+	if (!read_ahead->reading || (!wait && EINPROGRESS == aio_error(&read_ahead->aiocb)))
+		return false;
+
+	uint32_t slot = (read_ahead->head + read_ahead->num_ready) % (COMP_READ_AHEAD_SEGMENTS + 1);
+	ssize_t bytes_read = comp_wait_aio(&read_ahead->aiocb);
+	/*a short read is completed synchronously*/
+	if (bytes_read < SEGMENT_SIZE)
+		comp_pread_segment(read_ahead->fd, read_ahead->segment_buf[slot], read_ahead->aiocb.aio_offset,
+				   bytes_read);
+	struct segment_header *segment = (struct segment_header *)read_ahead->segment_buf[slot];
+	read_ahead->dev_offt[slot] = read_ahead->aiocb.aio_offset;
+	read_ahead->next_dev_offt = (uint64_t)segment->next_segment;
+	++read_ahead->num_ready;
+	read_ahead->reading = 0;
+	return true;
+}
+
+static struct comp_read_ahead *comp_start_read_ahead(int fd, uint64_t dev_offt, struct io_limiter *io_limiter)
+{
+	struct comp_read_ahead *read_ahead = calloc(1, sizeof(struct comp_read_ahead));
+	if (!read_ahead) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	for (uint32_t i = 0; i < COMP_READ_AHEAD_SEGMENTS + 1; ++i)
+		read_ahead->segment_buf[i] = comp_alloc_segment_buf();
+	read_ahead->fd = fd;
+	read_ahead->io_limiter = io_limiter;
+	read_ahead->next_dev_offt = dev_offt;
+	comp_read_ahead_next(read_ahead);
+	return read_ahead;
+}
+
+static void comp_stop_read_ahead(struct comp_read_ahead *read_ahead)
+{
+	/*the buffers are freed only after the read in flight fills one*/
+	if (read_ahead->reading)
+		comp_wait_aio(&read_ahead->aiocb);
+	for (uint32_t i = 0; i < COMP_READ_AHEAD_SEGMENTS + 1; ++i)
+		free(read_ahead->segment_buf[i]);
+	free(read_ahead);
+}
+
+static void comp_close_read_cursor(struct comp_level_read_cursor *c)
+{
+	if (c->read_ahead)
+		comp_stop_read_ahead(c->read_ahead);
+	free(c->leaf_buf);
+	free(c);
+}
+
+/**
+ * Makes curr_segment the current segment of the cursor. Segments are read
+ * ahead in chain order, starting at the first segment the cursor asks for.
+ * The reads that completed while the cursor decoded issue the next ones.
+ */
+static void comp_read_segment(struct comp_level_read_cursor *c)
+{
+	uint64_t dev_offt = ABSOLUTE_ADDRESS(c->curr_segment);
+	if (!c->read_ahead)
+		c->read_ahead = comp_start_read_ahead(c->fd, dev_offt, c->handle->db_desc->io_limiter);
+
+	struct comp_read_ahead *read_ahead = c->read_ahead;
+	while (comp_read_ahead_complete(read_ahead, false))
+		comp_read_ahead_next(read_ahead);
+	if (0 == read_ahead->num_ready) {
+		assert(read_ahead->reading);
+		comp_read_ahead_complete(read_ahead, true);
+	}
+
+	if (read_ahead->dev_offt[read_ahead->head] != dev_offt) {
+		log_fatal("Read ahead segment %lu instead of %lu", read_ahead->dev_offt[read_ahead->head], dev_offt);
+		BUG_ON();
+	}
+	c->segment_buf = read_ahead->segment_buf[read_ahead->head];
+	read_ahead->head = (read_ahead->head + 1) % (COMP_READ_AHEAD_SEGMENTS + 1);
+	--read_ahead->num_ready;
+	/*the buffer of the previous segment is free, one more segment can be read*/
+	comp_read_ahead_next(read_ahead);
+}
+
+static uint32_t comp_get_partition_id(struct level_partition_table *partitions, uint64_t root_offt)
+{
+	for (uint32_t i = 0; i < partitions->num_partitions; ++i) {
+		if (partitions->partitions[i].root_offt == root_offt)
+			return i;
+	}
+	log_fatal("No partition has its root at %lu", root_offt);
+	BUG_ON();
+}
+
+/**
+ * Positions the cursor at the leaf of its level where start_key belongs and
+ * bounds it to keys smaller than end_key. The leaf may start with smaller
+ * keys, comp_get_next_key skips them.
+ */
+static void comp_seek_read_cursor(struct comp_level_read_cursor *c, struct node_header *root,
+				  struct pivot_key *start_key, struct pivot_key *end_key)
+{
+	c->start_key = start_key;
+	c->end_key = end_key;
+	if (!start_key)
+		return;
+
+	struct node_header *node = root;
+	if (c->partitions) {
+		/*the children of the root of a partitioned level are the roots of its partitions*/
+		node = REAL_ADDRESS(index_binary_search((struct index_node *)node, start_key, INDEX_KEY_TYPE));
+		c->partition_id = comp_get_partition_id(c->partitions, ABSOLUTE_ADDRESS(node));
+	}
+	while (rootNode == node->type || internalNode == node->type)
+		node = REAL_ADDRESS(index_binary_search((struct index_node *)node, start_key, INDEX_KEY_TYPE));
+
+	uint64_t leaf_offt = ABSOLUTE_ADDRESS(node);
+	c->curr_segment = REAL_ADDRESS(leaf_offt - leaf_offt % SEGMENT_SIZE);
+	comp_read_segment(c);
+	/*the offset is only used within the segment from now on, the level end is its last segment*/
+	c->offset = leaf_offt % SEGMENT_SIZE;
+	c->seeked = 1;
+	c->state = COMP_CUR_FIND_LEAF;
+}
+
+/*Compares the current key of the cursor with a pivot, the prefix of separated KVs avoids most log accesses*/
+static int comp_cmp_cursor_key(struct comp_level_read_cursor *c, struct pivot_key *pivot)
+{
+	struct kv_splice *kv = (struct kv_splice *)c->cursor_key.kv_inplace;
+	if (MEDIUM_INLOG == c->category || BIG_INLOG == c->category) {
+		/*prefixes of short keys are zero padded, a difference is decisive only within the pivot*/
+		int32_t size = pivot->size < PREFIX_SIZE ? pivot->size : PREFIX_SIZE;
+		int ret = memcmp(c->cursor_key.kv_inlog->prefix, pivot->data, size);
+		if (ret)
+			return ret;
+		if (c->cursor_key.full_key) {
+			int32_t key_size = c->cursor_key.full_key_size;
+			size = key_size < pivot->size ? key_size : pivot->size;
+			ret = memcmp(c->cursor_key.full_key, pivot->data, size);
+			return ret ? ret : key_size - pivot->size;
+		}
+		kv = (struct kv_splice *)c->cursor_key.kv_inlog->dev_offt;
+	}
+	return -index_key_cmp(pivot, (char *)kv, KV_FORMAT);
+}
+
 static void comp_get_next_key(struct comp_level_read_cursor *c)
 {
 	if (c == NULL) {
@@ -289,53 +606,51 @@ static void comp_get_next_key(struct comp_level_read_cursor *c)
 		case COMP_CUR_FETCH_NEXT_SEGMENT: {
 			if (c->curr_segment == NULL) {
 				c->curr_segment = c->handle->db_desc->levels[c->level_id].first_segment[c->tree_id];
+				if (c->partitions)
+					c->curr_segment = REAL_ADDRESS(c->partitions->partitions[0].first_segment_offt);
 			} else {
-				if (c->curr_segment->next_segment == NULL) {
-					assert((uint64_t)c->curr_segment ==
-					       (uint64_t)c->handle->db_desc->levels[c->level_id]
-						       .last_segment[c->tree_id]);
+				if (c->curr_segment->next_segment == NULL && c->partitions &&
+				    c->partition_id + 1 < c->partitions->num_partitions) {
+					assert(ABSOLUTE_ADDRESS(c->curr_segment) ==
+					       c->partitions->partitions[c->partition_id].last_segment_offt);
+					/*the chain of the next partition starts elsewhere, so does its read ahead*/
+					comp_stop_read_ahead(c->read_ahead);
+					c->read_ahead = NULL;
+					++c->partition_id;
+					c->curr_segment = REAL_ADDRESS(c->partitions->partitions[c->partition_id]
+									       .first_segment_offt);
+				} else if (c->curr_segment->next_segment == NULL) {
+					/*the root segment of a partitioned level is its last one, cursors skip it*/
+					assert(c->partitions || (uint64_t)c->curr_segment ==
+								(uint64_t)c->handle->db_desc->levels[c->level_id]
+									.last_segment[c->tree_id]);
 					log_debug("Done reading level %u cursor offset %lu total offt %lu", c->level_id,
 						  c->offset,
 						  c->handle->db_desc->levels[c->level_id].offset[c->tree_id]);
-					assert(c->offset == c->handle->db_desc->levels[c->level_id].offset[c->tree_id]);
-					c->state = COMP_CUR_CHECK_OFFT;
-					//TODO replace goto with continue;
-					//TODO Rename device_offt
-					goto fsm_entry;
+					/*a cursor that seeked counts its offset from the segment it started at*/
+					assert(c->seeked || c->partitions ||
+					       c->offset == c->handle->db_desc->levels[c->level_id].offset[c->tree_id]);
+					c->end_of_level = 1;
+					return;
 				} else
 					c->curr_segment =
 						(segment_header *)REAL_ADDRESS((uint64_t)c->curr_segment->next_segment);
 			}
 			/*log_info("Fetching next segment id %llu for [%lu][%lu]", c->curr_segment->segment_id,
 				 c->level_id, c->tree_id);*/
-			/*read the segment*/
-
-			off_t dev_offt = ABSOLUTE_ADDRESS(c->curr_segment);
-			//	log_info("Reading level segment from dev_offt: %llu", dev_offt);
-			ssize_t bytes_read = 0; //sizeof(struct segment_header);
-			while (bytes_read < SEGMENT_SIZE) {
-				ssize_t bytes = pread(c->fd, &c->segment_buf[bytes_read], SEGMENT_SIZE - bytes_read,
-						      dev_offt + bytes_read);
-				if (-1 == bytes) {
-					log_fatal("Failed to read error code");
-					perror("Error");
-					BUG_ON();
-				}
-				bytes_read += bytes;
-			}
+			comp_read_segment(c);
 			c->offset += sizeof(struct segment_header);
 			c->state = COMP_CUR_FIND_LEAF;
 			break;
 		}
 
 		case COMP_CUR_DECODE_KV: {
-			struct bt_dynamic_leaf_node *leaf =
-				(struct bt_dynamic_leaf_node *)((uint64_t)c->segment_buf + (c->offset % SEGMENT_SIZE));
+			struct bt_dynamic_leaf_node *leaf = c->leaf;
 			// slot array entry
 			if (c->curr_leaf_entry >= leaf->header.num_entries) {
 				// done with this leaf
 				c->curr_leaf_entry = 0;
-				c->offset += level_leaf_size;
+				c->offset += c->leaf_node_size;
 				c->state = COMP_CUR_CHECK_OFFT;
 				break;
 			}
@@ -343,13 +658,14 @@ static void comp_get_next_key(struct comp_level_read_cursor *c)
 
 			c->category = slot_array[c->curr_leaf_entry].key_category;
 			c->cursor_key.tombstone = slot_array[c->curr_leaf_entry].tombstone;
+			c->cursor_key.full_key = NULL;
 			char *kv_loc = get_kv_offset(leaf, level_leaf_size, slot_array[c->curr_leaf_entry].index);
 			switch (c->category) {
 			case SMALL_INPLACE:
 			case MEDIUM_INPLACE: {
-				// Real key in KV_FORMAT
-				c->cursor_key.kv_inplace =
-					fill_keybuf(kv_loc, get_kv_format(slot_array[c->curr_leaf_entry].key_category));
+				// Real key in KV_FORMAT, rebuilt if the leaf is prefix compressed
+				c->cursor_key.kv_inplace = (char *)get_kv_inplace(leaf, level_leaf_size, c->level_id,
+										  c->curr_leaf_entry, c->kv_buf);
 				break;
 			}
 			case MEDIUM_INLOG:
@@ -357,30 +673,60 @@ static void comp_get_next_key(struct comp_level_read_cursor *c)
 				c->cursor_key.kv_inlog = (struct kv_seperation_splice *)kv_loc;
 				c->cursor_key.kv_inlog->dev_offt =
 					(uint64_t)REAL_ADDRESS(c->cursor_key.kv_inlog->dev_offt);
+				struct key_splice *full_key = get_separated_full_key(leaf, kv_loc);
+				if (full_key) {
+					c->cursor_key.full_key = get_key_splice_key_offset(full_key);
+					c->cursor_key.full_key_size = full_key->key_size;
+				}
 				break;
 			default:
 				log_fatal("Cannot handle this category");
 				BUG_ON();
 			}
 			++c->curr_leaf_entry;
+			if (c->start_key && comp_cmp_cursor_key(c, c->start_key) < 0)
+				break;
+			/*keys are sorted, no need to check the start of the range again*/
+			c->start_key = NULL;
+			if (c->end_key && comp_cmp_cursor_key(c, c->end_key) >= 0) {
+				c->end_of_level = 1;
+				return;
+			}
 			return;
 		}
 
 		case COMP_CUR_FIND_LEAF: {
 			/*read four bytes to check what is the node format*/
 			nodeType_t type = *(uint32_t *)(&c->segment_buf[c->offset % SEGMENT_SIZE]);
+			struct index_node *node = NULL;
 			switch (type) {
 			case leafNode:
 			case leafRootNode:
 				//__sync_fetch_and_add(&leaves, 1);
 				//log_info("Found a leaf!");
+				c->leaf = (struct bt_dynamic_leaf_node *)&c->segment_buf[c->offset % SEGMENT_SIZE];
+				c->leaf_node_size = level_leaf_size;
+				c->state = COMP_CUR_DECODE_KV;
+				goto fsm_entry;
+
+			case compressedLeafNode: {
+				struct bt_compressed_leaf_node *compressed_leaf =
+					(struct bt_compressed_leaf_node *)&c->segment_buf[c->offset % SEGMENT_SIZE];
+				/*levels written with compression off may still hold compressed leaves*/
+				if (!c->leaf_buf)
+					c->leaf_buf = comp_alloc_leaf_buf(level_leaf_size);
+				decompress_dynamic_leaf(compressed_leaf, c->leaf_buf, level_leaf_size);
+				c->leaf = c->leaf_buf;
+				c->leaf_node_size = compressed_leaf->node_size;
 				c->state = COMP_CUR_DECODE_KV;
 				goto fsm_entry;
+			}
 
 			case rootNode:
 			case internalNode:
 				/*log_info("Found an internal");*/
-				c->offset += index_node_get_size();
+				node = (struct index_node *)&c->segment_buf[c->offset % SEGMENT_SIZE];
+				c->offset += index_get_node_size(node);
 				c->state = COMP_CUR_CHECK_OFFT;
 				goto fsm_entry;
 
@@ -408,24 +754,121 @@ static void comp_get_next_key(struct comp_level_read_cursor *c)
 	}
 }
 
-static void comp_init_write_cursor(struct comp_level_write_cursor *c, struct db_handle *handle, int level_id, int fd)
+/*Starts the index nodes of a height, a cursor allocates the segments of a height once its tree reaches it*/
+static void comp_init_index_height(struct comp_level_write_cursor *c, int32_t height)
+{
+	comp_get_space(c, height, internalNode);
+	index_init_node_with_size(DO_NOT_ADD_GUARD, (struct index_node *)c->last_index[height], internalNode,
+				  c->handle->db_desc->levels[c->level_id].index_node_size);
+	index_set_immutable((struct index_node *)c->last_index[height]);
+	c->first_segment_btree_level_offt[height] = c->last_segment_btree_level_offt[height];
+	assert(c->last_segment_btree_level_offt[height]);
+}
+
+/*The highest height with segments, the chain of the cursor ends at its last segment*/
+static int32_t comp_get_top_height(struct comp_level_write_cursor *c)
+{
+	return c->tree_height > 1 ? c->tree_height : 1;
+}
+
+static void comp_init_write_cursor(struct comp_level_write_cursor *c, struct db_handle *handle, int level_id,
+				   uint8_t tree_id, int fd)
 {
 	memset(c, 0, sizeof(struct comp_level_write_cursor));
 	c->level_id = level_id;
+	c->tree_id = tree_id;
 	c->tree_height = 0;
 	c->fd = fd;
 	c->handle = handle;
+	for (int i = 0; i < MAX_HEIGHT; ++i)
+		c->segment_buf[i] = comp_alloc_segment_buf();
+	c->write_behind = comp_start_write_behind(fd, handle->db_desc->io_limiter);
+	if (handle->db_desc->levels[level_id].compress_leaves) {
+		c->leaf_buf = comp_alloc_leaf_buf(handle->db_desc->levels[level_id].leaf_size);
+		c->compressed_leaf = comp_alloc_leaf_buf(handle->db_desc->levels[level_id].leaf_size);
+	}
 
 	comp_get_space(c, 0, leafNode);
 	assert(c->last_segment_btree_level_offt[0]);
 	c->first_segment_btree_level_offt[0] = c->last_segment_btree_level_offt[0];
+	comp_init_index_height(c, 1);
+}
+
+/*Frees a closed write cursor, its last segments stay in memory until then*/
+static void comp_destroy_write_cursor(struct comp_level_write_cursor *c)
+{
+	assert(NULL == c->write_behind);
+	for (int i = 0; i < MAX_HEIGHT; ++i)
+		free(c->segment_buf[i]);
+	free(c);
+}
+
+/*Reserves size bytes for a leaf in the current leaf segment, moving to a new segment if they do not fit*/
+static char *comp_get_leaf_space(struct comp_level_write_cursor *c, uint32_t size)
+{
+	uint32_t remaining_space;
+	if (c->segment_offt[0] == 0)
+		remaining_space = 0;
+	else if (c->segment_offt[0] % SEGMENT_SIZE == 0)
+		remaining_space = 0;
+	else
+		remaining_space = SEGMENT_SIZE - c->segment_offt[0] % SEGMENT_SIZE;
+
+	if (0 == c->segment_offt[0] || remaining_space < size) {
+		if (remaining_space > 0) {
+			*(uint32_t *)&c->segment_buf[0][c->segment_offt[0] % SEGMENT_SIZE] = paddedSpace;
+			c->segment_offt[0] += remaining_space;
+		}
+
+		struct segment_header *new_device_segment =
+			get_segment_for_lsm_level_IO(c->handle->db_desc, c->level_id, c->tree_id);
+		struct segment_header *current_segment_mem_buffer = (struct segment_header *)&c->segment_buf[0][0];
+
+		if (c->segment_offt[0] != 0) {
+			current_segment_mem_buffer->next_segment = (void *)ABSOLUTE_ADDRESS(new_device_segment);
+
+			assert(new_device_segment);
+			assert(current_segment_mem_buffer->next_segment);
+			comp_write_full_segment(c, 0);
+			current_segment_mem_buffer = (struct segment_header *)&c->segment_buf[0][0];
+		}
+
+		memset(&c->segment_buf[0][0], 0x00, sizeof(struct segment_header));
 
-	for (int i = 1; i < MAX_HEIGHT; ++i) {
-		comp_get_space(c, i, internalNode);
-		index_init_node(DO_NOT_ADD_GUARD, (struct index_node *)c->last_index[i], internalNode);
-		c->first_segment_btree_level_offt[i] = c->last_segment_btree_level_offt[i];
-		assert(c->last_segment_btree_level_offt[i]);
+		c->last_segment_btree_level_offt[0] = ABSOLUTE_ADDRESS(new_device_segment);
+		c->segment_offt[0] = sizeof(struct segment_header);
+		current_segment_mem_buffer->segment_id = c->segment_id_cnt++;
+		current_segment_mem_buffer->nodetype = leafNode;
 	}
+
+	char *leaf_space = &c->segment_buf[0][c->segment_offt[0] % SEGMENT_SIZE];
+	c->segment_offt[0] += size;
+	return leaf_space;
+}
+
+/**
+ * Places the last leaf in its segment and returns its device offset. Leaves
+ * of uncompressed levels are built in place, the rest are compressed and
+ * stored as they are only when compression does not make them smaller.
+ */
+static uint64_t comp_place_last_leaf(struct comp_level_write_cursor *c)
+{
+	struct level_descriptor *level_desc = &c->handle->db_desc->levels[c->level_id];
+	char *leaf_space = (char *)c->last_leaf;
+
+	if (level_desc->compress_leaves) {
+		char *node = (char *)c->compressed_leaf;
+		uint32_t node_size = compress_dynamic_leaf(c->last_leaf, level_desc->leaf_size, c->compressed_leaf);
+		if (0 == node_size) {
+			node = (char *)c->last_leaf;
+			node_size = level_desc->leaf_size;
+		}
+		leaf_space = comp_get_leaf_space(c, node_size);
+		memcpy(leaf_space, node, node_size);
+	}
+
+	uint32_t offt = comp_calc_offt_in_seg(c->segment_buf[0], leaf_space);
+	return c->last_segment_btree_level_offt[0] + offt;
 }
 
 /*mini allocator*/
@@ -435,46 +878,18 @@ static void comp_get_space(struct comp_level_write_cursor *c, uint32_t height, n
 
 	struct level_descriptor *level_desc = &c->handle->db_desc->levels[c->level_id];
 	uint32_t level_leaf_size = level_desc->leaf_size;
+	uint32_t level_index_node_size = level_desc->index_node_size;
 	switch (type) {
 	case leafNode:
 	case leafRootNode: {
-		uint32_t remaining_space;
-		if (c->segment_offt[0] == 0)
-			remaining_space = 0;
-		else if (c->segment_offt[0] % SEGMENT_SIZE == 0)
-			remaining_space = 0;
-		else
-			remaining_space = SEGMENT_SIZE - c->segment_offt[0] % SEGMENT_SIZE;
-		if (remaining_space < level_leaf_size) {
-			if (remaining_space > 0) {
-				*(uint32_t *)&c->segment_buf[0][c->segment_offt[0] % SEGMENT_SIZE] = paddedSpace;
-				c->segment_offt[0] += remaining_space;
-			}
-
-			struct segment_header *new_device_segment =
-				get_segment_for_lsm_level_IO(c->handle->db_desc, c->level_id, 1);
-			struct segment_header *current_segment_mem_buffer =
-				(struct segment_header *)&c->segment_buf[0][0];
-
-			if (c->segment_offt[height] != 0) {
-				current_segment_mem_buffer->next_segment = (void *)ABSOLUTE_ADDRESS(new_device_segment);
-
-				assert(new_device_segment);
-				assert(current_segment_mem_buffer->next_segment);
-				comp_write_segment(c->segment_buf[0], c->last_segment_btree_level_offt[0], 0,
-						   SEGMENT_SIZE, c->fd);
-			}
-
-			memset(&c->segment_buf[0][0], 0x00, sizeof(struct segment_header));
-
-			c->last_segment_btree_level_offt[0] = ABSOLUTE_ADDRESS(new_device_segment);
-			c->segment_offt[0] = sizeof(struct segment_header);
-			current_segment_mem_buffer->segment_id = c->segment_id_cnt++;
-			current_segment_mem_buffer->nodetype = type;
-		}
-		c->last_leaf = (struct bt_dynamic_leaf_node *)(&c->segment_buf[0][(c->segment_offt[0] % SEGMENT_SIZE)]);
-		comp_init_dynamic_leaf(c->last_leaf);
-		c->segment_offt[0] += level_leaf_size;
+		if (level_desc->compress_leaves) {
+			/*the first leaf segment heads the level, allocate it before the first leaf is placed*/
+			if (0 == c->segment_offt[0])
+				comp_get_leaf_space(c, 0);
+			c->last_leaf = c->leaf_buf;
+		} else
+			c->last_leaf = (struct bt_dynamic_leaf_node *)comp_get_leaf_space(c, level_leaf_size);
+		comp_init_dynamic_leaf(c->last_leaf, c->handle->db_options.options[FULL_KEYS_IN_LEAVES].value != 0);
 		break;
 	}
 	case internalNode:
@@ -487,7 +902,7 @@ static void comp_get_space(struct comp_level_write_cursor *c, uint32_t height, n
 		else
 			remaining_space = SEGMENT_SIZE - (c->segment_offt[height] % SEGMENT_SIZE);
 
-		if (remaining_space < index_node_get_size()) {
+		if (remaining_space < level_index_node_size) {
 			if (remaining_space > 0) {
 				*(uint32_t *)(&c->segment_buf[height][c->segment_offt[height] % SEGMENT_SIZE]) =
 					paddedSpace;
@@ -495,7 +910,7 @@ static void comp_get_space(struct comp_level_write_cursor *c, uint32_t height, n
 			}
 
 			struct segment_header *new_device_segment =
-				get_segment_for_lsm_level_IO(c->handle->db_desc, c->level_id, 1);
+				get_segment_for_lsm_level_IO(c->handle->db_desc, c->level_id, c->tree_id);
 			struct segment_header *current_segment_mem_buffer =
 				(struct segment_header *)&c->segment_buf[height][0];
 
@@ -505,8 +920,8 @@ static void comp_get_space(struct comp_level_write_cursor *c, uint32_t height, n
 				assert(new_device_segment);
 				assert(current_segment_mem_buffer->next_segment);
 
-				comp_write_segment(c->segment_buf[height], c->last_segment_btree_level_offt[height], 0,
-						   SEGMENT_SIZE, c->fd);
+				comp_write_full_segment(c, height);
+				current_segment_mem_buffer = (struct segment_header *)&c->segment_buf[height][0];
 			}
 
 			memset(&c->segment_buf[height][0], 0x00, sizeof(struct segment_header));
@@ -517,7 +932,7 @@ static void comp_get_space(struct comp_level_write_cursor *c, uint32_t height, n
 		}
 		c->last_index[height] =
 			(struct index_node *)&c->segment_buf[height][c->segment_offt[height] % SEGMENT_SIZE];
-		c->segment_offt[height] += index_node_get_size();
+		c->segment_offt[height] += level_index_node_size;
 		break;
 	}
 	default:
@@ -575,19 +990,31 @@ static void assert_level_segments(db_descriptor *db_desc, uint8_t level_id, uint
 
 static void comp_close_write_cursor(struct comp_level_write_cursor *c)
 {
-	uint32_t level_leaf_size = c->handle->db_desc->levels[c->level_id].leaf_size;
-	for (int32_t i = 0; i < MAX_HEIGHT; ++i) {
+	if (c->medium_log_chunk)
+		put_chunk_to_LRU(c->medium_log_LRU_cache, c->medium_log_chunk);
+	c->medium_log_chunk = NULL;
+
+	uint64_t last_leaf_offt = comp_place_last_leaf(c);
+	if (c->pending_pivot_left_offt)
+		comp_append_pivot_to_index(1, c, c->pending_pivot_left_offt, (struct pivot_key *)c->pending_pivot,
+					   last_leaf_offt);
+
+	int32_t top_height = comp_get_top_height(c);
+	for (int32_t i = 0; i <= top_height; ++i) {
 		uint32_t *type;
 		//log_debug("i = %u tree height: %u", i, c->tree_height);
 
+		if (i > 0)
+			index_seal_node(c->last_index[i]);
+
 		if (i <= c->tree_height) {
 			assert(c->segment_offt[i] > 4096);
 			if (i == 0 && c->segment_offt[i] % SEGMENT_SIZE != 0) {
-				type = (uint32_t *)((uint64_t)c->last_leaf + level_leaf_size);
+				type = (uint32_t *)&c->segment_buf[0][c->segment_offt[0] % SEGMENT_SIZE];
 				//log_info("Marking padded space for %u segment offt %llu", i, c->segment_offt[0]);
 				*type = paddedSpace;
 			} else if (i > 0 && c->segment_offt[i] % SEGMENT_SIZE != 0) {
-				type = (uint32_t *)(((char *)c->last_index[i]) + index_node_get_size());
+				type = (uint32_t *)(((char *)c->last_index[i]) + index_get_node_size(c->last_index[i]));
 				// log_info("Marking padded space for %u segment offt %llu entries of
 				// last node %llu", i,
 				//	 c->segment_offt[i], c->last_index[i]->header.num_entries);
@@ -603,13 +1030,17 @@ static void comp_close_write_cursor(struct comp_level_write_cursor *c)
 		if (i == c->tree_height) {
 			log_debug("Merged level has a height off %u", c->tree_height);
 
-			if (!index_set_type((struct index_node *)c->last_index[i], rootNode)) {
-				log_fatal("Error setting node type");
-				BUG_ON();
+			if (0 == i) {
+				/*a subcompaction of a narrow range may fill a single leaf, it is its root*/
+				c->root_offt = last_leaf_offt;
+			} else {
+				if (!index_set_type((struct index_node *)c->last_index[i], rootNode)) {
+					log_fatal("Error setting node type");
+					BUG_ON();
+				}
+				uint32_t offt = comp_calc_offt_in_seg(c->segment_buf[i], (char *)c->last_index[i]);
+				c->root_offt = c->last_segment_btree_level_offt[i] + offt;
 			}
-			uint32_t offt = comp_calc_offt_in_seg(c->segment_buf[i], (char *)c->last_index[i]);
-			c->root_offt = c->last_segment_btree_level_offt[i] + offt;
-			c->handle->db_desc->levels[c->level_id].root_r[1] = REAL_ADDRESS(c->root_offt);
 		}
 
 		struct segment_header *segment_in_mem_buffer = (struct segment_header *)c->segment_buf[i];
@@ -617,20 +1048,25 @@ static void comp_close_write_cursor(struct comp_level_write_cursor *c)
 		//assert(c->segment_id_cnt != 251);
 		/* segment_in_mem_buffer->nodetype = paddedSpace; */
 
-		if (MAX_HEIGHT - 1 == i) {
-			c->handle->db_desc->levels[c->level_id].last_segment[1] =
-				REAL_ADDRESS(c->last_segment_btree_level_offt[i]);
+		if (top_height == i) {
 			assert(c->last_segment_btree_level_offt[i]);
 			segment_in_mem_buffer->next_segment = NULL;
 		} else {
 			assert(c->last_segment_btree_level_offt[i + 1]);
 			segment_in_mem_buffer->next_segment = (void *)c->first_segment_btree_level_offt[i + 1];
 		}
+		io_limiter_request(c->handle->db_desc->io_limiter, SEGMENT_SIZE);
+		uint64_t start = comp_get_usec();
 		comp_write_segment(c->segment_buf[i], c->last_segment_btree_level_offt[i], 0, SEGMENT_SIZE, c->fd);
+		c->write_usec += comp_get_usec() - start;
+		c->bytes_written += SEGMENT_SIZE;
 	}
 
+	comp_stop_write_behind(c);
+	free(c->leaf_buf);
+	free(c->compressed_leaf);
 #if 0
-	assert_level_segments(c->handle->db_desc, c->level_id, 1);
+	assert_level_segments(c->handle->db_desc, c->level_id, c->tree_id);
 #endif
 }
 
@@ -642,6 +1078,8 @@ static void comp_append_pivot_to_index(int32_t height, struct comp_level_write_c
 
 	if (c->tree_height < height)
 		c->tree_height = height;
+	if (!c->last_index[height])
+		comp_init_index_height(c, height);
 
 	struct index_node *node = (struct index_node *)c->last_index[height];
 
@@ -660,9 +1098,13 @@ static void comp_append_pivot_to_index(int32_t height, struct comp_level_write_c
 		struct pivot_key *pivot_copy = index_remove_last_pivot_key(node);
 		struct pivot_pointer *piv_pointer =
 			(struct pivot_pointer *)&((char *)pivot_copy)[PIVOT_KEY_SIZE(pivot_copy)];
+		/*node is full and immutable from now on*/
+		index_seal_node(node);
 		comp_get_space(c, height, internalNode);
 		ins_pivot_req.node = (struct index_node *)c->last_index[height];
-		index_init_node(DO_NOT_ADD_GUARD, ins_pivot_req.node, internalNode);
+		index_init_node_with_size(DO_NOT_ADD_GUARD, ins_pivot_req.node, internalNode,
+					  index_get_node_size(node));
+		index_set_immutable(ins_pivot_req.node);
 		index_add_guard(ins_pivot_req.node, piv_pointer->child_offt);
 		index_set_height(ins_pivot_req.node, height);
 
@@ -699,7 +1141,7 @@ static int comp_append_medium_L1(struct comp_level_write_cursor *c, struct comp_
 	struct db_descriptor *db_desc = c->handle->db_desc;
 	if (db_desc->medium_log.head_dev_offt == 0 && db_desc->medium_log.tail_dev_offt == 0 &&
 	    db_desc->medium_log.size == 0) {
-		comp_init_medium_log(c->handle->db_desc, c->level_id, 1);
+		comp_init_medium_log(c->handle->db_desc, c->level_id, c->tree_id);
 	}
 	struct bt_insert_req ins_req;
 	ins_req.metadata.handle = c->handle;
@@ -707,7 +1149,7 @@ static int comp_append_medium_L1(struct comp_level_write_cursor *c, struct comp_
 
 	ins_req.metadata.cat = MEDIUM_INLOG;
 	ins_req.metadata.level_id = c->level_id;
-	ins_req.metadata.tree_id = 1;
+	ins_req.metadata.tree_id = c->tree_id;
 	ins_req.metadata.append_to_log = 1;
 	ins_req.metadata.gc_request = 0;
 	ins_req.metadata.recovery_request = 0;
@@ -739,6 +1181,9 @@ static int comp_append_medium_L1(struct comp_level_write_cursor *c, struct comp_
 		memcpy(out->kv_sep.prefix, get_key_offset_in_kv(kv_inplace), get_key_size(kv_inplace));
 	}
 	out->kv_sep.dev_offt = (uint64_t)log_location;
+	out->kv_sep.kv_size = get_kv_size(kv_inplace);
+	out->full_key = get_key_offset_in_kv(kv_inplace);
+	out->full_key_size = get_key_size(kv_inplace);
 	out->kv_category = MEDIUM_INLOG;
 	out->kv_type = KV_INLOG;
 	out->kv_inlog = &out->kv_sep;
@@ -747,16 +1192,65 @@ static int comp_append_medium_L1(struct comp_level_write_cursor *c, struct comp_
 	return 1;
 }
 
-static void comp_append_entry_to_leaf_node(struct comp_level_write_cursor *cursor, struct comp_parallax_key *kv)
+/**
+ * Runs the TTL expiry and the compaction filter of the DB on a KV the
+ * compaction merges. In TTL mode the filter gets the value without its expiry
+ * time.
+ * @return true if the KV is filtered out
+ */
+static bool comp_filter_entry(struct comp_level_write_cursor *cursor, struct comp_parallax_key *kv)
+{
+	struct db_descriptor *db_desc = cursor->handle->db_desc;
+	uint64_t ttl_mode = cursor->handle->db_options.options[TTL_MODE].value;
+	par_compaction_filter filter = db_desc->compaction_filter;
+	if (kv->tombstone || (!ttl_mode && !filter))
+		return false;
+
+	struct kv_splice *kv_pair = KV_INLOG == kv->kv_type ? (struct kv_splice *)kv->kv_inlog->dev_offt :
+							    (struct kv_splice *)kv->kv_inplace;
+	int32_t key_size = get_key_size(kv_pair);
+	struct par_key key = { .size = key_size, .data = get_key_offset_in_kv(kv_pair) };
+	struct par_value value = { .val_size = get_value_size(kv_pair),
+				   .val_buffer = get_value_offset_in_kv(kv_pair, key_size),
+				   .val_buffer_size = get_value_size(kv_pair) };
+	if (ttl_mode) {
+		if (is_value_expired(value.val_buffer, value.val_size, time(NULL)))
+			return true;
+		value.val_size = get_value_size_without_expiry(value.val_size);
+	}
+	return filter && filter(db_desc->compaction_filter_context, &key, &value);
+}
+
+/**
+ * Appends a KV to the run of the cursor. A KV the compaction filter removes
+ * leaves a tombstone while older versions of it may live below the run.
+ * @return false if the value of the KV was dropped
+ */
+static bool comp_append_entry_to_leaf_node(struct comp_level_write_cursor *cursor, struct comp_parallax_key *kv)
 {
 	struct comp_parallax_key trans_medium;
 	struct write_dynamic_leaf_args write_leaf_args;
 	struct comp_parallax_key *curr_key = kv;
 	uint64_t left_leaf_offt = 0;
-	uint64_t right_leaf_offt = 0;
 	uint32_t level_leaf_size = cursor->handle->db_desc->levels[cursor->level_id].leaf_size;
 	uint32_t kv_size = 0;
 	uint8_t append_to_medium_log = 0;
+	char tombstone_buf[sizeof(struct kv_splice) + MAX_KEY_SIZE];
+
+	bool filtered = comp_filter_entry(cursor, kv);
+	if (filtered && cursor->drop_deleted)
+		return false;
+	if (filtered) {
+		struct kv_splice *kv_pair = KV_INLOG == kv->kv_type ? (struct kv_splice *)kv->kv_inlog->dev_offt :
+								    (struct kv_splice *)kv->kv_inplace;
+		struct kv_splice *tombstone = (struct kv_splice *)tombstone_buf;
+		set_key(tombstone, get_key_offset_in_kv(kv_pair), get_key_size(kv_pair));
+		set_tombstone(tombstone);
+		kv->kv_inplace = tombstone_buf;
+		kv->kv_type = KV_INPLACE;
+		kv->kv_category = SMALL_INPLACE;
+		kv->tombstone = 1;
+	}
 
 	if (comp_append_medium_L1(cursor, kv, &trans_medium)) {
 		curr_key = &trans_medium;
@@ -764,6 +1258,8 @@ static void comp_append_entry_to_leaf_node(struct comp_level_write_cursor *curso
 	}
 
 	write_leaf_args.level_medium_inplace = cursor->handle->db_desc->level_medium_inplace;
+	write_leaf_args.full_key = NULL;
+	write_leaf_args.full_key_size = 0;
 	switch (curr_key->kv_type) {
 	case KV_INPLACE:
 		kv_size = get_kv_size((struct kv_splice *)curr_key->kv_inplace);
@@ -787,99 +1283,122 @@ static void comp_append_entry_to_leaf_node(struct comp_level_write_cursor *curso
 		write_leaf_args.kv_format = KV_PREFIX;
 		write_leaf_args.cat = curr_key->kv_category;
 		write_leaf_args.tombstone = curr_key->tombstone;
+		write_leaf_args.full_key = curr_key->full_key;
+		write_leaf_args.full_key_size = curr_key->full_key_size;
+		/*the source leaf kept only the prefix, read the key from the log once for leaves that keep it*/
+		if (!write_leaf_args.full_key && cursor->last_leaf->header.leaf_full_keys) {
+			struct kv_splice *kv_in_log = (struct kv_splice *)curr_key->kv_inlog->dev_offt;
+			write_leaf_args.full_key = get_key_offset_in_kv(kv_in_log);
+			write_leaf_args.full_key_size = get_key_size(kv_in_log);
+		}
 		break;
 	default:
 		log_fatal("Unknown key_type (IN_PLACE,IN_LOG) instead got %u", curr_key->kv_type);
 		BUG_ON();
 	}
 
-	if (write_leaf_args.cat == MEDIUM_INLOG &&
-	    write_leaf_args.level_id == cursor->handle->db_desc->level_medium_inplace) {
-		write_leaf_args.key_value_buf = fetch_kv_from_LRU(&write_leaf_args, cursor);
-		assert(get_key_size((struct kv_splice *)write_leaf_args.key_value_buf) <= MAX_KEY_SIZE);
-		write_leaf_args.cat = MEDIUM_INPLACE;
-
-		kv_size = get_kv_size((struct kv_splice *)write_leaf_args.key_value_buf);
-		write_leaf_args.key_value_size = kv_size;
-		curr_key->kv_type = KV_INPLACE;
-		curr_key->kv_category = MEDIUM_INPLACE;
-		curr_key->kv_inplace = write_leaf_args.key_value_buf;
-		write_leaf_args.kv_format = KV_FORMAT;
-#if MEASURE_MEDIUM_INPLACE
-		__sync_fetch_and_add(&cursor->handle->db_desc->count_medium_inplace, 1);
-#endif
-	}
+	/*the medium transfer batch of the merge moves medium KVs in place before they get here*/
+	assert(write_leaf_args.cat != MEDIUM_INLOG ||
+	       write_leaf_args.level_id != cursor->handle->db_desc->level_medium_inplace);
 
-	struct split_level_leaf split_metadata = { .leaf = cursor->last_leaf,
-						   .leaf_size = level_leaf_size,
-						   .kv_size = kv_size,
-						   .level_id = cursor->level_id,
-						   .key_type = curr_key->kv_type,
-						   .cat = curr_key->kv_category,
-						   .level_medium_inplace =
-							   cursor->handle->db_desc->level_medium_inplace };
+	write_leaf_args.leaf = cursor->last_leaf;
+	write_leaf_args.dest = NULL;
+	write_leaf_args.middle = 0;
 
 	int new_leaf = 0;
-	if (is_dynamic_leaf_full(split_metadata)) {
+	if (!append_to_prefix_compressed_leaf(&write_leaf_args, level_leaf_size)) {
 		// log_info("Time for a split!");
 		/*keep current aka left leaf offt*/
-		uint32_t offt_l = comp_calc_offt_in_seg(cursor->segment_buf[0], (char *)cursor->last_leaf);
-		left_leaf_offt = cursor->last_segment_btree_level_offt[0] + offt_l;
+		left_leaf_offt = comp_place_last_leaf(cursor);
 		comp_get_space(cursor, 0, leafNode);
-		/*last leaf updated*/
-		uint32_t offt_r = comp_calc_offt_in_seg(cursor->segment_buf[0], (char *)cursor->last_leaf);
-		right_leaf_offt = cursor->last_segment_btree_level_offt[0] + offt_r;
 		new_leaf = 1;
-	}
-
-	write_leaf_args.leaf = cursor->last_leaf;
-	write_leaf_args.dest = get_leaf_log_offset(cursor->last_leaf, level_leaf_size);
-	write_leaf_args.middle = cursor->last_leaf->header.num_entries;
 
-	write_data_in_dynamic_leaf(&write_leaf_args);
-	// just append and leave
-	++cursor->last_leaf->header.num_entries;
+		write_leaf_args.leaf = cursor->last_leaf;
+		if (!append_to_prefix_compressed_leaf(&write_leaf_args, level_leaf_size)) {
+			log_fatal("KV of %u bytes does not fit in an empty leaf of %u bytes",
+				  write_leaf_args.key_value_size, level_leaf_size);
+			BUG_ON();
+		}
+	}
 #if ENABLE_BLOOM_FILTERS
 // TODO XXX
 #endif
 	// TODO SIZE
-	cursor->handle->db_desc->levels[cursor->level_id].level_size[1] += write_leaf_args.key_value_size;
+	__sync_fetch_and_add(&cursor->handle->db_desc->levels[cursor->level_id].level_size[cursor->tree_id],
+			     write_leaf_args.key_value_size);
+	cursor->level_size += write_leaf_args.key_value_size;
+
+	// constructing the pivot key out of the keys, pivot key follows different format than KV_PREFIX/KV_FORMAT
+	// first retrieve the kv_formated kv
+	char *kv_formated_kv = kv->kv_inplace;
+	if (!append_to_medium_log) {
+		switch (write_leaf_args.kv_format) {
+		case KV_FORMAT:
+			kv_formated_kv = write_leaf_args.key_value_buf;
+			break;
+		case KV_PREFIX:
+			if (cursor->level_id == 1 && curr_key->kv_category == MEDIUM_INPLACE)
+				kv_formated_kv = curr_key->kv_inplace;
+			else if (write_leaf_args.full_key)
+				kv_formated_kv = NULL;
+			else {
+				// the key lives in the log, do not touch it unless we need a pivot
+				kv_formated_kv = (char *)curr_key->kv_inlog->dev_offt;
+			}
+			break;
+		default:
+			BUG_ON();
+		}
+	}
 
 	if (new_leaf) {
 		// log_info("keys are %llu for level %u",
 		// c->handle->db_desc->levels[c->level_id].level_size[1],
 		//	 c->level_id);
 
-		// constructing the pivot key out of the keys, pivot key follows different format than KV_PREFIX/KV_FORMAT
-		// first retrieve the kv_formated kv
-		char *kv_formated_kv = kv->kv_inplace;
-		if (!append_to_medium_log) {
-			switch (write_leaf_args.kv_format) {
-			case KV_FORMAT:
-				kv_formated_kv = write_leaf_args.key_value_buf;
-				break;
-			case KV_PREFIX:
-				if (cursor->level_id == 1 && curr_key->kv_category == MEDIUM_INPLACE)
-					kv_formated_kv = curr_key->kv_inplace;
-				else {
-					// do a page fault to find the pivot
-					kv_formated_kv = (char *)curr_key->kv_inlog->dev_offt;
-				}
-				break;
-			default:
-				BUG_ON();
-			}
+		// do a page fault to fetch the last key of the left leaf if it lives in the log
+		char *left_key = cursor->last_key;
+		int32_t left_key_size = cursor->last_key_size;
+		if (cursor->last_key_in_log) {
+			left_key = get_key_offset_in_kv((struct kv_splice *)cursor->last_key_in_log);
+			left_key_size = get_key_size((struct kv_splice *)cursor->last_key_in_log);
 		}
-		//create a pivot key based on the pivot key format | key_size | key | out of the kv_formated key
+
+		/*the offset of the new leaf is known once it is placed, the pivot of the previous split precedes it*/
+		struct pivot_key *pending_pivot = (struct pivot_key *)cursor->pending_pivot;
+		if (cursor->pending_pivot_left_offt)
+			comp_append_pivot_to_index(1, cursor, cursor->pending_pivot_left_offt, pending_pivot,
+						   left_leaf_offt);
+
+		//create the shortest pivot key | key_size | key | that separates the two leaves
 		struct kv_splice *kv_buf = (struct kv_splice *)kv_formated_kv;
-		int32_t key_size_with_metadata_size = get_key_size_with_metadata(kv_buf);
-		int32_t key_size = get_key_size(kv_buf);
-		struct pivot_key *new_pivot = (struct pivot_key *)calloc(1, key_size_with_metadata_size);
-		set_pivot_key_size(new_pivot, key_size);
-		set_pivot_key(new_pivot, get_key_offset_in_kv(kv_buf), key_size);
+		if (kv_buf)
+			index_fill_shortest_separator(pending_pivot, left_key, left_key_size,
+						      get_key_offset_in_kv(kv_buf), get_key_size(kv_buf));
+		else
+			index_fill_shortest_separator(pending_pivot, left_key, left_key_size, write_leaf_args.full_key,
+						      write_leaf_args.full_key_size);
+		cursor->pending_pivot_left_offt = left_leaf_offt;
+	}
+
+	/*a separated KV that came with its full key leaves it in the cursor, no need to look in the log*/
+	if (!kv_formated_kv) {
+		cursor->last_key_in_log = NULL;
+		cursor->last_key_size = write_leaf_args.full_key_size;
+		memcpy(cursor->last_key, write_leaf_args.full_key, cursor->last_key_size);
+		return !filtered;
+	}
 
-		comp_append_pivot_to_index(1, cursor, left_leaf_offt, (struct pivot_key *)new_pivot, right_leaf_offt);
+	if (KV_PREFIX == write_leaf_args.kv_format && !append_to_medium_log &&
+	    !(cursor->level_id == 1 && curr_key->kv_category == MEDIUM_INPLACE)) {
+		cursor->last_key_in_log = kv_formated_kv;
+		return !filtered;
 	}
+	struct kv_splice *last_kv = (struct kv_splice *)kv_formated_kv;
+	cursor->last_key_in_log = NULL;
+	cursor->last_key_size = get_key_size(last_kv);
+	memcpy(cursor->last_key, get_key_offset_in_kv(last_kv), cursor->last_key_size);
+	return !filtered;
 }
 
 struct compaction_request {
@@ -889,9 +1408,15 @@ struct compaction_request {
 	uint64_t l0_start;
 	uint64_t l0_end;
 	uint8_t src_level;
+	/*tree of an L0 source, device sources merge all their runs*/
 	uint8_t src_tree;
 	uint8_t dst_level;
+	/*tree the compaction builds its run in*/
 	uint8_t dst_tree;
+	/*tree the new run takes, the dst runs from it onwards are merged into the new one*/
+	uint8_t dst_run;
+	/*requested by par_flush or par_compact_range*/
+	uint8_t manual;
 };
 
 void mark_segment_space(db_handle *handle, struct dups_list *list, uint8_t level_id, uint8_t tree_id)
@@ -915,15 +1440,20 @@ void mark_segment_space(db_handle *handle, struct dups_list *list, uint8_t level
 			// If the segment is already in the hash table just increase the garbage bytes.
 			search_segment->garbage_bytes += list_iter->kv_size;
 			assert(search_segment->garbage_bytes < SEGMENT_SIZE);
+			if (!search_segment->segment_moved)
+				gc_update_victim(handle->db_desc, search_segment);
 		} else {
-			// This is the first time we detect garbage bytes in this segment,
-			// allocate a node and insert it in the hash table.
+			// The segment was not registered when it was appended (the first segment of the log or
+			// one whose allocation was not replayed), allocate a node and insert it in the hash table.
 			temp_segment_entry = calloc(1, sizeof(struct large_log_segment_gc_entry));
 			temp_segment_entry->segment_dev_offt = segment_dev_offt;
 			temp_segment_entry->garbage_bytes = list_iter->kv_size;
 			temp_segment_entry->segment_moved = 0;
+			temp_segment_entry->append_clock = 0;
+			temp_segment_entry->heap_id = GC_NOT_A_VICTIM;
 			HASH_ADD(hh, handle->db_desc->segment_ht, segment_dev_offt,
 				 sizeof(temp_segment_entry->segment_dev_offt), temp_segment_entry);
+			gc_update_victim(handle->db_desc, temp_segment_entry);
 		}
 
 		struct dups_node *node = find_element(calculate_diffs, segment_dev_offt);
@@ -947,175 +1477,380 @@ void mark_segment_space(db_handle *handle, struct dups_list *list, uint8_t level
 	}
 }
 
-static void *compaction(void *_comp_req);
+static void compaction(void *_comp_req);
 
-void *compaction_daemon(void *args)
+/*Counts the job in the jobs of the DB that db_close waits for*/
+static void comp_submit_job(struct db_descriptor *db_desc, bg_job_func func, void *args,
+			    enum bg_job_priority priority)
 {
-	struct db_handle *handle = (struct db_handle *)args;
-	struct db_descriptor *db_desc = handle->db_desc;
-	struct compaction_request *comp_req = NULL;
-	pthread_setname_np(pthread_self(), "compactiond");
+	__sync_fetch_and_add(&db_desc->bg_jobs, 1);
+	bg_pool_submit(func, args, priority);
+}
 
-	int next_L0_tree_to_compact = 0;
-	while (1) {
-		/*special care for Level 0 to 1*/
-		sem_wait(&db_desc->compaction_daemon_interrupts);
-		if (db_desc->db_state == DB_TERMINATE_COMPACTION_DAEMON) {
-			log_warn("Compaction daemon instructed to exit because DB %s is closing, "
-				 "Bye bye!...",
-				 db_desc->db_superblock->db_name);
-			db_desc->db_state = DB_IS_CLOSING;
-			return NULL;
-		}
-		struct level_descriptor *level_0 = &handle->db_desc->levels[0];
-		struct level_descriptor *src_level = &handle->db_desc->levels[1];
-
-		int L0_tree = next_L0_tree_to_compact;
-		// is level-0 full and not already compacting?
-		if (level_0->tree_status[L0_tree] == NO_COMPACTION &&
-		    level_0->level_size[L0_tree] >= level_0->max_level_size) {
-			// Can I issue a compaction to L1?
-			int L1_tree = 0;
-			if (src_level->tree_status[L1_tree] == NO_COMPACTION &&
-			    src_level->level_size[L1_tree] < src_level->max_level_size) {
-				/*mark them as compacting L0*/
-				level_0->tree_status[L0_tree] = COMPACTION_IN_PROGRESS;
-				/*mark them as compacting L1*/
-				src_level->tree_status[L1_tree] = COMPACTION_IN_PROGRESS;
-
-				/*start a compaction*/
-				comp_req = (struct compaction_request *)calloc(1, sizeof(struct compaction_request));
-				assert(comp_req);
-				comp_req->db_desc = handle->db_desc;
-				comp_req->volume_desc = handle->volume_desc;
-				comp_req->db_options = &handle->db_options;
-				comp_req->src_level = 0;
-				comp_req->src_tree = L0_tree;
-				comp_req->dst_level = 1;
-				comp_req->dst_tree = 1;
-				if (++next_L0_tree_to_compact >= NUM_TREES_PER_LEVEL)
-					next_L0_tree_to_compact = 0;
-			}
-		}
-		/*can I set a different active tree for L0*/
-		int active_tree = db_desc->levels[0].active_tree;
-		if (db_desc->levels[0].tree_status[active_tree] == COMPACTION_IN_PROGRESS) {
-			int next_active_tree = active_tree != (NUM_TREES_PER_LEVEL - 1) ? active_tree + 1 : 0;
-			if (db_desc->levels[0].tree_status[next_active_tree] == NO_COMPACTION) {
-				/*Acquire guard lock and wait writers to finish*/
-				if (RWLOCK_WRLOCK(&db_desc->levels[0].guard_of_level.rx_lock)) {
-					log_fatal("Failed to acquire guard lock");
-					BUG_ON();
-				}
-				spin_loop(&(db_desc->levels[0].active_operations), 0);
-				/*fill L0 recovery log  info*/
-				db_desc->small_log_start_segment_dev_offt = db_desc->small_log.tail_dev_offt;
-				db_desc->small_log_start_offt_in_segment = db_desc->small_log.size % SEGMENT_SIZE;
-
-				/*fill big log recovery  info*/
-				db_desc->big_log_start_segment_dev_offt = db_desc->big_log.tail_dev_offt;
-				db_desc->big_log_start_offt_in_segment = db_desc->big_log.size % SEGMENT_SIZE;
-				/*done now atomically change active tree*/
-
-				db_desc->levels[0].active_tree = next_active_tree;
-				db_desc->levels[0].scanner_epoch += 1;
-				db_desc->levels[0].epoch[active_tree] = db_desc->levels[0].scanner_epoch;
-				log_info("Next active tree %u for L0 of DB: %s", next_active_tree,
-					 db_desc->db_superblock->db_name);
-				/*Acquire a new transaction id for the next_active_tree*/
-				db_desc->levels[0].allocation_txn_id[next_active_tree] = rul_start_txn(db_desc);
-				/*Release guard lock*/
-				if (RWLOCK_UNLOCK(&db_desc->levels[0].guard_of_level.rx_lock)) {
-					log_fatal("Failed to acquire guard lock");
-					BUG_ON();
-				}
+/*Root of a tree of a level, NULL if the tree is empty*/
+static struct node_header *comp_get_tree_root(struct level_descriptor *level, uint8_t tree_id)
+{
+	return level->root_w[tree_id] ? level->root_w[tree_id] : level->root_r[tree_id];
+}
 
-				MUTEX_LOCK(&db_desc->client_barrier_lock);
-				if (pthread_cond_broadcast(&db_desc->client_barrier) != 0) {
-					log_fatal("Failed to wake up stopped clients");
-					BUG_ON();
-				}
-				MUTEX_UNLOCK(&db_desc->client_barrier_lock);
-			}
-		}
+/*Sorted runs of a device level, they take its first trees in the order they were written*/
+static uint8_t comp_get_num_runs(struct level_descriptor *level)
+{
+	uint8_t num_runs = 0;
+	while (num_runs < NUM_TREES_PER_LEVEL && comp_get_tree_root(level, num_runs))
+		++num_runs;
+	return num_runs;
+}
 
-		if (comp_req) {
-			/*Start a compaction from L0 to L1. Flush L0 prior to compaction from L0 to L1*/
-			log_info("Flushing L0 for region:%s tree:[0][%u]", db_desc->db_superblock->db_name,
-				 comp_req->src_tree);
-			pr_flush_L0(db_desc, comp_req->src_tree);
-			db_desc->levels[1].allocation_txn_id[1] = rul_start_txn(db_desc);
-			comp_req->dst_tree = 1;
-			assert(db_desc->levels[0].root_w[comp_req->src_tree] != NULL ||
-			       db_desc->levels[0].root_r[comp_req->src_tree] != NULL);
-			if (pthread_create(&db_desc->levels[0].compaction_thread[comp_req->src_tree], NULL, compaction,
-					   comp_req) != 0) {
-				log_fatal("Failed to start compaction");
-				BUG_ON();
-			}
-			comp_req = NULL;
-		}
+/*Bytes of KVs in the runs of a device level*/
+static uint64_t comp_get_level_size(struct level_descriptor *level)
+{
+	uint64_t level_size = 0;
+	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+		if (comp_get_tree_root(level, tree_id))
+			level_size += level->level_size[tree_id];
+	}
+	return level_size;
+}
 
-		// rest of levels
-		for (int level_id = 1; level_id < MAX_LEVELS - 1; ++level_id) {
-			src_level = &db_desc->levels[level_id];
-			struct level_descriptor *dst_level = &db_desc->levels[level_id + 1];
-			uint8_t tree_1 = 0;
-
-			if (src_level->tree_status[tree_1] == NO_COMPACTION &&
-			    src_level->level_size[tree_1] >= src_level->max_level_size) {
-				uint8_t tree_2 = 0;
-
-				if (dst_level->tree_status[tree_2] == NO_COMPACTION &&
-				    dst_level->level_size[tree_2] < dst_level->max_level_size) {
-					src_level->tree_status[tree_1] = COMPACTION_IN_PROGRESS;
-					dst_level->tree_status[tree_2] = COMPACTION_IN_PROGRESS;
-					/*start a compaction*/
-					struct compaction_request *comp_req_p = (struct compaction_request *)calloc(
-						1, sizeof(struct compaction_request));
-					assert(comp_req_p);
-					comp_req_p->db_desc = db_desc;
-					comp_req_p->volume_desc = handle->volume_desc;
-					comp_req_p->db_options = &handle->db_options;
-					comp_req_p->src_level = level_id;
-					comp_req_p->src_tree = tree_1;
-					comp_req_p->dst_level = level_id + 1;
-
-					comp_req_p->dst_tree = 1;
-
-					/*Acquire a txn_id for the allocations of the compaction*/
-					db_desc->levels[comp_req_p->dst_level].allocation_txn_id[comp_req_p->dst_tree] =
-						rul_start_txn(db_desc);
-
-					assert(db_desc->levels[level_id].root_w[0] != NULL ||
-					       db_desc->levels[level_id].root_r[0] != NULL);
-					if (pthread_create(&db_desc->levels[comp_req_p->dst_level]
-								    .compaction_thread[comp_req_p->dst_tree],
-							   NULL, compaction, comp_req_p) != 0) {
-						log_fatal("Failed to start compaction");
-						BUG_ON();
-					}
-				}
-			}
-		}
+/**
+ * Returns how many sorted runs a device level gathers before it is merged into
+ * the next one. With LEVEL_RUNS above 1 the DB follows lazy leveling: the
+ * levels above the last one that holds data are tiered and gather up to
+ * LEVEL_RUNS runs, while compactions into the last level merge its single run.
+ */
+static uint8_t comp_get_level_runs(struct db_handle *handle, uint8_t level_id)
+{
+	uint64_t level_runs = handle->db_options.options[LEVEL_RUNS].value;
+	/*a level keeps a free tree for the run a compaction builds*/
+	if (level_runs > NUM_TREES_PER_LEVEL - 1)
+		level_runs = NUM_TREES_PER_LEVEL - 1;
+	if (0 == level_id || level_runs <= 1)
+		return 1;
+	for (uint8_t i = level_id + 1; i < MAX_LEVELS; ++i) {
+		if (comp_get_num_runs(&handle->db_desc->levels[i]))
+			return level_runs;
 	}
+	return 1;
 }
 
-static void swap_levels(struct level_descriptor *src, struct level_descriptor *dst, int src_active_tree,
-			int dst_active_tree)
+/*A device level is full when it reaches its size or, if tiered, its runs*/
+static bool comp_is_level_full(struct db_handle *handle, uint8_t level_id)
 {
-	dst->first_segment[dst_active_tree] = src->first_segment[src_active_tree];
-	src->first_segment[src_active_tree] = NULL;
+	struct level_descriptor *level = &handle->db_desc->levels[level_id];
+	uint8_t level_runs = comp_get_level_runs(handle, level_id);
+	if (level_runs > 1 && comp_get_num_runs(level) >= level_runs)
+		return true;
+	return comp_get_level_size(level) >= level->max_level_size;
+}
 
-	dst->last_segment[dst_active_tree] = src->last_segment[src_active_tree];
-	src->last_segment[src_active_tree] = NULL;
+/*Compaction urgency of a level, 1 and above means that the level waits for a compaction*/
+static double comp_level_score(struct db_handle *handle, uint8_t level_id, uint64_t pending_bytes)
+{
+	struct level_descriptor *level = &handle->db_desc->levels[level_id];
+	if (0 == level->max_level_size)
+		return 0;
+	double score = (double)(comp_get_level_size(level) + pending_bytes) / level->max_level_size;
+	/*a tiered level is due once it gathers all its runs*/
+	uint8_t level_runs = comp_get_level_runs(handle, level_id);
+	double runs_score = (double)comp_get_num_runs(level) / level_runs;
+	return level_runs > 1 && runs_score > score ? runs_score : score;
+}
 
-	dst->offset[dst_active_tree] = src->offset[src_active_tree];
+/**
+ * Scores the levels of the DB by their size over their target size. Full L0
+ * trees that wait to be compacted count a whole each. A due level adds its
+ * size to the score of the next one, which it is going to be merged into, so
+ * levels that need room for the level above them go first.
+ */
+static void comp_update_scores(struct db_handle *handle)
+{
+	struct db_descriptor *db_desc = handle->db_desc;
+	struct level_descriptor *level_0 = &db_desc->levels[0];
+	uint64_t pending_bytes = 0;
+	double L0_score = 0;
+	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+		if (level_0->tree_status[tree_id] != NO_COMPACTION)
+			continue;
+		L0_score += (double)level_0->level_size[tree_id] / level_0->max_level_size;
+		if (level_0->level_size[tree_id] >= level_0->max_level_size)
+			pending_bytes += level_0->level_size[tree_id];
+	}
+	/*levels of manual compactions are due whatever their size*/
+	level_0->compaction_score = db_desc->manual_L0_trees && L0_score < 1 ? 1 : L0_score;
+
+	for (uint8_t level_id = 1; level_id < MAX_LEVELS; ++level_id) {
+		struct level_descriptor *level = &db_desc->levels[level_id];
+		level->compaction_score = comp_level_score(handle, level_id, pending_bytes);
+		if (db_desc->manual_levels & (1U << level_id) && level->compaction_score < 1)
+			level->compaction_score = 1;
+		pending_bytes = comp_is_level_full(handle, level_id) ? comp_get_level_size(level) : 0;
+	}
+}
+
+/*Fills order with the levels that wait for a compaction, the most urgent first*/
+static uint32_t comp_order_levels_by_score(struct db_descriptor *db_desc, uint8_t order[MAX_LEVELS - 1])
+{
+	uint32_t num_levels = 0;
+	for (uint8_t level_id = 0; level_id < MAX_LEVELS - 1; ++level_id) {
+		if (db_desc->levels[level_id].compaction_score < 1)
+			continue;
+		uint32_t i = num_levels++;
+		for (; i > 0 && db_desc->levels[order[i - 1]].compaction_score <
+				       db_desc->levels[level_id].compaction_score;
+		     --i)
+			order[i] = order[i - 1];
+		order[i] = level_id;
+	}
+	return num_levels;
+}
+
+/*Switches the active L0 tree away from a tree that compaction claimed*/
+static void comp_switch_L0_active_tree(struct db_descriptor *db_desc)
+{
+	int active_tree = db_desc->levels[0].active_tree;
+	if (db_desc->levels[0].tree_status[active_tree] == COMPACTION_IN_PROGRESS) {
+		int next_active_tree = active_tree != (NUM_TREES_PER_LEVEL - 1) ? active_tree + 1 : 0;
+		if (db_desc->levels[0].tree_status[next_active_tree] == NO_COMPACTION) {
+			/*Acquire guard lock and wait writers to finish*/
+			if (RWLOCK_WRLOCK(&db_desc->levels[0].guard_of_level.rx_lock)) {
+				log_fatal("Failed to acquire guard lock");
+				BUG_ON();
+			}
+			spin_loop(&(db_desc->levels[0].active_operations), 0);
+			/*fill L0 recovery log  info*/
+			db_desc->small_log_start_segment_dev_offt = db_desc->small_log.tail_dev_offt;
+			db_desc->small_log_start_offt_in_segment = db_desc->small_log.size % SEGMENT_SIZE;
+
+			/*fill big log recovery  info*/
+			db_desc->big_log_start_segment_dev_offt = db_desc->big_log.tail_dev_offt;
+			db_desc->big_log_start_offt_in_segment = db_desc->big_log.size % SEGMENT_SIZE;
+			/*done now atomically change active tree*/
+
+			db_desc->levels[0].active_tree = next_active_tree;
+			db_desc->levels[0].scanner_epoch += 1;
+			db_desc->levels[0].epoch[active_tree] = db_desc->levels[0].scanner_epoch;
+			log_info("Next active tree %u for L0 of DB: %s", next_active_tree,
+				 db_desc->db_superblock->db_name);
+			/*Acquire a new transaction id for the next_active_tree*/
+			db_desc->levels[0].allocation_txn_id[next_active_tree] = rul_start_txn(db_desc);
+			/*Release guard lock*/
+			if (RWLOCK_UNLOCK(&db_desc->levels[0].guard_of_level.rx_lock)) {
+				log_fatal("Failed to acquire guard lock");
+				BUG_ON();
+			}
+
+			MUTEX_LOCK(&db_desc->client_barrier_lock);
+			if (pthread_cond_broadcast(&db_desc->client_barrier) != 0) {
+				log_fatal("Failed to wake up stopped clients");
+				BUG_ON();
+			}
+			MUTEX_UNLOCK(&db_desc->client_barrier_lock);
+		}
+	}
+}
+
+/**
+ * Picks the trees of a compaction into dst_level_id. The new run of a tiered
+ * level follows its runs while the one of a leveled level replaces them.
+ * Returns false if the level is full and has to be compacted first.
+ */
+static bool comp_choose_dst_trees(struct db_handle *handle, uint8_t dst_level_id, uint8_t *dst_run,
+				  uint8_t *dst_tree)
+{
+	struct level_descriptor *dst_level = &handle->db_desc->levels[dst_level_id];
+	if (dst_level->tree_status[0] != NO_COMPACTION || comp_is_level_full(handle, dst_level_id))
+		return false;
+	uint8_t num_runs = comp_get_num_runs(dst_level);
+	*dst_run = comp_get_level_runs(handle, dst_level_id) > 1 ? num_runs : 0;
+	/*the new run is built in the first free tree of the level*/
+	*dst_tree = num_runs ? num_runs : 1;
+	return true;
+}
+
+/**
+ * Accounts for a completed manual compaction into dst_level. The data it moved
+ * continues down while dst_level is above the target level of the manual
+ * compactions. Caller holds the scheduler lock.
+ */
+static void comp_complete_manual_compaction(struct db_descriptor *db_desc, uint8_t dst_level)
+{
+	++db_desc->manual_completed;
+	if (dst_level < db_desc->manual_target_level)
+		db_desc->manual_levels |= 1U << dst_level;
+	if (0 == db_desc->manual_L0_trees && 0 == db_desc->manual_levels && 0 == db_desc->manual_running)
+		db_desc->manual_target_level = 0;
+}
+
+/*L0 trees are compacted in the order they filled up, newer trees shadow the keys of older ones*/
+static void comp_start_L0_compaction(struct db_handle *handle)
+{
+	struct db_descriptor *db_desc = handle->db_desc;
+	struct compaction_request *comp_req = NULL;
+	struct level_descriptor *level_0 = &handle->db_desc->levels[0];
+	struct level_descriptor *src_level = &handle->db_desc->levels[1];
+
+	int L0_tree = db_desc->next_L0_tree_to_compact;
+	/*trees of a manual flush are compacted unless they are empty*/
+	uint64_t min_L0_size = db_desc->manual_L0_trees ? 1 : level_0->max_level_size;
+	// is level-0 full and not already compacting?
+	if (level_0->tree_status[L0_tree] == NO_COMPACTION && level_0->level_size[L0_tree] >= min_L0_size) {
+		// Can I issue a compaction to L1?
+		int L1_tree = 0;
+		uint8_t dst_run = 0;
+		uint8_t dst_tree = 1;
+		if (comp_choose_dst_trees(handle, 1, &dst_run, &dst_tree)) {
+			/*mark them as compacting L0*/
+			level_0->tree_status[L0_tree] = COMPACTION_IN_PROGRESS;
+			/*mark them as compacting L1*/
+			src_level->tree_status[L1_tree] = COMPACTION_IN_PROGRESS;
+
+			/*start a compaction*/
+			comp_req = (struct compaction_request *)calloc(1, sizeof(struct compaction_request));
+			assert(comp_req);
+			comp_req->db_desc = handle->db_desc;
+			comp_req->volume_desc = handle->volume_desc;
+			comp_req->db_options = &handle->db_options;
+			comp_req->src_level = 0;
+			comp_req->src_tree = L0_tree;
+			comp_req->dst_level = 1;
+			comp_req->dst_run = dst_run;
+			comp_req->dst_tree = dst_tree;
+			/*manual trees come first in the compaction order*/
+			if (db_desc->manual_L0_trees) {
+				--db_desc->manual_L0_trees;
+				++db_desc->manual_running;
+				comp_req->manual = 1;
+			}
+			if (++db_desc->next_L0_tree_to_compact >= NUM_TREES_PER_LEVEL)
+				db_desc->next_L0_tree_to_compact = 0;
+		}
+	}
+
+	comp_switch_L0_active_tree(db_desc);
+
+	if (comp_req) {
+		/*Start a compaction from L0 to L1. Flush L0 prior to compaction from L0 to L1*/
+		log_info("Flushing L0 for region:%s tree:[0][%u]", db_desc->db_superblock->db_name,
+			 comp_req->src_tree);
+		pr_flush_L0(db_desc, comp_req->src_tree);
+		db_desc->levels[1].allocation_txn_id[comp_req->dst_tree] = rul_start_txn(db_desc);
+		assert(db_desc->levels[0].root_w[comp_req->src_tree] != NULL ||
+		       db_desc->levels[0].root_r[comp_req->src_tree] != NULL);
+		comp_submit_job(db_desc, compaction, comp_req, BG_L0_COMPACTION_PRIORITY);
+		comp_req = NULL;
+	}
+}
+
+static void comp_start_level_compaction(struct db_handle *handle, uint8_t level_id)
+{
+	struct db_descriptor *db_desc = handle->db_desc;
+	struct level_descriptor *src_level = &db_desc->levels[level_id];
+	struct level_descriptor *dst_level = &db_desc->levels[level_id + 1];
+	uint8_t tree_1 = 0;
+	uint8_t manual = (db_desc->manual_levels & (1U << level_id)) != 0;
+
+	if (manual && src_level->tree_status[tree_1] == NO_COMPACTION && 0 == comp_get_num_runs(src_level)) {
+		/*a regular compaction already moved the data of the level down*/
+		db_desc->manual_levels &= ~(1U << level_id);
+		comp_complete_manual_compaction(db_desc, level_id + 1);
+		return;
+	}
+
+	/*a tiered level is also compacted once it gathers all its runs*/
+	if (src_level->tree_status[tree_1] == NO_COMPACTION && (manual || comp_is_level_full(handle, level_id))) {
+		uint8_t tree_2 = 0;
+		uint8_t dst_run = 0;
+		uint8_t dst_tree = 1;
+
+		if (comp_choose_dst_trees(handle, level_id + 1, &dst_run, &dst_tree)) {
+			src_level->tree_status[tree_1] = COMPACTION_IN_PROGRESS;
+			dst_level->tree_status[tree_2] = COMPACTION_IN_PROGRESS;
+			/*start a compaction*/
+			struct compaction_request *comp_req_p = (struct compaction_request *)calloc(
+				1, sizeof(struct compaction_request));
+			assert(comp_req_p);
+			comp_req_p->db_desc = db_desc;
+			comp_req_p->volume_desc = handle->volume_desc;
+			comp_req_p->db_options = &handle->db_options;
+			comp_req_p->src_level = level_id;
+			comp_req_p->src_tree = tree_1;
+			comp_req_p->dst_level = level_id + 1;
+			comp_req_p->dst_run = dst_run;
+			comp_req_p->dst_tree = dst_tree;
+			if (manual) {
+				db_desc->manual_levels &= ~(1U << level_id);
+				++db_desc->manual_running;
+				comp_req_p->manual = 1;
+			}
+
+			/*Acquire a txn_id for the allocations of the compaction*/
+			db_desc->levels[comp_req_p->dst_level].allocation_txn_id[comp_req_p->dst_tree] =
+				rul_start_txn(db_desc);
+
+			assert(db_desc->levels[level_id].root_w[0] != NULL ||
+			       db_desc->levels[level_id].root_r[0] != NULL);
+			comp_submit_job(db_desc, compaction, comp_req_p, BG_COMPACTION_PRIORITY);
+		}
+	}
+}
+
+/*Starts the compactions that the levels of the DB need by score, called with the scheduler lock held*/
+static void comp_start_compactions(struct db_handle *handle)
+{
+	struct db_descriptor *db_desc = handle->db_desc;
+	uint8_t order[MAX_LEVELS - 1];
+	comp_update_scores(handle);
+	uint32_t num_levels = comp_order_levels_by_score(db_desc, order);
+	for (uint32_t i = 0; i < num_levels; ++i) {
+		if (0 == order[i])
+			comp_start_L0_compaction(handle);
+		else
+			comp_start_level_compaction(handle, order[i]);
+	}
+	/*a tree claimed by a previous pass may still be the active one*/
+	comp_switch_L0_active_tree(db_desc);
+}
+
+/*A compaction scheduling pass of a DB, the passes of a DB run one at a time*/
+static void compaction_scheduler(void *args)
+{
+	struct db_handle *handle = (struct db_handle *)args;
+	struct db_descriptor *db_desc = handle->db_desc;
+	MUTEX_LOCK(&db_desc->compaction_scheduler_lock);
+	/*requests from now on need a new pass*/
+	__sync_fetch_and_and(&db_desc->compaction_scheduler_queued, 0);
+	if (db_desc->db_state != DB_TERMINATE_COMPACTION_DAEMON)
+		comp_start_compactions(handle);
+	MUTEX_UNLOCK(&db_desc->compaction_scheduler_lock);
+	__sync_fetch_and_sub(&db_desc->bg_jobs, 1);
+}
+
+void schedule_compactions(struct db_descriptor *db_desc)
+{
+	if (!__sync_bool_compare_and_swap(&db_desc->compaction_scheduler_queued, 0, 1))
+		return;
+	comp_submit_job(db_desc, compaction_scheduler, db_desc->compaction_handle, BG_L0_COMPACTION_PRIORITY);
+}
+
+static void swap_levels(struct level_descriptor *src, struct level_descriptor *dst, int src_active_tree,
+			int dst_active_tree)
+{
+	dst->first_segment[dst_active_tree] = src->first_segment[src_active_tree];
+	src->first_segment[src_active_tree] = NULL;
+
+	dst->last_segment[dst_active_tree] = src->last_segment[src_active_tree];
+	src->last_segment[src_active_tree] = NULL;
+
+	dst->offset[dst_active_tree] = src->offset[src_active_tree];
 	src->offset[src_active_tree] = 0;
 
 	dst->level_size[dst_active_tree] = src->level_size[src_active_tree];
 	src->level_size[src_active_tree] = 0;
 
+	dst->range_tombstones[dst_active_tree] = src->range_tombstones[src_active_tree];
+	src->range_tombstones[src_active_tree] = NULL;
+
 	while (!__sync_bool_compare_and_swap(&dst->root_w[dst_active_tree], dst->root_w[dst_active_tree],
 					     src->root_w[src_active_tree])) {
 	}
@@ -1129,13 +1864,15 @@ static void swap_levels(struct level_descriptor *src, struct level_descriptor *d
 	src->root_r[src_active_tree] = NULL;
 }
 
-static void comp_fill_heap_node(struct compaction_request *comp_req, struct comp_level_read_cursor *cur,
-				struct sh_heap_node *nd)
+/*Fills a heap node with the key of a read cursor, a tree of a device level is one of its sorted runs*/
+static void comp_fill_heap_node(struct comp_level_read_cursor *cur, struct sh_heap_node *nd)
 {
 	nd->level_id = cur->level_id;
-	nd->active_tree = comp_req->src_tree;
+	nd->active_tree = cur->tree_id;
 	nd->cat = cur->category;
 	nd->tombstone = cur->cursor_key.tombstone;
+	nd->full_key = cur->cursor_key.full_key;
+	nd->full_key_size = cur->cursor_key.full_key_size;
 	switch (nd->cat) {
 	case SMALL_INPLACE:
 	case MEDIUM_INPLACE:
@@ -1161,6 +1898,8 @@ static void comp_fill_parallax_key(struct sh_heap_node *nd, struct comp_parallax
 {
 	curr_key->kv_category = nd->cat;
 	curr_key->tombstone = nd->tombstone;
+	curr_key->full_key = nd->full_key;
+	curr_key->full_key_size = nd->full_key_size;
 	assert(nd->KV);
 	switch (nd->cat) {
 	case SMALL_INPLACE:
@@ -1201,14 +1940,33 @@ static void print_heap_node_key(struct sh_heap_node *nd)
 	}
 }
 
+static void comp_add_range_tombstones(struct db_descriptor *db_desc, struct compaction_roots *comp_roots,
+				      uint8_t level_id, uint8_t tree_id)
+{
+	struct level_descriptor *level = &db_desc->levels[level_id];
+	if (!level->range_tombstones[tree_id] || !level->range_tombstones[tree_id]->num_tombstones)
+		return;
+	struct rt_ranked_list *ranked_list = &comp_roots->range_tombstones[comp_roots->num_range_tombstones++];
+	ranked_list->list = level->range_tombstones[tree_id];
+	ranked_list->rank = rt_get_tree_rank(comp_roots->L0_active_tree, level_id, tree_id);
+}
+
 static void choose_compaction_roots(struct db_handle *handle, struct compaction_request *comp_req,
 				    struct compaction_roots *comp_roots)
 {
-	if (handle->db_desc->levels[comp_req->src_level].root_w[comp_req->src_tree] != NULL)
-		comp_roots->src_root = handle->db_desc->levels[comp_req->src_level].root_w[comp_req->src_tree];
-	else if (handle->db_desc->levels[comp_req->src_level].root_r[comp_req->src_tree] != NULL)
-		comp_roots->src_root = handle->db_desc->levels[comp_req->src_level].root_r[comp_req->src_tree];
+	struct level_descriptor *src_level = &handle->db_desc->levels[comp_req->src_level];
+	struct level_descriptor *dst_level = &handle->db_desc->levels[comp_req->dst_level];
+	comp_roots->num_src_runs = 0;
+	if (0 == comp_req->src_level)
+		comp_roots->src_runs[comp_roots->num_src_runs++] = comp_get_tree_root(src_level, comp_req->src_tree);
 	else {
+		uint8_t num_runs = comp_get_num_runs(src_level);
+		for (uint8_t tree_id = 0; tree_id < num_runs; ++tree_id)
+			comp_roots->src_runs[comp_roots->num_src_runs++] = comp_get_tree_root(src_level, tree_id);
+	}
+
+	comp_roots->src_root = comp_roots->num_src_runs ? comp_roots->src_runs[0] : NULL;
+	if (NULL == comp_roots->src_root) {
 		log_fatal("NULL src root for compaction from level's tree [%u][%u] to "
 			  "level's tree[%u][%u] for db %s",
 			  comp_req->src_level, comp_req->src_tree, comp_req->dst_level, comp_req->dst_tree,
@@ -1216,13 +1974,19 @@ static void choose_compaction_roots(struct db_handle *handle, struct compaction_
 		BUG_ON();
 	}
 
-	if (handle->db_desc->levels[comp_req->dst_level].root_w[0] != NULL)
-		comp_roots->dst_root = handle->db_desc->levels[comp_req->dst_level].root_w[0];
-	else if (handle->db_desc->levels[comp_req->dst_level].root_r[0] != NULL)
-		comp_roots->dst_root = handle->db_desc->levels[comp_req->dst_level].root_r[0];
-	else {
-		comp_roots->dst_root = NULL;
-	}
+	/*runs before dst_run stay in the dst level, the new run replaces the rest*/
+	comp_roots->num_dst_runs = 0;
+	for (uint8_t tree_id = comp_req->dst_run; tree_id < comp_get_num_runs(dst_level); ++tree_id)
+		comp_roots->dst_runs[comp_roots->num_dst_runs++] = comp_get_tree_root(dst_level, tree_id);
+	comp_roots->dst_root = comp_roots->num_dst_runs ? comp_roots->dst_runs[0] : NULL;
+
+	comp_roots->num_range_tombstones = 0;
+	comp_roots->L0_active_tree = handle->db_desc->levels[0].active_tree;
+	uint8_t first_src_tree = comp_req->src_level ? 0 : comp_req->src_tree;
+	for (uint8_t i = 0; i < comp_roots->num_src_runs; ++i)
+		comp_add_range_tombstones(handle->db_desc, comp_roots, comp_req->src_level, first_src_tree + i);
+	for (uint8_t i = 0; i < comp_roots->num_dst_runs; ++i)
+		comp_add_range_tombstones(handle->db_desc, comp_roots, comp_req->dst_level, comp_req->dst_run + i);
 }
 
 static void lock_to_update_levels_after_compaction(struct compaction_request *comp_req)
@@ -1253,99 +2017,437 @@ static void unlock_to_update_levels_after_compaction(struct compaction_request *
 	}
 }
 
-static void compact_level_direct_IO(struct db_handle *handle, struct compaction_request *comp_req)
+/**
+ * Partition of the level a compaction writes. Either a range merges it or it
+ * is a partition of the dst level that the range keeps as it is.
+ */
+struct comp_partition {
+	struct level_partition partition;
+	/*smallest key of the partition, unused for the first partition of the level*/
+	char pivot_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+};
+
+/*Entries and bytes a medium transfer batch holds before it moves them to the new level*/
+#define COMP_MEDIUM_BATCH_ENTRIES 4096
+#define COMP_MEDIUM_BATCH_SIZE MB(8)
+
+struct comp_medium_batch_entry {
+	struct comp_parallax_key key;
+	struct sh_heap_node nd;
+	/*where the medium KV of a log entry is copied once fetched*/
+	char *medium_kv;
+};
+
+struct comp_medium_ref {
+	uint64_t kv_dev_offt;
+	uint32_t entry_id;
+};
+
+/**
+ * Merged entries of a compaction into the level where medium KVs move in
+ * place. Their medium KVs are fetched from the medium log in device order
+ * and the entries are then appended in key order. The batch copies the
+ * entries since the buffers of the read cursors are refilled meanwhile.
+ */
+struct comp_medium_batch {
+	struct comp_medium_batch_entry entries[COMP_MEDIUM_BATCH_ENTRIES];
+	struct comp_medium_ref refs[COMP_MEDIUM_BATCH_ENTRIES];
+	uint32_t num_entries;
+	uint32_t num_refs;
+	uint32_t buf_size;
+	char buf[COMP_MEDIUM_BATCH_SIZE];
+};
+
+struct comp_range_pool;
+
+/**
+ * A key range of a compaction. Compactions between device levels split their
+ * key range and merge each range into partitions of its own, which are then
+ * stitched into the new level. When the dst level is partitioned each range
+ * covers one of its partitions.
+ */
+struct comp_merge_range {
+	struct compaction_request *comp_req;
+	struct db_handle *handle;
+	struct compaction_roots *comp_roots;
+	struct comp_range_pool *pool;
+	/*keys in [start_key, end_key), NULL for an open end*/
+	struct pivot_key *start_key;
+	struct pivot_key *end_key;
+	/*partition of a partitioned dst level that the range covers*/
+	struct level_partition *dst_partition;
+	/*no src keys fell in the range so the new level keeps dst_partition*/
+	char kept_dst_partition;
+	/*write cursor of the partition being merged*/
+	struct comp_level_write_cursor *merged_level;
+	struct comp_partition *partitions;
+	uint32_t num_partitions;
+	/*bytes of KVs after which the range starts a new partition, 0 for no limit*/
+	uint64_t partition_size;
+	uint64_t bytes_written;
+	uint64_t write_usec;
+	struct sh_heap *m_heap;
+	/*set when the range merges into the level where medium KVs move in place*/
+	struct comp_medium_batch *medium_batch;
+	char end_key_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+};
+
+/*The ranges of a compaction, the compaction and its helper jobs in the background pool merge them in turn*/
+struct comp_range_pool {
+	struct comp_merge_range *ranges;
+	uint32_t num_ranges;
+	uint32_t next_range;
+	/*partitions of the new level, ranges stop cutting new ones at MAX_LEVEL_PARTITIONS*/
+	uint32_t num_partitions;
+	/*the compaction waits until all the ranges are merged*/
+	uint32_t num_merged;
+	/*held by the compaction and each helper job, the last one frees the pool*/
+	uint32_t reference_count;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static char *comp_medium_batch_copy(struct comp_medium_batch *batch, void *src, uint32_t size)
 {
-	struct compaction_roots comp_roots = { .src_root = NULL, .dst_root = NULL };
+	char *dst = &batch->buf[batch->buf_size];
+	memcpy(dst, src, size);
+	batch->buf_size += size;
+	return dst;
+}
 
-	choose_compaction_roots(handle, comp_req, &comp_roots);
-	/*used for L0 only as src*/
-	struct level_scanner *level_src = NULL;
-	struct comp_level_read_cursor *l_src = NULL;
-	struct comp_level_read_cursor *l_dst = NULL;
-	struct comp_level_write_cursor *merged_level = NULL;
+/**
+ * Copies a merged entry in the batch along with the heap node it came from.
+ * @return false if the batch is full
+ */
+static bool comp_medium_batch_add(struct comp_medium_batch *batch, struct comp_parallax_key *key,
+				  struct sh_heap_node *nd)
+{
+	bool is_medium = KV_INLOG == key->kv_type && MEDIUM_INLOG == key->kv_category;
+	uint32_t size = KV_INLOG == key->kv_type ? get_kv_seperated_splice_size() :
+						   get_kv_size((struct kv_splice *)key->kv_inplace);
+	uint32_t reserved = is_medium ? LEAF_KV_INPLACE_MAX_SIZE : 0;
+	uint32_t full_key_size = KV_INLOG == key->kv_type && key->full_key ? key->full_key_size : 0;
+	if (batch->num_entries >= COMP_MEDIUM_BATCH_ENTRIES ||
+	    batch->buf_size + size + full_key_size + reserved > COMP_MEDIUM_BATCH_SIZE)
+		return false;
+
+	struct comp_medium_batch_entry *entry = &batch->entries[batch->num_entries];
+	entry->key = *key;
+	entry->nd = *nd;
+	entry->medium_kv = NULL;
+	char *kv_copy = comp_medium_batch_copy(batch, key->kv_inplace, size);
+	entry->key.kv_inplace = kv_copy;
+	/*big KVs in KV_FORMAT point to the log, which stays put*/
+	if (KV_PREFIX == nd->type || KV_INPLACE == key->kv_type)
+		entry->nd.KV = kv_copy;
+	if (full_key_size) {
+		entry->key.full_key = comp_medium_batch_copy(batch, key->full_key, full_key_size);
+		entry->nd.full_key = entry->key.full_key;
+	}
 
-	if (comp_req->src_level == 0) {
-		RWLOCK_WRLOCK(&handle->db_desc->levels[0].guard_of_level.rx_lock);
-		spin_loop(&handle->db_desc->levels[0].active_operations, 0);
-		pr_flush_log_tail(comp_req->db_desc, &comp_req->db_desc->big_log);
-		RWLOCK_UNLOCK(&handle->db_desc->levels[0].guard_of_level.rx_lock);
+	if (is_medium) {
+		entry->medium_kv = &batch->buf[batch->buf_size];
+		batch->buf_size += reserved;
+		batch->refs[batch->num_refs].kv_dev_offt = key->kv_inlog->dev_offt;
+		batch->refs[batch->num_refs++].entry_id = batch->num_entries;
+	}
+	++batch->num_entries;
+	return true;
+}
 
-		log_debug("Initializing L0 scanner");
-		level_src = _init_compaction_buffer_scanner(handle, comp_req->src_level, comp_roots.src_root, NULL);
-	} else {
-		if (posix_memalign((void **)&l_src, ALIGNMENT, sizeof(struct comp_level_read_cursor)) != 0) {
-			log_fatal("Posix memalign failed");
-			perror("Reason: ");
-			BUG_ON();
-		}
-		comp_init_read_cursor(l_src, handle, comp_req->src_level, 0, FD);
-		comp_get_next_key(l_src);
-		assert(!l_src->end_of_level);
+static int comp_medium_ref_cmp(const void *ref_1, const void *ref_2)
+{
+	uint64_t offt_1 = ((const struct comp_medium_ref *)ref_1)->kv_dev_offt;
+	uint64_t offt_2 = ((const struct comp_medium_ref *)ref_2)->kv_dev_offt;
+	return offt_1 < offt_2 ? -1 : offt_1 > offt_2;
+}
+
+/**
+ * Moves the entries of the batch to the partition being merged. It fetches
+ * the medium KVs in device order first, so the medium log chunks are read
+ * sequentially, each once, and its prefetching reads ahead of the fetches.
+ */
+static void comp_flush_medium_batch(struct comp_merge_range *range)
+{
+	struct comp_medium_batch *batch = range->medium_batch;
+	if (!batch || !batch->num_entries)
+		return;
+
+	qsort(batch->refs, batch->num_refs, sizeof(struct comp_medium_ref), comp_medium_ref_cmp);
+	for (uint32_t i = 0; i < batch->num_refs; ++i) {
+		struct comp_medium_batch_entry *entry = &batch->entries[batch->refs[i].entry_id];
+		struct kv_splice *kv = (struct kv_splice *)fetch_kv_from_LRU(range->merged_level,
+									     batch->refs[i].kv_dev_offt);
+		assert(get_key_size(kv) <= MAX_KEY_SIZE);
+		assert((uint32_t)get_kv_size(kv) <= LEAF_KV_INPLACE_MAX_SIZE);
+		memcpy(entry->medium_kv, kv, get_kv_size(kv));
+		entry->key.kv_inplace = entry->medium_kv;
+		entry->key.kv_type = KV_INPLACE;
+		entry->key.kv_category = MEDIUM_INPLACE;
+#if MEASURE_MEDIUM_INPLACE
+		__sync_fetch_and_add(&range->handle->db_desc->count_medium_inplace, 1);
+#endif
 	}
 
-	if (comp_roots.dst_root) {
-		if (posix_memalign((void **)&l_dst, ALIGNMENT, sizeof(struct comp_level_read_cursor)) != 0) {
-			log_fatal("Posix memalign failed");
-			perror("Reason: ");
-			BUG_ON();
-		}
-		comp_init_read_cursor(l_dst, handle, comp_req->dst_level, 0, FD);
-		comp_get_next_key(l_dst);
-		assert(!l_dst->end_of_level);
+	for (uint32_t i = 0; i < batch->num_entries; ++i) {
+		if (!comp_append_entry_to_leaf_node(range->merged_level, &batch->entries[i].key))
+			sh_add_dropped_kv(range->m_heap, &batch->entries[i].nd);
+	}
+	batch->num_entries = 0;
+	batch->num_refs = 0;
+	batch->buf_size = 0;
+}
+
+/*Appends a merged entry to the partition being merged, through the medium transfer batch if the range has one*/
+static void comp_append_merged_entry(struct comp_merge_range *range, struct comp_parallax_key *key,
+				     struct sh_heap_node *nd)
+{
+	if (!range->medium_batch) {
+		if (!comp_append_entry_to_leaf_node(range->merged_level, key))
+			sh_add_dropped_kv(range->m_heap, nd);
+		return;
+	}
+	if (comp_medium_batch_add(range->medium_batch, key, nd))
+		return;
+	comp_flush_medium_batch(range);
+	if (!comp_medium_batch_add(range->medium_batch, key, nd)) {
+		log_fatal("Entry does not fit in an empty medium transfer batch");
+		BUG_ON();
+	}
+}
+
+static struct comp_level_read_cursor *comp_open_read_cursor(struct comp_merge_range *range, uint32_t level_id,
+							    uint8_t tree_id, struct node_header *root)
+{
+	struct comp_level_read_cursor *c = NULL;
+	if (posix_memalign((void **)&c, ALIGNMENT, sizeof(struct comp_level_read_cursor)) != 0) {
+		log_fatal("Posix memalign failed");
+		perror("Reason: ");
+		BUG_ON();
 	}
+	comp_init_read_cursor(c, range->handle, level_id, tree_id, FD);
+	c->partitions = seg_get_partition_table(root);
+	comp_seek_read_cursor(c, root, range->start_key, range->end_key);
+	comp_get_next_key(c);
+	/*only the ranges of a split compaction may miss keys of a level*/
+	assert(!c->end_of_level || range->start_key || range->end_key);
+	return c;
+}
 
-	log_debug("Initializing write cursor for level %u", comp_req->dst_level);
+/*Appends a partition to those of the range, pivot is its smallest key*/
+static struct comp_partition *comp_add_partition(struct comp_merge_range *range, struct pivot_key *pivot)
+{
+	struct comp_partition *partitions =
+		realloc(range->partitions, (range->num_partitions + 1) * sizeof(struct comp_partition));
+	if (!partitions) {
+		log_fatal("Realloc failed");
+		BUG_ON();
+	}
+	range->partitions = partitions;
+	struct comp_partition *partition = &partitions[range->num_partitions++];
+	memset(partition, 0x00, sizeof(struct comp_partition));
+	if (pivot)
+		memcpy(partition->pivot_buf, pivot, PIVOT_KEY_SIZE(pivot));
+	return partition;
+}
+
+/*Starts a new partition of the range, it has a write cursor and a segment chain of its own*/
+static void comp_open_partition(struct comp_merge_range *range, struct pivot_key *pivot)
+{
+	comp_add_partition(range, pivot);
+	log_debug("Initializing write cursor for level %u", range->comp_req->dst_level);
+	struct comp_level_write_cursor *merged_level = NULL;
 	if (posix_memalign((void **)&merged_level, ALIGNMENT, sizeof(struct comp_level_write_cursor)) != 0) {
 		log_fatal("Posix memalign failed");
 		perror("Reason: ");
 		BUG_ON();
 	}
+	comp_init_write_cursor(merged_level, range->handle, range->comp_req->dst_level, range->comp_req->dst_tree,
+			       FD);
+	merged_level->medium_log_LRU_cache = range->handle->db_desc->medium_log_LRU_cache;
+	merged_level->drop_deleted = range->comp_roots->drop_deleted;
+	range->merged_level = merged_level;
+}
 
-	assert(0 == handle->db_desc->levels[comp_req->dst_level].offset[comp_req->dst_tree]);
-	comp_init_write_cursor(merged_level, handle, comp_req->dst_level, FD);
+/*Writes the last segments of the partition being merged and records where it lives*/
+static void comp_close_partition(struct comp_merge_range *range)
+{
+	struct comp_level_write_cursor *c = range->merged_level;
+	comp_close_write_cursor(c);
+	if (c->level_id == c->handle->db_desc->level_medium_inplace)
+		comp_medium_log_set_max_segment_id(c);
+
+	struct level_partition *partition = &range->partitions[range->num_partitions - 1].partition;
+	partition->first_segment_offt = c->first_segment_btree_level_offt[0];
+	partition->last_segment_offt = c->last_segment_btree_level_offt[comp_get_top_height(c)];
+	partition->root_offt = c->root_offt;
+	/*each segment the cursor allocated is in the chain of the partition*/
+	partition->offset = c->segment_id_cnt * SEGMENT_SIZE;
+	partition->level_size = c->level_size;
+	range->bytes_written += c->bytes_written;
+	range->write_usec += c->write_usec;
+	comp_destroy_write_cursor(c);
+	range->merged_level = NULL;
+}
 
-	//initialize LRU cache for storing chunks of segments when medium log goes in place
-	if (merged_level->level_id == handle->db_desc->level_medium_inplace)
-		merged_level->medium_log_LRU_cache = init_LRU(handle);
+/**
+ * Closes the partition being merged and starts a new one at key. The new
+ * level has at most MAX_LEVEL_PARTITIONS partitions, once they are reached
+ * the range merges the rest of its keys in its last partition.
+ */
+static void comp_cut_partition(struct comp_merge_range *range, struct comp_parallax_key *key)
+{
+	if (__sync_fetch_and_add(&range->pool->num_partitions, 1) >= MAX_LEVEL_PARTITIONS) {
+		__sync_fetch_and_sub(&range->pool->num_partitions, 1);
+		range->partition_size = 0;
+		return;
+	}
 
-	log_debug("Src [%u][%u] size = %lu", comp_req->src_level, comp_req->src_tree,
-		  handle->db_desc->levels[comp_req->src_level].level_size[comp_req->src_tree]);
-	if (comp_roots.dst_root)
-		log_debug("Dst [%u][%u] size = %lu", comp_req->dst_level, 0,
-			  handle->db_desc->levels[comp_req->dst_level].level_size[0]);
-	else
-		log_debug("Empty dst [%u]", comp_req->dst_level);
+	/*partitions do not share leaves, the full key separates them*/
+	struct kv_splice *kv = KV_INLOG == key->kv_type ? (struct kv_splice *)key->kv_inlog->dev_offt :
+							(struct kv_splice *)key->kv_inplace;
+	char pivot_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	struct pivot_key *pivot = (struct pivot_key *)pivot_buf;
+	set_pivot_key_size(pivot, get_key_size(kv));
+	set_pivot_key(pivot, get_key_offset_in_kv(kv), get_key_size(kv));
+	comp_flush_medium_batch(range);
+	comp_close_partition(range);
+	comp_open_partition(range, pivot);
+}
+
+static struct kv_splice *comp_get_heap_node_kv(struct sh_heap_node *nd)
+{
+	return KV_PREFIX == nd->type ? (struct kv_splice *)((struct kv_seperation_splice *)nd->KV)->dev_offt :
+				       (struct kv_splice *)nd->KV;
+}
+
+/*True if a range tombstone of a merged tree newer than the tree of the heap node deletes its key*/
+static bool comp_is_range_deleted(struct compaction_roots *comp_roots, struct sh_heap_node *nd)
+{
+	if (!comp_roots->num_range_tombstones)
+		return false;
+	struct kv_splice *kv = comp_get_heap_node_kv(nd);
+	uint32_t rank = rt_get_tree_rank(comp_roots->L0_active_tree, nd->level_id, nd->active_tree);
+	return rt_is_deleted(comp_roots->range_tombstones, comp_roots->num_range_tombstones, rank,
+			     get_key_offset_in_kv(kv), get_key_size(kv));
+}
+
+/**
+ * Remembers the key of a put that the merge drops as a duplicate. The heap pops
+ * the older versions of a key before the newest one, so a single delete that
+ * pops right after such a put deletes it.
+ */
+static struct kv_splice *comp_remember_dropped_put(struct sh_heap_node *nd, char *dropped_put_buf)
+{
+	if (!nd->duplicate || nd->tombstone)
+		return NULL;
+	/*log KVs stay where they are, in place ones and full keys live in the buffer of their cursor*/
+	struct kv_splice *dropped_put = (struct kv_splice *)dropped_put_buf;
+	if (KV_PREFIX == nd->type && nd->full_key) {
+		set_key(dropped_put, nd->full_key, nd->full_key_size);
+		return dropped_put;
+	}
+	if (KV_PREFIX == nd->type)
+		return comp_get_heap_node_kv(nd);
+	struct kv_splice *kv = (struct kv_splice *)nd->KV;
+	set_key(dropped_put, get_key_offset_in_kv(kv), get_key_size(kv));
+	return dropped_put;
+}
+
+/**
+ * True if the merge drops a tombstone it popped from the heap. Tombstones are
+ * dropped when no older keys remain below the new run. A single delete is
+ * dropped along with the put of its key that the merge dropped right before it.
+ */
+static bool comp_is_dropped_tombstone(struct compaction_roots *comp_roots, struct kv_splice *dropped_put,
+				      struct sh_heap_node *nd)
+{
+	if (!nd->tombstone)
+		return false;
+	if (comp_roots->drop_deleted)
+		return true;
+
+	struct kv_splice *kv = comp_get_heap_node_kv(nd);
+	if (!dropped_put || !is_single_delete_kv_pair(kv))
+		return false;
+	return get_key_size(kv) == get_key_size(dropped_put) &&
+	       0 == memcmp(get_key_offset_in_kv(kv), get_key_offset_in_kv(dropped_put), get_key_size(kv));
+}
+
+static void comp_merge_range(struct comp_merge_range *range)
+{
+	struct compaction_request *comp_req = range->comp_req;
+	struct db_handle *handle = range->handle;
+	struct compaction_roots *comp_roots = range->comp_roots;
+	struct sh_heap *m_heap = range->m_heap;
+	/*used for L0 only as src*/
+	struct level_scanner *level_src = NULL;
+	/*read cursors of the src runs followed by those of the merged dst runs*/
+	struct comp_level_read_cursor *cursors[2 * NUM_TREES_PER_LEVEL] = { NULL };
+	uint32_t num_cursors = 0;
+	/*put the merge dropped as a duplicate of the next key it pops*/
+	char dropped_put_buf[sizeof(struct kv_splice) + MAX_KEY_SIZE];
+	struct kv_splice *dropped_put = NULL;
+
+	if (comp_req->src_level == 0) {
+		RWLOCK_WRLOCK(&handle->db_desc->levels[0].guard_of_level.rx_lock);
+		spin_loop(&handle->db_desc->levels[0].active_operations, 0);
+		pr_flush_log_tail(comp_req->db_desc, &comp_req->db_desc->big_log);
+		RWLOCK_UNLOCK(&handle->db_desc->levels[0].guard_of_level.rx_lock);
+
+		log_debug("Initializing L0 scanner");
+		level_src = _init_compaction_buffer_scanner(handle, comp_req->src_level, comp_roots->src_root, NULL);
+	} else {
+		for (uint8_t i = 0; i < comp_roots->num_src_runs; ++i)
+			cursors[num_cursors++] =
+				comp_open_read_cursor(range, comp_req->src_level, i, comp_roots->src_runs[i]);
+	}
+	uint32_t num_src_cursors = num_cursors;
+
+	uint8_t src_in_range = level_src != NULL;
+	for (uint32_t i = 0; i < num_src_cursors; ++i)
+		src_in_range |= !cursors[i]->end_of_level;
+	/*range tombstones of the src level may delete keys of the partition*/
+	if (range->dst_partition && !src_in_range && !comp_roots->num_range_tombstones) {
+		/*nothing to merge, the partition moves to the new level as it is*/
+		struct comp_partition *partition = comp_add_partition(range, range->start_key);
+		partition->partition = *range->dst_partition;
+		range->kept_dst_partition = 1;
+		for (uint32_t i = 0; i < num_src_cursors; ++i)
+			comp_close_read_cursor(cursors[i]);
+		return;
+	}
+	comp_open_partition(range, range->start_key);
+
+	for (uint8_t i = 0; i < comp_roots->num_dst_runs; ++i)
+		cursors[num_cursors++] = comp_open_read_cursor(range, comp_req->dst_level, comp_req->dst_run + i,
+							       comp_roots->dst_runs[i]);
 
 	// initialize and fill min_heap properly
-	struct sh_heap *m_heap = sh_alloc_heap();
-	sh_init_heap(m_heap, comp_req->src_level, MIN_HEAP);
-	struct sh_heap_node nd_src = { .KV = NULL, .level_id = 0, .active_tree = 0, .duplicate = 0, .type = KV_PREFIX };
-	struct sh_heap_node nd_dst = { .KV = NULL, .level_id = 0, .active_tree = 0, .duplicate = 0, .type = KV_PREFIX };
 	struct sh_heap_node nd_min = { .KV = NULL, .level_id = 0, .active_tree = 0, .duplicate = 0, .type = KV_PREFIX };
 	// init Li cursor
 	if (level_src) {
-		nd_src.KV = level_src->keyValue;
-		nd_src.level_id = comp_req->src_level;
-		nd_src.type = level_src->kv_format;
-		nd_src.cat = level_src->cat;
-		nd_src.kv_size = level_src->kv_size;
-		nd_src.tombstone = level_src->tombstone;
-		nd_src.active_tree = comp_req->src_tree;
+		nd_min.KV = level_src->keyValue;
+		nd_min.level_id = comp_req->src_level;
+		nd_min.type = level_src->kv_format;
+		nd_min.cat = level_src->cat;
+		nd_min.kv_size = level_src->kv_size;
+		nd_min.tombstone = level_src->tombstone;
+		nd_min.active_tree = comp_req->src_tree;
+		nd_min.db_desc = comp_req->db_desc;
+		nd_min.full_key = NULL;
 		log_debug("Initializing heap from SRC L0");
-	} else {
-		log_debug("Initializing heap from SRC read cursor level %u with key:", comp_req->src_level);
-		comp_fill_heap_node(comp_req, l_src, &nd_src);
+		sh_insert_heap_node(m_heap, &nd_min);
 	}
 
-	nd_src.db_desc = comp_req->db_desc;
-	sh_insert_heap_node(m_heap, &nd_src);
-	// init Li+1 cursor (if any)
-	if (l_dst) {
-		comp_fill_heap_node(comp_req, l_dst, &nd_dst);
-		// log_debug("Initializing heap from DST read cursor level %u", comp_req->dst_level);
-		print_heap_node_key(&nd_dst);
-		nd_dst.db_desc = comp_req->db_desc;
-		sh_insert_heap_node(m_heap, &nd_dst);
+	// init the cursors of the device level runs
+	for (uint32_t i = 0; i < num_cursors; ++i) {
+		if (cursors[i]->end_of_level)
+			continue;
+		comp_fill_heap_node(cursors[i], &nd_min);
+		print_heap_node_key(&nd_min);
+		nd_min.db_desc = comp_req->db_desc;
+		sh_insert_heap_node(m_heap, &nd_min);
 	}
 
 	while (1) {
@@ -1357,43 +2459,41 @@ static void compact_level_direct_IO(struct db_handle *handle, struct compaction_
 			break;
 		}
 
-		if (!nd_min.duplicate) {
+		bool dropped = nd_min.duplicate || comp_is_dropped_tombstone(comp_roots, dropped_put, &nd_min);
+		dropped_put = comp_remember_dropped_put(&nd_min, dropped_put_buf);
+		if (!dropped && comp_is_range_deleted(comp_roots, &nd_min))
+			sh_add_dropped_kv(m_heap, &nd_min);
+		else if (!dropped) {
 			struct comp_parallax_key key = { 0 };
 			comp_fill_parallax_key(&nd_min, &key);
-			comp_append_entry_to_leaf_node(merged_level, &key);
+			if (range->partition_size && range->merged_level->level_size >= range->partition_size)
+				comp_cut_partition(range, &key);
+			comp_append_merged_entry(range, &key, &nd_min);
 		}
 
-		/*refill from the appropriate level*/
-		if (nd_min.level_id == comp_req->src_level) {
-			if (nd_min.level_id == 0) {
-				if (level_scanner_get_next(level_src) != END_OF_DATABASE) {
-					// log_info("Refilling from L0");
-					nd_min.KV = level_src->keyValue;
-					nd_min.level_id = comp_req->src_level;
-					nd_min.type = level_src->kv_format;
-					nd_min.cat = level_src->cat;
-					nd_min.tombstone = level_src->tombstone;
-					nd_min.kv_size = level_src->kv_size;
-					nd_min.active_tree = comp_req->src_tree;
-					nd_min.db_desc = comp_req->db_desc;
-					sh_insert_heap_node(m_heap, &nd_min);
-				}
-
-			} else {
-				comp_get_next_key(l_src);
-				if (!l_src->end_of_level) {
-					comp_fill_heap_node(comp_req, l_src, &nd_min);
-					// log_info("Refilling from SRC level read cursor");
-					nd_min.db_desc = comp_req->db_desc;
-					sh_insert_heap_node(m_heap, &nd_min);
-				}
+		/*refill from the run the key came from*/
+		if (nd_min.level_id == 0) {
+			if (level_scanner_get_next(level_src) != END_OF_DATABASE) {
+				// log_info("Refilling from L0");
+				nd_min.KV = level_src->keyValue;
+				nd_min.level_id = comp_req->src_level;
+				nd_min.type = level_src->kv_format;
+				nd_min.cat = level_src->cat;
+				nd_min.tombstone = level_src->tombstone;
+				nd_min.kv_size = level_src->kv_size;
+				nd_min.active_tree = comp_req->src_tree;
+				nd_min.db_desc = comp_req->db_desc;
+				nd_min.full_key = NULL;
+				sh_insert_heap_node(m_heap, &nd_min);
 			}
-		} else if (l_dst) {
-			comp_get_next_key(l_dst);
-			if (!l_dst->end_of_level) {
-				comp_fill_heap_node(comp_req, l_dst, &nd_min);
-				// log_info("Refilling from DST level read cursor key is %s",
-				// nd_min.KV + 4);
+		} else {
+			uint32_t cursor_id = nd_min.level_id == comp_req->src_level ?
+						     nd_min.active_tree :
+						     num_src_cursors + nd_min.active_tree - comp_req->dst_run;
+			assert(cursor_id < num_cursors);
+			comp_get_next_key(cursors[cursor_id]);
+			if (!cursors[cursor_id]->end_of_level) {
+				comp_fill_heap_node(cursors[cursor_id], &nd_min);
 				nd_min.db_desc = comp_req->db_desc;
 				sh_insert_heap_node(m_heap, &nd_min);
 			}
@@ -1401,51 +2501,175 @@ static void compact_level_direct_IO(struct db_handle *handle, struct compaction_
 
 		RWLOCK_UNLOCK(&handle->db_desc->levels[comp_req->dst_level].guard_of_level.rx_lock);
 	}
+	RWLOCK_RDLOCK(&handle->db_desc->levels[comp_req->dst_level].guard_of_level.rx_lock);
+	comp_flush_medium_batch(range);
+	RWLOCK_UNLOCK(&handle->db_desc->levels[comp_req->dst_level].guard_of_level.rx_lock);
+	comp_close_partition(range);
 
 	if (level_src)
 		close_compaction_buffer_scanner(level_src);
-	else
-		free(l_src);
+	for (uint32_t i = 0; i < num_cursors; ++i)
+		comp_close_read_cursor(cursors[i]);
+}
 
-	if (comp_roots.dst_root)
-		free(l_dst);
+static void comp_merge_ranges(struct comp_range_pool *pool)
+{
+	for (uint32_t i = __sync_fetch_and_add(&pool->next_range, 1); i < pool->num_ranges;
+	     i = __sync_fetch_and_add(&pool->next_range, 1)) {
+		comp_merge_range(&pool->ranges[i]);
+		MUTEX_LOCK(&pool->lock);
+		if (++pool->num_merged == pool->num_ranges)
+			pthread_cond_broadcast(&pool->cond);
+		MUTEX_UNLOCK(&pool->lock);
+	}
+}
+
+static void comp_put_range_pool(struct comp_range_pool *pool)
+{
+	if (__sync_sub_and_fetch(&pool->reference_count, 1))
+		return;
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
 
-	mark_segment_space(handle, m_heap->dups, comp_req->dst_level, 1);
-	comp_close_write_cursor(merged_level);
+/**
+ * Helper job of a split compaction. It merges the ranges that are left when
+ * a worker runs it, which may be none once the compaction has merged them
+ * itself. Only the pool is touched past the ranges it merged.
+ */
+static void comp_merge_ranges_job(void *args)
+{
+	struct comp_range_pool *pool = (struct comp_range_pool *)args;
+	comp_merge_ranges(pool);
+	comp_put_range_pool(pool);
+}
 
-	sh_destroy_heap(m_heap);
-	merged_level->handle->db_desc->levels[comp_req->dst_level].root_w[1] =
-		(struct node_header *)REAL_ADDRESS(merged_level->root_offt);
-	assert(merged_level->handle->db_desc->levels[comp_req->dst_level].root_w[1]->type == rootNode);
+/**
+ * Returns in how many key ranges to split a compaction into a dst level that
+ * is not partitioned, each range takes the keys under a similar number of
+ * children of the dst root. L0 sources, empty dst levels and the level that
+ * fetches medium KVs through the LRU cache of the medium log are merged as a
+ * single range.
+ */
+static uint32_t comp_calc_num_ranges(struct db_handle *handle, struct compaction_request *comp_req,
+				     struct compaction_roots *comp_roots)
+{
+	uint64_t subcompactions = handle->db_options.options[SUBCOMPACTIONS].value;
+	if (subcompactions <= 1 || 0 == comp_req->src_level || NULL == comp_roots->dst_root ||
+	    comp_roots->dst_root->type != rootNode || comp_req->dst_level == handle->db_desc->level_medium_inplace)
+		return 1;
+
+	uint64_t num_children = comp_roots->dst_root->num_entries;
+	if (num_children > MAX_LEVEL_PARTITIONS)
+		num_children = MAX_LEVEL_PARTITIONS;
+	return subcompactions < num_children ? subcompactions : num_children;
+}
 
-	if (merged_level->level_id == handle->db_desc->level_medium_inplace) {
-		comp_medium_log_set_max_segment_id(merged_level);
-		destroy_LRU(merged_level->medium_log_LRU_cache);
+/**
+ * Stitches the partitions a compaction merged or kept into one level. They
+ * keep their segment chains, a new root segment holds the partition table of
+ * the level and a root with a pivot per partition. Returns the device offset
+ * of the root.
+ */
+static uint64_t comp_stitch_partitions(struct db_handle *handle, uint8_t level_id, uint8_t tree_id,
+				       struct comp_partition **partitions, uint32_t num_partitions)
+{
+	assert(num_partitions <= MAX_LEVEL_PARTITIONS);
+	char *segment_buf = comp_alloc_segment_buf();
+	memset(segment_buf, 0x00, SEGMENT_SIZE);
+
+	struct segment_header *root_segment = get_segment_for_lsm_level_IO(handle->db_desc, level_id, tree_id);
+	uint64_t root_segment_offt = ABSOLUTE_ADDRESS(root_segment);
+	struct segment_header *segment_in_mem_buffer = (struct segment_header *)segment_buf;
+	segment_in_mem_buffer->nodetype = rootNode;
+	segment_in_mem_buffer->next_segment = NULL;
+
+	struct level_partition_table *table = (struct level_partition_table *)&segment_in_mem_buffer[1];
+	table->magic = LEVEL_PARTITION_MAGIC;
+	table->num_partitions = num_partitions;
+	for (uint32_t i = 0; i < num_partitions; ++i)
+		table->partitions[i] = partitions[i]->partition;
+
+	struct index_node *root = (struct index_node *)&table[1];
+	/*pivots are full keys, a root of the largest size fits those of MAX_LEVEL_PARTITIONS partitions*/
+	index_init_node_with_size(DO_NOT_ADD_GUARD, root, internalNode, INDEX_NODE_MAX_SIZE);
+	index_set_immutable(root);
+	index_add_guard(root, partitions[0]->partition.root_offt);
+	struct node_header *partition_root = REAL_ADDRESS(partitions[0]->partition.root_offt);
+	int32_t height = partition_root->height;
+	for (uint32_t i = 1; i < num_partitions; ++i) {
+		struct pivot_pointer right = { .child_offt = partitions[i]->partition.root_offt };
+		struct insert_pivot_req ins_pivot_req = { .node = root,
+							  .key = (struct pivot_key *)partitions[i]->pivot_buf,
+							  .right_child = &right };
+		if (!index_append_pivot(&ins_pivot_req)) {
+			log_fatal("Partition pivots do not fit in the root of level %u", level_id);
+			BUG_ON();
+		}
+		partition_root = REAL_ADDRESS(partitions[i]->partition.root_offt);
+		if (partition_root->height > height)
+			height = partition_root->height;
+	}
+	/*the partitions may differ in height, lookups descend until they find a leaf*/
+	index_set_height(root, height + 1);
+	index_seal_node(root);
+	if (!index_set_type(root, rootNode)) {
+		log_fatal("Error setting node type");
+		BUG_ON();
 	}
-	free(merged_level);
+	*(uint32_t *)((char *)root + index_get_node_size(root)) = paddedSpace;
+	io_limiter_request(handle->db_desc->io_limiter, SEGMENT_SIZE);
+	comp_write_segment(segment_buf, root_segment_offt, 0, SEGMENT_SIZE, FD);
+	free(segment_buf);
+	return root_segment_offt + sizeof(struct segment_header) + sizeof(struct level_partition_table);
+}
 
-	/***************************************************************/
+/**
+ * Installs the run a compaction built in the dst_tree of the dst level as its
+ * dst_run and empties the src level. The segments of the partitions set in
+ * kept_dst_partitions and kept_src_partitions belong to the new run, the rest
+ * of the segments of the runs it merged are freed.
+ */
+static void comp_install_new_level(struct compaction_request *comp_req, uint64_t kept_dst_partitions,
+				   uint64_t kept_src_partitions)
+{
 	struct level_descriptor *ld = &comp_req->db_desc->levels[comp_req->dst_level];
 	struct db_handle hd = { .db_desc = comp_req->db_desc, .volume_desc = comp_req->volume_desc };
+	uint64_t txn_id = ld->allocation_txn_id[comp_req->dst_tree];
 
 	lock_to_update_levels_after_compaction(comp_req);
 
 	uint64_t space_freed = 0;
-	/*Free L_(i+1)*/
-	if (l_dst) {
-		uint64_t txn_id = comp_req->db_desc->levels[comp_req->dst_level].allocation_txn_id[comp_req->dst_tree];
-		/*free dst (L_i+1) level*/
-		space_freed = seg_free_level(comp_req->db_desc, txn_id, comp_req->dst_level, 0);
-
-		log_debug("Freed space %lu MB from db:%s destination level %u", space_freed / (1024 * 1024L),
-			  comp_req->db_desc->db_superblock->db_name, comp_req->dst_level);
-	}
-	/*Free and zero L_i*/
-	uint64_t txn_id = comp_req->db_desc->levels[comp_req->dst_level].allocation_txn_id[comp_req->dst_tree];
-	space_freed = seg_free_level(hd.db_desc, txn_id, comp_req->src_level, comp_req->src_tree);
+	/*Free the runs of L_(i+1) that the new run replaces*/
+	for (uint8_t tree_id = comp_req->dst_run; tree_id < comp_req->dst_tree; ++tree_id) {
+		seg_free_range_tombstones(hd.db_desc, txn_id, comp_req->dst_level, tree_id);
+		if (!comp_get_tree_root(ld, tree_id))
+			continue;
+		/*free dst (L_i+1) level except the partitions the new level kept*/
+		space_freed += seg_free_level_partitions(comp_req->db_desc, txn_id, comp_req->dst_level, tree_id,
+							 kept_dst_partitions);
+		seg_zero_level(hd.db_desc, comp_req->dst_level, tree_id);
+	}
+	log_debug("Freed space %lu MB from db:%s destination level %u", space_freed / (1024 * 1024L),
+		  comp_req->db_desc->db_superblock->db_name, comp_req->dst_level);
+
+	/*Free and zero the runs of L_i*/
+	uint8_t first_src_tree = comp_req->src_level ? 0 : comp_req->src_tree;
+	uint8_t last_src_tree = comp_req->src_level ? comp_get_num_runs(&hd.db_desc->levels[comp_req->src_level]) :
+						      comp_req->src_tree + 1;
+	space_freed = 0;
+	for (uint8_t tree_id = first_src_tree; tree_id < last_src_tree; ++tree_id) {
+		seg_free_range_tombstones(hd.db_desc, txn_id, comp_req->src_level, tree_id);
+		if (kept_src_partitions)
+			space_freed += seg_free_level_partitions(hd.db_desc, txn_id, comp_req->src_level, tree_id,
+								 kept_src_partitions);
+		else
+			space_freed += seg_free_level(hd.db_desc, txn_id, comp_req->src_level, tree_id);
+		seg_zero_level(hd.db_desc, comp_req->src_level, tree_id);
+	}
 	log_debug("Freed space %lu MB from db:%s source level %u", space_freed / (1024 * 1024L),
 		  comp_req->db_desc->db_superblock->db_name, comp_req->src_level);
-	seg_zero_level(hd.db_desc, comp_req->src_level, comp_req->src_tree);
 
 #if ENABLE_BLOOM_FILTERS
 	if (dst_root) {
@@ -1456,33 +2680,392 @@ static void compact_level_direct_IO(struct db_handle *handle, struct compaction_
 	memset(&ld->bloom_filter[1], 0x00, sizeof(struct bloom));
 #endif
 
+	/*set L'_(i+1) as L_(i+1), the new run takes the place of the runs it replaced*/
+	if (comp_req->dst_run != comp_req->dst_tree)
+		swap_levels(ld, ld, comp_req->dst_tree, comp_req->dst_run);
+	if (ld->root_w[comp_req->dst_run] != NULL)
+		ld->root_r[comp_req->dst_run] = ld->root_w[comp_req->dst_run];
+	else if (NULL == ld->root_r[comp_req->dst_run]) {
+		log_fatal("Where is the root?");
+		BUG_ON();
+	}
+	ld->root_w[comp_req->dst_run] = NULL;
+
+	/*flushing the transfer to in place trims the medium log*/
+	if (comp_req->dst_level == comp_req->db_desc->level_medium_inplace)
+		invalidate_LRU(comp_req->db_desc->medium_log_LRU_cache, ld->medium_in_place_max_segment_id);
+
 	/*Finally persist compaction */
 	pr_flush_compaction(comp_req->db_desc, comp_req->dst_level, comp_req->dst_tree);
 	log_debug("Flushed compaction[%u][%u] successfully", comp_req->dst_level, comp_req->dst_tree);
-	/*set L'_(i+1) as L_(i+1)*/
-	ld->first_segment[0] = ld->first_segment[1];
-	ld->first_segment[1] = NULL;
-	ld->last_segment[0] = ld->last_segment[1];
-	ld->last_segment[1] = NULL;
-	ld->offset[0] = ld->offset[1];
-	ld->offset[1] = 0;
-
-	if (ld->root_w[1] != NULL)
-		ld->root_r[0] = ld->root_w[1];
-	else if (ld->root_r[1] != NULL)
-		ld->root_r[0] = ld->root_r[1];
-	else {
-		log_fatal("Where is the root?");
+
+	/*the freed segments may be reused for new leaves at the same addresses*/
+	leaf_cache_invalidate(comp_req->db_desc->leaf_cache, comp_req->src_level);
+	leaf_cache_invalidate(comp_req->db_desc->leaf_cache, comp_req->dst_level);
+	unlock_to_update_levels_after_compaction(comp_req);
+}
+
+/*True if older runs of the dst level or deeper levels hold keys that the new run may shadow*/
+static bool comp_has_older_keys(struct db_handle *handle, struct compaction_request *comp_req)
+{
+	bool older_keys = comp_req->dst_run > 0;
+	for (uint8_t level_id = comp_req->dst_level + 1; level_id < MAX_LEVELS && !older_keys; ++level_id)
+		older_keys = comp_get_num_runs(&handle->db_desc->levels[level_id]) > 0;
+	return older_keys;
+}
+
+/**
+ * The new run inherits the range tombstones of the trees the compaction
+ * merged, they still delete the keys of the older runs of the dst level and of
+ * the deeper levels. They are dropped once no older keys remain.
+ */
+static void comp_write_range_tombstones(struct db_handle *handle, struct compaction_request *comp_req,
+					struct compaction_roots *comp_roots)
+{
+	if (!comp_roots->num_range_tombstones)
+		return;
+	if (comp_roots->drop_deleted) {
+		log_debug("Dropping the range tombstones of the compaction to level %u", comp_req->dst_level);
+		return;
+	}
+
+	struct range_tombstones *range_tombstones = rt_create();
+	for (uint32_t i = 0; i < comp_roots->num_range_tombstones; ++i)
+		rt_add_all(range_tombstones, comp_roots->range_tombstones[i].list);
+
+	char *segment_buf = comp_alloc_segment_buf();
+	memset(segment_buf, 0x00, SEGMENT_SIZE);
+	if (!rt_serialize(range_tombstones, segment_buf, SEGMENT_SIZE)) {
+		log_fatal("Range tombstones of level %u do not fit in a segment", comp_req->dst_level);
 		BUG_ON();
 	}
+	range_tombstones->dev_offt =
+		seg_get_range_tombstones_segment(handle->db_desc, comp_req->dst_level, comp_req->dst_tree);
+	io_limiter_request(handle->db_desc->io_limiter, SEGMENT_SIZE);
+	comp_write_segment(segment_buf, range_tombstones->dev_offt, 0, SEGMENT_SIZE, FD);
+	free(segment_buf);
+	handle->db_desc->levels[comp_req->dst_level].range_tombstones[comp_req->dst_tree] = range_tombstones;
+}
 
-	ld->root_w[0] = NULL;
-	ld->level_size[0] = ld->level_size[1];
-	ld->level_size[1] = 0;
-	ld->root_w[1] = NULL;
-	ld->root_r[1] = NULL;
+static void compact_level_direct_IO(struct db_handle *handle, struct compaction_request *comp_req)
+{
+	struct compaction_roots comp_roots = { .src_root = NULL, .dst_root = NULL };
+	uint64_t start_usec = comp_get_usec();
 
-	unlock_to_update_levels_after_compaction(comp_req);
+	choose_compaction_roots(handle, comp_req, &comp_roots);
+	comp_roots.drop_deleted = !comp_has_older_keys(handle, comp_req);
+
+	log_debug("Src [%u][%u] size = %lu", comp_req->src_level, comp_req->src_tree,
+		  handle->db_desc->levels[comp_req->src_level].level_size[comp_req->src_tree]);
+	if (comp_roots.dst_root)
+		log_debug("Dst [%u][%u] size = %lu", comp_req->dst_level, comp_req->dst_run,
+			  handle->db_desc->levels[comp_req->dst_level].level_size[comp_req->dst_run]);
+	else
+		log_debug("Empty dst [%u]", comp_req->dst_level);
+
+	/*a partitioned dst level is merged per partition, untouched partitions move to the new level as they are*/
+	struct level_partition_table *dst_partitions = NULL;
+	if (1 == comp_roots.num_dst_runs && comp_req->src_level &&
+	    comp_req->dst_level != handle->db_desc->level_medium_inplace)
+		dst_partitions = seg_get_partition_table(comp_roots.dst_root);
+	assert(!dst_partitions || (int32_t)dst_partitions->num_partitions == comp_roots.dst_root->num_entries);
+
+	uint32_t num_ranges = dst_partitions ? dst_partitions->num_partitions :
+					       comp_calc_num_ranges(handle, comp_req, &comp_roots);
+	struct comp_merge_range *ranges = calloc(num_ranges, sizeof(struct comp_merge_range));
+	if (!ranges) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	struct comp_range_pool *pool = calloc(1, sizeof(struct comp_range_pool));
+	if (!pool) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	pool->ranges = ranges;
+	pool->num_ranges = num_ranges;
+	pool->num_partitions = num_ranges;
+	MUTEX_INIT(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	/*the LRU cache of the medium log serves a single range, its level is not cut*/
+	uint64_t partition_size = handle->db_options.options[PARTITION_SIZE].value;
+	if (comp_req->dst_level == handle->db_desc->level_medium_inplace)
+		partition_size = 0;
+
+	assert(0 == handle->db_desc->levels[comp_req->dst_level].offset[comp_req->dst_tree]);
+	for (uint32_t i = 0; i < num_ranges; ++i) {
+		struct comp_merge_range *range = &ranges[i];
+		range->comp_req = comp_req;
+		range->handle = handle;
+		range->comp_roots = &comp_roots;
+		range->pool = pool;
+		range->partition_size = partition_size;
+		if (dst_partitions)
+			range->dst_partition = &dst_partitions->partitions[i];
+		if (i > 0)
+			range->start_key = ranges[i - 1].end_key;
+		if (i < num_ranges - 1) {
+			range->end_key = (struct pivot_key *)range->end_key_buf;
+			/*the root of a partitioned level has a pivot per partition*/
+			int32_t position = (i + 1) * comp_roots.dst_root->num_entries / num_ranges;
+			index_get_pivot_key_copy((struct index_node *)comp_roots.dst_root, position, range->end_key);
+		}
+
+		range->m_heap = sh_alloc_heap();
+		sh_init_heap(range->m_heap, comp_req->src_level, MIN_HEAP);
+		sh_account_dropped_kvs(range->m_heap);
+		if (comp_req->dst_level == handle->db_desc->level_medium_inplace) {
+			range->medium_batch = malloc(sizeof(struct comp_medium_batch));
+			if (!range->medium_batch) {
+				log_fatal("Malloc failed");
+				BUG_ON();
+			}
+			range->medium_batch->num_entries = 0;
+			range->medium_batch->num_refs = 0;
+			range->medium_batch->buf_size = 0;
+		}
+	}
+
+	uint64_t subcompactions = handle->db_options.options[SUBCOMPACTIONS].value;
+	uint32_t num_workers = subcompactions < num_ranges ? subcompactions : num_ranges;
+	if (0 == num_workers)
+		num_workers = 1;
+	if (num_ranges > 1)
+		log_debug("Splitting compaction of level %u to %u key ranges merged by up to %u workers",
+			  comp_req->src_level, num_ranges, num_workers);
+	pool->reference_count = num_workers;
+	for (uint32_t i = 1; i < num_workers; ++i)
+		bg_pool_submit(comp_merge_ranges_job, pool, BG_COMPACTION_PRIORITY);
+	comp_merge_ranges(pool);
+	/*the ranges left are merged by helper jobs that run, queued ones find no range to wait for*/
+	MUTEX_LOCK(&pool->lock);
+	while (pool->num_merged < pool->num_ranges)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+	MUTEX_UNLOCK(&pool->lock);
+	comp_put_range_pool(pool);
+
+	struct level_descriptor *dst_level = &handle->db_desc->levels[comp_req->dst_level];
+	uint64_t bytes_written = 0;
+	uint64_t write_usec = 0;
+	uint32_t num_partitions = 0;
+	uint64_t kept_partitions = 0;
+	for (uint32_t i = 0; i < num_ranges; ++i) {
+		mark_segment_space(handle, ranges[i].m_heap->dups, comp_req->dst_level, comp_req->dst_tree);
+		sh_destroy_heap(ranges[i].m_heap);
+		free(ranges[i].medium_batch);
+		bytes_written += ranges[i].bytes_written;
+		write_usec += ranges[i].write_usec;
+		num_partitions += ranges[i].num_partitions;
+		if (!ranges[i].kept_dst_partition)
+			continue;
+		/*the segments of a kept partition now belong to the new level*/
+		kept_partitions |= 1UL << i;
+		dst_level->offset[comp_req->dst_tree] += ranges[i].dst_partition->offset;
+		dst_level->level_size[comp_req->dst_tree] += ranges[i].dst_partition->level_size;
+	}
+
+	struct comp_partition **partitions = calloc(num_partitions, sizeof(struct comp_partition *));
+	if (!partitions) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	uint32_t partition_id = 0;
+	for (uint32_t i = 0; i < num_ranges; ++i) {
+		for (uint32_t j = 0; j < ranges[i].num_partitions; ++j)
+			partitions[partition_id++] = &ranges[i].partitions[j];
+	}
+
+	uint64_t root_offt = partitions[0]->partition.root_offt;
+	uint64_t last_segment_offt = partitions[0]->partition.last_segment_offt;
+	if (num_partitions > 1) {
+		root_offt = comp_stitch_partitions(handle, comp_req->dst_level, comp_req->dst_tree, partitions,
+						   num_partitions);
+		last_segment_offt = root_offt - root_offt % SEGMENT_SIZE;
+	}
+	dst_level->first_segment[comp_req->dst_tree] = REAL_ADDRESS(partitions[0]->partition.first_segment_offt);
+	dst_level->last_segment[comp_req->dst_tree] = REAL_ADDRESS(last_segment_offt);
+	dst_level->root_w[comp_req->dst_tree] = (struct node_header *)REAL_ADDRESS(root_offt);
+	assert(dst_level->root_w[comp_req->dst_tree]->type == rootNode);
+	free(partitions);
+
+	for (uint32_t i = 0; i < num_ranges; ++i)
+		free(ranges[i].partitions);
+	free(ranges);
+
+	uint64_t elapsed_usec = comp_get_usec() - start_usec;
+	dst_level->compaction_bytes_written += bytes_written;
+	dst_level->last_compaction_write_bw = elapsed_usec ? bytes_written / elapsed_usec : 0;
+	log_info("Compaction [%u][%u] to [%u] wrote %lu MB in %lu ms, %lu MB/s with writes busy for %lu ms, "
+		 "%u partitions of which %d kept",
+		 comp_req->src_level, comp_req->src_tree, comp_req->dst_level, bytes_written / (1024 * 1024UL),
+		 elapsed_usec / 1000, dst_level->last_compaction_write_bw, write_usec / 1000, num_partitions,
+		 __builtin_popcountl(kept_partitions));
+
+	comp_write_range_tombstones(handle, comp_req, &comp_roots);
+	comp_install_new_level(comp_req, kept_partitions, 0);
+}
+
+/*Copies the smallest or the largest key of a device level to key, false if the level has no keys*/
+static bool comp_get_level_boundary_key(struct db_descriptor *db_desc, uint8_t level_id, struct node_header *root,
+					bool largest, struct pivot_key *key)
+{
+	struct node_header *node = root;
+	while (rootNode == node->type || internalNode == node->type) {
+		struct index_node_iterator iterator = { 0 };
+		index_iterator_init((struct index_node *)node, &iterator);
+		if (largest)
+			iterator.position = iterator.num_entries - 1;
+		/*REAL_ADDRESS evaluates its argument twice and the iterator advances on each call*/
+		uint64_t child_offt = index_iterator_get_pivot_pointer(&iterator)->child_offt;
+		node = REAL_ADDRESS(child_offt);
+	}
+
+	uint32_t leaf_size = db_desc->levels[level_id].leaf_size;
+	struct bt_dynamic_leaf_node *leaf = (struct bt_dynamic_leaf_node *)node;
+	struct bt_dynamic_leaf_node *leaf_buf = NULL;
+	if (compressedLeafNode == node->type) {
+		leaf_buf = comp_alloc_leaf_buf(leaf_size);
+		decompress_dynamic_leaf((struct bt_compressed_leaf_node *)node, leaf_buf, leaf_size);
+		leaf = leaf_buf;
+	}
+
+	bool found = leaf->header.num_entries > 0;
+	if (found) {
+		int32_t position = largest ? leaf->header.num_entries - 1 : 0;
+		struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+		char kv_buf[LEAF_KV_INPLACE_MAX_SIZE];
+		struct kv_splice *kv = NULL;
+		switch (slot_array[position].key_category) {
+		case SMALL_INPLACE:
+		case MEDIUM_INPLACE:
+			kv = get_kv_inplace(leaf, leaf_size, level_id, position, kv_buf);
+			break;
+		case MEDIUM_INLOG:
+		case BIG_INLOG: {
+			char *kv_loc = get_kv_offset(leaf, leaf_size, slot_array[position].index);
+			struct kv_seperation_splice *kv_inlog = (struct kv_seperation_splice *)kv_loc;
+			kv = (struct kv_splice *)REAL_ADDRESS(kv_inlog->dev_offt);
+			break;
+		}
+		default:
+			log_fatal("Cannot handle this category");
+			BUG_ON();
+		}
+		set_pivot_key_size(key, get_key_size(kv));
+		set_pivot_key(key, get_key_offset_in_kv(kv), get_key_size(kv));
+	}
+	free(leaf_buf);
+	return found;
+}
+
+/*Appends the partitions of a device level to partitions, a level without a partition table is a single one*/
+static uint32_t comp_get_level_partitions(struct level_descriptor *level, uint8_t tree_id, struct node_header *root,
+					  struct pivot_key *first_key, struct comp_partition *partitions)
+{
+	struct level_partition_table *table = seg_get_partition_table(root);
+	if (!table) {
+		partitions[0].partition.first_segment_offt = ABSOLUTE_ADDRESS(level->first_segment[tree_id]);
+		partitions[0].partition.last_segment_offt = ABSOLUTE_ADDRESS(level->last_segment[tree_id]);
+		partitions[0].partition.root_offt = ABSOLUTE_ADDRESS(root);
+		partitions[0].partition.offset = level->offset[tree_id];
+		partitions[0].partition.level_size = level->level_size[tree_id];
+	}
+
+	uint32_t num_partitions = table ? table->num_partitions : 1;
+	for (uint32_t i = 0; table && i < num_partitions; ++i) {
+		partitions[i].partition = table->partitions[i];
+		if (i > 0)
+			index_get_pivot_key_copy((struct index_node *)root, i,
+						 (struct pivot_key *)partitions[i].pivot_buf);
+	}
+	memcpy(partitions[0].pivot_buf, first_key, PIVOT_KEY_SIZE(first_key));
+	return num_partitions;
+}
+
+/**
+ * Moves a device level under a dst level whose key range it does not overlap
+ * without reading or writing any leaf. The partitions of both levels keep
+ * their segments and a new root segment stitches them into the new dst level.
+ * @return false if the key ranges overlap and the levels must be merged
+ */
+static bool comp_trivial_move(struct db_handle *handle, struct compaction_request *comp_req)
+{
+	struct compaction_roots comp_roots = { .src_root = NULL, .dst_root = NULL };
+	choose_compaction_roots(handle, comp_req, &comp_roots);
+	assert(comp_req->src_level && comp_roots.dst_root);
+	/*range tombstones delete keys only while merging*/
+	if (comp_roots.num_src_runs != 1 || comp_roots.num_dst_runs != 1 || comp_roots.num_range_tombstones)
+		return false;
+
+	struct level_partition_table *src_table = seg_get_partition_table(comp_roots.src_root);
+	struct level_partition_table *dst_table = seg_get_partition_table(comp_roots.dst_root);
+	uint32_t num_partitions = src_table ? src_table->num_partitions : 1;
+	num_partitions += dst_table ? dst_table->num_partitions : 1;
+	if (num_partitions > MAX_LEVEL_PARTITIONS)
+		return false;
+
+	char src_first_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	char src_last_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	char dst_first_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	char dst_last_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	struct pivot_key *src_first = (struct pivot_key *)src_first_buf;
+	struct pivot_key *src_last = (struct pivot_key *)src_last_buf;
+	struct pivot_key *dst_first = (struct pivot_key *)dst_first_buf;
+	struct pivot_key *dst_last = (struct pivot_key *)dst_last_buf;
+	struct db_descriptor *db_desc = handle->db_desc;
+	if (!comp_get_level_boundary_key(db_desc, comp_req->src_level, comp_roots.src_root, false, src_first) ||
+	    !comp_get_level_boundary_key(db_desc, comp_req->src_level, comp_roots.src_root, true, src_last) ||
+	    !comp_get_level_boundary_key(db_desc, comp_req->dst_level, comp_roots.dst_root, false, dst_first) ||
+	    !comp_get_level_boundary_key(db_desc, comp_req->dst_level, comp_roots.dst_root, true, dst_last))
+		return false;
+
+	bool src_is_lower = index_key_cmp(src_last, (char *)dst_first, INDEX_KEY_TYPE) < 0;
+	if (!src_is_lower && index_key_cmp(dst_last, (char *)src_first, INDEX_KEY_TYPE) >= 0)
+		return false;
+
+	struct level_descriptor *src_level = &db_desc->levels[comp_req->src_level];
+	struct level_descriptor *dst_level = &db_desc->levels[comp_req->dst_level];
+	struct comp_partition *partitions = calloc(num_partitions, sizeof(struct comp_partition));
+	struct comp_partition **partition_list = calloc(num_partitions, sizeof(struct comp_partition *));
+	if (!partitions || !partition_list) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	/*the partitions of the level with the smaller keys come first*/
+	uint32_t num_lower = 0;
+	if (src_is_lower) {
+		num_lower = comp_get_level_partitions(src_level, comp_req->src_tree, comp_roots.src_root, src_first,
+						      partitions);
+		comp_get_level_partitions(dst_level, comp_req->dst_run, comp_roots.dst_root, dst_first,
+					  &partitions[num_lower]);
+	} else {
+		num_lower = comp_get_level_partitions(dst_level, comp_req->dst_run, comp_roots.dst_root, dst_first,
+						      partitions);
+		comp_get_level_partitions(src_level, comp_req->src_tree, comp_roots.src_root, src_first,
+					  &partitions[num_lower]);
+	}
+
+	/*the segments of both levels now belong to the new level*/
+	uint8_t tree_id = comp_req->dst_tree;
+	assert(0 == dst_level->offset[tree_id]);
+	for (uint32_t i = 0; i < num_partitions; ++i) {
+		dst_level->offset[tree_id] += partitions[i].partition.offset;
+		dst_level->level_size[tree_id] += partitions[i].partition.level_size;
+		partition_list[i] = &partitions[i];
+	}
+	uint64_t root_offt =
+		comp_stitch_partitions(handle, comp_req->dst_level, tree_id, partition_list, num_partitions);
+	dst_level->first_segment[tree_id] = REAL_ADDRESS(partitions[0].partition.first_segment_offt);
+	dst_level->last_segment[tree_id] = REAL_ADDRESS(root_offt - root_offt % SEGMENT_SIZE);
+	dst_level->root_w[tree_id] = (struct node_header *)REAL_ADDRESS(root_offt);
+	free(partition_list);
+	free(partitions);
+
+	log_info("Moved level [%u][%u] to [%u] without merging, the new level has %u partitions", comp_req->src_level,
+		 comp_req->src_tree, comp_req->dst_level, num_partitions);
+	/*only the old root segments of partitioned levels are freed*/
+	comp_install_new_level(comp_req, UINT64_MAX, UINT64_MAX);
+	return true;
 }
 
 static void compact_with_empty_destination_level(struct compaction_request *comp_req)
@@ -1494,10 +3077,12 @@ static void compact_with_empty_destination_level(struct compaction_request *comp
 	struct level_descriptor *leveld_src = &comp_req->db_desc->levels[comp_req->src_level];
 	struct level_descriptor *leveld_dst = &comp_req->db_desc->levels[comp_req->dst_level];
 
-	swap_levels(leveld_src, leveld_dst, comp_req->src_tree, 1);
+	/*the single run of the src level becomes the new run of the dst level*/
+	swap_levels(leveld_src, leveld_dst, comp_req->src_tree, comp_req->dst_run);
 
 	pr_flush_compaction(comp_req->db_desc, comp_req->dst_level, comp_req->dst_tree);
-	swap_levels(leveld_dst, leveld_dst, 1, 0);
+	/*cached leaves are tagged with the level that read them*/
+	leaf_cache_invalidate(comp_req->db_desc->leaf_cache, comp_req->src_level);
 	log_debug("Flushed compaction (Swap levels) successfully from src[%u][%u] to dst[%u][%u]", comp_req->src_level,
 		  comp_req->src_tree, comp_req->dst_level, comp_req->dst_tree);
 
@@ -1510,36 +3095,36 @@ static void compact_with_empty_destination_level(struct compaction_request *comp
 
 	log_debug("Swapped levels %d to %d successfully", comp_req->src_level, comp_req->dst_level);
 	log_debug("After swapping src tree[%d][%d] size is %lu", comp_req->src_level, 0, leveld_src->level_size[0]);
-	log_debug("After swapping dst tree[%d][%d] size is %lu", comp_req->dst_level, 0, leveld_dst->level_size[0]);
+	log_debug("After swapping dst tree[%d][%d] size is %lu", comp_req->dst_level, comp_req->dst_run,
+		  leveld_dst->level_size[comp_req->dst_run]);
 	assert(leveld_dst->first_segment != NULL);
 }
 
-void *compaction(void *_comp_req)
+static void compaction(void *_comp_req)
 {
 	db_handle handle;
 	struct compaction_request *comp_req = (struct compaction_request *)_comp_req;
 	db_descriptor *db_desc = comp_req->db_desc;
-	pthread_setname_np(pthread_self(), "comp_thread");
 	log_info("starting compaction from level's tree [%u][%u] to level's tree[%u][%u]", comp_req->src_level,
 		 comp_req->src_tree, comp_req->dst_level, comp_req->dst_tree);
 	/*Initialize a scan object*/
 	handle.db_desc = comp_req->db_desc;
 	handle.volume_desc = comp_req->volume_desc;
 	memcpy(&handle.db_options, comp_req->db_options, sizeof(struct par_db_options));
-	// optimization check if level below is empty
-	struct node_header *dst_root = NULL;
-	if (handle.db_desc->levels[comp_req->dst_level].root_w[0] != NULL)
-		dst_root = handle.db_desc->levels[comp_req->dst_level].root_w[0];
-	else if (handle.db_desc->levels[comp_req->dst_level].root_r[0] != NULL)
-		dst_root = handle.db_desc->levels[comp_req->dst_level].root_r[0];
-	else {
-		dst_root = NULL;
-	}
-
-	if (comp_req->src_level == 0 || comp_req->dst_level == handle.db_desc->level_medium_inplace || dst_root)
-		compact_level_direct_IO(&handle, comp_req);
-	else
+	// optimization check if the compaction merges no run of the level below
+	struct compaction_roots comp_roots = { .src_root = NULL, .dst_root = NULL };
+	choose_compaction_roots(&handle, comp_req, &comp_roots);
+
+	/*leaves are read with the leaf size of their level, so only levels with equal leaf sizes can swap*/
+	uint8_t same_leaf_size = handle.db_desc->levels[comp_req->src_level].leaf_size ==
+				 handle.db_desc->levels[comp_req->dst_level].leaf_size;
+	/*a device level of a single run moves as it is when it merges no dst run or their keys do not overlap*/
+	uint8_t can_move = comp_req->src_level != 0 && comp_req->dst_level != handle.db_desc->level_medium_inplace &&
+			   same_leaf_size && 1 == comp_roots.num_src_runs;
+	if (can_move && !comp_roots.dst_root)
 		compact_with_empty_destination_level(comp_req);
+	else if (!can_move || !comp_trivial_move(&handle, comp_req))
+		compact_level_direct_IO(&handle, comp_req);
 
 	log_debug("DONE Compaction from level's tree [%u][%u] to level's tree[%u][%u] "
 		  "cleaning src level",
@@ -1559,7 +3144,106 @@ void *compaction(void *_comp_req)
 		}
 	}
 	MUTEX_UNLOCK(&db_desc->client_barrier_lock);
-	sem_post(&db_desc->compaction_daemon_interrupts);
+	if (comp_req->manual) {
+		MUTEX_LOCK(&db_desc->compaction_scheduler_lock);
+		--db_desc->manual_running;
+		comp_complete_manual_compaction(db_desc, comp_req->dst_level);
+		MUTEX_UNLOCK(&db_desc->compaction_scheduler_lock);
+	}
+	schedule_compactions(db_desc);
 	free(comp_req);
-	return NULL;
+	__sync_fetch_and_sub(&db_desc->bg_jobs, 1);
+}
+
+/*Orders a key of a level against a user key, shorter keys go first on equal prefixes*/
+static int comp_cmp_par_key(struct pivot_key *key, struct par_key *par_key)
+{
+	uint32_t size = (uint32_t)key->size < par_key->size ? (uint32_t)key->size : par_key->size;
+	int ret = memcmp(key->data, par_key->data, size);
+	return ret ? ret : key->size - (int32_t)par_key->size;
+}
+
+/*True if a run of a device level holds keys in [start, end], NULL ends are open*/
+static bool comp_level_overlaps_range(struct db_descriptor *db_desc, uint8_t level_id, struct par_key *start,
+				      struct par_key *end)
+{
+	char first_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	char last_buf[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	struct pivot_key *first = (struct pivot_key *)first_buf;
+	struct pivot_key *last = (struct pivot_key *)last_buf;
+	struct level_descriptor *level = &db_desc->levels[level_id];
+	bool overlaps = false;
+
+	/*compactions free the runs they merge under the write lock of the guard*/
+	RWLOCK_RDLOCK(&level->guard_of_level.rx_lock);
+	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL && !overlaps; ++tree_id) {
+		struct node_header *root = comp_get_tree_root(level, tree_id);
+		if (!root || !comp_get_level_boundary_key(db_desc, level_id, root, false, first))
+			continue;
+		comp_get_level_boundary_key(db_desc, level_id, root, true, last);
+		overlaps = (!end || comp_cmp_par_key(first, end) <= 0) &&
+			   (!start || comp_cmp_par_key(last, start) >= 0);
+	}
+	RWLOCK_UNLOCK(&level->guard_of_level.rx_lock);
+	return overlaps;
+}
+
+/*Marks the L0 trees up to the active one for compaction, caller holds the scheduler lock*/
+static void comp_flush_L0(struct db_descriptor *db_desc)
+{
+	struct level_descriptor *level_0 = &db_desc->levels[0];
+	uint8_t num_trees = 0;
+	uint8_t tree_id = db_desc->next_L0_tree_to_compact;
+	/*trees older than the active one wait for a compaction, the active one may be empty*/
+	for (uint8_t i = 0; i < NUM_TREES_PER_LEVEL; ++i) {
+		if (level_0->tree_status[tree_id] == NO_COMPACTION && level_0->level_size[tree_id])
+			num_trees = i + 1;
+		if (tree_id == level_0->active_tree)
+			break;
+		tree_id = tree_id + 1 < NUM_TREES_PER_LEVEL ? tree_id + 1 : 0;
+	}
+	if (num_trees > db_desc->manual_L0_trees)
+		db_desc->manual_L0_trees = num_trees;
+}
+
+void comp_request_flush(struct db_descriptor *db_desc)
+{
+	MUTEX_LOCK(&db_desc->compaction_scheduler_lock);
+	comp_flush_L0(db_desc);
+	MUTEX_UNLOCK(&db_desc->compaction_scheduler_lock);
+	log_info("Flushing L0 of DB: %s", db_desc->db_superblock->db_name);
+	schedule_compactions(db_desc);
+}
+
+void comp_request_range_compaction(struct db_descriptor *db_desc, struct par_key *start, struct par_key *end)
+{
+	uint8_t target_level = 1;
+	for (uint8_t level_id = 1; level_id < MAX_LEVELS; ++level_id) {
+		if (comp_get_num_runs(&db_desc->levels[level_id]))
+			target_level = level_id;
+	}
+
+	uint32_t levels = 0;
+	for (uint8_t level_id = 1; level_id < target_level; ++level_id) {
+		if (comp_level_overlaps_range(db_desc, level_id, start, end))
+			levels |= 1U << level_id;
+	}
+
+	MUTEX_LOCK(&db_desc->compaction_scheduler_lock);
+	comp_flush_L0(db_desc);
+	db_desc->manual_levels |= levels;
+	if (target_level > db_desc->manual_target_level)
+		db_desc->manual_target_level = target_level;
+	MUTEX_UNLOCK(&db_desc->compaction_scheduler_lock);
+	log_info("Compacting range of DB: %s down to level %u", db_desc->db_superblock->db_name, target_level);
+	schedule_compactions(db_desc);
+}
+
+void comp_get_manual_progress(struct db_descriptor *db_desc, struct par_compaction_progress *progress)
+{
+	MUTEX_LOCK(&db_desc->compaction_scheduler_lock);
+	progress->pending =
+		db_desc->manual_L0_trees + __builtin_popcount(db_desc->manual_levels) + db_desc->manual_running;
+	progress->completed = db_desc->manual_completed;
+	MUTEX_UNLOCK(&db_desc->compaction_scheduler_lock);
 }
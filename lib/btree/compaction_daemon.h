@@ -4,8 +4,11 @@
 #include "btree_node.h"
 #include "conf.h"
 #include "dynamic_leaf.h"
+#include "index_node.h"
 #include "kv_pairs.h"
 #include "parallax/structures.h"
+#include <aio.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <uthash.h>
 
@@ -15,23 +18,69 @@ struct medium_log_segment_map {
 	UT_hash_handle hh;
 };
 
+/*Full segments of a write cursor that may wait for their write while the merge fills new ones*/
+#define COMP_WRITE_BEHIND_SEGMENTS 4
+
+/**
+ * Asynchronous writes of the full segments of a write cursor, issued with
+ * POSIX AIO while the merge goes on. The cursor trades each full segment for
+ * a buffer whose write has completed.
+ */
+struct comp_write_behind {
+	/*FIFO of full segments whose write is in flight*/
+	struct aiocb aiocb[COMP_WRITE_BEHIND_SEGMENTS];
+	char *pending_buf[COMP_WRITE_BEHIND_SEGMENTS];
+	uint32_t head;
+	uint32_t num_pending;
+	char *free_buf[COMP_WRITE_BEHIND_SEGMENTS];
+	uint32_t num_free;
+	uint64_t bytes_written;
+	/*time the merge waited for writes to complete*/
+	uint64_t write_usec;
+	/*paces the writes with the rest of the background I/O of the DB*/
+	struct io_limiter *io_limiter;
+	int fd;
+};
+
 /*
  * Checks for pending compactions. It is responsible to check for dependencies
  * between two levels before triggering a compaction.
 */
 struct comp_level_write_cursor {
-	char segment_buf[MAX_HEIGHT][SEGMENT_SIZE];
+	/*segment of each height being filled*/
+	char *segment_buf[MAX_HEIGHT];
+	struct comp_write_behind *write_behind;
+	uint64_t bytes_written;
+	uint64_t write_usec;
 	uint64_t segment_offt[MAX_HEIGHT];
 	uint64_t first_segment_btree_level_offt[MAX_HEIGHT];
 	uint64_t last_segment_btree_level_offt[MAX_HEIGHT];
 	struct index_node *last_index[MAX_HEIGHT];
 	struct bt_dynamic_leaf_node *last_leaf;
 	struct chunk_LRU_cache *medium_log_LRU_cache;
+	/*chunk of the last medium KV transferred in place, pinned until the next one*/
+	char *medium_log_chunk;
 	struct medium_log_segment_map *medium_log_segment_map;
+	/*last key appended in the current leaf, used to compute the shortest separator pivot*/
+	char *last_key_in_log;
+	int32_t last_key_size;
+	char last_key[MAX_KEY_SIZE];
+	/*separator of the last two leaves, it enters the index once the right leaf is placed in its segment*/
+	char pending_pivot[sizeof(struct pivot_key) + MAX_KEY_SIZE];
+	uint64_t pending_pivot_left_offt;
+	/*leaves of compressed levels are built here and compressed when full*/
+	struct bt_dynamic_leaf_node *leaf_buf;
+	struct bt_compressed_leaf_node *compressed_leaf;
 	uint64_t root_offt;
 	uint64_t segment_id_cnt;
+	/*bytes of the KVs appended*/
+	uint64_t level_size;
 	db_handle *handle;
 	uint32_t level_id;
+	/*tree of the level the cursor builds*/
+	uint8_t tree_id;
+	/*no older keys remain below the run the cursor builds, deleted keys need no tombstone*/
+	uint8_t drop_deleted;
 	int32_t tree_height;
 	int fd;
 };
@@ -50,13 +99,56 @@ struct comp_parallax_key {
 		char *kv_inplace;
 	};
 	struct kv_seperation_splice kv_sep;
+	/*full key of a separated KV when its leaf keeps it, NULL otherwise*/
+	char *full_key;
+	int32_t full_key_size;
 	enum kv_category kv_category;
 	enum kv_entry_location kv_type;
 	uint8_t tombstone : 1;
 };
 
+/*Segments a read cursor keeps read ahead of the one it decodes*/
+#define COMP_READ_AHEAD_SEGMENTS 2
+
+/**
+ * Asynchronous reads of the next segments of a read cursor, issued with POSIX
+ * AIO while the cursor decodes the current one. A segment header names the
+ * next one, so a single read is in flight. Buffers form a ring, the ready ones
+ * follow the buffer of the cursor and the one in flight follows them.
+ */
+struct comp_read_ahead {
+	struct aiocb aiocb;
+	char *segment_buf[COMP_READ_AHEAD_SEGMENTS + 1];
+	uint64_t dev_offt[COMP_READ_AHEAD_SEGMENTS + 1];
+	/*next segment to read, 0 past the last segment of the level*/
+	uint64_t next_dev_offt;
+	uint32_t head;
+	uint32_t num_ready;
+	struct io_limiter *io_limiter;
+	int fd;
+	/*the read of aiocb is in flight*/
+	char reading;
+};
+
 struct comp_level_read_cursor {
-	char segment_buf[SEGMENT_SIZE];
+	/*current segment, a buffer of the read ahead ring*/
+	char *segment_buf;
+	struct comp_read_ahead *read_ahead;
+	/*current in place KV, rebuilt here when its leaf is prefix compressed*/
+	char kv_buf[LEAF_KV_INPLACE_MAX_SIZE];
+	/*current leaf, compressed leaves are decompressed in leaf_buf*/
+	struct bt_dynamic_leaf_node *leaf;
+	struct bt_dynamic_leaf_node *leaf_buf;
+	/*bytes the current leaf occupies in its segment*/
+	uint32_t leaf_node_size;
+	/*range of a subcompaction, keys in [start_key, end_key) and NULL for an open end*/
+	struct pivot_key *start_key;
+	struct pivot_key *end_key;
+	/*the cursor started at the leaf of start_key instead of the first segment of the level*/
+	char seeked;
+	/*partitions of a partitioned level, the cursor reads their chains one after the other*/
+	struct level_partition_table *partitions;
+	uint32_t partition_id;
 	struct comp_parallax_key cursor_key;
 	uint64_t device_offt;
 	uint64_t offset;
@@ -72,5 +164,7 @@ struct comp_level_read_cursor {
 };
 
 static void comp_get_space(struct comp_level_write_cursor *c, uint32_t height, nodeType_t type);
+static void comp_append_pivot_to_index(int32_t height, struct comp_level_write_cursor *c, uint64_t left_node_offt,
+				       struct pivot_key *pivot, uint64_t right_node_offt);
 
 #endif // COMPACTION_DAEMON_H_
@@ -25,6 +25,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
 
 void print_all_keys(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size);
 
@@ -55,10 +56,9 @@ void validate_dynamic_leaf(struct bt_dynamic_leaf_node *leaf, level_descriptor *
 
 	for (unsigned i = 0; i < leaf->header.num_entries; ++i) {
 		assert(slot_array[i].index <
-		       LEVEL0_LEAF_SIZE /* level->leaf_size */ - sizeof(struct bt_dynamic_leaf_node) -
+		       level->leaf_size - sizeof(struct bt_dynamic_leaf_node) -
 			       (sizeof(struct bt_dynamic_leaf_slot_array) * leaf->header.num_entries));
-		assert(*(uint32_t *)fill_keybuf(get_kv_offset(leaf, LEVEL0_LEAF_SIZE /* level->leaf_size */,
-							      slot_array[i].index),
+		assert(*(uint32_t *)fill_keybuf(get_kv_offset(leaf, level->leaf_size, slot_array[i].index),
 						slot_array[i].bitmap) < 40);
 		assert(slot_array[i].key_category == BIG_INLOG || slot_array[i].key_category == MEDIUM_INLOG ||
 		       slot_array[i].key_category == SMALL_INPLACE);
@@ -120,7 +120,8 @@ struct find_result find_key_in_dynamic_leaf(const struct bt_dynamic_leaf_node *l
 {
 	bt_insert_req req;
 	char buf[MAX_KEY_SIZE];
-	struct dl_bsearch_result result = { .middle = 0, .status = INSERT, .op = DYNAMIC_LEAF_FIND };
+	/*on a miss middle is the position of the key, lookups in key order use it to tell when they leave the leaf*/
+	struct dl_bsearch_result result = { .middle = 0, .status = INSERT, .op = DYNAMIC_LEAF_INSERT };
 	struct find_result ret_result = { .kv = NULL, .key_type = KV_INPLACE, .kv_category = BIG_INLOG, .tombstone = 0 };
 	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
 	db_handle handle = { .db_desc = db_desc, .volume_desc = NULL };
@@ -143,6 +144,7 @@ struct find_result find_key_in_dynamic_leaf(const struct bt_dynamic_leaf_node *l
 	case FOUND:
 		switch (get_kv_format(slot_array[result.middle].key_category)) {
 		case KV_INPLACE:
+			/*in prefix compressed leaves the KV keeps only the suffix of its key, its value is intact*/
 			ret_result.kv = (void *)ABSOLUTE_ADDRESS(
 				get_kv_offset(leaf, leaf_size, slot_array[result.middle].index));
 			ret_result.key_type = KV_INPLACE;
@@ -160,12 +162,123 @@ struct find_result find_key_in_dynamic_leaf(const struct bt_dynamic_leaf_node *l
 		}
 		break;
 	default:
+		ret_result.past_last_key = result.middle >= (int)leaf->header.num_entries;
 		break;
 	}
 
 	return ret_result;
 }
 
+static int dl_is_inplace(enum kv_category cat)
+{
+	return cat == SMALL_INPLACE || cat == MEDIUM_INPLACE;
+}
+
+static int dl_key_cmp(const char *key1, int32_t key1_size, const char *key2, int32_t key2_size)
+{
+	int ret = memcmp(key1, key2, MIN(key1_size, key2_size));
+	return ret ? ret : key1_size - key2_size;
+}
+
+struct key_splice *get_separated_full_key(const struct bt_dynamic_leaf_node *leaf, char *kv_loc)
+{
+	if (!leaf->header.leaf_full_keys)
+		return NULL;
+	return (struct key_splice *)(kv_loc + get_kv_seperated_splice_size());
+}
+
+/*Bytes of the separated entry at kv_loc in the leaf log*/
+static uint32_t dl_get_separated_entry_size(const struct bt_dynamic_leaf_node *leaf, char *kv_loc)
+{
+	struct key_splice *full_key = get_separated_full_key(leaf, kv_loc);
+	uint32_t size = get_kv_seperated_splice_size();
+	return full_key ? size + sizeof(struct key_splice) + full_key->key_size : size;
+}
+
+/**
+ * Compares the entry at position with a lookup key that starts with the prefix
+ * of the leaf. In place entries store only the suffix of their key, separated
+ * entries keep the full key in the log and are fetched only when their first
+ * PREFIX_SIZE bytes are not enough, unless the leaf keeps their full keys.
+ */
+static int dl_compare_compressed_entry(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, int32_t position,
+				       char *key, int32_t key_size)
+{
+	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+	char *kv_loc = get_kv_offset(leaf, leaf_size, slot_array[position].index);
+	uint32_t prefix_size = leaf->header.leaf_prefix_size;
+
+	if (dl_is_inplace(slot_array[position].key_category)) {
+		struct kv_splice *kv = (struct kv_splice *)kv_loc;
+		return dl_key_cmp(get_key_offset_in_kv(kv), get_key_size(kv), key + prefix_size,
+				  key_size - (int32_t)prefix_size);
+	}
+
+	struct kv_seperation_splice *kv_entry = (struct kv_seperation_splice *)kv_loc;
+	char padded_key_prefix[PREFIX_SIZE] = { 0 };
+	memcpy(padded_key_prefix, key, MIN(key_size, PREFIX_SIZE));
+	int ret = prefix_compare(kv_entry->prefix, padded_key_prefix, PREFIX_SIZE);
+	if (ret)
+		return ret;
+
+	struct key_splice *full_key = get_separated_full_key(leaf, kv_loc);
+	if (full_key)
+		return dl_key_cmp(full_key->data, full_key->key_size, key, key_size);
+	struct kv_splice *kv = (struct kv_splice *)fill_keybuf(kv_loc, KV_INLOG);
+	return dl_key_cmp(get_key_offset_in_kv(kv), get_key_size(kv), key, key_size);
+}
+
+/**
+ * Binary search for prefix compressed device level leaves and for those that
+ * keep full keys. A lookup key that does not start with the prefix of the leaf
+ * sorts before or after all of its keys, otherwise only the suffixes are
+ * compared.
+ */
+static void dl_search_compressed_leaf(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, bt_insert_req *req,
+				      struct dl_bsearch_result *result)
+{
+	if (req->metadata.key_format != KV_FORMAT) {
+		log_fatal("Prefix compressed leaves are searched only with KV_FORMAT keys");
+		BUG_ON();
+	}
+
+	struct kv_splice *lookup_kv = (struct kv_splice *)req->key_value_buf;
+	char *key = get_key_offset_in_kv(lookup_kv);
+	int32_t key_size = get_key_size(lookup_kv);
+	int32_t prefix_size = leaf->header.leaf_prefix_size;
+	int32_t num_entries = leaf->header.num_entries;
+	result->status = INSERT;
+
+	int ret = memcmp(leaf->header.leaf_prefix, key, MIN(prefix_size, key_size));
+	if (ret > 0 || (0 == ret && key_size < prefix_size)) {
+		result->middle = 0;
+		return;
+	}
+	if (ret < 0) {
+		result->middle = num_entries;
+		return;
+	}
+
+	int32_t start = 0;
+	int32_t end = num_entries;
+	while (start < end) {
+		int32_t middle = start + (end - start) / 2;
+		ret = dl_compare_compressed_entry(leaf, leaf_size, middle, key, key_size);
+		if (0 == ret) {
+			struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+			result->middle = middle;
+			result->status = FOUND;
+			result->tombstone = slot_array[middle].tombstone;
+			return;
+		}
+		if (ret < 0)
+			start = middle + 1;
+		else
+			end = middle;
+	}
+	result->middle = start;
+}
+
 void binary_search_dynamic_leaf(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, bt_insert_req *req,
 				struct dl_bsearch_result *result)
 {
@@ -178,6 +291,12 @@ void binary_search_dynamic_leaf(const struct bt_dynamic_leaf_node *leaf, uint32_
 	int ret, ret_case;
 	struct key_compare key1_cmp, key2_cmp;
 
+	/*L0 leaves are updated in place and never carry a prefix or full keys*/
+	if (req->metadata.level_id && (leaf->header.leaf_prefix_size || leaf->header.leaf_full_keys)) {
+		dl_search_compressed_leaf(leaf, leaf_size, req, result);
+		return;
+	}
+
 	while (numberOfEntriesInNode > 0) {
 		int32_t middle = (start + end) / 2;
 		if (middle < 0 || middle >= numberOfEntriesInNode) {
@@ -383,7 +502,8 @@ uint32_t append_kv_inplace(char *dest, char *buf, uint32_t buf_size)
 	return buf_size;
 }
 
-uint32_t append_bt_leaf_entry_inplace(char *dest, uint64_t pointer, char *prefix, uint32_t prefix_size)
+uint32_t append_bt_leaf_entry_inplace(char *dest, uint64_t pointer, uint32_t kv_size, char *prefix,
+				      uint32_t prefix_size)
 {
 	char padded_prefix[PREFIX_SIZE];
 	if (prefix_size < PREFIX_SIZE) {
@@ -392,13 +512,15 @@ uint32_t append_bt_leaf_entry_inplace(char *dest, uint64_t pointer, char *prefix
 		prefix = padded_prefix;
 		prefix_size = PREFIX_SIZE;
 	}
-	if (prefix_size)
-		dest -= sizeof(pointer);
-	*(uint64_t *)dest = pointer;
+	/*entries of leaves that keep full keys are not aligned*/
+	dest -= sizeof(kv_size);
+	memcpy(dest, &kv_size, sizeof(kv_size));
+	dest -= sizeof(pointer);
+	memcpy(dest, &pointer, sizeof(pointer));
 	dest -= prefix_size;
 	memcpy(dest, prefix, prefix_size);
 
-	return prefix_size + sizeof(pointer);
+	return prefix_size + sizeof(pointer) + sizeof(kv_size);
 }
 
 int is_dynamic_leaf_full(struct split_level_leaf split_metadata)
@@ -607,17 +729,18 @@ void write_data_in_dynamic_leaf(struct write_dynamic_leaf_args *args)
 		if (args->level_id == 0 && args->cat == BIG_INLOG && kv_format == KV_FORMAT) {
 			struct kv_splice *key = (struct kv_splice *)key_value_buf;
 			assert(args->kv_dev_offt != 0);
-			leaf->header.leaf_log_size += append_bt_leaf_entry_inplace(dest, args->kv_dev_offt, key->data,
-										   MIN(key->key_size, PREFIX_SIZE));
+			leaf->header.leaf_log_size += append_bt_leaf_entry_inplace(
+				dest, args->kv_dev_offt, get_kv_size(key), key->data, MIN(key->key_size, PREFIX_SIZE));
 		} else {
 			if (kv_format == KV_FORMAT) {
 				struct kv_splice *key = (struct kv_splice *)key_value_buf;
-				leaf->header.leaf_log_size +=
-					append_bt_leaf_entry_inplace(dest, ABSOLUTE_ADDRESS(key_value_buf), key->data,
-								     MIN(key->key_size, PREFIX_SIZE));
+				leaf->header.leaf_log_size += append_bt_leaf_entry_inplace(
+					dest, ABSOLUTE_ADDRESS(key_value_buf), get_kv_size(key), key->data,
+					MIN(key->key_size, PREFIX_SIZE));
 			} else {
 				leaf->header.leaf_log_size += append_bt_leaf_entry_inplace(
-					dest, ABSOLUTE_ADDRESS(serialized->dev_offt), serialized->prefix, PREFIX_SIZE);
+					dest, ABSOLUTE_ADDRESS(serialized->dev_offt), serialized->kv_size,
+					serialized->prefix, PREFIX_SIZE);
 			}
 		}
 	} else
@@ -629,6 +752,232 @@ void write_data_in_dynamic_leaf(struct write_dynamic_leaf_args *args)
 	slot_array[middle] = slot;
 }
 
+/*Bytes of a separated key known without fetching it from the log, its prefix is zero padded*/
+static uint32_t dl_get_known_prefix_size(const char *prefix)
+{
+	return strnlen(prefix, PREFIX_SIZE);
+}
+
+static uint32_t dl_common_prefix_size(const char *key1, const char *key2, uint32_t size)
+{
+	uint32_t i = 0;
+	while (i < size && key1[i] == key2[i])
+		++i;
+	return i;
+}
+
+/**
+ * Shrinks the prefix of the leaf to new_prefix_size by moving the bytes it
+ * loses back in front of the suffix of every in place KV. Entries are visited
+ * from the last appended, which lies lowest in the leaf log, so every entry
+ * moves to space that is either free or its own.
+ */
+static void dl_shrink_leaf_prefix(struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, uint32_t new_prefix_size)
+{
+	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+	uint32_t restored_size = leaf->header.leaf_prefix_size - new_prefix_size;
+	char *restored = &leaf->header.leaf_prefix[new_prefix_size];
+	uint32_t inplace_entries = 0;
+
+	for (int32_t i = 0; i < leaf->header.num_entries; ++i)
+		inplace_entries += dl_is_inplace(slot_array[i].key_category);
+	leaf->header.leaf_log_size += restored_size * inplace_entries;
+
+	for (int32_t i = leaf->header.num_entries - 1; i >= 0; --i) {
+		uint32_t new_index = slot_array[i].index + restored_size * inplace_entries;
+		char *old_loc = get_kv_offset(leaf, leaf_size, slot_array[i].index);
+		char *new_loc = get_kv_offset(leaf, leaf_size, new_index);
+
+		if (!dl_is_inplace(slot_array[i].key_category)) {
+			memmove(new_loc, old_loc, dl_get_separated_entry_size(leaf, old_loc));
+			slot_array[i].index = new_index;
+			continue;
+		}
+
+		struct kv_splice *old_kv = (struct kv_splice *)old_loc;
+		int32_t key_size = old_kv->key_size;
+		int32_t value_size = old_kv->value_size;
+		uint32_t data_size = get_kv_size(old_kv) - get_kv_metadata_size();
+
+		struct kv_splice *new_kv = (struct kv_splice *)new_loc;
+		memmove(new_kv->data + restored_size, old_kv->data, data_size);
+		memcpy(new_kv->data, restored, restored_size);
+		new_kv->key_size = key_size + restored_size;
+		new_kv->value_size = value_size;
+		slot_array[i].index = new_index;
+		--inplace_entries;
+	}
+	leaf->header.leaf_prefix_size = new_prefix_size;
+}
+
+int8_t append_to_prefix_compressed_leaf(struct write_dynamic_leaf_args *args, uint32_t leaf_size)
+{
+	struct bt_dynamic_leaf_node *leaf = args->leaf;
+	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+	int inplace = dl_is_inplace(args->cat);
+	struct kv_splice *kv = (struct kv_splice *)args->key_value_buf;
+	char *key = NULL;
+	uint32_t key_size = 0;
+
+	if (inplace) {
+		key = get_key_offset_in_kv(kv);
+		key_size = get_key_size(kv);
+	} else if (leaf->header.leaf_full_keys) {
+		assert(args->kv_format == KV_PREFIX);
+		if (!args->full_key) {
+			log_fatal("Leaf keeps full keys but the separated KV comes without its key");
+			BUG_ON();
+		}
+		key = args->full_key;
+		key_size = args->full_key_size;
+	} else {
+		assert(args->kv_format == KV_PREFIX);
+		key = ((struct kv_seperation_splice *)args->key_value_buf)->prefix;
+		key_size = dl_get_known_prefix_size(key);
+	}
+
+	uint32_t prefix_size = MIN(key_size, LEAF_PREFIX_MAX_SIZE);
+	uint32_t restored_size = 0;
+	if (leaf->header.num_entries) {
+		prefix_size = dl_common_prefix_size(leaf->header.leaf_prefix, key,
+						    MIN(leaf->header.leaf_prefix_size, key_size));
+		restored_size = leaf->header.leaf_prefix_size - prefix_size;
+	}
+
+	uint32_t full_key_size = !inplace && leaf->header.leaf_full_keys ? sizeof(struct key_splice) + key_size : 0;
+	uint32_t entry_size =
+		inplace ? args->key_value_size - prefix_size : (uint32_t)get_kv_seperated_splice_size() + full_key_size;
+	uint32_t log_size = leaf->header.leaf_log_size + entry_size;
+	for (int32_t i = 0; restored_size && i < leaf->header.num_entries; ++i)
+		log_size += dl_is_inplace(slot_array[i].key_category) ? restored_size : 0;
+
+	uint32_t metadata_size = sizeof(struct bt_dynamic_leaf_node) +
+				 (sizeof(struct bt_dynamic_leaf_slot_array) * (leaf->header.num_entries + 1));
+	if (metadata_size + log_size >= leaf_size)
+		return 0;
+
+	if (restored_size)
+		dl_shrink_leaf_prefix(leaf, leaf_size, prefix_size);
+
+	if (0 == leaf->header.num_entries) {
+		memcpy(leaf->header.leaf_prefix, key, prefix_size);
+		leaf->header.leaf_prefix_size = prefix_size;
+	}
+
+	args->dest = get_leaf_log_offset(leaf, leaf_size);
+	args->middle = leaf->header.num_entries;
+	if (!inplace) {
+		/*the full key lies above the separated KV, which the slot points to*/
+		if (full_key_size) {
+			struct key_splice *stored_key = (struct key_splice *)(args->dest - full_key_size);
+			stored_key->key_size = key_size;
+			memcpy(stored_key->data, key, key_size);
+			leaf->header.leaf_log_size += full_key_size;
+			args->dest -= full_key_size;
+		}
+		write_data_in_dynamic_leaf(args);
+		++leaf->header.num_entries;
+		return 1;
+	}
+
+	struct kv_splice *stored_kv = (struct kv_splice *)(args->dest - entry_size);
+	stored_kv->key_size = key_size - prefix_size;
+	stored_kv->value_size = kv->value_size;
+	memcpy(stored_kv->data, kv->data + prefix_size, entry_size - get_kv_metadata_size());
+	leaf->header.leaf_log_size += entry_size;
+
+	struct bt_dynamic_leaf_slot_array slot = { .index = leaf->header.leaf_log_size,
+						   .key_category = args->cat,
+						   .tombstone = args->tombstone };
+	slot_array[args->middle] = slot;
+	++leaf->header.num_entries;
+	return 1;
+}
+
+struct kv_splice *get_kv_inplace(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, uint32_t level_id,
+				 int32_t position, char *kv_buf)
+{
+	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+	struct kv_splice *stored_kv = (struct kv_splice *)get_kv_offset(leaf, leaf_size, slot_array[position].index);
+	uint32_t prefix_size = level_id ? leaf->header.leaf_prefix_size : 0;
+	assert(dl_is_inplace(slot_array[position].key_category));
+
+	if (0 == prefix_size)
+		return stored_kv;
+
+	uint32_t data_size = get_kv_size(stored_kv) - get_kv_metadata_size();
+	if (get_kv_metadata_size() + prefix_size + data_size > LEAF_KV_INPLACE_MAX_SIZE) {
+		log_fatal("In place KV of %u bytes does not fit in the decode buffer", prefix_size + data_size);
+		BUG_ON();
+	}
+
+	struct kv_splice *kv = (struct kv_splice *)kv_buf;
+	kv->key_size = stored_kv->key_size + prefix_size;
+	kv->value_size = stored_kv->value_size;
+	memcpy(kv->data, leaf->header.leaf_prefix, prefix_size);
+	memcpy(kv->data + prefix_size, stored_kv->data, data_size);
+	return kv;
+}
+
+uint32_t compress_dynamic_leaf(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size,
+			       struct bt_compressed_leaf_node *node)
+{
+	uint32_t front_size = sizeof(struct bt_dynamic_leaf_node) +
+			      leaf->header.num_entries * sizeof(struct bt_dynamic_leaf_slot_array);
+	uint32_t log_size = leaf->header.leaf_log_size;
+	/*a compressed leaf that does not save at least 8 bytes is not worth the decompression*/
+	uint32_t max_data_size = leaf_size - sizeof(struct bt_compressed_leaf_node) - sizeof(uint64_t);
+
+	z_stream stream = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
+	if (deflateInit(&stream, Z_BEST_SPEED) != Z_OK) {
+		log_fatal("Failed to initialize zlib stream");
+		BUG_ON();
+	}
+
+	/*the free space between the slot array and the KV log is not stored*/
+	stream.next_out = (Bytef *)node->data;
+	stream.avail_out = max_data_size;
+	stream.next_in = (Bytef *)leaf;
+	stream.avail_in = front_size;
+	int ret = deflate(&stream, Z_NO_FLUSH);
+	if (Z_OK == ret) {
+		stream.next_in = (Bytef *)get_leaf_log_offset(leaf, leaf_size);
+		stream.avail_in = log_size;
+		ret = deflate(&stream, Z_FINISH);
+	}
+	uint32_t data_size = max_data_size - stream.avail_out;
+	deflateEnd(&stream);
+
+	if (ret != Z_STREAM_END)
+		return 0;
+
+	node->type = compressedLeafNode;
+	node->uncompressed_front_size = front_size;
+	node->uncompressed_size = front_size + log_size;
+	/*keep the next node of the segment 8 bytes aligned*/
+	node->node_size = sizeof(struct bt_compressed_leaf_node) + data_size;
+	node->node_size += (sizeof(uint64_t) - node->node_size % sizeof(uint64_t)) % sizeof(uint64_t);
+	return node->node_size;
+}
+
+void decompress_dynamic_leaf(const struct bt_compressed_leaf_node *node, struct bt_dynamic_leaf_node *leaf,
+			     uint32_t leaf_size)
+{
+	uLongf uncompressed_size = node->uncompressed_size;
+	if (node->type != compressedLeafNode || node->uncompressed_size > leaf_size ||
+	    uncompress((Bytef *)leaf, &uncompressed_size, (const Bytef *)node->data,
+		       node->node_size - sizeof(struct bt_compressed_leaf_node)) != Z_OK ||
+	    uncompressed_size != node->uncompressed_size) {
+		log_fatal("Corrupted compressed leaf of %u bytes", node->node_size);
+		BUG_ON();
+	}
+
+	/*move the KV log back to the end of the leaf*/
+	uint32_t log_size = node->uncompressed_size - node->uncompressed_front_size;
+	memmove((char *)leaf + leaf_size - log_size, (char *)leaf + node->uncompressed_front_size, log_size);
+	assert(leaf->header.leaf_log_size == log_size);
+}
+
 int reorganize_dynamic_leaf(struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, bt_insert_req *req)
 {
 	enum kv_category cat = req->metadata.cat;
@@ -723,7 +1072,7 @@ int8_t insert_in_dynamic_leaf(struct bt_dynamic_leaf_node *leaf, bt_insert_req *
 #ifdef DEBUG_DYNAMIC_LEAF
 	validate_dynamic_leaf(leaf, level, req->metadata.kv_size, 0);
 #endif
-	assert(leaf->header.leaf_log_size < LEVEL0_LEAF_SIZE);
+	assert(leaf->header.leaf_log_size < level->leaf_size);
 
 	switch (bsearch.status) {
 	case INSERT:
@@ -766,7 +1115,7 @@ int8_t insert_in_dynamic_leaf(struct bt_dynamic_leaf_node *leaf, bt_insert_req *
 	validate_dynamic_leaf(leaf, level, 0, 1);
 	check_sorted_dynamic_leaf(leaf, level->leaf_size);
 #endif
-	assert(leaf->header.leaf_log_size < LEVEL0_LEAF_SIZE);
+	assert(leaf->header.leaf_log_size < level->leaf_size);
 	//validate_dynamic_leaf(leaf, level, 0, 1);
 
 	return bsearch.status;
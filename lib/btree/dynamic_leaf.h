@@ -27,6 +27,8 @@ struct find_result {
 	enum kv_entry_location key_type;
 	enum kv_category kv_category;
 	uint8_t tombstone : 1;
+	/*the key is missing and sorts after all the keys of the leaf*/
+	uint8_t past_last_key : 1;
 };
 
 struct dl_bsearch_result {
@@ -53,6 +55,9 @@ struct write_dynamic_leaf_args {
 	unsigned int level_medium_inplace;
 	int kv_format;
 	enum kv_category cat;
+	/*full key of a separated KV, leaves that keep full keys store it*/
+	char *full_key;
+	int32_t full_key_size;
 };
 
 struct split_level_leaf {
@@ -68,6 +73,49 @@ struct split_level_leaf {
 char *get_leaf_log_offset(const struct bt_dynamic_leaf_node *leaf, const uint32_t leaf_size);
 void write_data_in_dynamic_leaf(struct write_dynamic_leaf_args *args);
 
+/**
+ * Appends a KV at the end of a device level leaf that compaction builds in key
+ * order. The leaf keeps the longest prefix shared by all of its keys, up to
+ * LEAF_PREFIX_MAX_SIZE bytes, in its header and stores in place KVs without it.
+ * Separated KVs stay as they are and limit the prefix to their first
+ * PREFIX_SIZE bytes, unless the leaf keeps full keys. Then each one is
+ * followed by the full_key of args and the whole key counts for the prefix.
+ * @param args: the KV to append, dest and middle are filled by the function
+ * @param leaf_size: the leaf size of the level
+ * @return 1 on success, 0 if the KV does not fit and belongs to a new leaf
+ */
+int8_t append_to_prefix_compressed_leaf(struct write_dynamic_leaf_args *args, uint32_t leaf_size);
+
+/**
+ * Returns the full key that a leaf keeping full keys stores after the
+ * separated KV at kv_loc, NULL if the leaf keeps only the prefixes.
+ */
+struct key_splice *get_separated_full_key(const struct bt_dynamic_leaf_node *leaf, char *kv_loc);
+
+/**
+ * Returns the in place KV at position in its full form. For prefix compressed
+ * leaves the KV is rebuilt in kv_buf, which must hold LEAF_KV_INPLACE_MAX_SIZE
+ * bytes, otherwise the KV in the leaf is returned.
+ */
+struct kv_splice *get_kv_inplace(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size, uint32_t level_id,
+				 int32_t position, char *kv_buf);
+
+/**
+ * Compresses a device level leaf into node. Only the header, the slot array
+ * and the KV log of the leaf are stored, node must hold leaf_size bytes.
+ * @return the bytes node occupies in its segment, a multiple of 8, or 0 if
+ * compression does not make the leaf smaller
+ */
+uint32_t compress_dynamic_leaf(const struct bt_dynamic_leaf_node *leaf, uint32_t leaf_size,
+			       struct bt_compressed_leaf_node *node);
+
+/**
+ * Restores a leaf compressed by compress_dynamic_leaf in the leaf_size bytes
+ * of leaf.
+ */
+void decompress_dynamic_leaf(const struct bt_compressed_leaf_node *node, struct bt_dynamic_leaf_node *leaf,
+			     uint32_t leaf_size);
+
 char *fill_keybuf(char *key_loc, enum kv_entry_location key_type);
 void fill_prefix(struct prefix *key, char *key_loc, enum kv_entry_location key_type);
 
@@ -18,8 +18,10 @@
 #include "../allocator/volume_manager.h"
 #include "../btree/kv_pairs.h"
 #include "../common/common.h"
+#include "bg_pool.h"
 #include "btree.h"
 #include "conf.h"
+#include "io_limiter.h"
 #include "lsn.h"
 #include "parallax/structures.h"
 #include <assert.h>
@@ -30,6 +32,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 #include <uthash.h>
@@ -64,6 +67,12 @@ void move_kv_pairs_to_new_segment(struct db_handle handle, stack *marks)
 	char *kv_address;
 	int i;
 
+	/*the valid KVs are appended again to the log*/
+	uint64_t bytes_to_move = 0;
+	for (i = 0; i < marks->size; ++i)
+		bytes_to_move += get_kv_size((struct kv_splice *)marks->valid_pairs[i]) + get_lsn_size();
+	io_limiter_request(handle.db_desc->io_limiter, bytes_to_move);
+
 	for (i = 0; i < marks->size; ++i, ++handle.db_desc->gc_keys_transferred) {
 		kv_address = marks->valid_pairs[i];
 		// struct splice *key = (struct splice *)kv_address;
@@ -88,47 +97,129 @@ void move_kv_pairs_to_new_segment(struct db_handle handle, stack *marks)
 	}
 }
 
-int8_t find_deleted_kv_pairs_in_segment(struct db_handle handle, struct gc_segment_descriptor *log_seg, stack *marks)
+/*A KV of the segment under GC, its key is serialized for the lookup that checks if the index points to it*/
+struct gc_segment_kv {
+	struct kv_splice *kv;
+	char *key_buf;
+	uint64_t kv_dev_offt;
+	/*position of the KV in the segment*/
+	uint32_t id;
+};
+
+/*Buffers of the validity checks of a segment, allocated once per GC pass*/
+struct gc_validity_check {
+	struct gc_segment_kv *kvs;
+	struct lookup_operation *get_ops;
+	/*the valid KVs by their position in the segment*/
+	struct kv_splice **valid_kvs;
+	char *key_bufs;
+};
+
+static struct gc_validity_check *gc_create_validity_check(void)
 {
-	struct gc_segment_descriptor iter_log_segment = *log_seg;
-	char *log_segment_in_device = REAL_ADDRESS(log_seg->segment_dev_offt);
-	char buf[MAX_KEY_SIZE];
-	struct kv_splice *kv = NULL;
-	int64_t checked_segment_chunk = get_lsn_size();
-	int64_t segment_data = LOG_DATA_OFFSET;
+	struct gc_validity_check *check = calloc(1UL, sizeof(struct gc_validity_check));
+	if (!check) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	check->kvs = calloc(STACK_SIZE, sizeof(struct gc_segment_kv));
+	check->get_ops = calloc(STACK_SIZE, sizeof(struct lookup_operation));
+	check->valid_kvs = calloc(STACK_SIZE, sizeof(struct kv_splice *));
+	/*a key splice is never larger than the KV and its LSN*/
+	check->key_bufs = calloc(1UL, SEGMENT_SIZE);
+	if (!check->kvs || !check->get_ops || !check->valid_kvs || !check->key_bufs) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	return check;
+}
 
-	iter_log_segment.log_segment_in_memory += get_lsn_size();
-	log_segment_in_device += get_lsn_size();
+static void gc_destroy_validity_check(struct gc_validity_check *check)
+{
+	free(check->kvs);
+	free(check->get_ops);
+	free(check->valid_kvs);
+	free(check->key_bufs);
+	free(check);
+}
 
-	int32_t key_value_size = get_kv_metadata_size();
-	marks->size = 0;
+static int gc_segment_kv_cmp(const void *a, const void *b)
+{
+	const struct gc_segment_kv *kv_a = (const struct gc_segment_kv *)a;
+	const struct gc_segment_kv *kv_b = (const struct gc_segment_kv *)b;
+	struct key_splice *key_a = (struct key_splice *)kv_a->key_buf;
+	struct key_splice *key_b = (struct key_splice *)kv_b->key_buf;
+	int32_t key_a_size = get_key_splice_key_size(key_a);
+	int32_t key_b_size = get_key_splice_key_size(key_b);
+
+	int ret = memcmp(get_key_splice_key_offset(key_a), get_key_splice_key_offset(key_b),
+			 key_a_size < key_b_size ? key_a_size : key_b_size);
+	if (ret)
+		return ret;
+	if (key_a_size != key_b_size)
+		return key_a_size < key_b_size ? -1 : 1;
+	/*the same key written twice in the segment, keep the log order*/
+	return kv_a->id < kv_b->id ? -1 : kv_a->id > kv_b->id;
+}
 
-	while (checked_segment_chunk < segment_data) {
-		kv = (struct kv_splice *)iter_log_segment.log_segment_in_memory;
+/*
+ * Finds the KVs of the segment that the index still points to and moves them
+ * to the tail of the log. The keys of the segment are sorted and checked with
+ * one find_keys pass over the levels instead of a find_key per KV.
+ */
+static int8_t find_deleted_kv_pairs_in_segment(struct db_handle handle, struct gc_segment_descriptor *log_seg,
+					       stack *marks, struct gc_validity_check *check)
+{
+	uint64_t segment_offt = get_lsn_size();
+	uint64_t key_bufs_offt = 0;
+	uint32_t num_kvs = 0;
+	marks->size = 0;
 
-		if (!kv->key_size || checked_segment_chunk - segment_data < get_min_possible_kv_size())
+	/*the segment is a sequence of LSN, KV entries, a zero key size marks the end of its data*/
+	while (segment_offt + get_min_possible_kv_size() <= LOG_DATA_OFFSET) {
+		struct kv_splice *kv = (struct kv_splice *)&log_seg->log_segment_in_memory[segment_offt];
+		if (!kv->key_size || segment_offt + get_kv_size(kv) > LOG_DATA_OFFSET)
 			break;
 
-		serialize_kv_splice_to_key_splice(buf, kv);
-		struct lookup_operation get_op = { .db_desc = handle.db_desc,
-						   .found = 0,
-						   .size = 0,
-						   .buffer_to_pack_kv = NULL,
-						   .buffer_overflow = 0,
-						   .key_buf = buf,
-						   .retrieve = 0 };
-		find_key(&get_op);
-
-		if (get_op.found && log_segment_in_device == get_op.key_device_address)
-			push_stack(marks, iter_log_segment.log_segment_in_memory);
-
-		if (kv->key_size) {
-			int32_t bytes_to_move = kv->key_size + kv->value_size + key_value_size + get_lsn_size();
-			iter_log_segment.log_segment_in_memory += bytes_to_move;
-			log_segment_in_device += bytes_to_move;
-			checked_segment_chunk += kv->key_size + kv->value_size + key_value_size + get_lsn_size();
-		} else
-			break;
+		struct gc_segment_kv *segment_kv = &check->kvs[num_kvs];
+		segment_kv->kv = kv;
+		segment_kv->kv_dev_offt = log_seg->segment_dev_offt + segment_offt;
+		segment_kv->id = num_kvs;
+		segment_kv->key_buf = &check->key_bufs[key_bufs_offt];
+		serialize_kv_splice_to_key_splice(segment_kv->key_buf, kv);
+		key_bufs_offt += sizeof(int32_t) + get_key_size(kv);
+		assert(key_bufs_offt <= SEGMENT_SIZE);
+		++num_kvs;
+		assert(num_kvs < STACK_SIZE);
+
+		segment_offt += get_kv_size(kv) + get_lsn_size();
+	}
+
+	qsort(check->kvs, num_kvs, sizeof(struct gc_segment_kv), gc_segment_kv_cmp);
+
+	for (uint32_t i = 0; i < num_kvs; ++i) {
+		check->get_ops[i] = (struct lookup_operation){ .db_desc = handle.db_desc,
+							       .found = 0,
+							       .size = 0,
+							       .buffer_to_pack_kv = NULL,
+							       .buffer_overflow = 0,
+							       .key_buf = check->kvs[i].key_buf,
+							       .retrieve = 0 };
+	}
+	find_keys(check->get_ops, num_kvs);
+
+	/*a KV is valid if the index points to this copy of it, the device offsets are absolute*/
+	memset(check->valid_kvs, 0x00, num_kvs * sizeof(struct kv_splice *));
+	for (uint32_t i = 0; i < num_kvs; ++i) {
+		if (check->get_ops[i].found &&
+		    (uint64_t)check->get_ops[i].key_device_address == check->kvs[i].kv_dev_offt)
+			check->valid_kvs[check->kvs[i].id] = check->kvs[i].kv;
+	}
+
+	/*valid KVs move in the order of the log*/
+	for (uint32_t id = 0; id < num_kvs; ++id) {
+		if (check->valid_kvs[id])
+			push_stack(marks, check->valid_kvs[id]);
 	}
 
 	assert(marks->size < STACK_SIZE);
@@ -138,13 +229,156 @@ int8_t find_deleted_kv_pairs_in_segment(struct db_handle handle, struct gc_segme
 	return 1;
 }
 
+uint32_t gc_get_log_clock(struct db_descriptor *db_desc)
+{
+	return db_desc->big_log.size / SEGMENT_SIZE;
+}
+
+/*Space freed times its age over the cost to read the segment and write back its live data, as in LFS*/
+static double gc_cost_benefit(const struct gc_victim_heap *heap, const struct large_log_segment_gc_entry *segment)
+{
+	uint32_t age = heap->now > segment->append_clock ? heap->now - segment->append_clock : 0;
+	double garbage = segment->garbage_bytes;
+	/*(1 - u) * age / (1 + u) with u = (SEGMENT_SIZE - garbage) / SEGMENT_SIZE*/
+	return garbage * (age + 1) / (2.0 * SEGMENT_SIZE - garbage);
+}
+
+static void gc_swap_victims(struct gc_victim_heap *heap, uint32_t left, uint32_t right)
+{
+	struct large_log_segment_gc_entry *tmp = heap->segments[left];
+	heap->segments[left] = heap->segments[right];
+	heap->segments[right] = tmp;
+	heap->segments[left]->heap_id = left;
+	heap->segments[right]->heap_id = right;
+}
+
+static void gc_sift_up(struct gc_victim_heap *heap, uint32_t heap_id)
+{
+	while (heap_id > 0) {
+		uint32_t parent = (heap_id - 1) / 2;
+		if (gc_cost_benefit(heap, heap->segments[parent]) >= gc_cost_benefit(heap, heap->segments[heap_id]))
+			return;
+		gc_swap_victims(heap, parent, heap_id);
+		heap_id = parent;
+	}
+}
+
+static void gc_sift_down(struct gc_victim_heap *heap, uint32_t heap_id)
+{
+	while (1) {
+		uint32_t largest = heap_id;
+		uint32_t left = 2 * heap_id + 1;
+		uint32_t right = left + 1;
+		if (left < heap->num_segments &&
+		    gc_cost_benefit(heap, heap->segments[left]) > gc_cost_benefit(heap, heap->segments[largest]))
+			largest = left;
+		if (right < heap->num_segments &&
+		    gc_cost_benefit(heap, heap->segments[right]) > gc_cost_benefit(heap, heap->segments[largest]))
+			largest = right;
+		if (largest == heap_id)
+			return;
+		gc_swap_victims(heap, heap_id, largest);
+		heap_id = largest;
+	}
+}
+
+void gc_add_log_segment(struct db_descriptor *db_desc, uint64_t segment_dev_offt, uint32_t append_clock)
+{
+	MUTEX_LOCK(&db_desc->segment_ht_lock);
+	struct large_log_segment_gc_entry *segment = NULL;
+	HASH_FIND(hh, db_desc->segment_ht, &segment_dev_offt, sizeof(segment_dev_offt), segment);
+	if (!segment) {
+		segment = calloc(1UL, sizeof(struct large_log_segment_gc_entry));
+		if (!segment) {
+			log_fatal("Calloc failed");
+			BUG_ON();
+		}
+		segment->segment_dev_offt = segment_dev_offt;
+		segment->heap_id = GC_NOT_A_VICTIM;
+		HASH_ADD(hh, db_desc->segment_ht, segment_dev_offt, sizeof(segment->segment_dev_offt), segment);
+	}
+	segment->append_clock = append_clock;
+	MUTEX_UNLOCK(&db_desc->segment_ht_lock);
+}
+
+void gc_update_victim(struct db_descriptor *db_desc, struct large_log_segment_gc_entry *segment)
+{
+	/*cleaning a segment with little garbage costs a rewrite of almost all of it*/
+	if (segment->heap_id == GC_NOT_A_VICTIM && segment->garbage_bytes < GC_SEGMENT_THRESHOLD * SEGMENT_SIZE)
+		return;
+
+	if (!db_desc->gc_victims) {
+		db_desc->gc_victims = calloc(1UL, sizeof(struct gc_victim_heap));
+		if (!db_desc->gc_victims) {
+			log_fatal("Calloc failed");
+			BUG_ON();
+		}
+		db_desc->gc_victims->now = gc_get_log_clock(db_desc);
+	}
+	struct gc_victim_heap *heap = db_desc->gc_victims;
+
+	/*garbage only grows, so a segment in the heap can only move towards the top*/
+	if (segment->heap_id != GC_NOT_A_VICTIM) {
+		assert(heap->segments[segment->heap_id] == segment);
+		gc_sift_up(heap, segment->heap_id);
+		return;
+	}
+
+	if (heap->num_segments == heap->capacity) {
+		heap->capacity = heap->capacity ? 2 * heap->capacity : 1024;
+		heap->segments = realloc(heap->segments, heap->capacity * sizeof(struct large_log_segment_gc_entry *));
+		if (!heap->segments) {
+			log_fatal("Realloc failed");
+			BUG_ON();
+		}
+	}
+	segment->heap_id = heap->num_segments;
+	heap->segments[heap->num_segments++] = segment;
+	gc_sift_up(heap, segment->heap_id);
+}
+
+/*Ages grow with the log, so the heap is ordered again for the current clock before GC picks its victims*/
+static void gc_order_victims(struct db_descriptor *db_desc)
+{
+	struct gc_victim_heap *heap = db_desc->gc_victims;
+	if (!heap)
+		return;
+
+	heap->now = gc_get_log_clock(db_desc);
+	for (uint32_t i = heap->num_segments / 2; i > 0; --i)
+		gc_sift_down(heap, i - 1);
+}
+
+static struct large_log_segment_gc_entry *gc_pop_victim(struct db_descriptor *db_desc)
+{
+	struct gc_victim_heap *heap = db_desc->gc_victims;
+	if (!heap || !heap->num_segments)
+		return NULL;
+
+	struct large_log_segment_gc_entry *victim = heap->segments[0];
+	gc_swap_victims(heap, 0, --heap->num_segments);
+	gc_sift_down(heap, 0);
+	victim->heap_id = GC_NOT_A_VICTIM;
+	return victim;
+}
+
+void gc_destroy_victims(struct db_descriptor *db_desc)
+{
+	if (!db_desc->gc_victims)
+		return;
+	free(db_desc->gc_victims->segments);
+	free(db_desc->gc_victims);
+	db_desc->gc_victims = NULL;
+}
+
 // read a segment and store it into segment_buf
-static void fetch_segment(struct log_segment *segment_buf, uint64_t segment_offt)
+static void fetch_segment(struct io_limiter *io_limiter, struct log_segment *segment_buf, uint64_t segment_offt)
 {
 	off_t dev_offt = segment_offt;
 	ssize_t bytes_to_read = 0;
 
 	assert(segment_offt % SEGMENT_SIZE == 0);
+	io_limiter_request(io_limiter, SEGMENT_SIZE);
 
 	while (bytes_to_read < SEGMENT_SIZE) {
 		ssize_t bytes =
@@ -158,73 +392,93 @@ static void fetch_segment(struct log_segment *segment_buf, uint64_t segment_offt
 	}
 }
 
+uint32_t gc_pick_victims(struct db_descriptor *db_desc, uint64_t victims[SEGMENTS_TORECLAIM])
+{
+	struct large_log_segment_gc_entry *victim = NULL;
+	struct large_log_segment_gc_entry *tail_segment = NULL;
+	uint32_t num_victims = 0;
+
+	/*the pass takes the segments with the best cost-benefit first*/
+	MUTEX_LOCK(&db_desc->segment_ht_lock);
+	gc_order_victims(db_desc);
+	while (num_victims < SEGMENTS_TORECLAIM && (victim = gc_pop_victim(db_desc))) {
+		/*the tail of the log is still written, it stays a victim for later passes*/
+		if (victim->segment_dev_offt == db_desc->big_log.tail_dev_offt) {
+			tail_segment = victim;
+			continue;
+		}
+		// If we get a segment with 0 garbage bytes it is fatal! The gc thread should only check for segments that contain invalid data.
+		assert(victim->garbage_bytes > 0);
+		assert(!victim->segment_moved);
+
+		/*claimed under the lock, so garbage found later in the segment does not make it a victim again*/
+		victim->segment_moved = 1;
+		victims[num_victims++] = victim->segment_dev_offt;
+	}
+	if (tail_segment)
+		gc_update_victim(db_desc, tail_segment);
+	MUTEX_UNLOCK(&db_desc->segment_ht_lock);
+	return num_victims;
+}
+
 void scan_db(db_descriptor *db_desc, volume_descriptor *volume_desc, stack *marks)
 {
-	struct accum_segments {
-		unsigned *segment_moved;
-		uint64_t segment_dev_offt;
-		unsigned garbage_bytes;
-	};
-	struct accum_segments *segments_toreclaim = calloc(SEGMENTS_TORECLAIM, sizeof(struct accum_segments));
+	uint64_t *segments_toreclaim = calloc(SEGMENTS_TORECLAIM, sizeof(uint64_t));
 	struct db_handle temp_handle = { .db_desc = db_desc, .volume_desc = volume_desc };
 	struct log_segment *segment;
-	uint32_t segment_count = 0;
 
 	if (posix_memalign((void **)&segment, ALIGNMENT_SIZE, SEGMENT_SIZE) != 0) {
 		log_fatal("MEMALIGN FAILED");
 		BUG_ON();
 	}
 
-	log_segment *last_segment = (log_segment *)REAL_ADDRESS(db_desc->big_log.tail_dev_offt);
-	struct large_log_segment_gc_entry *current_segment = NULL, *tmp, *segment_ht = db_desc->segment_ht;
-
-	MUTEX_LOCK(&db_desc->segment_ht_lock);
-	HASH_ITER(hh, segment_ht, current_segment, tmp)
-	{
-		assert(current_segment);
-		if (REAL_ADDRESS(current_segment->segment_dev_offt) != last_segment) {
-			// If we get a segment with 0 garbage bytes it is fatal! The gc thread should only check for segments that contain invalid data.
-			assert(current_segment->garbage_bytes > 0);
-
-			if (!current_segment->segment_moved) {
-				segments_toreclaim[segment_count].segment_dev_offt = current_segment->segment_dev_offt;
-				segments_toreclaim[segment_count].segment_moved = &current_segment->segment_moved;
-				segments_toreclaim[segment_count++].garbage_bytes = current_segment->garbage_bytes;
-			}
-
-			if (segment_count == SEGMENTS_TORECLAIM)
-				break;
-		}
-	}
-	MUTEX_UNLOCK(&db_desc->segment_ht_lock);
+	uint32_t segment_count = gc_pick_victims(db_desc, segments_toreclaim);
 
 	temp_handle.db_desc = db_desc;
+	struct gc_validity_check *check = segment_count ? gc_create_validity_check() : NULL;
 
 	for (uint32_t i = 0; i < segment_count; ++i) {
-		uint64_t segment_dev_offt = segments_toreclaim[i].segment_dev_offt;
+		uint64_t segment_dev_offt = segments_toreclaim[i];
 
-		fetch_segment(segment, segment_dev_offt);
-
-		if (*segments_toreclaim[i].segment_moved)
-			continue;
+		fetch_segment(db_desc->io_limiter, segment, segment_dev_offt);
 
 		struct gc_segment_descriptor gc_segment = { .log_segment_in_memory = segment->data,
 							    .segment_dev_offt = segment_dev_offt };
-		int ret = find_deleted_kv_pairs_in_segment(temp_handle, &gc_segment, marks);
-
-		if (ret)
-			*segments_toreclaim[i].segment_moved = 1;
+		find_deleted_kv_pairs_in_segment(temp_handle, &gc_segment, marks, check);
 	}
 
+	if (check)
+		gc_destroy_validity_check(check);
 	free(segment);
 	free(segments_toreclaim);
 }
 
+struct gc_scan_request {
+	db_descriptor *db_desc;
+	volume_descriptor *volume_desc;
+};
+
+static void gc_scan_db(void *args)
+{
+	struct gc_scan_request *scan_req = (struct gc_scan_request *)args;
+	db_descriptor *db_desc = scan_req->db_desc;
+	stack *marks = calloc(1, sizeof(stack));
+	if (!marks) {
+		log_error("ERROR i could not allocate stack");
+		BUG_ON();
+	}
+
+	scan_db(db_desc, scan_req->volume_desc, marks);
+
+	free(marks);
+	free(scan_req);
+	/*db_close waits for the scan before it frees the DB, the DB is not accessed after this point*/
+	__atomic_store_n(&db_desc->gc_scanning_db, false, __ATOMIC_RELEASE);
+}
+
 void *gc_log_entries(void *hd)
 {
-	struct timespec ts;
 	uint64_t gc_interval;
-	stack *marks;
 	struct db_handle *handle = (struct db_handle *)hd;
 	db_descriptor *db_desc;
 	volume_descriptor *volume_desc = handle->volume_desc;
@@ -233,58 +487,39 @@ void *gc_log_entries(void *hd)
 	if (!gc_active)
 		pthread_exit(NULL);
 
-	marks = calloc(1, sizeof(stack));
-	if (!marks) {
-		log_error("ERROR i could not allocate stack");
-		BUG_ON();
-	}
-
 	pthread_setname_np(pthread_self(), "gcd");
 
 	gc_interval = handle->db_options.options[GC_INTERVAL].value;
 
 	log_debug("Starting garbage collection thread");
 
+	/*the thread only times the GC passes, the scans of the DBs run in the background pool*/
 	while (1) {
-		if (clock_gettime(CLOCK_REALTIME, &ts) == -1) {
-			perror("FATAL: clock_gettime failed)\n");
-			_Exit(-1);
-		}
-		ts.tv_sec += (gc_interval / 1000000L);
-		ts.tv_nsec += (gc_interval % 1000000L) * 1000L;
 		sleep(gc_interval);
 
 		if (volume_desc->state == VOLUME_IS_CLOSING || volume_desc->state == VOLUME_IS_CLOSED) {
 			log_debug("GC thread exiting %s", volume_desc->volume_id);
-			free(marks);
 			pthread_exit(NULL);
 		}
 
-		int init_loop_condition = 1;
-		while (1) {
-			if (init_loop_condition) {
-				MUTEX_LOCK(&init_lock);
-				region = klist_get_first(volume_desc->open_databases);
-				init_loop_condition = 0;
-			} else
-				region = region->next;
-
-			if (!region) {
-				MUTEX_UNLOCK(&init_lock);
-				break;
-			}
-
+		MUTEX_LOCK(&init_lock);
+		for (region = klist_get_first(volume_desc->open_databases); region; region = region->next) {
 			db_desc = (db_descriptor *)region->data;
-			++db_desc->reference_count;
+			/*the scan of the previous pass has not completed yet*/
+			if (db_desc->gc_scanning_db)
+				continue;
+
+			struct gc_scan_request *scan_req = calloc(1, sizeof(struct gc_scan_request));
+			if (!scan_req) {
+				log_fatal("Calloc failed");
+				BUG_ON();
+			}
+			scan_req->db_desc = db_desc;
+			scan_req->volume_desc = volume_desc;
 			db_desc->gc_scanning_db = true;
-			MUTEX_UNLOCK(&init_lock);
-
-			scan_db(db_desc, volume_desc, marks);
-
-			MUTEX_LOCK(&init_lock);
-			--db_desc->reference_count;
-			db_desc->gc_scanning_db = false;
+			bg_pool_submit(gc_scan_db, scan_req, BG_GC_PRIORITY);
 		}
+		MUTEX_UNLOCK(&init_lock);
 	}
 
 	pthread_exit(NULL);
@@ -34,12 +34,68 @@ struct large_log_segment_gc_entry {
 	uint64_t segment_dev_offt;
 	unsigned garbage_bytes;
 	unsigned segment_moved;
+	/*log clock when the segment became the tail of the big log, its age counts from it*/
+	uint32_t append_clock;
+	/*position in the GC victim heap, GC_NOT_A_VICTIM if the segment is not a candidate*/
+	uint32_t heap_id;
 	UT_hash_handle hh;
 } __attribute__((aligned(128)));
 
-#define GC_SEGMENT_THRESHOLD (10 / 100)
-#define SEGMENTS_TORECLAIM 100000
+#define GC_NOT_A_VICTIM UINT32_MAX
+
+/*Segments with enough garbage that GC has not moved yet, a max heap on their cost-benefit*/
+struct gc_victim_heap {
+	struct large_log_segment_gc_entry **segments;
+	uint32_t num_segments;
+	uint32_t capacity;
+	/*log clock the ages of the heap are measured up to, it advances when GC orders the heap*/
+	uint32_t now;
+};
+
+struct db_descriptor;
+
+/*smallest fraction of garbage that makes a segment a GC victim*/
+#define GC_SEGMENT_THRESHOLD (0.1)
+/*most segments a GC pass reclaims, it bounds the I/O of a pass*/
+#define SEGMENTS_TORECLAIM 128
 #define LOG_DATA_OFFSET (SEGMENT_SIZE)
 void *gc_log_entries(void *hd);
 uint8_t is_gc_executed(void);
 void disable_gc(void);
+
+/**
+ * Returns the log clock of GC, the number of segments appended to the big log
+ * of the DB. It measures the age of segments across restarts.
+ */
+uint32_t gc_get_log_clock(struct db_descriptor *db_desc);
+
+/**
+ * Registers a new tail segment of the big log in segment_ht with no garbage,
+ * so that its age is known once it gets garbage.
+ * @param append_clock: the log clock when the segment became the tail
+ */
+void gc_add_log_segment(struct db_descriptor *db_desc, uint64_t segment_dev_offt, uint32_t append_clock);
+
+/**
+ * Adds a segment to the GC victims of the DB once at least
+ * GC_SEGMENT_THRESHOLD of it is garbage, or restores its order after its
+ * garbage grew. Victims are ordered by the LFS cost-benefit
+ * (1 - u) * age / (1 + u), where u is the fraction of live data in the
+ * segment and its age is the log clock since it was appended. The caller
+ * holds the segment_ht_lock of the DB.
+ */
+void gc_update_victim(struct db_descriptor *db_desc, struct large_log_segment_gc_entry *segment);
+
+/**
+ * Takes from the victim heap the segments a GC pass reclaims, at most
+ * SEGMENTS_TORECLAIM with the best cost-benefit first, and marks them moved.
+ * The tail segment of the big log is skipped and stays a victim.
+ * @param victims: the device offsets of the segments taken
+ * @return the number of segments taken
+ */
+uint32_t gc_pick_victims(struct db_descriptor *db_desc, uint64_t victims[SEGMENTS_TORECLAIM]);
+
+/**
+ * Frees the victim heap of the DB, the segment entries belong to segment_ht.
+ */
+void gc_destroy_victims(struct db_descriptor *db_desc);
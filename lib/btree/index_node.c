@@ -15,22 +15,54 @@
 #include "../btree/kv_pairs.h"
 #include "../common/common.h"
 #include <assert.h>
+#include <endian.h>
 #include <log.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define INDEX_GUARD_SIZE 1
-#define INDEX_NODE_SIZE (8192)
+/*Sealing a node with fewer entries (guard included) does not pay off*/
+#define INDEX_MIN_ENTRIES_TO_SEAL 3
+
+/**
+ * Common prefix of all the pivots of a sealed node except the guard. The
+ * prefix bytes live in the key log of the node at offset offt. Size 0 means
+ * the pivots are stored in full.
+ */
+struct index_node_prefix {
+	uint16_t offt;
+	uint16_t size;
+} __attribute__((packed));
+
+/**
+ * Search array of sealed immutable nodes. It keeps the first
+ * INDEX_FIXED_KEY_SIZE bytes of each non guard pivot (after the common prefix)
+ * as a big endian integer in Eytzinger (BFS) order, followed by the slot
+ * array position of each of them. offt is 0 when the node has no search
+ * array. Nodes with reserve set account space for the array on every append.
+ */
+struct index_node_eytzinger {
+	uint16_t offt;
+	uint16_t reserve;
+} __attribute__((packed));
 
 struct index_node {
 	struct node_header header;
-	struct {
-		char rest_space[INDEX_NODE_SIZE - sizeof(struct node_header)];
-	};
+	struct index_node_prefix prefix;
+	struct index_node_eytzinger eytzinger;
+	/*L0 nodes are INDEX_NODE_SIZE, device levels may use larger ones*/
+	uint32_t node_size;
+	char rest_space[];
 } __attribute__((packed));
 
+#define INDEX_FIXED_KEY_SIZE (sizeof(uint64_t))
+#define INDEX_EYTZINGER_ENTRY_SIZE (INDEX_FIXED_KEY_SIZE + sizeof(uint16_t))
+
+#define INDEX_SLOT_ARRAY_OFFT (offsetof(struct index_node, rest_space))
+
 struct node_header *index_node_get_header(struct index_node *node)
 {
 	return &node->header;
@@ -38,8 +70,14 @@ struct node_header *index_node_get_header(struct index_node *node)
 
 uint64_t index_node_get_size(void)
 {
-	_Static_assert(sizeof(struct index_node) == INDEX_NODE_SIZE, "Index node is not page aligned");
-	return sizeof(struct index_node);
+	_Static_assert(INDEX_NODE_SIZE % 4096 == 0, "Index node is not page aligned");
+	_Static_assert(INDEX_NODE_MAX_SIZE - 1 <= UINT16_MAX, "Slot array cannot address the whole node");
+	return INDEX_NODE_SIZE;
+}
+
+uint32_t index_get_node_size(struct index_node *node)
+{
+	return node->node_size;
 }
 
 static struct pivot_pointer *index_get_pivot_pointer(struct pivot_key *key)
@@ -50,7 +88,7 @@ static struct pivot_pointer *index_get_pivot_pointer(struct pivot_key *key)
 static struct index_slot_array_entry *index_get_slot_array(struct index_node *node)
 {
 	char *node_array = (char *)node;
-	return (struct index_slot_array_entry *)&node_array[sizeof(struct node_header)];
+	return (struct index_slot_array_entry *)&node_array[INDEX_SLOT_ARRAY_OFFT];
 }
 
 void index_add_guard(struct index_node *node, uint64_t child_node_dev_offt)
@@ -61,9 +99,9 @@ void index_add_guard(struct index_node *node, uint64_t child_node_dev_offt)
 	struct pivot_pointer *guard_pointer = index_get_pivot_pointer(guard);
 	guard_pointer->child_offt = child_node_dev_offt;
 
-	char *pivot_addr = &((char *)node)[INDEX_NODE_SIZE - PIVOT_SIZE(guard)];
+	char *pivot_addr = &((char *)node)[node->node_size - PIVOT_SIZE(guard)];
 	memcpy(pivot_addr, guard, PIVOT_SIZE(guard));
-	assert(node->header.key_log_size == INDEX_NODE_SIZE);
+	assert(node->header.key_log_size == node->node_size);
 	node->header.key_log_size -= PIVOT_SIZE(guard);
 	node->header.num_entries = 1;
 	struct index_slot_array_entry *slot_array = index_get_slot_array(node);
@@ -76,29 +114,60 @@ bool index_is_empty(const struct index_node *node)
 }
 
 void index_init_node(enum add_guard_option option, struct index_node *node, nodeType_t type)
+{
+	index_init_node_with_size(option, node, type, INDEX_NODE_SIZE);
+}
+
+void index_init_node_with_size(enum add_guard_option option, struct index_node *node, nodeType_t type,
+			       uint32_t node_size)
 {
 	if (option != ADD_GUARD && option != DO_NOT_ADD_GUARD) {
 		log_fatal("Unknown guard option");
 		BUG_ON();
 	}
 
+	if (node_size < INDEX_NODE_SIZE || node_size > INDEX_NODE_MAX_SIZE || node_size % 4096) {
+		log_fatal("Index node size %u must be a multiple of 4 KB in [%u, %u]", node_size, INDEX_NODE_SIZE,
+			  INDEX_NODE_MAX_SIZE);
+		BUG_ON();
+	}
+
 	node->header.type = type;
 	node->header.num_entries = 0;
 
 	node->header.height = -1;
 	node->header.fragmentation = 0;
+	node->prefix.offt = 0;
+	node->prefix.size = 0;
+	node->eytzinger.offt = 0;
+	node->eytzinger.reserve = 0;
 
 	/*private key log for index nodes, these are unnecessary now will be deleted*/
-	node->header.key_log_size = INDEX_NODE_SIZE;
+	node->node_size = node_size;
+	node->header.key_log_size = node_size;
 	if (ADD_GUARD == option)
 		index_add_guard(node, UINT64_MAX);
 }
 
+void index_set_immutable(struct index_node *node)
+{
+	assert(index_is_empty(node));
+	node->eytzinger.reserve = 1;
+}
+
+static uint32_t index_get_entry_overhead(struct index_node *node)
+{
+	return sizeof(struct index_slot_array_entry) + (node->eytzinger.reserve ? INDEX_EYTZINGER_ENTRY_SIZE : 0);
+}
+
 static uint32_t index_get_remaining_space(struct index_node *node)
 {
 	/*Is there enough space?*/
 	uint64_t left_border_dev_offt =
-		sizeof(struct node_header) + (node->header.num_entries * sizeof(struct index_slot_array_entry));
+		INDEX_SLOT_ARRAY_OFFT + (node->header.num_entries * index_get_entry_overhead(node));
+	/*Room to align the search array*/
+	if (node->eytzinger.reserve)
+		left_border_dev_offt += INDEX_FIXED_KEY_SIZE;
 	/*What is the value of the right border if we append the pivot?*/
 	uint64_t right_border_dev_offt = node->header.key_log_size;
 	assert(right_border_dev_offt >= left_border_dev_offt);
@@ -109,19 +178,105 @@ static uint32_t index_get_remaining_space(struct index_node *node)
 static uint32_t index_get_next_pivot_offt_in_node(struct index_node *node, struct pivot_key *key)
 {
 	uint32_t remaining_space = index_get_remaining_space(node);
-	uint32_t size_needed = PIVOT_SIZE(key) + sizeof(struct index_slot_array_entry);
+	uint32_t size_needed = PIVOT_SIZE(key) + index_get_entry_overhead(node);
 	//log_debug("Remaining space %u pivot_size: %lu", remaining_space, PIVOT_SIZE(key));
 	return remaining_space <= size_needed ? 0 : node->header.key_log_size - PIVOT_SIZE(key);
 }
 
 bool index_is_split_needed(struct index_node *node, uint32_t max_pivot_size)
 {
-	max_pivot_size +=
-		sizeof(struct pivot_key) + sizeof(struct pivot_pointer) + sizeof(struct index_slot_array_entry);
+	max_pivot_size += sizeof(struct pivot_key) + sizeof(struct pivot_pointer) + index_get_entry_overhead(node);
 
 	return index_get_remaining_space(node) < max_pivot_size;
 }
 
+static void index_get_lookup_key(char *lookup_key, enum KV_type lookup_key_format, char **key, int32_t *key_size)
+{
+	assert(lookup_key_format != KV_PREFIX);
+	if (lookup_key_format == KV_FORMAT) {
+		struct kv_splice *kv = (struct kv_splice *)lookup_key;
+		*key = get_key_offset_in_kv(kv);
+		*key_size = get_key_size(kv);
+		return;
+	}
+
+	if (lookup_key_format == INDEX_KEY_TYPE) {
+		struct pivot_key *p_key = (struct pivot_key *)lookup_key;
+		*key = get_offset_of_pivot_key(p_key);
+		*key_size = get_pivot_key_size(p_key);
+		return;
+	}
+
+	/* lookup_key is KEY_TYPE*/
+	struct key_splice *k_splice = (struct key_splice *)lookup_key;
+	*key = get_key_splice_key_offset(k_splice);
+	*key_size = k_splice->key_size;
+}
+
+static int index_raw_key_cmp(char *key_a, int32_t key_a_size, char *key_b, int32_t key_b_size)
+{
+	int32_t size = key_a_size <= key_b_size ? key_a_size : key_b_size;
+	int ret = memcmp(key_a, key_b, size);
+	return ret != 0 ? ret : key_a_size - key_b_size;
+}
+
+/**
+ * Compares the common prefix of a sealed node with the lookup key. Returns
+ * a value greater than zero if the prefix is larger than the lookup key (the
+ * key is smaller than every pivot but the guard), smaller than zero if
+ * the lookup key is larger than every pivot, and zero if the lookup key
+ * starts with the prefix.
+ */
+static int index_prefix_cmp(struct index_node *node, char *key, int32_t key_size)
+{
+	char *prefix = &((char *)node)[node->prefix.offt];
+	int32_t size = key_size < node->prefix.size ? key_size : node->prefix.size;
+	int ret = memcmp(prefix, key, size);
+	if (ret != 0)
+		return ret;
+	return key_size < node->prefix.size ? 1 : 0;
+}
+
+static uint64_t index_get_fixed_key(char *key, int32_t key_size)
+{
+	uint64_t fixed_key = 0;
+	int32_t size = key_size < (int32_t)INDEX_FIXED_KEY_SIZE ? key_size : (int32_t)INDEX_FIXED_KEY_SIZE;
+	memcpy(&fixed_key, key, size);
+	return be64toh(fixed_key);
+}
+
+static uint64_t *index_get_eytzinger_keys(struct index_node *node)
+{
+	return (uint64_t *)&((char *)node)[node->eytzinger.offt];
+}
+
+static uint16_t *index_get_eytzinger_positions(struct index_node *node)
+{
+	/*Both arrays have num_entries elements, element 0 is unused*/
+	return (uint16_t *)&index_get_eytzinger_keys(node)[node->header.num_entries];
+}
+
+/**
+ * Branch free lower bound in the Eytzinger array. Returns the slot array
+ * position of the first pivot whose fixed key is greater or equal to
+ * fixed_key, or num_entries if there is none. All pivots before it are
+ * strictly smaller than the lookup key.
+ */
+static int32_t index_eytzinger_lower_bound(struct index_node *node, uint64_t fixed_key)
+{
+	uint64_t *keys = index_get_eytzinger_keys(node);
+	uint32_t num_keys = node->header.num_entries - 1;
+	uint32_t k = 1;
+	while (k <= num_keys) {
+		/*descendants of k four levels down start at 16k*/
+		__builtin_prefetch(&keys[16 * k]);
+		k = 2 * k + (keys[k] < fixed_key);
+	}
+	/*undo the right turns taken after the last left turn*/
+	k >>= __builtin_ffs(~k);
+	return k ? index_get_eytzinger_positions(node)[k] : node->header.num_entries;
+}
+
 /**
  * Returns the position in the node header children offt array which we need to follow based on the lookup_key.
  * The actual offset is at node->children_offt[position]
@@ -131,20 +286,56 @@ static int32_t index_search_get_pos(struct index_node *node, void *lookup_key, e
 {
 	*exact_match = false;
 
+	char *key = NULL;
+	int32_t key_size = 0;
+	index_get_lookup_key(lookup_key, lookup_key_format, &key, &key_size);
+
 	int comparison_return_value = 0;
 	int32_t start = 0;
 	int32_t end = node->header.num_entries - 1;
 
-	int32_t middle = 0;
+	if (node->prefix.size) {
+		/*Sealed node, pivots after the guard store only their suffix*/
+		int ret = index_prefix_cmp(node, key, key_size);
+		if (ret > 0)
+			return 0;
+		if (ret < 0)
+			return end;
+		key += node->prefix.size;
+		key_size -= node->prefix.size;
+		start = 1;
+	}
+
 	struct index_slot_array_entry *slot_array = index_get_slot_array(node);
 
+	if (node->eytzinger.offt) {
+		/*Fixed keys may tie, resolve ties with the full suffixes*/
+		int32_t position = index_eytzinger_lower_bound(node, index_get_fixed_key(key, key_size));
+		int32_t found = position - 1;
+		for (; position <= end; ++position) {
+			struct pivot_key *p_key =
+				(struct pivot_key *)INDEX_PIVOT_ADDRESS(node, slot_array[position].pivot);
+			comparison_return_value = index_raw_key_cmp(p_key->data, p_key->size, key, key_size);
+			if (comparison_return_value > 0)
+				break;
+			found = position;
+			if (0 == comparison_return_value) {
+				*exact_match = true;
+				break;
+			}
+		}
+		return found;
+	}
+
+	int32_t middle = 0;
+
 	while (start <= end) {
 		middle = (start + end) / 2;
 
 		struct pivot_key *p_key = (struct pivot_key *)INDEX_PIVOT_ADDRESS(node, slot_array[middle].pivot);
 
 		/*At zero position we have a guard or -oo*/
-		comparison_return_value = index_key_cmp(p_key, (char *)lookup_key, lookup_key_format);
+		comparison_return_value = index_raw_key_cmp(p_key->data, p_key->size, key, key_size);
 		if (0 == comparison_return_value) {
 			*exact_match = true;
 			return middle;
@@ -183,6 +374,7 @@ struct pivot_key *index_remove_last_pivot_key(struct index_node *node)
 		return NULL;
 	if (0 == node->header.num_entries)
 		return NULL;
+	assert(0 == node->prefix.size && 0 == node->eytzinger.offt);
 	int32_t position = node->header.num_entries - 1;
 	struct index_slot_array_entry *slot_array = index_get_slot_array(node);
 	struct pivot_key *pivot = (struct pivot_key *)INDEX_PIVOT_ADDRESS(node, slot_array[position].pivot);
@@ -224,6 +416,7 @@ static bool index_internal_insert_pivot(struct insert_pivot_req *ins_pivot_req,
 
 	if (!pivot_offt_in_node)
 		return false;
+	assert(0 == ins_pivot_req->node->prefix.size && 0 == ins_pivot_req->node->eytzinger.offt);
 	int32_t position = ins_pivot_req->node->header.num_entries - 1;
 
 	struct index_slot_array_entry *slot_array = index_get_slot_array(ins_pivot_req->node);
@@ -342,6 +535,18 @@ struct pivot_key *index_iterator_get_pivot_key(struct index_node_iterator *itera
 	return iterator->key;
 }
 
+void index_get_pivot_key_copy(struct index_node *node, int32_t position, struct pivot_key *pivot_buf)
+{
+	assert(position >= 0 && position < node->header.num_entries);
+	struct index_slot_array_entry *slot_array = index_get_slot_array(node);
+	struct pivot_key *pivot = (struct pivot_key *)INDEX_PIVOT_ADDRESS(node, slot_array[position].pivot);
+	/*The guard is kept as is*/
+	int32_t prefix_size = 0 == position ? 0 : node->prefix.size;
+	memcpy(pivot_buf->data, &((char *)node)[node->prefix.offt], prefix_size);
+	memcpy(&pivot_buf->data[prefix_size], pivot->data, pivot->size);
+	pivot_buf->size = prefix_size + pivot->size;
+}
+
 void index_split_node(struct index_node_split_request *request, struct index_node_split_reply *reply)
 {
 	// struct bt_rebalance_result result = { 0 };
@@ -411,30 +616,122 @@ void index_split_node(struct index_node_split_request *request, struct index_nod
 
 int index_key_cmp(struct pivot_key *index_key, char *lookup_key, enum KV_type lookup_key_format)
 {
-	assert(lookup_key_format != KV_PREFIX);
-	int32_t size = 0;
-	int ret = 0;
+	char *key = NULL;
+	int32_t key_size = 0;
+	index_get_lookup_key(lookup_key, lookup_key_format, &key, &key_size);
+	return index_raw_key_cmp(get_offset_of_pivot_key(index_key), get_pivot_key_size(index_key), key, key_size);
+}
 
-	if (lookup_key_format == KV_FORMAT) {
-		struct kv_splice *key = (struct kv_splice *)lookup_key;
-		size = index_key->size <= get_key_size(key) ? index_key->size : get_key_size(key);
-		ret = memcmp(get_offset_of_pivot_key(index_key), get_key_offset_in_kv(key), size);
-		return ret != 0 ? ret : index_key->size - get_key_size(key);
+void index_fill_shortest_separator(struct pivot_key *pivot, char *left_key, int32_t left_key_size, char *right_key,
+				   int32_t right_key_size)
+{
+	int32_t size = left_key_size < right_key_size ? left_key_size : right_key_size;
+	int32_t pos = 0;
+	while (pos < size && left_key[pos] == right_key[pos])
+		++pos;
+
+	/*The keys differ at pos or left_key is a prefix of right_key, either way right_key[0..pos] separates them*/
+	if (pos >= right_key_size) {
+		log_fatal("Right key %.*s is not greater than left key %.*s", right_key_size, right_key, left_key_size,
+			  left_key);
+		BUG_ON();
 	}
+	set_pivot_key_size(pivot, pos + 1);
+	set_pivot_key(pivot, right_key, pos + 1);
+}
 
-	if (lookup_key_format == INDEX_KEY_TYPE) {
-		/* this should only(!) happend when we are inserting and new key into an index node (after a split) */
-		struct pivot_key *p_key = (struct pivot_key *)(lookup_key);
-		size = index_key->size <= p_key->size ? index_key->size : p_key->size;
-		ret = memcmp(get_offset_of_pivot_key(index_key), get_offset_of_pivot_key(p_key), size);
-		return ret != 0 ? ret : index_key->size - p_key->size;
+static void index_compress_prefix(struct index_node *node)
+{
+	if (node->header.num_entries < INDEX_MIN_ENTRIES_TO_SEAL)
+		return;
+
+	struct index_node *old_node = malloc(node->node_size);
+	if (!old_node) {
+		log_fatal("Malloc failed");
+		BUG_ON();
+	}
+	memcpy(old_node, node, node->node_size);
+	struct index_slot_array_entry *old_slot_array = index_get_slot_array(old_node);
+
+	/*Pivots are sorted so the common prefix of the first and the last non guard pivot is common to all*/
+	struct pivot_key *first = (struct pivot_key *)INDEX_PIVOT_ADDRESS(old_node, old_slot_array[1].pivot);
+	struct pivot_key *last = (struct pivot_key *)INDEX_PIVOT_ADDRESS(
+		old_node, old_slot_array[old_node->header.num_entries - 1].pivot);
+	int32_t size = first->size < last->size ? first->size : last->size;
+	int32_t prefix_size = 0;
+	while (prefix_size < size && first->data[prefix_size] == last->data[prefix_size])
+		++prefix_size;
+
+	if (0 == prefix_size) {
+		free(old_node);
+		return;
 	}
 
-	/* lookup_key is KEY_TYPE*/
-	struct key_splice *p_key = (struct key_splice *)(lookup_key);
-	size = index_key->size <= p_key->key_size ? index_key->size : p_key->key_size;
-	ret = memcmp(get_offset_of_pivot_key(index_key), get_key_splice_key_offset(p_key), size);
-	return ret != 0 ? ret : index_key->size - p_key->key_size;
+	struct index_slot_array_entry *slot_array = index_get_slot_array(node);
+	node->header.key_log_size = node->node_size - prefix_size;
+	node->prefix.offt = node->header.key_log_size;
+	node->prefix.size = prefix_size;
+	memcpy(&((char *)node)[node->prefix.offt], first->data, prefix_size);
+
+	for (int32_t i = 0; i < old_node->header.num_entries; ++i) {
+		struct pivot_key *pivot = (struct pivot_key *)INDEX_PIVOT_ADDRESS(old_node, old_slot_array[i].pivot);
+		/*The guard is kept as is*/
+		int32_t skip = 0 == i ? 0 : prefix_size;
+		node->header.key_log_size -= PIVOT_SIZE(pivot) - skip;
+		struct pivot_key *suffix = (struct pivot_key *)INDEX_PIVOT_ADDRESS(node, node->header.key_log_size);
+		suffix->size = pivot->size - skip;
+		memcpy(suffix->data, &pivot->data[skip], suffix->size);
+		*index_get_pivot_pointer(suffix) = *index_get_pivot_pointer(pivot);
+		slot_array[i].pivot = node->header.key_log_size;
+	}
+	free(old_node);
+}
+
+/**
+ * In order traversal of the implicit tree rooted at k that assigns the sorted
+ * pivots (slot positions 1..num_entries - 1) to their Eytzinger positions.
+ */
+static int32_t index_fill_eytzinger(struct index_node *node, uint32_t k, int32_t position)
+{
+	if (k >= (uint32_t)node->header.num_entries)
+		return position;
+
+	position = index_fill_eytzinger(node, 2 * k, position);
+
+	struct index_slot_array_entry *slot_array = index_get_slot_array(node);
+	struct pivot_key *pivot = (struct pivot_key *)INDEX_PIVOT_ADDRESS(node, slot_array[position].pivot);
+	index_get_eytzinger_keys(node)[k] = index_get_fixed_key(pivot->data, pivot->size);
+	index_get_eytzinger_positions(node)[k] = position;
+
+	return index_fill_eytzinger(node, 2 * k + 1, position + 1);
+}
+
+static void index_build_eytzinger(struct index_node *node)
+{
+	if (!node->eytzinger.reserve || node->header.num_entries < 2)
+		return;
+
+	uint32_t search_array_offt =
+		INDEX_SLOT_ARRAY_OFFT + node->header.num_entries * sizeof(struct index_slot_array_entry);
+	search_array_offt = (search_array_offt + INDEX_FIXED_KEY_SIZE - 1) & ~(INDEX_FIXED_KEY_SIZE - 1);
+	if (search_array_offt + node->header.num_entries * INDEX_EYTZINGER_ENTRY_SIZE > node->header.key_log_size) {
+		log_fatal("No room for the search array although it has been reserved");
+		BUG_ON();
+	}
+
+	node->eytzinger.offt = search_array_offt;
+	index_get_eytzinger_keys(node)[0] = 0;
+	index_get_eytzinger_positions(node)[0] = 0;
+	index_fill_eytzinger(node, 1, 1);
+}
+
+void index_seal_node(struct index_node *node)
+{
+	if (node->prefix.size || node->eytzinger.offt)
+		return;
+
+	index_compress_prefix(node);
+	index_build_eytzinger(node);
 }
 
 int32_t get_pivot_key_size(struct pivot_key *pivot)
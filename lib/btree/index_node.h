@@ -20,6 +20,10 @@
 #include <stdint.h>
 
 #define SMALLEST_POSSIBLE_PIVOT_SIZE 16
+/*Size of L0 index nodes and the smallest size of device level index nodes*/
+#define INDEX_NODE_SIZE (8192)
+/*Pivot offsets in the slot array are 16 bits*/
+#define INDEX_NODE_MAX_SIZE (64 * 1024)
 
 struct index_node;
 
@@ -78,6 +82,14 @@ enum add_guard_option { INVALID_GUARD_STATE = 0, ADD_GUARD, DO_NOT_ADD_GUARD };
 */
 void index_init_node(enum add_guard_option option, struct index_node *node, nodeType_t type);
 
+/**
+ * Same as index_init_node for nodes of node_size bytes instead of
+ * INDEX_NODE_SIZE. Device levels use it for their per level index node size.
+ * @param node_size: multiple of 4 KB in [INDEX_NODE_SIZE, INDEX_NODE_MAX_SIZE]
+ */
+void index_init_node_with_size(enum add_guard_option option, struct index_node *node, nodeType_t type,
+			       uint32_t node_size);
+
 /**
   * Sets the height of the node
   * @param node
@@ -163,6 +175,38 @@ struct pivot_key *index_remove_last_pivot_key(struct index_node *node);
  */
 uint64_t index_binary_search(struct index_node *node, void *lookup_key, enum KV_type lookup_key_format);
 
+/**
+ * Marks a freshly initialized node as immutable, meaning that it is built
+ * once through index_append_pivot and then sealed, as compaction does for
+ * device levels. Appends to such nodes reserve room for the search array
+ * that index_seal_node builds. L0 nodes keep the mutable layout.
+ * @param node: the empty node
+ */
+void index_set_immutable(struct index_node *node);
+
+/**
+ * Seals an append-only index node that will not be modified again, e.g. a
+ * full device level index node built by compaction. Sealing factors out the
+ * common prefix of all the pivots except the guard and stores it once in the
+ * node. For immutable nodes it also builds an Eytzinger ordered array of
+ * fixed size pivot prefixes which lookups search without branches, falling
+ * back to the full pivots only to break ties. Sealed nodes are searched
+ * transparently but they do not accept new pivots.
+ * @param node: the node to seal
+ */
+void index_seal_node(struct index_node *node);
+
+/**
+ * Fills pivot with the shortest key that is greater than left_key and smaller
+ * or equal to right_key. Compaction uses it to build pivots out of the last
+ * key of a leaf and the first key of the next one.
+ * @param pivot: buffer of at least sizeof(struct pivot_key) + right_key_size bytes
+ * @param left_key: the largest key of the left child
+ * @param right_key: the smallest key of the right child
+ */
+void index_fill_shortest_separator(struct pivot_key *pivot, char *left_key, int32_t left_key_size, char *right_key,
+				   int32_t right_key_size);
+
 /**
  * Splits an index node into two child index nodes.
  */
@@ -198,7 +242,9 @@ void fill_smallest_possible_pivot(char *buffer, int size);
 uint8_t index_iterator_is_valid(struct index_node_iterator *iterator);
 
 /**
-  * returns the pivot key of where the index iterator is pointing;
+  * returns the pivot key of where the index iterator is pointing. For sealed
+  * nodes the pivot keys after the guard contain only the part following the
+  * common prefix of the node.
   * @param iterator: an iteration pointing to an index node
   */
 struct pivot_key *index_iterator_get_pivot_key(struct index_node_iterator *iterator);
@@ -209,6 +255,16 @@ struct pivot_key *index_iterator_get_pivot_key(struct index_node_iterator *itera
   */
 struct pivot_pointer *index_iterator_get_pivot_pointer(struct index_node_iterator *iterator);
 
+/**
+  * Copies the pivot key at a slot array position of the node in full to
+  * pivot_buf, restoring the common prefix of sealed nodes. pivot_buf must fit
+  * sizeof(struct pivot_key) + MAX_KEY_SIZE bytes.
+  * @param node: an index node
+  * @param position: slot array position, 0 is the guard
+  * @param pivot_buf: where the pivot key is copied
+  */
+void index_get_pivot_key_copy(struct index_node *node, int32_t position, struct pivot_key *pivot_buf);
+
 /**
   * Compares a look up key following the lookup key format with an index key (pivot key)
   * @param index_key: the index key to be compared
@@ -248,10 +304,16 @@ void set_pivot_key(struct pivot_key *pivot, void *key, int32_t key_size);
   */
 struct node_header *index_node_get_header(struct index_node *node);
 /**
-  * returns the sizeof(struct index_node)
+  * returns the size of L0 index nodes (INDEX_NODE_SIZE)
   */
 uint64_t index_node_get_size(void);
 
+/**
+  * returns the size of a given index node as set by its initialization
+  * @param node: an index_node
+  */
+uint32_t index_get_node_size(struct index_node *node);
+
 #define PIVOT_KEY_SIZE(X) ((X) ? (X)->size + sizeof(*X) : BUG_ON_UINT32T())
 #define PIVOT_SIZE(X) (PIVOT_KEY_SIZE(X) + sizeof(struct pivot_pointer))
 #define INDEX_PIVOT_ADDRESS(X, Y) ((uint64_t)(X) + (Y))
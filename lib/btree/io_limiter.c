@@ -0,0 +1,161 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#define _GNU_SOURCE
+#include "io_limiter.h"
+#include "../common/common.h"
+#include "conf.h"
+#include <log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*Values of linux/ioprio.h, glibc does not wrap ioprio_set*/
+#define IO_LIMITER_IOPRIO_WHO_PROCESS 1
+#define IO_LIMITER_IOPRIO_CLASS_BE 2
+#define IO_LIMITER_IOPRIO_CLASS_SHIFT 13
+#define IO_LIMITER_IOPRIO_LOWEST_LEVEL 7
+
+uint64_t io_limiter_get_usec(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+		log_fatal("clock_gettime failed");
+		perror("Reason");
+		BUG_ON();
+	}
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+struct io_limiter *io_limiter_create(uint64_t rate, uint64_t target_latency_usec)
+{
+	struct io_limiter *limiter = calloc(1, sizeof(struct io_limiter));
+	if (!limiter) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	MUTEX_INIT(&limiter->lock, NULL);
+	limiter->rate = rate;
+	limiter->max_rate = rate;
+	limiter->target_latency_usec = target_latency_usec;
+	limiter->refill_usec = io_limiter_get_usec();
+	limiter->period_start_usec = limiter->refill_usec;
+	return limiter;
+}
+
+void io_limiter_destroy(struct io_limiter *limiter)
+{
+	pthread_mutex_destroy(&limiter->lock);
+	free(limiter);
+}
+
+void io_limiter_set_rate(struct io_limiter *limiter, uint64_t rate)
+{
+	MUTEX_LOCK(&limiter->lock);
+	limiter->rate = rate;
+	limiter->max_rate = rate;
+	limiter->tokens = 0;
+	limiter->refill_usec = io_limiter_get_usec();
+	MUTEX_UNLOCK(&limiter->lock);
+}
+
+uint64_t io_limiter_get_rate(struct io_limiter *limiter)
+{
+	MUTEX_LOCK(&limiter->lock);
+	uint64_t rate = limiter->rate;
+	MUTEX_UNLOCK(&limiter->lock);
+	return rate;
+}
+
+/**
+ * Retunes the rate once a tuning period ends. Slow gets cut the rate by a
+ * quarter of what background I/O achieved in the period, fast ones raise it by
+ * an eighth. Caller holds the lock.
+ */
+static void io_limiter_tune(struct io_limiter *limiter, uint64_t now)
+{
+	uint64_t period_usec = now - limiter->period_start_usec;
+	if (period_usec < IO_LIMITER_TUNE_USEC)
+		return;
+	uint64_t samples = __sync_lock_test_and_set(&limiter->latency_samples, 0);
+	uint64_t latency_sum = __sync_lock_test_and_set(&limiter->latency_sum_usec, 0);
+	uint64_t period_rate = limiter->period_bytes * 1000000UL / period_usec;
+	limiter->period_bytes = 0;
+	limiter->period_start_usec = now;
+	if (0 == limiter->target_latency_usec || 0 == samples)
+		return;
+
+	if (latency_sum / samples > limiter->target_latency_usec) {
+		/*gets are slow for reasons other than background I/O*/
+		if (0 == period_rate)
+			return;
+		uint64_t rate = limiter->rate && limiter->rate < period_rate ? limiter->rate : period_rate;
+		rate -= rate / 4;
+		limiter->rate = rate < IO_LIMITER_MIN_RATE ? IO_LIMITER_MIN_RATE : rate;
+		return;
+	}
+
+	if (0 == limiter->rate)
+		return;
+	uint64_t rate = limiter->rate + limiter->rate / 8;
+	if (limiter->max_rate && rate >= limiter->max_rate)
+		rate = limiter->max_rate;
+	/*an unbounded limiter stops pacing once background I/O asks for much less than its rate*/
+	else if (0 == limiter->max_rate && rate > 2 * period_rate)
+		rate = 0;
+	limiter->rate = rate;
+}
+
+void io_limiter_request(struct io_limiter *limiter, uint64_t bytes)
+{
+	MUTEX_LOCK(&limiter->lock);
+	uint64_t now = io_limiter_get_usec();
+	io_limiter_tune(limiter, now);
+	limiter->period_bytes += bytes;
+	if (0 == limiter->rate) {
+		limiter->tokens = 0;
+		limiter->refill_usec = now;
+		MUTEX_UNLOCK(&limiter->lock);
+		return;
+	}
+
+	int64_t burst = limiter->rate * IO_LIMITER_BURST_USEC / 1000000UL;
+	double refill = (double)(now - limiter->refill_usec) * limiter->rate / 1000000UL;
+	limiter->tokens = refill >= (double)(burst - limiter->tokens) ? burst : limiter->tokens + (int64_t)refill;
+	limiter->refill_usec = now;
+	limiter->tokens -= bytes;
+	uint64_t sleep_usec = limiter->tokens < 0 ? (uint64_t)-limiter->tokens * 1000000UL / limiter->rate : 0;
+	MUTEX_UNLOCK(&limiter->lock);
+
+	if (sleep_usec)
+		usleep(sleep_usec);
+}
+
+void io_limiter_report_latency(struct io_limiter *limiter, uint64_t latency_usec)
+{
+	if (0 == limiter->target_latency_usec)
+		return;
+	__sync_fetch_and_add(&limiter->latency_sum_usec, latency_usec);
+	__sync_fetch_and_add(&limiter->latency_samples, 1);
+}
+
+void io_limiter_set_background_priority(void)
+{
+	int ioprio = IO_LIMITER_IOPRIO_CLASS_BE << IO_LIMITER_IOPRIO_CLASS_SHIFT | IO_LIMITER_IOPRIO_LOWEST_LEVEL;
+	/*with who 0 the priority applies to the calling thread*/
+	if (syscall(SYS_ioprio_set, IO_LIMITER_IOPRIO_WHO_PROCESS, 0, ioprio) == -1)
+		log_warn("Failed to lower the I/O priority of a background thread");
+}
@@ -0,0 +1,90 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef IO_LIMITER_H
+#define IO_LIMITER_H
+#include <pthread.h>
+#include <stdint.h>
+
+/*Tokens the bucket saves up while background I/O is idle, in usec of the rate*/
+#define IO_LIMITER_BURST_USEC 100000UL
+/*Period over which the limiter averages the latency of gets before it retunes its rate*/
+#define IO_LIMITER_TUNE_USEC 200000UL
+/*Auto tuning never paces background I/O below this rate, compactions must keep up with L0*/
+#define IO_LIMITER_MIN_RATE (4UL * 1024 * 1024)
+
+/**
+ * Token bucket that paces the background I/O of a DB, the reads and writes of
+ * its compactions and of the GC, to a byte rate. A request larger than the
+ * tokens left borrows them and sleeps until the bucket pays them back, so the
+ * rate holds whatever the size of the requests.
+ *
+ * With a target latency the limiter also tunes its rate from the latency of
+ * the foreground gets. It paces background I/O harder while gets take longer
+ * than the target on average and relaxes back to the configured rate
+ * otherwise.
+ */
+struct io_limiter {
+	pthread_mutex_t lock;
+	/*current rate in bytes per second, 0 leaves background I/O unpaced*/
+	uint64_t rate;
+	/*rate set by the user, auto tuning stays at or below it and 0 means unbounded*/
+	uint64_t max_rate;
+	/*negative while requests sleep for tokens they borrowed*/
+	int64_t tokens;
+	uint64_t refill_usec;
+	/*average get latency auto tuning aims for, 0 disables it*/
+	uint64_t target_latency_usec;
+	/*gets and background bytes of the current tuning period*/
+	uint64_t latency_sum_usec;
+	uint64_t latency_samples;
+	uint64_t period_bytes;
+	uint64_t period_start_usec;
+};
+
+/**
+ * Creates a limiter that paces background I/O to rate bytes per second, 0 for
+ * no pacing. A non zero target_latency_usec turns on auto tuning.
+ */
+struct io_limiter *io_limiter_create(uint64_t rate, uint64_t target_latency_usec);
+void io_limiter_destroy(struct io_limiter *limiter);
+
+/**
+ * Sets the rate of the limiter at runtime and makes it the bound of auto
+ * tuning, 0 removes pacing until auto tuning throttles background I/O again.
+ */
+void io_limiter_set_rate(struct io_limiter *limiter, uint64_t rate);
+
+/*Returns the current rate of the limiter, it differs from the set one under auto tuning*/
+uint64_t io_limiter_get_rate(struct io_limiter *limiter);
+
+/**
+ * Called by background threads before they read or write bytes of the device.
+ * Sleeps as long as the rate of the limiter requires.
+ */
+void io_limiter_request(struct io_limiter *limiter, uint64_t bytes);
+
+/*Adds the latency of a foreground get to the current tuning period*/
+void io_limiter_report_latency(struct io_limiter *limiter, uint64_t latency_usec);
+
+/*Monotonic clock in usec that latencies reported to the limiter are measured with*/
+uint64_t io_limiter_get_usec(void);
+
+/**
+ * Moves the calling thread to the lowest priority of the best effort I/O
+ * class, so that the I/O scheduler serves foreground requests first. Threads
+ * the caller starts afterwards inherit it.
+ */
+void io_limiter_set_background_priority(void);
+
+#endif
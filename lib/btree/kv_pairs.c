@@ -1,7 +1,12 @@
 #include "kv_pairs.h"
+#include <assert.h>
 #include <string.h>
 
 #define DELETE_MARKER_ID (INT32_MAX)
+/*range deletes carry the key splices of both ends of the range as their key*/
+#define RANGE_DELETE_MARKER_ID (INT32_MAX - 1)
+/*tombstones of par_single_delete, they cancel out with the put they delete*/
+#define SINGLE_DELETE_MARKER_ID (INT32_MAX - 2)
 
 inline int32_t get_key_size(struct kv_splice *kv_pair)
 {
@@ -15,7 +20,8 @@ inline int32_t get_key_size_with_metadata(struct kv_splice *kv_pair)
 
 inline int32_t get_value_size(struct kv_splice *kv_pair)
 {
-	return is_tombstone_kv_pair(kv_pair) ? 0 : kv_pair->value_size;
+	/*tombstones and range deletes have no value*/
+	return kv_pair->value_size >= SINGLE_DELETE_MARKER_ID ? 0 : kv_pair->value_size;
 }
 
 // cppcheck-suppress unusedFunction
@@ -53,7 +59,7 @@ inline void set_value_size(struct kv_splice *kv_pair, int32_t value_size)
 
 inline void set_value(struct kv_splice *kv_pair, char *value, int32_t value_size)
 {
-	if (is_tombstone_kv_pair(kv_pair))
+	if (is_tombstone_kv_pair(kv_pair) || is_range_delete_kv_pair(kv_pair))
 		return;
 	kv_pair->value_size = value_size;
 	memcpy(get_value_offset_in_kv(kv_pair, kv_pair->key_size), value, value_size);
@@ -91,7 +97,7 @@ inline int32_t get_kv_seperated_splice_size(void)
 
 inline bool is_tombstone_kv_pair(struct kv_splice *kv_pair)
 {
-	return DELETE_MARKER_ID == kv_pair->value_size;
+	return DELETE_MARKER_ID == kv_pair->value_size || SINGLE_DELETE_MARKER_ID == kv_pair->value_size;
 }
 
 inline void set_non_tombstone(struct kv_splice *kv_pair)
@@ -104,6 +110,51 @@ inline void set_tombstone(struct kv_splice *kv_pair)
 	kv_pair->value_size = DELETE_MARKER_ID;
 }
 
+inline bool is_single_delete_kv_pair(struct kv_splice *kv_pair)
+{
+	return SINGLE_DELETE_MARKER_ID == kv_pair->value_size;
+}
+
+inline void set_single_delete(struct kv_splice *kv_pair)
+{
+	kv_pair->value_size = SINGLE_DELETE_MARKER_ID;
+}
+
+inline bool is_range_delete_kv_pair(struct kv_splice *kv_pair)
+{
+	return RANGE_DELETE_MARKER_ID == kv_pair->value_size;
+}
+
+inline void set_range_delete(struct kv_splice *kv_pair)
+{
+	kv_pair->value_size = RANGE_DELETE_MARKER_ID;
+}
+
+inline uint64_t get_value_expiry(const char *value, int32_t value_size)
+{
+	uint64_t expiry = 0;
+	if (value_size >= KV_EXPIRY_SIZE)
+		memcpy(&expiry, &value[value_size - KV_EXPIRY_SIZE], KV_EXPIRY_SIZE);
+	return expiry;
+}
+
+inline void set_value_expiry(char *value, int32_t value_size, uint64_t expiry)
+{
+	assert(value_size >= KV_EXPIRY_SIZE);
+	memcpy(&value[value_size - KV_EXPIRY_SIZE], &expiry, KV_EXPIRY_SIZE);
+}
+
+inline bool is_value_expired(const char *value, int32_t value_size, uint64_t now)
+{
+	uint64_t expiry = get_value_expiry(value, value_size);
+	return expiry && expiry <= now;
+}
+
+inline int32_t get_value_size_without_expiry(int32_t value_size)
+{
+	return value_size >= KV_EXPIRY_SIZE ? value_size - KV_EXPIRY_SIZE : value_size;
+}
+
 inline int32_t get_key_splice_key_size(struct key_splice *key)
 {
 	return key->key_size;
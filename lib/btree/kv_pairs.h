@@ -15,6 +15,8 @@ struct kv_splice {
 struct kv_seperation_splice {
 	char prefix[PREFIX_SIZE];
 	uint64_t dev_offt;
+	/*size of the KV in the log, garbage accounting reads it instead of the log*/
+	uint32_t kv_size;
 } __attribute__((packed));
 
 // This struct defines the key abstraction of the system and it's irrelevant from splice format
@@ -115,7 +117,7 @@ int32_t get_kv_seperated_kv_size(struct kv_seperation_splice *kv_pair);
 int32_t get_kv_seperated_splice_size(void);
 
 /**
-  * Examines a KV pair to see if it is a delete marker
+  * Examines a KV pair to see if it is a delete marker, single deletes included
   */
 bool is_tombstone_kv_pair(struct kv_splice *kv_pair);
 
@@ -123,6 +125,47 @@ void set_tombstone(struct kv_splice *kv_pair);
 
 void set_non_tombstone(struct kv_splice *kv_pair);
 
+/**
+  * Examines a KV pair to see if it is the delete marker of a single delete.
+  * Compactions drop it together with the put it deletes.
+  */
+bool is_single_delete_kv_pair(struct kv_splice *kv_pair);
+
+void set_single_delete(struct kv_splice *kv_pair);
+
+/**
+  * Examines a KV pair of the log to see if it is a range delete. Range deletes
+  * have no value, their key holds the key splices of the start and the end of
+  * the range.
+  */
+bool is_range_delete_kv_pair(struct kv_splice *kv_pair);
+
+void set_range_delete(struct kv_splice *kv_pair);
+
+/*In TTL mode values end with the time in seconds since the epoch their KV expires at, 0 never expires*/
+#define KV_EXPIRY_SIZE ((int32_t)sizeof(uint64_t))
+
+/**
+  * Returns the expiry time a value of a TTL mode DB ends with, 0 for values
+  * too short to carry one.
+  */
+uint64_t get_value_expiry(const char *value, int32_t value_size);
+
+/**
+  * Stores the expiry time in the last KV_EXPIRY_SIZE bytes of a value.
+  */
+void set_value_expiry(char *value, int32_t value_size, uint64_t expiry);
+
+/**
+  * Examines the expiry time of a value of a TTL mode DB to see if it has passed at now.
+  */
+bool is_value_expired(const char *value, int32_t value_size, uint64_t now);
+
+/**
+  * Returns the size of a value of a TTL mode DB without its expiry time.
+  */
+int32_t get_value_size_without_expiry(int32_t value_size);
+
 int32_t get_key_splice_key_size(struct key_splice *key);
 char *get_key_splice_key_offset(struct key_splice *key);
 
@@ -0,0 +1,193 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "leaf_cache.h"
+#include "../common/common.h"
+#include "btree.h"
+#include "conf.h"
+#include "dynamic_leaf.h"
+#include <assert.h>
+#include <log.h>
+#include <stdlib.h>
+#include <uthash.h>
+
+/*the decompressed leaf follows its entry*/
+static struct bt_dynamic_leaf_node *lc_get_leaf(struct leaf_cache_entry *entry)
+{
+	return (struct bt_dynamic_leaf_node *)&entry[1];
+}
+
+static struct leaf_cache_entry *lc_get_entry(struct bt_dynamic_leaf_node *leaf)
+{
+	return &((struct leaf_cache_entry *)leaf)[-1];
+}
+
+static void lc_lru_remove(struct leaf_cache *cache, struct leaf_cache_entry *entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		cache->lru_head = entry->next;
+
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		cache->lru_tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+}
+
+static void lc_lru_push_front(struct leaf_cache *cache, struct leaf_cache_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->prev = entry;
+	cache->lru_head = entry;
+	if (!cache->lru_tail)
+		cache->lru_tail = entry;
+}
+
+static void lc_evict(struct leaf_cache *cache)
+{
+	while (cache->size > cache->capacity && cache->lru_tail) {
+		struct leaf_cache_entry *victim = cache->lru_tail;
+		lc_lru_remove(cache, victim);
+		HASH_DEL(cache->entries, victim);
+		cache->size -= victim->leaf_size;
+		free(victim);
+	}
+}
+
+/*Takes a pin on a cached leaf, pinned leaves leave the LRU list. Caller holds the lock*/
+static struct leaf_cache_entry *lc_find_and_pin(struct leaf_cache *cache, const struct bt_compressed_leaf_node *node)
+{
+	struct leaf_cache_entry *entry = NULL;
+	HASH_FIND_PTR(cache->entries, &node, entry);
+	if (!entry)
+		return NULL;
+
+	if (0 == entry->pin_count++)
+		lc_lru_remove(cache, entry);
+	return entry;
+}
+
+struct leaf_cache *leaf_cache_create(uint64_t capacity)
+{
+	struct leaf_cache *cache = calloc(1, sizeof(struct leaf_cache));
+	if (!cache) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	MUTEX_INIT(&cache->lock, NULL);
+	cache->capacity = capacity;
+	log_info("Leaf cache of %lu MB", capacity / (1024 * 1024UL));
+	return cache;
+}
+
+void leaf_cache_destroy(struct leaf_cache *cache)
+{
+	log_info("Leaf cache hits %lu misses %lu", cache->hits, cache->misses);
+	struct leaf_cache_entry *entry = NULL;
+	struct leaf_cache_entry *tmp = NULL;
+	HASH_ITER(hh, cache->entries, entry, tmp)
+	{
+		assert(0 == entry->pin_count);
+		HASH_DEL(cache->entries, entry);
+		free(entry);
+	}
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+struct bt_dynamic_leaf_node *leaf_cache_get(struct leaf_cache *cache, const struct bt_compressed_leaf_node *node,
+					    uint8_t level_id, uint32_t leaf_size)
+{
+	MUTEX_LOCK(&cache->lock);
+	struct leaf_cache_entry *entry = lc_find_and_pin(cache, node);
+	if (entry)
+		++cache->hits;
+	MUTEX_UNLOCK(&cache->lock);
+	if (entry)
+		return lc_get_leaf(entry);
+
+	/*decompress without holding the lock, a concurrent reader may cache the leaf first*/
+	struct leaf_cache_entry *new_entry = calloc(1, sizeof(struct leaf_cache_entry) + leaf_size);
+	if (!new_entry) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	new_entry->node = node;
+	new_entry->leaf_size = leaf_size;
+	new_entry->pin_count = 1;
+	new_entry->level_id = level_id;
+	decompress_dynamic_leaf(node, lc_get_leaf(new_entry), leaf_size);
+
+	MUTEX_LOCK(&cache->lock);
+	entry = lc_find_and_pin(cache, node);
+	if (entry) {
+		++cache->hits;
+		MUTEX_UNLOCK(&cache->lock);
+		free(new_entry);
+		return lc_get_leaf(entry);
+	}
+	HASH_ADD_PTR(cache->entries, node, new_entry);
+	cache->size += leaf_size;
+	++cache->misses;
+	lc_evict(cache);
+	MUTEX_UNLOCK(&cache->lock);
+	return lc_get_leaf(new_entry);
+}
+
+void leaf_cache_put(struct leaf_cache *cache, struct bt_dynamic_leaf_node *leaf)
+{
+	struct leaf_cache_entry *entry = lc_get_entry(leaf);
+	MUTEX_LOCK(&cache->lock);
+	assert(entry->pin_count > 0);
+	if (--entry->pin_count) {
+		MUTEX_UNLOCK(&cache->lock);
+		return;
+	}
+
+	if (entry->invalid) {
+		MUTEX_UNLOCK(&cache->lock);
+		free(entry);
+		return;
+	}
+
+	lc_lru_push_front(cache, entry);
+	lc_evict(cache);
+	MUTEX_UNLOCK(&cache->lock);
+}
+
+void leaf_cache_invalidate(struct leaf_cache *cache, uint8_t level_id)
+{
+	struct leaf_cache_entry *entry = NULL;
+	struct leaf_cache_entry *tmp = NULL;
+	MUTEX_LOCK(&cache->lock);
+	HASH_ITER(hh, cache->entries, entry, tmp)
+	{
+		if (entry->level_id != level_id)
+			continue;
+		HASH_DEL(cache->entries, entry);
+		cache->size -= entry->leaf_size;
+		if (entry->pin_count) {
+			entry->invalid = 1;
+			continue;
+		}
+		lc_lru_remove(cache, entry);
+		free(entry);
+	}
+	MUTEX_UNLOCK(&cache->lock);
+}
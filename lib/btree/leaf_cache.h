@@ -0,0 +1,72 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef LEAF_CACHE_H
+#define LEAF_CACHE_H
+#include <pthread.h>
+#include <stdint.h>
+#include <uthash.h>
+struct bt_compressed_leaf_node;
+struct bt_dynamic_leaf_node;
+
+struct leaf_cache_entry {
+	/*key, the address of the compressed leaf in the device mapping*/
+	const struct bt_compressed_leaf_node *node;
+	struct leaf_cache_entry *prev;
+	struct leaf_cache_entry *next;
+	uint32_t leaf_size;
+	uint32_t pin_count;
+	uint8_t level_id;
+	/*dropped from the cache while pinned, the last leaf_cache_put frees it*/
+	uint8_t invalid;
+	UT_hash_handle hh;
+};
+
+/*LRU cache of decompressed leaves, pinned leaves stay out of the LRU list and are never evicted*/
+struct leaf_cache {
+	pthread_mutex_t lock;
+	struct leaf_cache_entry *entries;
+	/*most recently used unpinned leaf*/
+	struct leaf_cache_entry *lru_head;
+	struct leaf_cache_entry *lru_tail;
+	uint64_t size;
+	uint64_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/**
+ * Creates a cache that keeps up to capacity bytes of decompressed leaves. A
+ * zero capacity cache still decompresses leaves for its readers but frees
+ * them as soon as they are released.
+ */
+struct leaf_cache *leaf_cache_create(uint64_t capacity);
+void leaf_cache_destroy(struct leaf_cache *cache);
+
+/**
+ * Returns the decompressed leaf of a compressed leaf node, decompressing it on
+ * a miss. The leaf is pinned and must be released with leaf_cache_put.
+ */
+struct bt_dynamic_leaf_node *leaf_cache_get(struct leaf_cache *cache, const struct bt_compressed_leaf_node *node,
+					    uint8_t level_id, uint32_t leaf_size);
+void leaf_cache_put(struct leaf_cache *cache, struct bt_dynamic_leaf_node *leaf);
+
+/**
+ * Drops the leaves of a level, called when compactions free its segments or
+ * move them to the next level. Leaves pinned at the time are freed when
+ * released.
+ */
+void leaf_cache_invalidate(struct leaf_cache *cache, uint8_t level_id);
+
+#endif
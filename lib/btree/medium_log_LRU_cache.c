@@ -12,225 +12,310 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#define _GNU_SOURCE
 #include "medium_log_LRU_cache.h"
+#include "../allocator/volume_manager.h"
 #include "../common/common.h"
+#include "bg_pool.h"
 #include "conf.h"
+#include "io_limiter.h"
 #include "parallax/structures.h"
 #include <assert.h>
 #include <log.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <uthash.h>
 
-struct chunk_list *create_list(void)
+/*chunks extend past their end to hold the KVs that cross it*/
+#define LRU_CHUNK_SIZE (LOG_CHUNK_SIZE + KB(4))
+/*chunks start at a device block like the segment headers some of them begin with*/
+#define LRU_CHUNK_ALIGNMENT DEVICE_BLOCK_SIZE
+
+_Static_assert(sizeof(struct chunk_LRU_entry) <= LRU_CHUNK_ALIGNMENT, "The entry must fit before its aligned chunk");
+
+static char *LRU_get_chunk(struct chunk_LRU_entry *entry)
 {
-	struct chunk_list *new_list = (struct chunk_list *)calloc(1, sizeof(struct chunk_list));
+	return (char *)entry + LRU_CHUNK_ALIGNMENT;
+}
 
-	return new_list;
+static struct chunk_LRU_entry *LRU_get_entry(char *chunk_buf)
+{
+	return (struct chunk_LRU_entry *)(chunk_buf - LRU_CHUNK_ALIGNMENT);
 }
 
-//add to tail
-void add_to_list(struct chunk_list *list, char *chunk_buf, uint64_t chunk_offt)
+static void LRU_list_remove(struct chunk_LRU_cache *chunk_cache, struct chunk_LRU_entry *entry)
 {
-	assert(list != NULL);
-	struct chunk_listnode *new_node = (struct chunk_listnode *)calloc(1, sizeof(struct chunk_listnode));
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		chunk_cache->lru_head = entry->next;
 
-	if (!new_node) {
-		log_fatal("Error calloc did not allocate memory!");
-		BUG_ON();
-	}
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		chunk_cache->lru_tail = entry->prev;
+
+	entry->prev = entry->next = NULL;
+}
 
-	new_node->chunk_buf = chunk_buf;
-	new_node->chunk_offt = chunk_offt;
+static void LRU_list_push_front(struct chunk_LRU_cache *chunk_cache, struct chunk_LRU_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = chunk_cache->lru_head;
+	if (chunk_cache->lru_head)
+		chunk_cache->lru_head->prev = entry;
+	chunk_cache->lru_head = entry;
+	if (!chunk_cache->lru_tail)
+		chunk_cache->lru_tail = entry;
+}
 
-	if (list->size != 0) {
-		list->tail->next = new_node;
-		list->tail = list->tail->next;
-	} else {
-		list->head = new_node;
-		list->tail = new_node;
+static void LRU_evict(struct chunk_LRU_cache *chunk_cache)
+{
+	while (chunk_cache->size > chunk_cache->capacity && chunk_cache->lru_tail) {
+		struct chunk_LRU_entry *victim = chunk_cache->lru_tail;
+		LRU_list_remove(chunk_cache, victim);
+		HASH_DEL(chunk_cache->chunks_hash_table, victim);
+		chunk_cache->size -= LRU_CHUNK_SIZE;
+		free(victim);
 	}
+}
 
-	++list->size;
+/*Takes a pin on a cached chunk, pinned chunks leave the LRU list. Caller holds the lock*/
+static struct chunk_LRU_entry *LRU_find_and_pin(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt)
+{
+	struct chunk_LRU_entry *entry = NULL;
+	HASH_FIND(hh, chunk_cache->chunks_hash_table, &chunk_offt, sizeof(uint64_t), entry);
+	if (!entry)
+		return NULL;
+
+	if (0 == entry->pin_count++)
+		LRU_list_remove(chunk_cache, entry);
+	return entry;
 }
 
-//remove from head
-void remove_from_list(struct chunk_list *list)
+static void LRU_unpin(struct chunk_LRU_cache *chunk_cache, struct chunk_LRU_entry *entry)
 {
-	assert(list != NULL);
-	assert(list->head != NULL);
+	assert(entry->pin_count > 0);
+	if (--entry->pin_count)
+		return;
+
+	if (entry->invalid) {
+		free(entry);
+		return;
+	}
 
-	struct chunk_listnode *pfront = list->head;
-	list->head = list->head->next;
-	--list->size;
-	free(pfront);
+	LRU_list_push_front(chunk_cache, entry);
+	LRU_evict(chunk_cache);
 }
 
-//move node at the end of the list
-void move_node_to_tail(struct chunk_list *list, const struct chunk_listnode *node)
+/*Adds a pinned chunk that is not read yet. Caller holds the lock*/
+static struct chunk_LRU_entry *LRU_add_chunk(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt)
 {
-	assert(list != NULL);
-	assert(node != NULL);
+	struct chunk_LRU_entry *entry = NULL;
+	if (posix_memalign((void **)&entry, LRU_CHUNK_ALIGNMENT, LRU_CHUNK_ALIGNMENT + LRU_CHUNK_SIZE) != 0) {
+		log_fatal("MEMALIGN FAILED");
+		BUG_ON();
+	}
+	memset(entry, 0x00, sizeof(struct chunk_LRU_entry));
+	entry->chunk_offt = chunk_offt;
+	entry->pin_count = 1;
+	entry->state = CHUNK_QUEUED;
+	HASH_ADD(hh, chunk_cache->chunks_hash_table, chunk_offt, sizeof(uint64_t), entry);
+	chunk_cache->size += LRU_CHUNK_SIZE;
+	LRU_evict(chunk_cache);
+	return entry;
+}
 
-	struct chunk_listnode *pfront, *pback;
-	pback = NULL;
+/*Reads a chunk that the caller moved to CHUNK_LOADING, without holding the lock*/
+static void LRU_read_chunk(struct chunk_LRU_cache *chunk_cache, struct chunk_LRU_entry *entry)
+{
+	struct db_descriptor *db_desc = chunk_cache->db_desc;
+	char *chunk_buf = LRU_get_chunk(entry);
+	ssize_t bytes_read = 0;
+
+	io_limiter_request(db_desc->io_limiter, LRU_CHUNK_SIZE);
+	while (bytes_read < (ssize_t)LRU_CHUNK_SIZE) {
+		ssize_t bytes = pread(db_desc->db_volume->vol_fd, &chunk_buf[bytes_read], LRU_CHUNK_SIZE - bytes_read,
+				      entry->chunk_offt + bytes_read);
+		if (bytes == -1) {
+			log_fatal("Failed to read medium log chunk at %lu", entry->chunk_offt);
+			perror("Error");
+			BUG_ON();
+		}
+		bytes_read += bytes;
+	}
 
-	for (pfront = list->head; pfront != node; pback = pfront, pfront = pfront->next)
-		;
+	uint64_t segment_offt = entry->chunk_offt - (entry->chunk_offt % SEGMENT_SIZE);
+	struct segment_header *segment = 0 == entry->chunk_offt % SEGMENT_SIZE ?
+						 (struct segment_header *)chunk_buf :
+						 (struct segment_header *)REAL_ADDRESS(segment_offt);
+	entry->segment_id = segment->segment_id;
+	entry->in_log_tail = segment_offt == db_desc->medium_log.tail_dev_offt;
+}
 
-	if (pback == NULL) {
-		if (list->size != 1) {
-			list->head = list->head->next;
-			pfront->next = NULL;
-			list->tail->next = pfront;
-			list->tail = list->tail->next;
+/*Reads the queued chunks, readers never wait for the job while it is queued*/
+static void LRU_prefetch_job(void *args)
+{
+	struct chunk_LRU_cache *chunk_cache = (struct chunk_LRU_cache *)args;
+	MUTEX_LOCK(&chunk_cache->lock);
+	while (!chunk_cache->stop && chunk_cache->num_queued) {
+		struct chunk_LRU_entry *entry = chunk_cache->prefetch_queue[0];
+		--chunk_cache->num_queued;
+		memmove(&chunk_cache->prefetch_queue[0], &chunk_cache->prefetch_queue[1],
+			chunk_cache->num_queued * sizeof(struct chunk_LRU_entry *));
+
+		/*a reader that needed the chunk first reads it itself*/
+		if (CHUNK_QUEUED == entry->state) {
+			entry->state = CHUNK_LOADING;
+			MUTEX_UNLOCK(&chunk_cache->lock);
+			LRU_read_chunk(chunk_cache, entry);
+			MUTEX_LOCK(&chunk_cache->lock);
+			entry->state = CHUNK_READY;
+			++chunk_cache->prefetches;
+			pthread_cond_broadcast(&chunk_cache->cond);
 		}
+		LRU_unpin(chunk_cache, entry);
+	}
+	chunk_cache->prefetch_job_pending = 0;
+	pthread_cond_broadcast(&chunk_cache->cond);
+	MUTEX_UNLOCK(&chunk_cache->lock);
+}
 
+/**
+ * Queues the chunks that follow chunk_offt in its segment when the chunks are
+ * accessed in log order. The next segment of the log is not adjacent to the
+ * current one so read ahead stops at the segment end. Caller holds the lock.
+ */
+static void LRU_prefetch_next_chunks(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt)
+{
+	if (chunk_offt == chunk_cache->last_chunk_offt)
+		return;
+	bool sequential = chunk_offt == chunk_cache->last_chunk_offt + LOG_CHUNK_SIZE;
+	chunk_cache->last_chunk_offt = chunk_offt;
+	if (!sequential)
 		return;
-	}
 
-	//corner case the found node is already tail
-	if (pfront == list->tail)
+	for (uint64_t i = 1; i <= LRU_PREFETCH_CHUNKS && chunk_cache->num_queued < LRU_PREFETCH_CHUNKS; ++i) {
+		uint64_t next_chunk_offt = chunk_offt + i * LOG_CHUNK_SIZE;
+		if (0 == next_chunk_offt % SEGMENT_SIZE)
+			break;
+		struct chunk_LRU_entry *entry = NULL;
+		HASH_FIND(hh, chunk_cache->chunks_hash_table, &next_chunk_offt, sizeof(uint64_t), entry);
+		if (entry)
+			continue;
+		/*the queue holds the pin of the chunk*/
+		chunk_cache->prefetch_queue[chunk_cache->num_queued++] = LRU_add_chunk(chunk_cache, next_chunk_offt);
+	}
+	if (0 == chunk_cache->num_queued || chunk_cache->prefetch_job_pending)
 		return;
 
-	//internal node in list
-	pback->next = pfront->next;
-	pfront->next = NULL;
-	list->tail->next = pfront;
-	list->tail = pfront;
+	chunk_cache->prefetch_job_pending = 1;
+	bg_pool_submit(LRU_prefetch_job, chunk_cache, BG_COMPACTION_PRIORITY);
 }
 
 struct chunk_LRU_cache *init_LRU(struct db_handle *handle)
 {
-	uint64_t chunk_size = KB(256);
 	uint64_t LRU_cache_size = handle->db_options.options[MEDIUM_LOG_LRU_CACHE_SIZE].value;
 
-	log_info("Init LRU with %lu chunks", LRU_cache_size / chunk_size);
+	log_info("Init LRU with %lu chunks", LRU_cache_size / LRU_CHUNK_SIZE);
 	struct chunk_LRU_cache *new_LRU = (struct chunk_LRU_cache *)calloc(1, sizeof(struct chunk_LRU_cache));
 	if (new_LRU == NULL) {
 		log_info("Calloc returned NULL, not enough memory, exiting...");
 		BUG_ON();
 	}
-
-	new_LRU->chunks_hash_table = (struct chunk_hash_entry **)calloc(1, sizeof(struct chunk_hash_entry *));
-	if (new_LRU->chunks_hash_table == NULL) {
-		log_info("Calloc returned NULL, not enough memory, exiting...");
-		BUG_ON();
-	}
-
-	*(new_LRU->chunks_hash_table) = NULL; /* needed by uthash api */
-	new_LRU->hash_table_capacity = LRU_cache_size / chunk_size;
-	new_LRU->chunks_list = create_list();
-
+	MUTEX_INIT(&new_LRU->lock, NULL);
+	pthread_cond_init(&new_LRU->cond, NULL);
+	new_LRU->db_desc = handle->db_desc;
+	new_LRU->chunks_hash_table = NULL; /* needed by uthash api */
+	new_LRU->capacity = LRU_cache_size;
 	return new_LRU;
 }
 
-void add_to_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt, char *chunk_buf)
+void destroy_LRU(struct chunk_LRU_cache *chunk_cache)
 {
 	assert(chunk_cache != NULL);
-	assert(chunk_cache->chunks_list != NULL);
 
-	//remove oldest chunk (head of list) from LRU
-	if (chunk_cache->hash_table_count == chunk_cache->hash_table_capacity) {
-		struct chunk_hash_entry *oldest_used_chunk = NULL;
-
-		HASH_FIND(hh, *(chunk_cache->chunks_hash_table), &chunk_cache->chunks_list->head->chunk_offt,
-			  sizeof(uint64_t), oldest_used_chunk);
-
-		if (!oldest_used_chunk)
-			BUG_ON();
-
-#if defined(__GNUC__) && !defined(__clang__)
-#pragma GCC diagnostic ignored "-Wnull-dereference"
-#endif
-
-		HASH_DEL(*(chunk_cache->chunks_hash_table), oldest_used_chunk);
-
-#if defined(__GNUC__) && !defined(__clang__)
-#pragma GCC diagnostic pop
-#endif
-		remove_from_list(chunk_cache->chunks_list);
-		--chunk_cache->hash_table_count;
-	}
-
-	//always adds on tail,as it is the newest chunk
-	add_to_list(chunk_cache->chunks_list, chunk_buf, chunk_offt);
-
-	struct chunk_hash_entry *new_entry;
-	new_entry = (struct chunk_hash_entry *)calloc(1, sizeof(struct chunk_hash_entry));
-
-	if (!new_entry) {
-		log_fatal("Error calloc did not allocate memory!");
-		BUG_ON();
+	MUTEX_LOCK(&chunk_cache->lock);
+	chunk_cache->stop = 1;
+	while (chunk_cache->prefetch_job_pending)
+		pthread_cond_wait(&chunk_cache->cond, &chunk_cache->lock);
+	MUTEX_UNLOCK(&chunk_cache->lock);
+	for (uint32_t i = 0; i < chunk_cache->num_queued; ++i)
+		LRU_unpin(chunk_cache, chunk_cache->prefetch_queue[i]);
+
+	log_info("Medium log LRU hits %lu misses %lu prefetches %lu", chunk_cache->hits, chunk_cache->misses,
+		 chunk_cache->prefetches);
+	struct chunk_LRU_entry *entry = NULL;
+	struct chunk_LRU_entry *tmp = NULL;
+	HASH_ITER(hh, chunk_cache->chunks_hash_table, entry, tmp)
+	{
+		assert(0 == entry->pin_count);
+		HASH_DEL(chunk_cache->chunks_hash_table, entry);
+		free(entry);
 	}
-
-	new_entry->chunk_offt = chunk_offt;
-	new_entry->chunk_ptr = chunk_cache->chunks_list->tail;
-	HASH_ADD(hh, *(chunk_cache->chunks_hash_table), chunk_offt, sizeof(uint64_t), new_entry);
-
-	assert(new_entry->chunk_ptr->chunk_offt == chunk_offt);
-
-	++chunk_cache->hash_table_count;
-	//log_info("hash chunks %lu list nodes %d", LRU_cache->hash_table_count, LRU_cache->chunks_list->size);
-}
-
-int chunk_exists_in_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt)
-{
-	assert(chunk_cache != NULL);
-	struct chunk_hash_entry *chunk;
-
-	HASH_FIND(hh, *(chunk_cache->chunks_hash_table), &chunk_offt, sizeof(uint64_t), chunk);
-
-	return chunk != NULL;
+	pthread_cond_destroy(&chunk_cache->cond);
+	pthread_mutex_destroy(&chunk_cache->lock);
+	free(chunk_cache);
 }
 
 char *get_chunk_from_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt)
 {
 	assert(chunk_cache != NULL);
-	struct chunk_hash_entry *chunk = NULL;
-	HASH_FIND(hh, *(chunk_cache->chunks_hash_table), &chunk_offt, sizeof(uint64_t), chunk);
-
-	if (!chunk)
-		return BUG_ON();
+	MUTEX_LOCK(&chunk_cache->lock);
+	struct chunk_LRU_entry *entry = LRU_find_and_pin(chunk_cache, chunk_offt);
+	if (entry)
+		++chunk_cache->hits;
+	else {
+		entry = LRU_add_chunk(chunk_cache, chunk_offt);
+		++chunk_cache->misses;
+	}
+	LRU_prefetch_next_chunks(chunk_cache, chunk_offt);
+
+	/*read a chunk still waiting in the prefetch queue here*/
+	if (CHUNK_QUEUED == entry->state) {
+		entry->state = CHUNK_LOADING;
+		MUTEX_UNLOCK(&chunk_cache->lock);
+		LRU_read_chunk(chunk_cache, entry);
+		MUTEX_LOCK(&chunk_cache->lock);
+		entry->state = CHUNK_READY;
+		pthread_cond_broadcast(&chunk_cache->cond);
+	}
+	while (CHUNK_READY != entry->state)
+		pthread_cond_wait(&chunk_cache->cond, &chunk_cache->lock);
+	MUTEX_UNLOCK(&chunk_cache->lock);
 
-	move_node_to_tail(chunk_cache->chunks_list, chunk->chunk_ptr);
-	assert(chunk->chunk_ptr->chunk_offt == chunk_offt);
-	return chunk->chunk_ptr->chunk_buf;
+	assert(entry->chunk_offt == chunk_offt);
+	return LRU_get_chunk(entry);
 }
 
-static void free_LRU_hashtable(struct chunk_hash_entry **hash_table)
+void put_chunk_to_LRU(struct chunk_LRU_cache *chunk_cache, char *chunk_buf)
 {
-	struct chunk_hash_entry *current_entry, *tmp;
-
-	HASH_ITER(hh, *(hash_table), current_entry, tmp)
-	{
-		HASH_DEL(*(hash_table), current_entry);
-		free(current_entry);
-	}
-	free(hash_table);
+	MUTEX_LOCK(&chunk_cache->lock);
+	LRU_unpin(chunk_cache, LRU_get_entry(chunk_buf));
+	MUTEX_UNLOCK(&chunk_cache->lock);
 }
 
-static void free_LRU_list(struct chunk_list *list)
+void invalidate_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t max_segment_id)
 {
-	assert(list != NULL);
-	struct chunk_listnode *pfront, *pback;
-
-	pfront = list->head;
-	pback = NULL;
-	while (pfront != NULL) {
-		pback = pfront;
-		pfront = pfront->next;
-		free(pback);
+	struct chunk_LRU_entry *entry = NULL;
+	struct chunk_LRU_entry *tmp = NULL;
+	MUTEX_LOCK(&chunk_cache->lock);
+	HASH_ITER(hh, chunk_cache->chunks_hash_table, entry, tmp)
+	{
+		/*chunks in flight are dropped too, they may belong to trimmed segments*/
+		if (CHUNK_READY == entry->state && !entry->in_log_tail && entry->segment_id >= max_segment_id)
+			continue;
+		HASH_DEL(chunk_cache->chunks_hash_table, entry);
+		chunk_cache->size -= LRU_CHUNK_SIZE;
+		if (entry->pin_count) {
+			entry->invalid = 1;
+			continue;
+		}
+		LRU_list_remove(chunk_cache, entry);
+		free(entry);
 	}
-}
-
-void destroy_LRU(struct chunk_LRU_cache *chunk_cache)
-{
-	assert(chunk_cache != NULL);
-
-	log_info("Compaction done! Destroying the LRU for medium log to in place");
-	free_LRU_hashtable(chunk_cache->chunks_hash_table);
-	free_LRU_list(chunk_cache->chunks_list);
-	free(chunk_cache->chunks_list);
-	free(chunk_cache);
+	MUTEX_UNLOCK(&chunk_cache->lock);
 }
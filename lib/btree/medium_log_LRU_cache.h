@@ -15,40 +15,79 @@
 #ifndef MEDIUM_LOG_CACHE_H
 #define MEDIUM_LOG_CACHE_H
 #include "btree.h"
+#include <pthread.h>
 #include <stdint.h>
 #include <uthash.h>
-struct chunk_list {
-	struct chunk_listnode *head;
-	struct chunk_listnode *tail;
-	uint32_t size;
-};
+/*chunks following a sequentially accessed one that the cache reads ahead*/
+#define LRU_PREFETCH_CHUNKS 2
 
-struct chunk_listnode {
-	struct chunk_listnode *next;
-	char *chunk_buf;
-	uint64_t chunk_offt;
-};
+enum chunk_state { CHUNK_QUEUED = 0, CHUNK_LOADING, CHUNK_READY };
 
-struct chunk_hash_entry {
+/*the chunk follows its entry, a device block after it*/
+struct chunk_LRU_entry {
 	uint64_t chunk_offt; /* key */
-	struct chunk_listnode *chunk_ptr; /* pointer to list node */
+	struct chunk_LRU_entry *prev;
+	struct chunk_LRU_entry *next;
+	uint64_t segment_id;
+	/*readers holding the chunk and the prefetch queue, pinned chunks are not in the LRU list*/
+	uint32_t pin_count;
+	enum chunk_state state;
+	/*read while its segment was the tail of the medium log, the bytes past the KVs may still change*/
+	uint8_t in_log_tail;
+	/*dropped from the cache while pinned, the last put frees it*/
+	uint8_t invalid;
 	UT_hash_handle hh;
 };
 
-//LRU consists of a hashtable and a list. The hash table has pointers to the assosiated list nodes
-//the chunk informations are stored in the list nodes
-//chunk offsets serve as keys in the hash function
+/**
+ * Byte budgeted LRU cache of the medium log chunks that compactions transfer
+ * in place. The cache of a DB lives as long as the DB, so the chunks of the
+ * segments a transfer leaves in the medium log serve the next transfers too.
+ * When chunks are accessed in log order the following chunks of the segment
+ * are read ahead by a prefetch job in the background pool.
+ */
 struct chunk_LRU_cache {
-	struct chunk_hash_entry **chunks_hash_table;
-	struct chunk_list *chunks_list;
-	uint64_t hash_table_count;
-	uint64_t hash_table_capacity;
+	pthread_mutex_t lock;
+	/*signals the readers waiting for a chunk in flight and the end of the prefetch job*/
+	pthread_cond_t cond;
+	struct db_descriptor *db_desc;
+	struct chunk_LRU_entry *chunks_hash_table;
+	/*most recently used unpinned chunk*/
+	struct chunk_LRU_entry *lru_head;
+	struct chunk_LRU_entry *lru_tail;
+	struct chunk_LRU_entry *prefetch_queue[LRU_PREFETCH_CHUNKS];
+	uint32_t num_queued;
+	uint64_t last_chunk_offt;
+	uint64_t size;
+	uint64_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t prefetches;
+	/*a prefetch job is queued or runs, it reads the queued chunks and ends once there are none*/
+	uint8_t prefetch_job_pending;
+	uint8_t stop;
 };
 
+/**
+ * Creates the medium log chunk cache of a DB with a budget of
+ * MEDIUM_LOG_LRU_CACHE_SIZE bytes.
+ */
 struct chunk_LRU_cache *init_LRU(db_handle *handle);
-void add_to_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt, char *chunk_buf);
-int chunk_exists_in_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt);
-char *get_chunk_from_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt);
 void destroy_LRU(struct chunk_LRU_cache *chunk_cache);
 
+/**
+ * Returns the chunk of the medium log at chunk_offt, reading it on a miss.
+ * The chunk is pinned and must be released with put_chunk_to_LRU.
+ */
+char *get_chunk_from_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t chunk_offt);
+void put_chunk_to_LRU(struct chunk_LRU_cache *chunk_cache, char *chunk_buf);
+
+/**
+ * Drops the chunks that a transfer to in place leaves stale. Trimming frees
+ * the medium log segments before the last segment the transfer touched and
+ * the chunks of the log tail may have grown since they were read.
+ * @param max_segment_id: id of the last medium log segment the transfer touched
+ */
+void invalidate_LRU(struct chunk_LRU_cache *chunk_cache, uint64_t max_segment_id);
+
 #endif
@@ -0,0 +1,227 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "range_tombstone.h"
+#include "../common/common.h"
+#include "conf.h"
+#include <log.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANGE_TOMBSTONES_MAGIC 0x52414e47U
+
+struct rt_serialized_list {
+	uint32_t magic;
+	uint32_t num_tombstones;
+};
+
+static char *rt_get_start(const struct range_tombstone *tombstone)
+{
+	return (char *)tombstone->keys;
+}
+
+static char *rt_get_end(const struct range_tombstone *tombstone)
+{
+	return (char *)&tombstone->keys[tombstone->start_size];
+}
+
+static uint32_t rt_get_size(const struct range_tombstone *tombstone)
+{
+	return sizeof(struct range_tombstone) + tombstone->start_size + tombstone->end_size;
+}
+
+int rt_key_cmp(const char *key1, uint32_t key1_size, const char *key2, uint32_t key2_size)
+{
+	int ret = memcmp(key1, key2, key1_size < key2_size ? key1_size : key2_size);
+	if (ret)
+		return ret;
+	return key1_size < key2_size ? -1 : key1_size > key2_size;
+}
+
+static struct range_tombstone *rt_new_tombstone(const char *start, uint32_t start_size, const char *end,
+						uint32_t end_size)
+{
+	struct range_tombstone *tombstone = malloc(sizeof(struct range_tombstone) + start_size + end_size);
+	if (!tombstone) {
+		log_fatal("Malloc failed");
+		BUG_ON();
+	}
+	tombstone->start_size = start_size;
+	tombstone->end_size = end_size;
+	memcpy(rt_get_start(tombstone), start, start_size);
+	memcpy(rt_get_end(tombstone), end, end_size);
+	return tombstone;
+}
+
+struct range_tombstones *rt_create(void)
+{
+	struct range_tombstones *rts = calloc(1, sizeof(struct range_tombstones));
+	if (!rts) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	return rts;
+}
+
+void rt_destroy(struct range_tombstones *rts)
+{
+	if (!rts)
+		return;
+	for (uint32_t i = 0; i < rts->num_tombstones; ++i)
+		free(rts->tombstones[i]);
+	free(rts->tombstones);
+	free(rts);
+}
+
+void rt_add(struct range_tombstones *rts, const char *start, uint32_t start_size, const char *end,
+	    uint32_t end_size)
+{
+	/*the ranges in [first, last) overlap or touch the new one and are replaced by their union*/
+	uint32_t first = 0;
+	while (first < rts->num_tombstones) {
+		struct range_tombstone *tombstone = rts->tombstones[first];
+		if (rt_key_cmp(rt_get_end(tombstone), tombstone->end_size, start, start_size) >= 0)
+			break;
+		++first;
+	}
+	uint32_t last = first;
+	while (last < rts->num_tombstones) {
+		struct range_tombstone *tombstone = rts->tombstones[last];
+		if (rt_key_cmp(rt_get_start(tombstone), tombstone->start_size, end, end_size) > 0)
+			break;
+		++last;
+	}
+
+	if (first < last) {
+		struct range_tombstone *first_tombstone = rts->tombstones[first];
+		struct range_tombstone *last_tombstone = rts->tombstones[last - 1];
+		if (rt_key_cmp(rt_get_start(first_tombstone), first_tombstone->start_size, start, start_size) < 0) {
+			start = rt_get_start(first_tombstone);
+			start_size = first_tombstone->start_size;
+		}
+		if (rt_key_cmp(rt_get_end(last_tombstone), last_tombstone->end_size, end, end_size) > 0) {
+			end = rt_get_end(last_tombstone);
+			end_size = last_tombstone->end_size;
+		}
+	}
+	/*the union may point into the ranges it replaces*/
+	struct range_tombstone *tombstone = rt_new_tombstone(start, start_size, end, end_size);
+	for (uint32_t i = first; i < last; ++i)
+		free(rts->tombstones[i]);
+
+	if (first == last && rts->num_tombstones == rts->capacity) {
+		rts->capacity = rts->capacity ? 2 * rts->capacity : 4;
+		rts->tombstones = realloc(rts->tombstones, rts->capacity * sizeof(struct range_tombstone *));
+		if (!rts->tombstones) {
+			log_fatal("Realloc failed");
+			BUG_ON();
+		}
+	}
+	uint32_t num_after = rts->num_tombstones - last;
+	memmove(&rts->tombstones[first + 1], &rts->tombstones[last], num_after * sizeof(struct range_tombstone *));
+	rts->tombstones[first] = tombstone;
+	rts->num_tombstones = first + 1 + num_after;
+}
+
+void rt_add_all(struct range_tombstones *dst, const struct range_tombstones *src)
+{
+	for (uint32_t i = 0; src && i < src->num_tombstones; ++i) {
+		struct range_tombstone *tombstone = src->tombstones[i];
+		rt_add(dst, rt_get_start(tombstone), tombstone->start_size, rt_get_end(tombstone),
+		       tombstone->end_size);
+	}
+}
+
+bool rt_covers(const struct range_tombstones *rts, const char *key, uint32_t key_size)
+{
+	if (!rts || 0 == rts->num_tombstones)
+		return false;
+
+	/*find the last range that starts at or before key*/
+	int64_t low = 0;
+	int64_t high = (int64_t)rts->num_tombstones - 1;
+	int64_t candidate = -1;
+	while (low <= high) {
+		int64_t middle = (low + high) / 2;
+		struct range_tombstone *tombstone = rts->tombstones[middle];
+		if (rt_key_cmp(rt_get_start(tombstone), tombstone->start_size, key, key_size) <= 0) {
+			candidate = middle;
+			low = middle + 1;
+		} else
+			high = middle - 1;
+	}
+	if (candidate < 0)
+		return false;
+	struct range_tombstone *tombstone = rts->tombstones[candidate];
+	return rt_key_cmp(key, key_size, rt_get_end(tombstone), tombstone->end_size) < 0;
+}
+
+bool rt_is_deleted(const struct rt_ranked_list *lists, uint32_t num_lists, uint32_t rank, const char *key,
+		   uint32_t key_size)
+{
+	for (uint32_t i = 0; i < num_lists; ++i) {
+		if (lists[i].rank > rank && rt_covers(lists[i].list, key, key_size))
+			return true;
+	}
+	return false;
+}
+
+uint32_t rt_get_tree_rank(uint8_t active_tree, uint8_t level_id, uint8_t tree_id)
+{
+	if (level_id)
+		return (MAX_LEVELS - level_id) * NUM_TREES_PER_LEVEL + tree_id;
+	/*the active tree is the newest, the one after it the oldest*/
+	uint32_t age = (active_tree + NUM_TREES_PER_LEVEL - tree_id) % NUM_TREES_PER_LEVEL;
+	return MAX_LEVELS * NUM_TREES_PER_LEVEL + NUM_TREES_PER_LEVEL - 1 - age;
+}
+
+uint32_t rt_serialize(const struct range_tombstones *rts, char *buf, uint32_t buf_size)
+{
+	uint32_t size = sizeof(struct rt_serialized_list);
+	if (size > buf_size)
+		return 0;
+	struct rt_serialized_list *list = (struct rt_serialized_list *)buf;
+	list->magic = RANGE_TOMBSTONES_MAGIC;
+	list->num_tombstones = rts->num_tombstones;
+	for (uint32_t i = 0; i < rts->num_tombstones; ++i) {
+		uint32_t tombstone_size = rt_get_size(rts->tombstones[i]);
+		if (size + tombstone_size > buf_size)
+			return 0;
+		memcpy(&buf[size], rts->tombstones[i], tombstone_size);
+		size += tombstone_size;
+	}
+	return size;
+}
+
+struct range_tombstones *rt_deserialize(const char *buf, uint32_t buf_size)
+{
+	const struct rt_serialized_list *list = (const struct rt_serialized_list *)buf;
+	if (buf_size < sizeof(struct rt_serialized_list) || RANGE_TOMBSTONES_MAGIC != list->magic)
+		return NULL;
+
+	struct range_tombstones *rts = rt_create();
+	uint32_t offt = sizeof(struct rt_serialized_list);
+	for (uint32_t i = 0; i < list->num_tombstones; ++i) {
+		const struct range_tombstone *tombstone = (const struct range_tombstone *)&buf[offt];
+		if (offt + sizeof(struct range_tombstone) > buf_size || offt + rt_get_size(tombstone) > buf_size) {
+			log_fatal("Corrupted range tombstones");
+			BUG_ON();
+		}
+		/*the ranges were coalesced before they were written, rt_add keeps them apart*/
+		rt_add(rts, rt_get_start(tombstone), tombstone->start_size, rt_get_end(tombstone),
+		       tombstone->end_size);
+		offt += rt_get_size(tombstone);
+	}
+	return rts;
+}
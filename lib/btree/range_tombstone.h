@@ -0,0 +1,91 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef RANGE_TOMBSTONE_H
+#define RANGE_TOMBSTONE_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/*Range tombstone that deletes the keys in [start, end)*/
+struct range_tombstone {
+	uint32_t start_size;
+	uint32_t end_size;
+	/*start key followed by the end key*/
+	char keys[];
+};
+
+/**
+ * Range tombstones of a tree, an L0 tree or a sorted run of a device level.
+ * They delete the keys of the older trees and the deeper levels, never the
+ * keys of their own tree. Overlapping ranges are coalesced so the list is
+ * disjoint and sorted by start key.
+ */
+struct range_tombstones {
+	struct range_tombstone **tombstones;
+	uint32_t num_tombstones;
+	uint32_t capacity;
+	/*segment that persists the tombstones of a device level tree, 0 for L0 trees*/
+	uint64_t dev_offt;
+};
+
+/*Range tombstones of a tree along with the age rank of the tree*/
+struct rt_ranked_list {
+	const struct range_tombstones *list;
+	uint32_t rank;
+};
+
+/*Compares two keys in the order of key_cmp, shorter keys go first on equal prefixes*/
+int rt_key_cmp(const char *key1, uint32_t key1_size, const char *key2, uint32_t key2_size);
+
+struct range_tombstones *rt_create(void);
+void rt_destroy(struct range_tombstones *rts);
+
+/**
+ * Adds the range [start, end) to the list, coalescing it with the ranges it
+ * overlaps or touches.
+ */
+void rt_add(struct range_tombstones *rts, const char *start, uint32_t start_size, const char *end,
+	    uint32_t end_size);
+
+/*Adds every range of src to dst*/
+void rt_add_all(struct range_tombstones *dst, const struct range_tombstones *src);
+
+/*True if one of the ranges of the list holds key, binary search over the start keys*/
+bool rt_covers(const struct range_tombstones *rts, const char *key, uint32_t key_size);
+
+/**
+ * Returns true if a tree of the lists newer than rank has a range that holds
+ * key, meaning that a key of a tree with age rank rank is deleted.
+ */
+bool rt_is_deleted(const struct rt_ranked_list *lists, uint32_t num_lists, uint32_t rank, const char *key,
+		   uint32_t key_size);
+
+/**
+ * Age rank of a tree, the ranges of a tree delete the keys of trees with a
+ * smaller rank. L0 trees are newer than any device level and fill up in turn
+ * up to the active one. Device levels get older as they get deeper and the
+ * runs of a level are newer the larger their tree id.
+ * @param active_tree: the active tree of L0
+ */
+uint32_t rt_get_tree_rank(uint8_t active_tree, uint8_t level_id, uint8_t tree_id);
+
+/**
+ * Serializes the list into buf.
+ * @return the bytes written or 0 if the list does not fit in buf_size bytes
+ */
+uint32_t rt_serialize(const struct range_tombstones *rts, char *buf, uint32_t buf_size);
+
+/*Rebuilds a list that rt_serialize wrote, NULL if buf does not hold one*/
+struct range_tombstones *rt_deserialize(const char *buf, uint32_t buf_size);
+
+#endif
@@ -19,7 +19,9 @@
 #include "../allocator/volume_manager.h"
 #include "../common/common.h"
 #include "conf.h"
+#include "gc.h"
 #include "index_node.h"
+#include "range_tombstone.h"
 #include <assert.h>
 #include <log.h>
 #include <stdlib.h>
@@ -155,6 +157,8 @@ struct segment_header *get_segment_for_lsm_level_IO(struct db_descriptor *db_des
 		log_warn("Not allowed this kind of allocations for L0!");
 		return NULL;
 	}
+	/*parallel subcompactions allocate segments of the same level*/
+	MUTEX_LOCK(&level_desc->level_allocation_lock);
 	uint64_t seg_offt = seg_allocate_segment(db_desc, db_desc->levels[level_id].allocation_txn_id[tree_id]);
 	//log_info("Allocated level segment %llu", seg_offt);
 	struct segment_header *new_segment = (struct segment_header *)REAL_ADDRESS(seg_offt);
@@ -170,6 +174,7 @@ struct segment_header *get_segment_for_lsm_level_IO(struct db_descriptor *db_des
 		level_desc->first_segment[tree_id] = new_segment;
 		level_desc->last_segment[tree_id] = NULL;
 	}
+	MUTEX_UNLOCK(&level_desc->level_allocation_lock);
 
 	return new_segment;
 }
@@ -254,11 +259,71 @@ segment_header *seg_get_raw_log_segment(struct db_descriptor *db_desc, enum log_
 					   .txn_id = db_desc->levels[level_id].allocation_txn_id[tree_id],
 					   .op_type = op_type,
 					   .size = SEGMENT_SIZE };
+	/*recovery restores the age of big log segments for GC from it*/
+	if (BIG_LOG == log_type)
+		log_entry.log_clock = gc_get_log_clock(db_desc);
 	rul_add_entry_in_txn_buf(db_desc, &log_entry);
 	segment_header *sg = (segment_header *)REAL_ADDRESS(log_entry.dev_offt);
 	return sg;
 }
 
+struct level_partition_table *seg_get_partition_table(struct node_header *root)
+{
+	if (!root)
+		return NULL;
+
+	uint64_t root_offt = ABSOLUTE_ADDRESS(root);
+	struct segment_header *segment = REAL_ADDRESS(root_offt - root_offt % SEGMENT_SIZE);
+	struct level_partition_table *table = (struct level_partition_table *)&segment[1];
+	if (rootNode != segment->nodetype || LEVEL_PARTITION_MAGIC != table->magic ||
+	    root_offt != ABSOLUTE_ADDRESS(&table[1]))
+		return NULL;
+	return table;
+}
+
+/*Frees the segment chain from first_segment up to the segment with no next one*/
+static uint64_t seg_free_segment_chain(struct db_descriptor *db_desc, uint64_t txn_id, segment_header *first_segment)
+{
+	uint64_t space_freed = 0;
+	segment_header *curr_segment = first_segment;
+	while (1) {
+		//log_info("Freeing level segment %llu", ABSOLUTE_ADDRESS(curr_segment));
+		seg_free_segment(db_desc, txn_id, ABSOLUTE_ADDRESS(curr_segment));
+		space_freed += SEGMENT_SIZE;
+		if (NULL == curr_segment->next_segment)
+			break;
+		curr_segment = REAL_ADDRESS(curr_segment->next_segment);
+	}
+	return space_freed;
+}
+
+uint64_t seg_free_level_partitions(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t level_id, uint8_t tree_id,
+				   uint64_t kept_partitions)
+{
+	struct level_descriptor *level_desc = &db_desc->levels[level_id];
+	struct node_header *root = level_desc->root_w[tree_id];
+	if (!root)
+		root = level_desc->root_r[tree_id];
+	struct level_partition_table *table = seg_get_partition_table(root);
+	if (!table) {
+		/*a level without a partition table is partition 0*/
+		if (kept_partitions & 1UL)
+			return 0;
+		return seg_free_segment_chain(db_desc, txn_id, level_desc->first_segment[tree_id]);
+	}
+
+	uint64_t space_freed = 0;
+	for (uint32_t i = 0; i < table->num_partitions; ++i) {
+		if (kept_partitions & (1UL << i))
+			continue;
+		segment_header *first_segment = REAL_ADDRESS(table->partitions[i].first_segment_offt);
+		space_freed += seg_free_segment_chain(db_desc, txn_id, first_segment);
+	}
+	/*the root segment of the level comes last, its next segment is NULL*/
+	seg_free_segment(db_desc, txn_id, ABSOLUTE_ADDRESS(level_desc->last_segment[tree_id]));
+	return space_freed + SEGMENT_SIZE;
+}
+
 uint64_t seg_free_level(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t level_id, uint8_t tree_id)
 {
 	segment_header *curr_segment = db_desc->levels[level_id].first_segment[tree_id];
@@ -273,15 +338,8 @@ uint64_t seg_free_level(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t
 	log_debug("Freeing up level %u for db %s", level_id, db_desc->db_superblock->db_name);
 
 	if (level_id != 0) {
-		while (1) {
-			//log_info("Freeing level segment %llu", ABSOLUTE_ADDRESS(curr_segment));
-			seg_free_segment(db_desc, txn_id, ABSOLUTE_ADDRESS(curr_segment));
-			space_freed += SEGMENT_SIZE;
-			if (NULL == curr_segment->next_segment)
-				break;
-			curr_segment = REAL_ADDRESS(curr_segment->next_segment);
-		}
-		assert(space_freed == db_desc->levels[level_id].offset[0]);
+		space_freed = seg_free_level_partitions(db_desc, txn_id, level_id, tree_id, 0);
+		assert(space_freed == db_desc->levels[level_id].offset[tree_id]);
 
 	} else {
 		/*Finally L0 index in memory*/
@@ -310,6 +368,23 @@ uint64_t seg_free_level(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t
 	return space_freed;
 }
 
+uint64_t seg_get_range_tombstones_segment(struct db_descriptor *db_desc, uint8_t level_id, uint8_t tree_id)
+{
+	assert(level_id);
+	return seg_allocate_segment(db_desc, db_desc->levels[level_id].allocation_txn_id[tree_id]);
+}
+
+void seg_free_range_tombstones(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t level_id, uint8_t tree_id)
+{
+	struct range_tombstones *range_tombstones = db_desc->levels[level_id].range_tombstones[tree_id];
+	if (!range_tombstones)
+		return;
+	if (range_tombstones->dev_offt)
+		seg_free_segment(db_desc, txn_id, range_tombstones->dev_offt);
+	rt_destroy(range_tombstones);
+	db_desc->levels[level_id].range_tombstones[tree_id] = NULL;
+}
+
 void seg_zero_level(struct db_descriptor *db_desc, uint8_t level_id, uint8_t tree_id)
 {
 	db_desc->levels[level_id].level_size[tree_id] = 0;
@@ -45,5 +45,35 @@ segment_header *seg_get_raw_log_segment(struct db_descriptor *db_desc, enum log_
 struct segment_header *get_segment_for_lsm_level_IO(struct db_descriptor *db_desc, uint8_t level_id, uint8_t tree_id);
 
 uint64_t seg_free_level(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t level_id, uint8_t tree_id);
+
+/**
+ * Returns the partition table of the device level with this root or NULL if
+ * the level is a single B-tree.
+ */
+struct level_partition_table *seg_get_partition_table(struct node_header *root);
+
+/**
+ * Frees the segments of a device level except those of the partitions set in
+ * kept_partitions, a bitmap of partition ids, which the level that replaces
+ * it reuses. A level without a partition table is partition 0. The root
+ * segment of a partitioned level is always freed.
+ * @return the bytes freed
+ */
+uint64_t seg_free_level_partitions(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t level_id, uint8_t tree_id,
+				   uint64_t kept_partitions);
+
+/**
+ * Allocates a segment that persists the range tombstones of a device level
+ * tree. It is not in the segment chain of the tree, seg_free_range_tombstones
+ * frees it.
+ * @return the device offset of the segment
+ */
+uint64_t seg_get_range_tombstones_segment(struct db_descriptor *db_desc, uint8_t level_id, uint8_t tree_id);
+
+/**
+ * Frees the range tombstones of a tree along with the segment that persists
+ * them, if any.
+ */
+void seg_free_range_tombstones(struct db_descriptor *db_desc, uint64_t txn_id, uint8_t level_id, uint8_t tree_id);
 void seg_zero_level(struct db_descriptor *db_desc, uint8_t level_id, uint8_t tree_id);
 #endif
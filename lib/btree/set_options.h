@@ -14,7 +14,7 @@
 
 #ifndef PARALLAX_SET_OPTIONS_H
 #define PARALLAX_SET_OPTIONS_H
-#define NUM_OF_OPTIONS 5
+#define NUM_OF_OPTIONS 30
 
 #include <uthash.h>
 
@@ -69,10 +69,21 @@ enum kv_category get_kv_category(int32_t key_size, int32_t value_size, request_t
  */
 struct par_put_metadata par_put(par_handle handle, struct par_key_value *key_value, const char **error_message);
 
+/**
+ * Same as par_put for a DB opened in TTL_MODE, the KV expires ttl_sec seconds
+ * after the call. Expired KVs are not found and compactions drop them without
+ * any delete. In TTL mode par_put stores KVs that never expire, values take
+ * 8 more bytes, and get buffers must fit them too.
+ * @param ttl_sec Seconds the KV lives, 0 never expires.
+ */
+struct par_put_metadata par_put_with_ttl(par_handle handle, struct par_key_value *key_value, uint32_t ttl_sec,
+					 const char **error_message);
+
 /**
  * Inserts a serialized key value pair by using the buffer provided by the user.
  * @param serialized_key_value is a buffer containing the serialized key value pair. The format of the key value pair is | key_size | key | value_size | value |
- * where {key,value}_size is uint32_t.
+ * where {key,value}_size is uint32_t. In TTL mode the KV is copied to append
+ * its expiry time, it never expires as with par_put.
  */
 struct par_put_metadata par_put_serialized(par_handle handle, char *serialized_key_value, const char **error_message);
 
@@ -110,6 +121,20 @@ par_ret_code par_exists(par_handle handle, struct par_key *key);
  */
 void par_delete(par_handle handle, struct par_key *key, const char **error_message);
 
+/**
+ * Deletes a key that was put once and not updated since. Compactions drop the
+ * tombstone together with the put it meets instead of carrying it to the last
+ * level. Keys put more than once may return older values after the delete.
+ */
+void par_single_delete(par_handle handle, struct par_key *key, const char **error_message);
+
+/**
+ * Deletes all the keys in [start, end). Keys written after the call are not
+ * affected.
+ * @param error_message Contains error message if call fails.
+ */
+void par_delete_range(par_handle handle, struct par_key *start, struct par_key *end, const char **error_message);
+
 /**
  * scanner API. At the current state scanner supports snapshot isolation. The lifetime of a scanner start with
  * a call to par_init_scanner and ends with par_close_scanner. Currently, to provide snapshot isolation during
@@ -146,6 +171,60 @@ struct par_value par_get_value(par_scanner sc);
  */
 par_ret_code par_sync(par_handle handle);
 
+/**
+ * Fills scores with the compaction scores of the levels of the DB, starting
+ * from L0, as the last compaction scheduling pass computed them. A score is
+ * the size of a level over its target size, levels with a score of 1 and above
+ * wait for a compaction and the highest score is compacted first.
+ * @param scores array of num_levels entries
+ * @retval The number of levels filled
+ */
+uint32_t par_get_compaction_scores(par_handle handle, double *scores, uint32_t num_levels);
+
+/**
+ * Switches the active L0 tree and compacts it into L1, along with the L0 trees
+ * that wait for a compaction, even if it is not full. Returns without waiting
+ * for the compactions, par_get_compaction_progress reports when they complete.
+ */
+void par_flush(par_handle handle);
+
+/**
+ * Pushes the keys in [start, end] down to the last level that holds data, so
+ * that reads of the range visit fewer levels. L0 is flushed whole and every
+ * device level that holds keys of the range is merged into the next one until
+ * the data reaches the last level. NULL start or end leave the range open.
+ * Returns without waiting, par_get_compaction_progress reports the progress.
+ */
+void par_compact_range(par_handle handle, struct par_key *start, struct par_key *end);
+
+/**
+ * Fills progress with the compactions that par_flush and par_compact_range
+ * requested and are still pending, and with the ones completed.
+ */
+void par_get_compaction_progress(par_handle handle, struct par_compaction_progress *progress);
+
+/**
+ * Sets at runtime the rate in bytes per second that the compactions and the
+ * GC of the DB read and write the device at, 0 removes the bound. With
+ * BG_IO_TARGET_LATENCY set the DB tunes the rate below this bound.
+ */
+void par_set_bg_io_rate(par_handle handle, uint64_t bytes_per_sec);
+
+/**
+ * Returns the current background I/O rate of the DB in bytes per second, 0
+ * when background I/O is not paced.
+ */
+uint64_t par_get_bg_io_rate(par_handle handle);
+
+/**
+ * Sets the filter the compactions of the DB run on every KV they merge, NULL
+ * removes it. Filtered KVs that may shadow older versions in deeper levels
+ * leave a tombstone, the rest are dropped, and their value log space becomes
+ * garbage. Set it right after par_open, the filter runs in the background
+ * threads of the DB until par_close.
+ */
+void par_set_compaction_filter(par_handle handle, par_compaction_filter filter, void *context);
+
 /**
  * Create, populate and return a buffer containing the default db_options values from option.yml file. Callers can modify the buffer at will.
  * @retval Array with NUM_OF_OPTIONS sizeo of struct options_desc
@@ -1,6 +1,7 @@
 #ifndef PARALLAX_STRUCTURES_H_
 #define PARALLAX_STRUCTURES_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 typedef void *par_handle;
 typedef void *par_scanner;
@@ -22,14 +23,66 @@ enum kv_category {
  *	In the request_type you will add the name of the operation i.e. transactionOp and
  *	in the log_operation you will add a pointer in the union with the new operation i.e. transaction_request.
  */
-typedef enum { insertOp, deleteOp, paddingOp, unknownOp } request_type;
+typedef enum { insertOp, deleteOp, deleteRangeOp, singleDeleteOp, paddingOp, unknownOp } request_type;
 
+/**
+ * The per level leaf and index node sizes must remain contiguous, Parallax
+ * indexes them as LEVEL0_LEAF_SIZE + level_id and LEVEL1_INDEX_NODE_SIZE +
+ * level_id - 1. They apply only when a DB is created, afterwards the sizes
+ * persisted in the DB are used. L0 index nodes have a fixed size.
+ * LEAF_COMPRESSION makes compactions compress the leaves of the levels below
+ * LEVEL_MEDIUM_INPLACE, LEAF_CACHE_SIZE bounds in bytes the cache that keeps
+ * them decompressed for reads. SUBCOMPACTIONS is the number of key ranges a
+ * compaction between device levels merges in parallel, with helper jobs in
+ * the background pool. BG_THREADS is the
+ * number of workers of the pool that runs the compactions and the GC of all
+ * the DBs of the process, the first DB opened sets it. PARTITION_SIZE bounds
+ * in bytes the key range partitions compactions split device levels into, so
+ * that they rewrite only the partitions their source overlaps, 0 leaves the
+ * partitions unbounded. LEVEL_RUNS is the number of sorted runs the device
+ * levels above the last one gather before they are merged into the next
+ * level, at most NUM_TREES_PER_LEVEL - 1. The last level keeps a single run,
+ * 1 makes all levels leveled. BG_IO_RATE bounds in bytes per second the device
+ * I/O of the compactions and the GC of a DB, 0 leaves it unbounded.
+ * BG_IO_TARGET_LATENCY is the average get latency in usec that the DB tunes
+ * the background I/O rate for, 0 disables the tuning. TTL_MODE makes every
+ * value of the DB carry the time it expires at, see par_put_with_ttl. It must
+ * not change once the DB holds data. FULL_KEYS_IN_LEAVES makes compactions
+ * store the full key of separated KVs in device level leaves next to their
+ * log pointer, so that searches and merges compare keys without reading the
+ * logs.
+ */
 typedef enum {
 	LEVEL0_SIZE = 0,
 	GC_INTERVAL,
 	GROWTH_FACTOR,
 	MEDIUM_LOG_LRU_CACHE_SIZE,
-	LEVEL_MEDIUM_INPLACE
+	LEVEL_MEDIUM_INPLACE,
+	LEVEL0_LEAF_SIZE,
+	LEVEL1_LEAF_SIZE,
+	LEVEL2_LEAF_SIZE,
+	LEVEL3_LEAF_SIZE,
+	LEVEL4_LEAF_SIZE,
+	LEVEL5_LEAF_SIZE,
+	LEVEL6_LEAF_SIZE,
+	LEVEL7_LEAF_SIZE,
+	LEVEL1_INDEX_NODE_SIZE,
+	LEVEL2_INDEX_NODE_SIZE,
+	LEVEL3_INDEX_NODE_SIZE,
+	LEVEL4_INDEX_NODE_SIZE,
+	LEVEL5_INDEX_NODE_SIZE,
+	LEVEL6_INDEX_NODE_SIZE,
+	LEVEL7_INDEX_NODE_SIZE,
+	LEAF_COMPRESSION,
+	LEAF_CACHE_SIZE,
+	SUBCOMPACTIONS,
+	BG_THREADS,
+	PARTITION_SIZE,
+	LEVEL_RUNS,
+	BG_IO_RATE,
+	BG_IO_TARGET_LATENCY,
+	TTL_MODE,
+	FULL_KEYS_IN_LEAVES
 } par_options;
 
 struct par_options_desc {
@@ -70,9 +123,27 @@ struct par_key_value {
 	struct par_value v;
 };
 
+/**
+ * Called by the compactions for each KV they merge with the context given to
+ * par_set_compaction_filter. Returning true drops the KV. In TTL mode the
+ * value excludes the expiry time and expired KVs are dropped without a call.
+ */
+typedef bool (*par_compaction_filter)(void *context, struct par_key *key, struct par_value *value);
+
 /**
  *	For some applications such as Tebis they need some metadata from Parallax.
  */
+/**
+ * Progress of the compactions par_flush and par_compact_range request. The
+ * compactions they asked for are complete once pending drops to 0.
+ */
+struct par_compaction_progress {
+	/*manual compactions that wait or run, compactions a completed one leads to are added as they become known*/
+	uint32_t pending;
+	/*manual compactions completed since the DB was opened*/
+	uint32_t completed;
+};
+
 struct par_put_metadata {
 	uint64_t lsn; // Log sequence number of KV when it was appended in the log.
 	uint64_t offset_in_log; // Offset in the L0 Recovery or Large Log.
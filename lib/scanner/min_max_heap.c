@@ -23,13 +23,10 @@
 #include <stdlib.h>
 #include <string.h>
 
-#define LCHILD(x) ((2 * x) + 1)
-#define RCHILD(x) ((2 * x) + 2)
-#define PARENT(x) ((x - 1) / 2)
-
 static void push_back_duplicate_kv(struct sh_heap *heap, struct sh_heap_node *hp_node)
 {
-	if (hp_node->cat != BIG_INLOG)
+	/*scanners do not account dropped KVs, only compactions free their space*/
+	if (!heap->dups || hp_node->cat != BIG_INLOG)
 		return;
 
 	struct kv_seperation_splice local = { 0 };
@@ -43,6 +40,10 @@ static void push_back_duplicate_kv(struct sh_heap *heap, struct sh_heap_node *hp
 		int size = key_size < PREFIX_SIZE ? key_size : PREFIX_SIZE;
 		memcpy(&local.prefix, get_key_offset_in_kv(kv), size);
 		local.dev_offt = (uint64_t)hp_node->KV;
+		/*only KVs of L0 logs reach the heap without their size*/
+		local.kv_size = hp_node->kv_size;
+		if (UINT32_MAX == local.kv_size)
+			local.kv_size = get_kv_size(kv);
 		keyvalue = &local;
 		break;
 	case KV_PREFIX:
@@ -55,53 +56,50 @@ static void push_back_duplicate_kv(struct sh_heap *heap, struct sh_heap_node *hp
 
 	uint64_t segment_offset =
 		ABSOLUTE_ADDRESS(keyvalue->dev_offt) - (ABSOLUTE_ADDRESS(keyvalue->dev_offt) % SEGMENT_SIZE);
-	struct kv_splice *kv = (struct kv_splice *)keyvalue->dev_offt;
-	assert(get_key_size(kv) <= MAX_KEY_SIZE);
+	/*the splice keeps the size of the KV so accounting does not read the log*/
 	struct dups_node *node = find_element(heap->dups, (uint64_t)REAL_ADDRESS(segment_offset));
 
 	if (node)
-		node->kv_size += get_kv_size(kv);
+		node->kv_size += keyvalue->kv_size;
 	else
-		append_node(heap->dups, (uint64_t)REAL_ADDRESS(segment_offset), get_kv_size(kv));
+		append_node(heap->dups, (uint64_t)REAL_ADDRESS(segment_offset), keyvalue->kv_size);
+}
+
+void sh_add_dropped_kv(struct sh_heap *heap, struct sh_heap_node *node)
+{
+	push_back_duplicate_kv(heap, node);
 }
 
 /**
  * Solves cases when we have duplicated keys across adjacent levels. It takes
  * into account the level id of each key to solve the tie. The rule is that the
- * key with the largest level id is duplicate and is ignored.
- * @returns negative int if nd_1 < nd_2, possitive if nd_1>nd_2, and 0 if equal
- * @param heap, pointer to min max heap
+ * key with the largest level id is duplicate and is ignored. Within a device
+ * level the runs are written in the order of their trees, so the key of the
+ * smaller tree is the duplicate. The duplicate orders first, a node keeps its
+ * mark until its source moves to the next key.
+ * @returns negative int if nd_1 < nd_2, possitive if nd_1>nd_2
  * @param nd_1 heap node containing the actual key, its corresponding level_id
  * @param nd_2 heap node containing the key and its corresponding level_id
  */
-static int sh_solve_tie(struct sh_heap *heap, struct sh_heap_node *nd_1, struct sh_heap_node *nd_2)
+static int sh_solve_tie(struct sh_heap_node *nd_1, struct sh_heap_node *nd_2)
 {
-	int ret = 1;
-	nd_1->duplicate = 0;
-	nd_2->duplicate = 1;
-	/*Is it an L0 conflict?*/
-	if (0 == nd_1->level_id && 0 == nd_2->level_id) {
-		/*largest epoch wins*/
-		if (nd_1->epoch < nd_2->epoch) {
-			nd_1->duplicate = 1;
-			nd_2->duplicate = 0;
-			ret = -1;
-		}
-	}
+	bool nd_1_duplicate = false;
+	/*Is it an L0 conflict? largest epoch wins*/
+	if (0 == nd_1->level_id && 0 == nd_2->level_id && nd_1->epoch < nd_2->epoch)
+		nd_1_duplicate = true;
+	/*the newer run of a device level wins*/
+	if (nd_1->level_id && nd_1->level_id == nd_2->level_id && nd_1->active_tree < nd_2->active_tree)
+		nd_1_duplicate = true;
 	/*Otherwise smallest level_id wins*/
-	if (nd_1->level_id > nd_2->level_id) {
+	if (nd_1->level_id > nd_2->level_id)
+		nd_1_duplicate = true;
+
+	if (nd_1_duplicate) {
 		nd_1->duplicate = 1;
-		nd_2->duplicate = 0;
-		ret = -1;
+		return -1;
 	}
-	if (nd_1->duplicate)
-		push_back_duplicate_kv(heap, nd_1);
-	if (nd_2->duplicate)
-		push_back_duplicate_kv(heap, nd_2);
-
-	//log_debug("Solving tie between %s from level: %u and %s from level: %u nd_1 duplicate?: %u nd_2:duplicate?: %u",
-	//	  nd_1->KV + 4, nd_1->level_id, nd_2->KV + 4, nd_2->level_id, nd_1->duplicate, nd_2->duplicate);
-	return ret;
+	nd_2->duplicate = 1;
+	return 1;
 }
 
 /**
@@ -114,13 +112,23 @@ static int sh_prefix_compare(struct key_compare *key1, struct key_compare *key2)
 	return memcmp(key1->key, key2->key, size);
 }
 
+/*Compares the full key of a KV_PREFIX node that carries it instead of the one in the log*/
+static void sh_set_full_key(struct sh_heap_node *nd, struct key_compare *key_cmp)
+{
+	if (key_cmp->key_format != KV_PREFIX || !nd->full_key)
+		return;
+	key_cmp->key = nd->full_key;
+	key_cmp->key_size = nd->full_key_size;
+	key_cmp->kv_dev_offt = UINT64_MAX;
+	key_cmp->key_format = KV_FORMAT;
+}
+
 /**
- * The comparator function used from the min max heap to compare node
- * @param hp the pointer to the min max heap structure
+ * The comparator function used from the tournament to compare nodes
  * @param nd_1 pointer to the heap node
  * @param nd_2 pointer to the heap node
  */
-static int sh_cmp_heap_nodes(struct sh_heap *hp, struct sh_heap_node *nd_1, struct sh_heap_node *nd_2)
+static int sh_cmp_heap_nodes(struct sh_heap_node *nd_1, struct sh_heap_node *nd_2)
 {
 	struct key_compare key1_cmp = { 0 };
 	struct key_compare key2_cmp = { 0 };
@@ -140,6 +148,8 @@ static int sh_cmp_heap_nodes(struct sh_heap *hp, struct sh_heap_node *nd_1, stru
 		return ret;
 
 	/* Going for full key comparison, we are going to end up in the full key comparator*/
+	sh_set_full_key(nd_1, &key1_cmp);
+	sh_set_full_key(nd_2, &key2_cmp);
 	struct bt_kv_log_address key1 = { 0 };
 	if (key1_cmp.key_format == KV_PREFIX) {
 		key1.addr = (char *)key1_cmp.kv_dev_offt;
@@ -163,7 +173,7 @@ static int sh_cmp_heap_nodes(struct sh_heap *hp, struct sh_heap_node *nd_1, stru
 	if (key2.in_tail)
 		bt_done_with_value_log_address(key2.log_desc, &key2);
 
-	return ret ? ret : sh_solve_tie(hp, nd_1, nd_2);
+	return ret ? ret : sh_solve_tie(nd_1, nd_2);
 }
 /**
  * Allocates a min heap using dynamic memory and zero initialize it
@@ -179,7 +189,12 @@ struct sh_heap *sh_alloc_heap(void)
 void sh_init_heap(struct sh_heap *heap, int active_tree, enum sh_heap_type heap_type)
 {
 	heap->heap_size = 0;
-	heap->dups = init_dups_list();
+	heap->width = 1;
+	heap->num_leaves = 0;
+	heap->pending_leaf = -1;
+	heap->rebuild = 0;
+	heap->num_comparisons = 0;
+	heap->dups = NULL;
 	(void)active_tree;
 	heap->heap_type = heap_type;
 	heap->active_tree = -1;
@@ -191,74 +206,118 @@ void sh_init_heap(struct sh_heap *heap, int active_tree, enum sh_heap_type heap_
 void sh_destroy_heap(struct sh_heap *heap)
 {
 	struct dups_list *heap_destroy = heap->dups;
-	free_dups_list(&heap_destroy);
+	if (heap_destroy)
+		free_dups_list(&heap_destroy);
 	assert(NULL == heap_destroy);
 	free(heap);
 }
 
+void sh_account_dropped_kvs(struct sh_heap *heap)
+{
+	if (!heap->dups)
+		heap->dups = init_dups_list();
+}
+
+/*True if the key of leaf_1 wins its match against the key of leaf_2*/
+static bool sh_wins(struct sh_heap *heap, int leaf_1, int leaf_2)
+{
+	if (heap->exhausted[leaf_1] || heap->exhausted[leaf_2])
+		return !heap->exhausted[leaf_1];
+	++heap->num_comparisons;
+	return sh_cmp_heap_nodes(&heap->elem[leaf_1], &heap->elem[leaf_2]) < 0;
+}
+
 /**
- * Heapify function is used to make sure that the heap property is never
- * violated In case of deletion of a heap_node, or creating a min heap from an
- * array, heap property may be violated. In such cases, heapify function can
- * be called to make sure that heap property is never violated
+ * Plays all the matches of the tournament bottom up. Leaves past the sources
+ * are exhausted so the tree stays complete.
  */
-static void heapify(struct sh_heap *hp, int i)
+static void sh_build_tournament(struct sh_heap *heap)
 {
-	int smallest = i;
-	if (LCHILD(i) < hp->heap_size && sh_cmp_heap_nodes(hp, &hp->elem[LCHILD(i)], &hp->elem[i]) < 0)
-		smallest = LCHILD(i);
-	if (RCHILD(i) < hp->heap_size && sh_cmp_heap_nodes(hp, &hp->elem[RCHILD(i)], &hp->elem[smallest]) < 0)
-		smallest = RCHILD(i);
+	heap->width = 1;
+	while (heap->width < heap->num_leaves)
+		heap->width *= 2;
+	for (int leaf = heap->num_leaves; leaf < heap->width; ++leaf)
+		heap->exhausted[leaf] = 1;
 
-	if (smallest != i) {
-		// swap(&(hp->elem[i]), &(hp->elem[smallest]))
-		struct sh_heap_node temp = hp->elem[i];
-		hp->elem[i] = hp->elem[smallest];
-		hp->elem[smallest] = temp;
-		heapify(hp, smallest);
+	/*winners[i] is the leaf that won at node i, leaves sit at width + leaf*/
+	uint8_t winners[2 * HEAP_SIZE];
+	for (int leaf = 0; leaf < heap->width; ++leaf)
+		winners[heap->width + leaf] = leaf;
+	for (int node = heap->width - 1; node > 0; --node) {
+		uint8_t left = winners[2 * node];
+		uint8_t right = winners[2 * node + 1];
+		bool left_wins = sh_wins(heap, left, right);
+		winners[node] = left_wins ? left : right;
+		heap->losers[node] = left_wins ? right : left;
 	}
+	heap->losers[0] = winners[1];
+	heap->rebuild = 0;
+	heap->pending_leaf = -1;
 }
 
 /**
- * Function to insert a heap_node into the min heap, by allocating space for
- * that heap_node in the heap and also making sure that the heap property and
- * shape propety are never violated.
+ * Replays the matches on the path of the leaf that won the tournament after
+ * its key changed. Every node on the path keeps the loser of the other side,
+ * so the new key meets each of them once.
  */
+static void sh_replay_matches(struct sh_heap *heap, int leaf)
+{
+	int winner = leaf;
+	for (int node = (heap->width + leaf) / 2; node > 0; node /= 2) {
+		if (!sh_wins(heap, heap->losers[node], winner))
+			continue;
+		int loser = winner;
+		winner = heap->losers[node];
+		heap->losers[node] = loser;
+	}
+	heap->losers[0] = winner;
+}
+
 void sh_insert_heap_node(struct sh_heap *heap, struct sh_heap_node *node)
 {
 	node->duplicate = 0;
-	if (heap->heap_size > HEAP_SIZE) {
-		log_fatal("min max heap out of space resize heap accordingly");
-		BUG_ON();
+	int leaf = heap->pending_leaf;
+	if (leaf >= 0) {
+		heap->elem[leaf] = *node;
+		heap->exhausted[leaf] = 0;
+		++heap->heap_size;
+		heap->pending_leaf = -1;
+		sh_replay_matches(heap, leaf);
+		return;
 	}
 
-	int i = heap->heap_size++;
-	while (i && sh_cmp_heap_nodes(heap, node, &(heap->elem[PARENT(i)])) < 0) {
-		heap->elem[i] = heap->elem[PARENT(i)];
-		i = PARENT(i);
+	for (leaf = 0; leaf < heap->num_leaves && !heap->exhausted[leaf]; ++leaf)
+		;
+	if (leaf == heap->num_leaves && ++heap->num_leaves > HEAP_SIZE) {
+		log_fatal("min max heap out of space resize heap accordingly");
+		BUG_ON();
 	}
-
-	heap->elem[i] = *node;
+	heap->elem[leaf] = *node;
+	heap->exhausted[leaf] = 0;
+	++heap->heap_size;
+	heap->rebuild = 1;
 }
 
-/**
- * Removes the top element of the min max heap and writes to the variable
- * pointed to by heap node pointer.
- * @returns true if it founds and element or false if the heap is
- * empty.
- */
 bool sh_remove_top(struct sh_heap *heap, struct sh_heap_node *node)
 {
+	if (heap->rebuild)
+		sh_build_tournament(heap);
+	else if (heap->pending_leaf >= 0) {
+		/*the source of the last winner ran out of keys*/
+		sh_replay_matches(heap, heap->pending_leaf);
+		heap->pending_leaf = -1;
+	}
+
 	if (0 == heap->heap_size)
 		return false;
 
-	*node = heap->elem[0];
-
+	int winner = heap->losers[0];
+	*node = heap->elem[winner];
+	/*all the newer versions of the key played against it by now*/
+	if (node->duplicate)
+		push_back_duplicate_kv(heap, node);
+	heap->exhausted[winner] = 1;
 	--heap->heap_size;
-	if (0 == heap->heap_size)
-		return true;
-
-	heap->elem[0] = heap->elem[heap->heap_size];
-	heapify(heap, 0);
+	heap->pending_leaf = winner;
 	return true;
 }
@@ -23,6 +23,9 @@ enum sh_heap_type { MIN_HEAP, MAX_HEAP };
 
 struct sh_heap_node {
 	char *KV;
+	/*full key of a KV_PREFIX KV when its source has it, comparisons then skip the log*/
+	char *full_key;
+	int32_t full_key_size;
 	struct db_descriptor *db_desc;
 	uint64_t epoch;
 	uint32_t kv_size;
@@ -34,17 +37,65 @@ struct sh_heap_node {
 	enum kv_category cat;
 };
 
+/**
+ * Merges up to HEAP_SIZE sorted sources with a tournament (loser) tree. Each
+ * source occupies a leaf and every internal node keeps the leaf that lost the
+ * match played there, so replacing the winner with the next key of its source
+ * replays only the log2(k) matches on the path of its leaf, against about
+ * 2*log2(k) comparisons for a binary heap. Among equal keys the older versions
+ * come out first marked as duplicates.
+ */
 struct sh_heap {
+	/*leaves of the tournament*/
 	struct sh_heap_node elem[HEAP_SIZE];
+	/*losers[0] is the leaf that won the tournament, losers[i] the leaf that lost at internal node i*/
+	uint8_t losers[HEAP_SIZE];
+	/*leaves without a key, they lose every match*/
+	uint8_t exhausted[HEAP_SIZE];
 	struct dups_list *dups;
+	/*leaves of the tree, a power of two*/
+	int width;
+	/*leaves sources occupied so far*/
+	int num_leaves;
+	/*leaf of the last removed winner, an insert that follows refills it*/
+	int pending_leaf;
+	/*new sources joined so the matches are played from scratch at the next removal*/
+	uint8_t rebuild;
 	int heap_size;
 	int active_tree;
 	enum sh_heap_type heap_type;
+	/*key comparisons made so far*/
+	uint64_t num_comparisons;
 };
 
 struct sh_heap *sh_alloc_heap(void);
 void sh_init_heap(struct sh_heap *heap, int active_tree, enum sh_heap_type heap_type);
 void sh_destroy_heap(struct sh_heap *heap);
+
+/**
+ * Adds the next key of a source. Inserting right after sh_remove_top refills
+ * the leaf of the removed winner with log2(k) comparisons, which is how merges
+ * advance the source of each key they consume. Other inserts add a new source.
+ */
 void sh_insert_heap_node(struct sh_heap *heap, struct sh_heap_node *node);
+
+/**
+ * Removes the smallest key and copies it to node.
+ * @returns false if all the sources ran out of keys
+ */
 bool sh_remove_top(struct sh_heap *heap, struct sh_heap_node *node);
+
+/**
+ * Makes the heap account the BIG_INLOG duplicates it removes and the KVs
+ * passed to sh_add_dropped_kv in dups, as garbage of their log segments. Only
+ * compactions free that space, scanner heaps skip the accounting.
+ */
+void sh_account_dropped_kvs(struct sh_heap *heap);
+
+/**
+ * Accounts a KV that a compaction drops without it being a duplicate, e.g.
+ * when a range tombstone deletes it. Like duplicates, BIG_INLOG KVs become
+ * garbage of their log segment.
+ */
+void sh_add_dropped_kv(struct sh_heap *heap, struct sh_heap_node *node);
 #endif
@@ -19,6 +19,8 @@
 #include "../btree/dynamic_leaf.h"
 #include "../btree/index_node.h"
 #include "../btree/kv_pairs.h"
+#include "../btree/leaf_cache.h"
+#include "../btree/range_tombstone.h"
 #include "../common/common.h"
 #include "../include/parallax/parallax.h"
 #include "../utilities/dups_list.h"
@@ -35,6 +37,7 @@
 int init_level_scanner(level_scanner *level_sc, void *start_key, char seek_mode)
 {
 	stack_init(&level_sc->stack);
+	level_sc->cached_leaf = NULL;
 
 	/* position scanner now to the appropriate row */
 	if (level_scanner_seek(level_sc, start_key, seek_mode) == END_OF_DATABASE) {
@@ -92,6 +95,20 @@ void init_generic_scanner(struct scannerHandle *sc, struct db_handle *handle, vo
 	}
 	sh_init_heap(&sc->heap, active_tree, MIN_HEAP);
 
+	sc->num_range_tombstones = 0;
+	sc->L0_active_tree = active_tree;
+	for (uint8_t level_id = 0; level_id < MAX_LEVELS; ++level_id) {
+		for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+			struct range_tombstones *range_tombstones =
+				handle->db_desc->levels[level_id].range_tombstones[tree_id];
+			if (!range_tombstones || !range_tombstones->num_tombstones)
+				continue;
+			sc->range_tombstones[sc->num_range_tombstones].list = range_tombstones;
+			sc->range_tombstones[sc->num_range_tombstones++].rank =
+				rt_get_tree_rank(active_tree, level_id, tree_id);
+		}
+	}
+
 	for (int i = 0; i < NUM_TREES_PER_LEVEL; ++i) {
 		struct node_header *root = handle->db_desc->levels[0].root_r[i];
 		if (dirty && handle->db_desc->levels[0].root_w[i] != NULL)
@@ -121,33 +138,30 @@ void init_generic_scanner(struct scannerHandle *sc, struct db_handle *handle, vo
 		sh_insert_heap_node(&sc->heap, &nd);
 	}
 
+	/*device levels keep a sorted run in each of their first trees*/
 	for (uint32_t level_id = 1; level_id < MAX_LEVELS; level_id++) {
-		struct node_header *root = NULL;
-		/*for persistent levels it is always the 0*/
-		int tree_id = 0;
-		root = handle->db_desc->levels[level_id].root_w[tree_id];
-		if (!root)
-			root = handle->db_desc->levels[level_id].root_r[tree_id];
-		if (!root)
-			continue;
-
-		sc->LEVEL_SCANNERS[level_id][tree_id].db = handle;
-		sc->LEVEL_SCANNERS[level_id][tree_id].level_id = level_id;
-		sc->LEVEL_SCANNERS[level_id][tree_id].root = root;
-		retval = init_level_scanner(&sc->LEVEL_SCANNERS[level_id][tree_id], start_key, seek_flag);
-		if (retval == 0) {
-			sc->LEVEL_SCANNERS[level_id][tree_id].valid = 1;
-			nd.KV = sc->LEVEL_SCANNERS[level_id][tree_id].keyValue;
-			nd.kv_size = sc->LEVEL_SCANNERS[level_id][tree_id].kv_size;
-			nd.type = KV_FORMAT;
-			//log_info("Tree[%d][%d] gave us key %s", level_id, 0, nd.KV + 4);
-			nd.level_id = level_id;
-			nd.active_tree = tree_id;
-			nd.db_desc = handle->db_desc;
-			nd.tombstone = sc->LEVEL_SCANNERS[level_id][tree_id].tombstone;
-			sh_insert_heap_node(&sc->heap, &nd);
-
-			sc->LEVEL_SCANNERS[level_id][tree_id].valid = 1;
+		for (int tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; tree_id++) {
+			struct node_header *root = handle->db_desc->levels[level_id].root_w[tree_id];
+			if (!root)
+				root = handle->db_desc->levels[level_id].root_r[tree_id];
+			if (!root)
+				continue;
+
+			sc->LEVEL_SCANNERS[level_id][tree_id].db = handle;
+			sc->LEVEL_SCANNERS[level_id][tree_id].level_id = level_id;
+			sc->LEVEL_SCANNERS[level_id][tree_id].root = root;
+			retval = init_level_scanner(&sc->LEVEL_SCANNERS[level_id][tree_id], start_key, seek_flag);
+			if (retval == 0) {
+				sc->LEVEL_SCANNERS[level_id][tree_id].valid = 1;
+				nd.KV = sc->LEVEL_SCANNERS[level_id][tree_id].keyValue;
+				nd.kv_size = sc->LEVEL_SCANNERS[level_id][tree_id].kv_size;
+				nd.type = KV_FORMAT;
+				nd.level_id = level_id;
+				nd.active_tree = tree_id;
+				nd.db_desc = handle->db_desc;
+				nd.tombstone = sc->LEVEL_SCANNERS[level_id][tree_id].tombstone;
+				sh_insert_heap_node(&sc->heap, &nd);
+			}
 		}
 	}
 
@@ -217,6 +231,36 @@ static void read_unlock_node(struct level_scanner *level_sc, struct node_header
 	}
 }
 
+static struct node_header *scanner_get_leaf(struct level_scanner *level_sc, struct node_header *node)
+{
+	if (node->type != compressedLeafNode)
+		return node;
+
+	assert(NULL == level_sc->cached_leaf);
+	struct db_descriptor *db_desc = level_sc->db->db_desc;
+	level_sc->cached_leaf = leaf_cache_get(db_desc->leaf_cache, (struct bt_compressed_leaf_node *)node,
+					       level_sc->level_id, db_desc->levels[level_sc->level_id].leaf_size);
+	return (struct node_header *)level_sc->cached_leaf;
+}
+
+static void scanner_put_leaf(struct level_scanner *level_sc)
+{
+	if (!level_sc->cached_leaf)
+		return;
+	leaf_cache_put(level_sc->db->db_desc->leaf_cache, level_sc->cached_leaf);
+	level_sc->cached_leaf = NULL;
+}
+
+/*KVs of a cached leaf are copied out, the leaf may be evicted once the scanner moves to the next one*/
+static char *scanner_copy_kv(struct level_scanner *level_sc, struct kv_splice *kv)
+{
+	char *kv_buf = level_sc->kv_buf[level_sc->kv_buf_id];
+	if (!level_sc->cached_leaf || (char *)kv == kv_buf)
+		return (char *)kv;
+	memcpy(kv_buf, kv, get_kv_size(kv));
+	return kv_buf;
+}
+
 void close_scanner(scannerHandle *scanner)
 {
 	/*special care for L0*/
@@ -233,8 +277,11 @@ void close_scanner(scannerHandle *scanner)
 	}
 
 	for (int i = 1; i < MAX_LEVELS; i++) {
-		if (scanner->LEVEL_SCANNERS[i][0].valid) {
-			stack_destroy(&(scanner->LEVEL_SCANNERS[i][0].stack));
+		for (int j = 0; j < NUM_TREES_PER_LEVEL; j++) {
+			if (!scanner->LEVEL_SCANNERS[i][j].valid)
+				continue;
+			scanner_put_leaf(&scanner->LEVEL_SCANNERS[i][j]);
+			stack_destroy(&(scanner->LEVEL_SCANNERS[i][j].stack));
 		}
 	}
 	/*finally*/
@@ -245,7 +292,8 @@ void close_scanner(scannerHandle *scanner)
 		__sync_fetch_and_sub(&scanner->db->db_desc->levels[0].active_operations, 1);
 	}
 
-	free_dups_list(&scanner->heap.dups);
+	if (scanner->heap.dups)
+		free_dups_list(&scanner->heap.dups);
 
 	free(scanner);
 }
@@ -257,7 +305,10 @@ static void fill_compaction_scanner(struct level_scanner *level_sc, struct level
 	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(dlnode);
 	switch (get_kv_format(slot_array[position].key_category)) {
 	case KV_INPLACE: {
-		level_sc->keyValue = get_kv_offset(dlnode, level->leaf_size, slot_array[position].index);
+		level_sc->kv_buf_id ^= 1;
+		level_sc->keyValue =
+			scanner_copy_kv(level_sc, get_kv_inplace(dlnode, level->leaf_size, level_sc->level_id, position,
+								 level_sc->kv_buf[level_sc->kv_buf_id]));
 		level_sc->kv_format = KV_FORMAT;
 		level_sc->cat = slot_array[position].key_category;
 		level_sc->tombstone = slot_array[position].tombstone;
@@ -289,7 +340,10 @@ static void fill_normal_scanner(struct level_scanner *level_sc, struct level_des
 
 	switch (get_kv_format(slot_array[position].key_category)) {
 	case KV_INPLACE: {
-		level_sc->keyValue = get_kv_offset(dlnode, level->leaf_size, slot_array[position].index);
+		level_sc->kv_buf_id ^= 1;
+		level_sc->keyValue =
+			scanner_copy_kv(level_sc, get_kv_inplace(dlnode, level->leaf_size, level_sc->level_id, position,
+								 level_sc->kv_buf[level_sc->kv_buf_id]));
 		level_sc->kv_size = get_kv_size((struct kv_splice *)level_sc->keyValue);
 		level_sc->kv_format = KV_FORMAT;
 		level_sc->cat = slot_array[position].key_category;
@@ -305,7 +359,7 @@ static void fill_normal_scanner(struct level_scanner *level_sc, struct level_des
 		level_sc->keyValue = (void *)level_sc->kv_entry.dev_offt;
 		level_sc->kv_size = UINT32_MAX;
 		if (level_sc->level_id)
-			level_sc->kv_size = get_kv_size((struct kv_splice *)level_sc->keyValue);
+			level_sc->kv_size = level_sc->kv_entry.kv_size;
 		level_sc->cat = slot_array[position].key_category;
 		level_sc->tombstone = slot_array[position].tombstone;
 		break;
@@ -340,6 +394,7 @@ int32_t level_scanner_get_next(level_scanner *sc)
 
 			if (++stack_element.idx >= stack_element.node->num_entries) {
 				read_unlock_node(sc, stack_element.node);
+				scanner_put_leaf(sc);
 				status = POP_STACK;
 				break;
 			}
@@ -364,6 +419,7 @@ int32_t level_scanner_get_next(level_scanner *sc)
 			stack_element.node = REAL_ADDRESS(pivot->child_offt);
 
 			read_lock_node(sc, stack_element.node);
+			stack_element.node = scanner_get_leaf(sc, stack_element.node);
 			if (stack_element.node->type == leafNode || stack_element.node->type == leafRootNode) {
 				stack_element.idx = -1;
 				status = GET_NEXT_KV;
@@ -427,6 +483,7 @@ int32_t level_scanner_seek(level_scanner *level_sc, void *start_key_buf, SEEK_SC
 
 	/*Drop all paths*/
 	stack_reset(&(level_sc->stack));
+	scanner_put_leaf(level_sc);
 	/*Insert stack guard*/
 	stackElementT guard_element = { .guard = 1, .idx = 0, .node = NULL, .iterator = { 0 } };
 	stack_push(&(level_sc->stack), guard_element);
@@ -434,7 +491,7 @@ int32_t level_scanner_seek(level_scanner *level_sc, void *start_key_buf, SEEK_SC
 	stackElementT element = { .guard = 0, .idx = INT32_MAX, .node = NULL, .iterator = { 0 } };
 
 	struct node_header *node = level_sc->root;
-	while (node->type != leafNode && node->type != leafRootNode) {
+	while (node->type != leafNode && node->type != leafRootNode && node->type != compressedLeafNode) {
 		element.node = node;
 		index_iterator_init_with_key((struct index_node *)element.node, &element.iterator, start_key);
 
@@ -449,6 +506,7 @@ int32_t level_scanner_seek(level_scanner *level_sc, void *start_key_buf, SEEK_SC
 		node = REAL_ADDRESS(piv_pointer->child_offt);
 		read_lock_node(level_sc, node);
 	}
+	node = scanner_get_leaf(level_sc, node);
 	assert(node->type == leafNode || node->type == leafRootNode);
 
 	/*Whole path root to leaf is locked and inserted into the stack. Now set the element for the leaf node*/
@@ -533,6 +591,96 @@ void close_compaction_buffer_scanner(level_scanner *level_sc)
 	free(level_sc);
 }
 
+/*True if a range tombstone of a newer tree deletes the key of the heap node*/
+static bool scanner_is_range_deleted(struct scannerHandle *scanner, struct sh_heap_node *node)
+{
+	if (!scanner->num_range_tombstones)
+		return false;
+
+	struct bt_kv_log_address log_address = { .addr = node->KV, .tail_id = UINT8_MAX, .in_tail = 0 };
+	if (!node->level_id && BIG_INLOG == node->cat)
+		log_address = bt_get_kv_log_address(&scanner->db->db_desc->big_log, ABSOLUTE_ADDRESS(node->KV));
+
+	struct kv_splice *kv = (struct kv_splice *)log_address.addr;
+	uint32_t rank = rt_get_tree_rank(scanner->L0_active_tree, node->level_id, node->active_tree);
+	bool deleted = rt_is_deleted(scanner->range_tombstones, scanner->num_range_tombstones, rank,
+				     get_key_offset_in_kv(kv), get_key_size(kv));
+	if (log_address.in_tail)
+		bt_done_with_value_log_address(&scanner->db->db_desc->big_log, &log_address);
+	return deleted;
+}
+
+char *scanner_get_L0_keys(db_handle *handle, struct key_splice *start, struct key_splice *end, uint32_t *num_keys)
+{
+	struct db_descriptor *db_desc = handle->db_desc;
+	char *keys = NULL;
+	uint32_t keys_size = 0;
+	*num_keys = 0;
+
+	RWLOCK_RDLOCK(&db_desc->levels[0].guard_of_level.rx_lock);
+	__sync_fetch_and_add(&db_desc->levels[0].active_operations, 1);
+	uint8_t active_tree = db_desc->levels[0].active_tree;
+	struct node_header *root = db_desc->levels[0].root_w[active_tree];
+	if (!root)
+		root = db_desc->levels[0].root_r[active_tree];
+
+	struct level_scanner *level_sc = calloc(1, sizeof(struct level_scanner));
+	if (!level_sc) {
+		log_fatal("Calloc failed");
+		BUG_ON();
+	}
+	level_sc->db = handle;
+	level_sc->level_id = 0;
+	level_sc->root = root;
+	level_sc->dirty = 1;
+	if (!root || init_level_scanner(level_sc, start, GREATER_OR_EQUAL))
+		goto exit;
+
+	bool end_of_range = false;
+	do {
+		struct bt_kv_log_address log_address = { .addr = level_sc->keyValue,
+							  .tail_id = UINT8_MAX,
+							  .in_tail = 0 };
+		if (BIG_INLOG == level_sc->cat)
+			log_address = bt_get_kv_log_address(&db_desc->big_log, ABSOLUTE_ADDRESS(level_sc->keyValue));
+		struct kv_splice *kv = (struct kv_splice *)log_address.addr;
+
+		end_of_range = rt_key_cmp(get_key_offset_in_kv(kv), get_key_size(kv), get_key_splice_key_offset(end),
+					  get_key_splice_key_size(end)) >= 0;
+		if (!end_of_range && !level_sc->tombstone) {
+			uint32_t key_splice_size = sizeof(struct key_splice) + get_key_size(kv);
+			keys = realloc(keys, keys_size + key_splice_size);
+			if (!keys) {
+				log_fatal("Realloc failed");
+				BUG_ON();
+			}
+			serialize_kv_splice_to_key_splice(&keys[keys_size], kv);
+			keys_size += key_splice_size;
+			++(*num_keys);
+		}
+
+		if (log_address.in_tail)
+			bt_done_with_value_log_address(&db_desc->big_log, &log_address);
+	} while (!end_of_range && level_scanner_get_next(level_sc) != END_OF_DATABASE);
+
+	/*release the path the scanner stopped at*/
+	if (end_of_range) {
+		while (1) {
+			stackElementT stack_top = stack_pop(&level_sc->stack);
+			if (stack_top.guard)
+				break;
+			read_unlock_node(level_sc, stack_top.node);
+		}
+	}
+	stack_destroy(&level_sc->stack);
+
+exit:
+	free(level_sc);
+	__sync_fetch_and_sub(&db_desc->levels[0].active_operations, 1);
+	RWLOCK_UNLOCK(&db_desc->levels[0].guard_of_level.rx_lock);
+	return keys;
+}
+
 bool get_next(scannerHandle *scanner)
 {
 	while (1) {
@@ -562,6 +710,8 @@ bool get_next(scannerHandle *scanner)
 			//log_warn("ommiting duplicate %s", (char *)node.KV + 4);
 			continue;
 		}
+		if (scanner_is_range_deleted(scanner, &node))
+			continue;
 		return true;
 	}
 }
@@ -16,6 +16,7 @@
 #include "../btree/btree_node.h"
 #include "../btree/conf.h"
 #include "../btree/kv_pairs.h"
+#include "../btree/range_tombstone.h"
 #include "min_max_heap.h"
 #include "parallax/structures.h"
 #include "stack.h"
@@ -33,6 +34,11 @@ typedef enum SCANNER_TYPE { FORWARD_SCANNER = 1 } SCANNER_TYPE;
 
 typedef struct level_scanner {
 	struct kv_seperation_splice kv_entry;
+	/*in place KVs of prefix compressed leaves are rebuilt here, two buffers keep the previous KV valid*/
+	char kv_buf[2][LEAF_KV_INPLACE_MAX_SIZE];
+	uint8_t kv_buf_id;
+	/*decompressed copy of the current leaf when it is compressed, pinned in the leaf cache*/
+	struct bt_dynamic_leaf_node *cached_leaf;
 	db_handle *db;
 	stackT stack;
 	node_header *root; /*root of the tree when the cursor was initialized/reset, related to CPAAS-188*/
@@ -50,6 +56,11 @@ typedef struct level_scanner {
 typedef struct scannerHandle {
 	level_scanner LEVEL_SCANNERS[MAX_LEVELS][NUM_TREES_PER_LEVEL];
 	struct sh_heap heap;
+	/*range tombstones of the trees, the scanner skips the keys of older trees they hold*/
+	struct rt_ranked_list range_tombstones[MAX_LEVELS * NUM_TREES_PER_LEVEL];
+	uint32_t num_range_tombstones;
+	/*active tree of L0 when the lists were ranked*/
+	uint8_t L0_active_tree;
 	db_handle *db;
 	void *keyValue;
 	int32_t type; /*to be removed also*/
@@ -75,6 +86,15 @@ bool get_next(scannerHandle *scanner);
 level_scanner *_init_compaction_buffer_scanner(db_handle *handle, int level_id, node_header *node, void *start_key);
 
 void close_compaction_buffer_scanner(level_scanner *level_sc);
+
+/**
+ * Collects the keys of the active tree of L0 in [start, end) that are not
+ * deleted.
+ * @param num_keys: the number of keys returned
+ * @return a malloced buffer of num_keys consecutive key splices, NULL if
+ * there are none. The caller frees it.
+ */
+char *scanner_get_L0_keys(db_handle *handle, struct key_splice *start, struct key_splice *end, uint32_t *num_keys);
 void close_dirty_scanner(scannerHandle *sc);
 #if MEASURE_SST_USED_SPACE
 void perf_measure_leaf_capacity(db_handle *hd, int level_id);
@@ -0,0 +1,100 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks the background pool that runs the compactions and the GC
+  * of all the DBs: 1) With a single busy worker, jobs queued meanwhile run by
+  * priority and in submission order within a priority. 2) Dropping the last
+  * reference waits for the queued jobs of many workers to complete.
+**/
+
+#include <assert.h>
+#include <btree/bg_pool.h>
+#include <log.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_JOBS_PER_PRIORITY 8
+#define TEST_NUM_WORKERS 4
+
+static pthread_mutex_t test_lock = PTHREAD_MUTEX_INITIALIZER;
+static int worker_busy;
+static int release_worker;
+static int job_order[BG_NUM_PRIORITIES * TEST_JOBS_PER_PRIORITY];
+static int num_done;
+
+static void hold_worker(void *args)
+{
+	(void)args;
+	__atomic_store_n(&worker_busy, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&release_worker, __ATOMIC_ACQUIRE))
+		usleep(100);
+}
+
+static void record_job(void *args)
+{
+	pthread_mutex_lock(&test_lock);
+	job_order[num_done++] = (int)(uintptr_t)args;
+	pthread_mutex_unlock(&test_lock);
+}
+
+static void run_by_priority_and_verify(void)
+{
+	bg_pool_get(1);
+	bg_pool_submit(hold_worker, NULL, BG_L0_COMPACTION_PRIORITY);
+	while (!__atomic_load_n(&worker_busy, __ATOMIC_ACQUIRE))
+		usleep(100);
+
+	/*job ids are priority * TEST_JOBS_PER_PRIORITY + submission order, lowest priorities first*/
+	for (int priority = BG_NUM_PRIORITIES - 1; priority >= 0; --priority) {
+		for (int i = 0; i < TEST_JOBS_PER_PRIORITY; ++i)
+			bg_pool_submit(record_job, (void *)(uintptr_t)(priority * TEST_JOBS_PER_PRIORITY + i),
+				       priority);
+	}
+	__atomic_store_n(&release_worker, 1, __ATOMIC_RELEASE);
+	bg_pool_put();
+
+	assert(num_done == BG_NUM_PRIORITIES * TEST_JOBS_PER_PRIORITY);
+	for (int i = 0; i < num_done; ++i) {
+		if (job_order[i] != i) {
+			log_fatal("Job %d ran at position %d", job_order[i], i);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void put_waits_for_jobs_and_verify(void)
+{
+	num_done = 0;
+	/*the second reference shares the pool of the first one*/
+	bg_pool_get(TEST_NUM_WORKERS);
+	bg_pool_get(1);
+	for (int i = 0; i < BG_NUM_PRIORITIES * TEST_JOBS_PER_PRIORITY; ++i)
+		bg_pool_submit(record_job, (void *)(uintptr_t)i, i % BG_NUM_PRIORITIES);
+	bg_pool_put();
+	bg_pool_put();
+	if (num_done != BG_NUM_PRIORITIES * TEST_JOBS_PER_PRIORITY) {
+		log_fatal("Only %d jobs completed before the pool stopped", num_done);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+int main(void)
+{
+	run_by_priority_and_verify();
+	put_waits_for_jobs_and_verify();
+	log_info("Background pool test passed");
+	return 0;
+}
@@ -0,0 +1,217 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks compaction filters in TTL mode: 1) KVs put with a TTL are
+  * not found once they expire while KVs put without one remain. Background
+  * compactions may run the filter before the explicit ones, so the KVs it
+  * drops are checked only after those. 2) After the KVs are compacted to the
+  * last level the ones the filter drops are gone, the filter saw the values
+  * without their expiry time, and a scan returns only the live KVs. Half of
+  * the live KVs are put serialized, which must get an expiry time too.
+**/
+
+#include "arg_parser.h"
+#include <btree/kv_pairs.h>
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+#define TEST_NUM_KEYS 120000
+#define TEST_VALUE_SIZE 32
+#define TEST_TTL_SEC 1
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+enum key_kind { EXPIRING_KEY = 0, LIVE_KEY, FILTERED_KEY };
+
+struct filter_stats {
+	uint64_t calls;
+	uint64_t bad_values;
+};
+
+static bool drop_filtered_keys(void *context, struct par_key *key, struct par_value *value)
+{
+	(void)key;
+	struct filter_stats *stats = (struct filter_stats *)context;
+	__sync_fetch_and_add(&stats->calls, 1);
+	if (value->val_size != TEST_VALUE_SIZE)
+		__sync_fetch_and_add(&stats->bad_values, 1);
+	return 'd' == value->val_buffer[0];
+}
+
+static void fill_key(char *key_buf, uint64_t key_id)
+{
+	snprintf(key_buf, 32, "filter_key_%012lu", key_id);
+}
+
+static void insert_keys(par_handle handle)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	char serialized_buf[128];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		fill_key(key_buf, i);
+		memset(value_buf, FILTERED_KEY == i % 3 ? 'd' : 'k', TEST_VALUE_SIZE);
+		struct par_key_value kv = { .k.data = key_buf,
+					    .k.size = strlen(key_buf) + 1,
+					    .v.val_buffer = value_buf,
+					    .v.val_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		if (EXPIRING_KEY == i % 3)
+			par_put_with_ttl(handle, &kv, TEST_TTL_SEC, &error_message);
+		else if (LIVE_KEY == i % 3 && 0 == i % 2) {
+			struct kv_splice *serialized_kv = (struct kv_splice *)serialized_buf;
+			set_key_size(serialized_kv, kv.k.size);
+			set_value_size(serialized_kv, TEST_VALUE_SIZE);
+			set_key(serialized_kv, key_buf, kv.k.size);
+			set_value(serialized_kv, value_buf, TEST_VALUE_SIZE);
+			par_put_serialized(handle, serialized_buf, &error_message);
+		} else
+			par_put(handle, &kv, &error_message);
+		if (error_message) {
+			log_fatal("Put failed: %s", error_message);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void verify_keys(par_handle handle, bool compacted)
+{
+	char key_buf[32];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		fill_key(key_buf, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		struct par_value value = { .val_buffer = NULL };
+		const char *error_message = NULL;
+		par_get(handle, &key, &value, &error_message);
+		/*before the explicit compactions a filtered key may be dropped or not*/
+		if (FILTERED_KEY == i % 3 && !compacted) {
+			free(value.val_buffer);
+			continue;
+		}
+		bool expected = LIVE_KEY == i % 3;
+		if (expected != (NULL == error_message)) {
+			log_fatal("Key %s is %s", key_buf, expected ? "lost" : "still there");
+			_exit(EXIT_FAILURE);
+		}
+		if (expected && value.val_size != TEST_VALUE_SIZE) {
+			log_fatal("Key %s has a value of %u bytes instead of %u", key_buf, value.val_size,
+				  TEST_VALUE_SIZE);
+			_exit(EXIT_FAILURE);
+		}
+		free(value.val_buffer);
+	}
+}
+
+static void verify_scan(par_handle handle)
+{
+	const char *error_message = NULL;
+	par_scanner scanner = par_init_scanner(handle, NULL, PAR_FETCH_FIRST, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	uint64_t num_keys = 0;
+	for (; par_is_valid(scanner); par_get_next(scanner)) {
+		struct par_value value = par_get_value(scanner);
+		if (value.val_size != TEST_VALUE_SIZE || 'k' != value.val_buffer[0]) {
+			log_fatal("Scan returned a value of %u bytes", value.val_size);
+			_exit(EXIT_FAILURE);
+		}
+		++num_keys;
+	}
+	par_close_scanner(scanner);
+	if (num_keys != TEST_NUM_KEYS / 3) {
+		log_fatal("Scan returned %lu keys instead of %u", num_keys, TEST_NUM_KEYS / 3);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_compaction_filter.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "compaction_filter.db",
+				      .options = par_get_default_options() };
+	db_options.options[TTL_MODE].value = 1;
+	par_handle handle = par_open(&db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	struct filter_stats stats = { 0 };
+	par_set_compaction_filter(handle, drop_filtered_keys, &stats);
+
+	insert_keys(handle);
+	sleep(TEST_TTL_SEC + 1);
+	verify_keys(handle, false);
+
+	par_flush(handle);
+	wait_for_compactions(handle);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	verify_keys(handle, true);
+	verify_scan(handle);
+	if (0 == stats.calls || stats.bad_values) {
+		log_fatal("Filter was called %lu times, %lu with a wrong value size", stats.calls, stats.bad_values);
+		return EXIT_FAILURE;
+	}
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("Compaction filter test passed");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,200 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks the compaction scores of the levels: 1) A small load is
+  * flushed to L1, which stays below its target size. 2) Compactions are
+  * stalled with a low background I/O rate while a writer fills L0 past
+  * level0_size, so full L0 trees wait. The score of L0 must reach 1 and
+  * outrank the score of L1, which must stay below 1. 3) The I/O rate bound is
+  * removed and once the compactions complete the scores of all the levels
+  * must drop under 1.
+**/
+
+#include "arg_parser.h"
+#include <log.h>
+#include <parallax/parallax.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+#define MAX_LEVELS_REPORTED 16
+#define TEST_LEVEL0_SIZE (1024 * 1024UL)
+#define TEST_VALUE_SIZE 100
+/*L1 gets a fraction of level0_size, the writer fills enough L0 trees to wait for the stalled compaction*/
+#define TEST_PRELOAD_BYTES (TEST_LEVEL0_SIZE / 4)
+#define TEST_WRITER_BYTES (5 * TEST_LEVEL0_SIZE / 2)
+/*a segment request of a compaction waits seconds at this rate*/
+#define TEST_STALL_IO_RATE (256 * 1024UL)
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+struct writer_args {
+	par_handle handle;
+	uint64_t first_key_id;
+	uint64_t bytes;
+};
+
+/*Puts keys from first_key_id on until they hold bytes, returns the next key id*/
+static uint64_t put_keys(par_handle handle, uint64_t first_key_id, uint64_t bytes)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	memset(value_buf, 'S', TEST_VALUE_SIZE);
+	uint64_t key_id = first_key_id;
+	for (uint64_t bytes_put = 0; bytes_put < bytes; ++key_id) {
+		snprintf(key_buf, sizeof(key_buf), "scores_key_%012lu", key_id);
+		struct par_key_value kv = { .k.data = key_buf,
+					    .k.size = strlen(key_buf) + 1,
+					    .v.val_buffer = value_buf,
+					    .v.val_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_put(handle, &kv, &error_message);
+		if (error_message) {
+			log_fatal("Put failed: %s", error_message);
+			_exit(EXIT_FAILURE);
+		}
+		bytes_put += kv.k.size + kv.v.val_size;
+	}
+	return key_id;
+}
+
+/*Writes while compactions are stalled, puts block once L0 has no free tree*/
+static void *writer(void *args)
+{
+	struct writer_args *writer_args = (struct writer_args *)args;
+	put_keys(writer_args->handle, writer_args->first_key_id, writer_args->bytes);
+	return NULL;
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+static uint32_t get_scores(par_handle handle, double *scores)
+{
+	uint32_t num_levels = par_get_compaction_scores(handle, scores, MAX_LEVELS_REPORTED);
+	if (num_levels < 2) {
+		log_fatal("Compaction scores reported for %u levels", num_levels);
+		_exit(EXIT_FAILURE);
+	}
+	return num_levels;
+}
+
+static void wait_for_full_L0(par_handle handle)
+{
+	double scores[MAX_LEVELS_REPORTED];
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		get_scores(handle, scores);
+		if (scores[0] >= 1)
+			break;
+		usleep(100000);
+	}
+	log_info("L0 score %.2lf L1 score %.2lf with stalled compactions", scores[0], scores[1]);
+	if (scores[0] < 1) {
+		log_fatal("L0 score %lf stays below 1 past level0_size", scores[0]);
+		_exit(EXIT_FAILURE);
+	}
+	if (scores[1] <= 0 || scores[1] >= 1 || scores[0] <= scores[1]) {
+		log_fatal("L0 score %lf does not outrank L1 score %lf below its target", scores[0], scores[1]);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void wait_for_scores_under_1(par_handle handle)
+{
+	double scores[MAX_LEVELS_REPORTED];
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		uint32_t num_levels = get_scores(handle, scores);
+		uint32_t level_id = 0;
+		while (level_id < num_levels && scores[level_id] < 1)
+			++level_id;
+		if (level_id == num_levels)
+			return;
+		usleep(100000);
+	}
+	log_fatal("L0 score %lf L1 score %lf after the compactions", scores[0], scores[1]);
+	_exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_compaction_scores.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "compaction_scores.db",
+				      .options = par_get_default_options() };
+	db_options.options[LEVEL0_SIZE].value = TEST_LEVEL0_SIZE;
+	par_handle handle = par_open(&db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	uint64_t next_key_id = put_keys(handle, 0, TEST_PRELOAD_BYTES);
+	par_flush(handle);
+	wait_for_compactions(handle);
+
+	par_set_bg_io_rate(handle, TEST_STALL_IO_RATE);
+	struct writer_args writer_args = { .handle = handle, .first_key_id = next_key_id, .bytes = TEST_WRITER_BYTES };
+	pthread_t writer_thread;
+	if (pthread_create(&writer_thread, NULL, writer, &writer_args) != 0) {
+		log_fatal("Failed to start the writer");
+		return EXIT_FAILURE;
+	}
+	wait_for_full_L0(handle);
+
+	par_set_bg_io_rate(handle, 0);
+	pthread_join(writer_thread, NULL);
+	wait_for_scores_under_1(handle);
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("Compaction scores test passed");
+	return EXIT_SUCCESS;
+}
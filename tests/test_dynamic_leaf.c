@@ -0,0 +1,292 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test builds device level leaves in memory the way compaction does and
+  * verifies their key prefix compression: 1) Append sorted in place KVs whose
+  * common prefix shrinks as the leaf fills and check that lookups and the
+  * rebuilt KVs match the appended ones. 2) Check that lookup keys outside the
+  * prefix of the leaf are not found and land at the leaf boundaries. 3)
+  * Compress a full leaf the way cold levels store it and verify the leaf
+  * restored from it. 4) Append separated KVs whose prefixes tie to a leaf that
+  * keeps full keys and check that lookups find them without reading the log.
+**/
+
+#include <assert.h>
+#include <btree/btree.h>
+#include <btree/dynamic_leaf.h>
+#include <btree/kv_pairs.h>
+#include <log.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_LEAF_SIZE 8192
+#define TEST_MAX_KEYS 1024
+#define TEST_VALUE_SIZE 16
+
+static struct kv_splice *create_kv(const char *key)
+{
+	int32_t key_size = strlen(key);
+	struct kv_splice *kv = calloc(1, get_kv_metadata_size() + key_size + TEST_VALUE_SIZE);
+	set_key_size(kv, key_size);
+	set_key(kv, (char *)key, key_size);
+	set_value_size(kv, TEST_VALUE_SIZE);
+	char value[TEST_VALUE_SIZE];
+	memset(value, key[key_size - 1], TEST_VALUE_SIZE);
+	set_value(kv, value, TEST_VALUE_SIZE);
+	return kv;
+}
+
+static struct bt_dynamic_leaf_node *create_leaf(void)
+{
+	struct bt_dynamic_leaf_node *leaf = calloc(1, TEST_LEAF_SIZE);
+	leaf->header.type = leafNode;
+	return leaf;
+}
+
+static uint32_t fill_leaf(struct bt_dynamic_leaf_node *leaf, struct kv_splice **kvs, uint32_t num_kvs)
+{
+	uint32_t appended = 0;
+	for (; appended < num_kvs; ++appended) {
+		struct write_dynamic_leaf_args args = { .leaf = leaf,
+							.key_value_buf = (char *)kvs[appended],
+							.key_value_size = get_kv_size(kvs[appended]),
+							.level_id = 1,
+							.kv_format = KV_FORMAT,
+							.cat = SMALL_INPLACE };
+		if (!append_to_prefix_compressed_leaf(&args, TEST_LEAF_SIZE))
+			break;
+	}
+	return appended;
+}
+
+static struct dl_bsearch_result search_leaf(struct bt_dynamic_leaf_node *leaf, struct kv_splice *kv)
+{
+	struct dl_bsearch_result result = { .middle = 0, .status = INSERT, .op = DYNAMIC_LEAF_INSERT };
+	bt_insert_req req = { 0 };
+	req.key_value_buf = (char *)kv;
+	req.metadata.key_format = KV_FORMAT;
+	req.metadata.level_id = 1;
+	binary_search_dynamic_leaf(leaf, TEST_LEAF_SIZE, &req, &result);
+	return result;
+}
+
+static void verify_leaf(struct bt_dynamic_leaf_node *leaf, struct kv_splice **kvs, uint32_t num_kvs)
+{
+	char kv_buf[LEAF_KV_INPLACE_MAX_SIZE];
+	for (uint32_t i = 0; i < num_kvs; ++i) {
+		struct kv_splice *kv = get_kv_inplace(leaf, TEST_LEAF_SIZE, 1, i, kv_buf);
+		if (get_kv_size(kv) != get_kv_size(kvs[i]) || memcmp(kv, kvs[i], get_kv_size(kv))) {
+			log_fatal("Rebuilt KV %u differs from the appended one", i);
+			_exit(EXIT_FAILURE);
+		}
+
+		struct dl_bsearch_result result = search_leaf(leaf, kvs[i]);
+		if (result.status != FOUND || result.middle != (int)i) {
+			log_fatal("Lookup of key %.*s failed status %d position %d", get_key_size(kvs[i]),
+				  get_key_offset_in_kv(kvs[i]), result.status, result.middle);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void append_shrinking_prefix_and_verify(void)
+{
+	struct kv_splice *kvs[TEST_MAX_KEYS];
+	char key[64];
+	/*the shared prefix shrinks from the full key to "user" as the keys spread*/
+	for (uint32_t i = 0; i < TEST_MAX_KEYS; ++i) {
+		snprintf(key, sizeof(key), "user%020u", i * 37);
+		kvs[i] = create_kv(key);
+	}
+
+	uint32_t kv_offt = 0;
+	uint32_t num_leaves = 0;
+	while (kv_offt < TEST_MAX_KEYS) {
+		struct bt_dynamic_leaf_node *leaf = create_leaf();
+		uint32_t appended = fill_leaf(leaf, &kvs[kv_offt], TEST_MAX_KEYS - kv_offt);
+		assert(appended > 0);
+		verify_leaf(leaf, &kvs[kv_offt], appended);
+		kv_offt += appended;
+		++num_leaves;
+		free(leaf);
+	}
+
+	uint32_t plain_leaf_kvs = (TEST_LEAF_SIZE - sizeof(struct bt_dynamic_leaf_node)) /
+				  (get_kv_size(kvs[0]) + sizeof(struct bt_dynamic_leaf_slot_array));
+	uint32_t plain_leaves = (TEST_MAX_KEYS + plain_leaf_kvs - 1) / plain_leaf_kvs;
+	if (num_leaves >= plain_leaves) {
+		log_fatal("Prefix compression did not save leaves: %u compressed vs %u plain", num_leaves,
+			  plain_leaves);
+		_exit(EXIT_FAILURE);
+	}
+	log_info("Stored %u KVs in %u compressed leaves instead of %u", TEST_MAX_KEYS, num_leaves, plain_leaves);
+
+	for (uint32_t i = 0; i < TEST_MAX_KEYS; ++i)
+		free(kvs[i]);
+}
+
+static void lookup_outside_prefix_and_verify(void)
+{
+	struct kv_splice *kvs[3] = { create_kv("prefix_b1"), create_kv("prefix_b2"), create_kv("prefix_b3") };
+	struct bt_dynamic_leaf_node *leaf = create_leaf();
+	assert(fill_leaf(leaf, kvs, 3) == 3);
+	assert(leaf->header.leaf_prefix_size == strlen("prefix_b"));
+	verify_leaf(leaf, kvs, 3);
+
+	const char *smaller_keys[] = { "prefix_a9", "prefix", "a" };
+	for (uint32_t i = 0; i < sizeof(smaller_keys) / sizeof(smaller_keys[0]); ++i) {
+		struct kv_splice *kv = create_kv(smaller_keys[i]);
+		struct dl_bsearch_result result = search_leaf(leaf, kv);
+		if (result.status == FOUND || result.middle != 0) {
+			log_fatal("Key %s should be before the leaf", smaller_keys[i]);
+			_exit(EXIT_FAILURE);
+		}
+		free(kv);
+	}
+
+	const char *larger_keys[] = { "prefix_c0", "prefix_b4", "z" };
+	for (uint32_t i = 0; i < sizeof(larger_keys) / sizeof(larger_keys[0]); ++i) {
+		struct kv_splice *kv = create_kv(larger_keys[i]);
+		struct dl_bsearch_result result = search_leaf(leaf, kv);
+		if (result.status == FOUND || result.middle != 3) {
+			log_fatal("Key %s should be after the leaf", larger_keys[i]);
+			_exit(EXIT_FAILURE);
+		}
+		free(kv);
+	}
+
+	free(leaf);
+	for (uint32_t i = 0; i < 3; ++i)
+		free(kvs[i]);
+}
+
+static void compress_leaf_and_verify(void)
+{
+	struct kv_splice *kvs[TEST_MAX_KEYS];
+	char key[64];
+	for (uint32_t i = 0; i < TEST_MAX_KEYS; ++i) {
+		snprintf(key, sizeof(key), "compressed_user%020u", i);
+		kvs[i] = create_kv(key);
+	}
+
+	struct bt_dynamic_leaf_node *leaf = create_leaf();
+	uint32_t appended = fill_leaf(leaf, kvs, TEST_MAX_KEYS);
+	assert(appended > 0 && appended < TEST_MAX_KEYS);
+
+	struct bt_compressed_leaf_node *node = calloc(1, TEST_LEAF_SIZE);
+	uint32_t node_size = compress_dynamic_leaf(leaf, TEST_LEAF_SIZE, node);
+	if (0 == node_size || node_size >= TEST_LEAF_SIZE / 2 || node_size % sizeof(uint64_t) ||
+	    node->type != compressedLeafNode || node->node_size != node_size) {
+		log_fatal("Leaf of %u KVs compressed to %u bytes", appended, node_size);
+		_exit(EXIT_FAILURE);
+	}
+	log_info("Compressed a leaf of %u bytes to %u bytes", TEST_LEAF_SIZE, node_size);
+
+	/*the restored leaf must not depend on the free space of the buffer*/
+	struct bt_dynamic_leaf_node *restored_leaf = create_leaf();
+	memset(restored_leaf, 0xFF, TEST_LEAF_SIZE);
+	decompress_dynamic_leaf(node, restored_leaf, TEST_LEAF_SIZE);
+	assert(restored_leaf->header.num_entries == leaf->header.num_entries);
+	verify_leaf(restored_leaf, kvs, appended);
+
+	free(restored_leaf);
+	free(node);
+	free(leaf);
+	for (uint32_t i = 0; i < TEST_MAX_KEYS; ++i)
+		free(kvs[i]);
+}
+
+static void full_keys_and_verify(void)
+{
+	struct kv_splice *kvs[TEST_MAX_KEYS];
+	char key[64];
+	struct bt_dynamic_leaf_node *leaf = create_leaf();
+	leaf->header.leaf_full_keys = 1;
+
+	/*separated KVs point to an unmapped log address, comparing them through the log crashes*/
+	uint32_t appended = 0;
+	for (; appended < TEST_MAX_KEYS; ++appended) {
+		snprintf(key, sizeof(key), "shared_prefix_user%012u", appended * 7);
+		kvs[appended] = create_kv(key);
+		struct kv_seperation_splice kv_sep = { .dev_offt = sizeof(uint64_t),
+						       .kv_size = get_kv_size(kvs[appended]) };
+		memcpy(kv_sep.prefix, key, PREFIX_SIZE);
+		struct write_dynamic_leaf_args args = { .leaf = leaf,
+							.key_value_buf = (char *)kvs[appended],
+							.key_value_size = get_kv_size(kvs[appended]),
+							.level_id = 1,
+							.kv_format = KV_FORMAT,
+							.cat = SMALL_INPLACE };
+		if (appended % 2) {
+			args.key_value_buf = (char *)&kv_sep;
+			args.key_value_size = get_kv_seperated_splice_size();
+			args.kv_format = KV_PREFIX;
+			args.cat = BIG_INLOG;
+			args.full_key = get_key_offset_in_kv(kvs[appended]);
+			args.full_key_size = get_key_size(kvs[appended]);
+		}
+		if (!append_to_prefix_compressed_leaf(&args, TEST_LEAF_SIZE)) {
+			free(kvs[appended]);
+			break;
+		}
+	}
+	assert(appended > 2 && appended < TEST_MAX_KEYS);
+
+	struct bt_dynamic_leaf_slot_array *slot_array = get_slot_array_offset(leaf);
+	for (uint32_t i = 0; i < appended; ++i) {
+		struct dl_bsearch_result result = search_leaf(leaf, kvs[i]);
+		if (result.status != FOUND || result.middle != (int)i) {
+			log_fatal("Lookup of key %.*s failed status %d position %d", get_key_size(kvs[i]),
+				  get_key_offset_in_kv(kvs[i]), result.status, result.middle);
+			_exit(EXIT_FAILURE);
+		}
+		if (0 == i % 2)
+			continue;
+		struct key_splice *full_key =
+			get_separated_full_key(leaf, get_kv_offset(leaf, TEST_LEAF_SIZE, slot_array[i].index));
+		if (full_key->key_size != get_key_size(kvs[i]) ||
+		    memcmp(full_key->data, get_key_offset_in_kv(kvs[i]), full_key->key_size)) {
+			log_fatal("Full key of separated KV %u differs from the appended one", i);
+			_exit(EXIT_FAILURE);
+		}
+
+		/*a missing key between two separated KVs lands after the smaller one*/
+		snprintf(key, sizeof(key), "%.*s0", get_key_size(kvs[i]), get_key_offset_in_kv(kvs[i]));
+		struct kv_splice *missing_kv = create_kv(key);
+		result = search_leaf(leaf, missing_kv);
+		if (result.status == FOUND || result.middle != (int)i + 1) {
+			log_fatal("Key %s should land at position %u", key, i + 1);
+			_exit(EXIT_FAILURE);
+		}
+		free(missing_kv);
+	}
+	log_info("Found %u KVs in a leaf that keeps full keys", appended);
+
+	free(leaf);
+	for (uint32_t i = 0; i < appended; ++i)
+		free(kvs[i]);
+}
+
+int main(void)
+{
+	append_shrinking_prefix_and_verify();
+	lookup_outside_prefix_and_verify();
+	compress_leaf_and_verify();
+	full_keys_and_verify();
+	log_info("Prefix and zlib compressed leaves test passed");
+	return 0;
+}
@@ -0,0 +1,222 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks that the batched lookups of find_keys, which GC uses,
+  * match a find_key per key: 1) Every other key is put and some are deleted,
+  * then the keys are compacted to device levels with compressed leaves and
+  * small partitions, the test checks that such levels exist. 2) Some keys are
+  * updated and deleted again in L0. 3) Sorted batches of present and missing
+  * keys, contiguous ones that share leaves and sparse ones that cross leaves
+  * and partitions, are looked up with find_keys and each result is compared
+  * with the result of find_key for the same key. Both report deleted keys as
+  * not found.
+**/
+
+#include "arg_parser.h"
+#include <btree/btree.h>
+#include <btree/kv_pairs.h>
+#include <btree/segment_allocator.h>
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+/*ids are twice the number of keys, odd ids are missing keys*/
+#define TEST_NUM_IDS 600000
+#define TEST_VALUE_SIZE 32
+#define TEST_KEY_SIZE 32
+#define TEST_PARTITION_SIZE (1024 * 1024UL)
+#define TEST_BATCH_SIZE 512
+/*sparse batches skip leaves and partitions between their keys*/
+#define TEST_SPARSE_STRIDE 997
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+static void fill_key(char *key_buf, uint64_t key_id)
+{
+	snprintf(key_buf, TEST_KEY_SIZE, "find_keys_%012lu", key_id);
+}
+
+static void put_key(par_handle handle, uint64_t key_id)
+{
+	char key_buf[TEST_KEY_SIZE];
+	char value_buf[TEST_VALUE_SIZE];
+	fill_key(key_buf, key_id);
+	memset(value_buf, 'A' + key_id % 26, TEST_VALUE_SIZE);
+	struct par_key_value kv = { .k.data = key_buf,
+				    .k.size = strlen(key_buf) + 1,
+				    .v.val_buffer = value_buf,
+				    .v.val_size = TEST_VALUE_SIZE };
+	const char *error_message = NULL;
+	par_put(handle, &kv, &error_message);
+	if (error_message) {
+		log_fatal("Put failed: %s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void remove_key(par_handle handle, uint64_t key_id)
+{
+	char key_buf[TEST_KEY_SIZE];
+	fill_key(key_buf, key_id);
+	struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+	const char *error_message = NULL;
+	par_delete(handle, &key, &error_message);
+	if (error_message) {
+		log_fatal("Delete failed: %s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+/*The batch must meet leaves decompressed from the leaf cache and leaves of different partitions*/
+static void check_device_levels(struct db_descriptor *db_desc)
+{
+	uint8_t has_compressed_level = 0;
+	uint8_t has_partitioned_level = 0;
+	for (uint8_t level_id = 1; level_id < MAX_LEVELS; ++level_id) {
+		for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+			struct node_header *root = db_desc->levels[level_id].root_r[tree_id];
+			if (!root)
+				continue;
+			if (db_desc->levels[level_id].compress_leaves)
+				has_compressed_level = 1;
+			if (seg_get_partition_table(root))
+				has_partitioned_level = 1;
+		}
+	}
+	if (!has_compressed_level || !has_partitioned_level) {
+		log_fatal("No device level with compressed leaves: %u or partitions: %u", has_compressed_level,
+			  has_partitioned_level);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+/*Looks up the batch with find_keys and every key of it with find_key, their results must match*/
+static void check_batch(struct db_descriptor *db_desc, uint64_t first_id, uint64_t stride)
+{
+	static char key_bufs[TEST_BATCH_SIZE][sizeof(struct key_splice) + TEST_KEY_SIZE];
+	struct lookup_operation get_ops[TEST_BATCH_SIZE];
+	char key_buf[TEST_KEY_SIZE];
+	uint32_t num_ops = 0;
+	for (uint64_t key_id = first_id; key_id < TEST_NUM_IDS + 2 && num_ops < TEST_BATCH_SIZE; key_id += stride) {
+		fill_key(key_buf, key_id);
+		struct key_splice *key = (struct key_splice *)key_bufs[num_ops];
+		set_key_size_of_key_splice(key, strlen(key_buf) + 1);
+		set_key_splice_key_offset(key, key_buf);
+		get_ops[num_ops] = (struct lookup_operation){ .db_desc = db_desc,
+							      .key_buf = key_bufs[num_ops],
+							      .buffer_to_pack_kv = NULL,
+							      .size = 0,
+							      .retrieve = 0 };
+		++num_ops;
+	}
+	find_keys(get_ops, num_ops);
+
+	for (uint32_t i = 0; i < num_ops; ++i) {
+		struct lookup_operation get_op = { .db_desc = db_desc,
+						   .key_buf = key_bufs[i],
+						   .buffer_to_pack_kv = NULL,
+						   .size = 0,
+						   .retrieve = 0 };
+		find_key(&get_op);
+		if (get_op.found != get_ops[i].found) {
+			struct key_splice *key = (struct key_splice *)key_bufs[i];
+			log_fatal("find_keys found: %u find_key found: %u for key %.*s of the batch at %lu stride %lu",
+				  get_ops[i].found, get_op.found, get_key_splice_key_size(key),
+				  get_key_splice_key_offset(key), first_id, stride);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_find_keys.", NULL, INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "find_keys.db",
+				      .options = par_get_default_options() };
+	/*levels below L1 compress their leaves*/
+	db_options.options[LEAF_COMPRESSION].value = 1;
+	db_options.options[LEVEL_MEDIUM_INPLACE].value = 1;
+	db_options.options[PARTITION_SIZE].value = TEST_PARTITION_SIZE;
+	par_handle handle = par_open(&db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	for (uint64_t key_id = 0; key_id < TEST_NUM_IDS; key_id += 2)
+		put_key(handle, key_id);
+	for (uint64_t key_id = 0; key_id < TEST_NUM_IDS; key_id += 10)
+		remove_key(handle, key_id);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	struct db_descriptor *db_desc = ((db_handle *)handle)->db_desc;
+	check_device_levels(db_desc);
+
+	/*L0 puts some deleted keys again and deletes others, so lookups stop at different levels*/
+	for (uint64_t key_id = 0; key_id < TEST_NUM_IDS; key_id += 30)
+		put_key(handle, key_id);
+	for (uint64_t key_id = 4; key_id < TEST_NUM_IDS; key_id += 14)
+		remove_key(handle, key_id);
+
+	for (uint64_t first_id = 0; first_id < TEST_NUM_IDS; first_id += TEST_BATCH_SIZE)
+		check_batch(db_desc, first_id, 1);
+	for (uint64_t first_id = 0; first_id < TEST_SPARSE_STRIDE; first_id += 97)
+		check_batch(db_desc, first_id, TEST_SPARSE_STRIDE);
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("find_keys test passed");
+	return EXIT_SUCCESS;
+}
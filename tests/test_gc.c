@@ -1,5 +1,6 @@
 #include "arg_parser.h"
 #include <assert.h>
+#include <btree/btree.h>
 #include <btree/gc.h>
 #include <log.h>
 #include <parallax/parallax.h>
@@ -21,6 +22,7 @@ int update_half = 0;
  * Next we update half of the KVs to trigger the GC thread to move KVs in the log tail (Phase 3).
  * Finally, we wait for the GC thread to notify the test that KVs have been moved
  * at the log tail before validating the KVs that were not updated still contain the same values (Phase 4).
+ * GC must have moved live KVs and every key, updated or not, must read back its latest value (Phase 5).
  */
 
 typedef struct key {
@@ -112,6 +114,32 @@ void validate_inserted_keys(par_handle hd)
 	log_info("Population ended");
 }
 
+/*Checks that every key holds its latest value, the updated keys got the values after the first population*/
+static void validate_all_keys(par_handle hd)
+{
+	char key_buf[KV_SIZE];
+	for (uint64_t i = TOTAL_KEYS; i < (TOTAL_KEYS + NUM_KEYS); i++) {
+		memcpy(key_buf, KEY_PREFIX, strlen(KEY_PREFIX));
+		sprintf(key_buf + strlen(KEY_PREFIX), "%llu", (long long unsigned)i);
+		uint64_t expected_counter = i % 2 == 1 ? i - TOTAL_KEYS : NUM_KEYS + (i - TOTAL_KEYS) / 2;
+
+		struct par_key k = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		struct par_value v = { 0 };
+		const char *error_message = NULL;
+		par_get(hd, &k, &v, &error_message);
+		if (error_message) {
+			log_fatal("Key %s disappeared after GC", key_buf);
+			exit(EXIT_FAILURE);
+		}
+
+		if (expected_counter != *(uint64_t *)v.val_buffer) {
+			log_fatal("Key %s does not hold its latest value after GC", key_buf);
+			exit(EXIT_FAILURE);
+		}
+		free(v.val_buffer);
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	int help_flag = 0;
@@ -160,5 +188,13 @@ int main(int argc, char *argv[])
 	validate_inserted_keys(handle);
 	log_info("GCed and Validated Keys");
 
+	uint64_t gc_keys_transferred = ((db_handle *)handle)->db_desc->gc_keys_transferred;
+	if (0 == gc_keys_transferred) {
+		log_fatal("GC did not move any live KV");
+		exit(EXIT_FAILURE);
+	}
+	validate_all_keys(handle);
+	log_info("GC moved %lu KVs and all keys hold their latest values", gc_keys_transferred);
+
 	return 0;
 }
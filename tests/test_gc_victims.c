@@ -0,0 +1,301 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks the order GC picks its victim segments in: 1) Segments
+  * with known garbage and age are registered in a DB descriptor of the test,
+  * a pass picks them by cost-benefit, so an old segment with little garbage
+  * goes before young ones with more, and a segment whose garbage grows moves
+  * up. A segment under GC_SEGMENT_THRESHOLD is not picked until its garbage
+  * reaches it. 2) The tail segment of the big log is skipped and picked once
+  * it is no longer the tail. 3) A pass picks at most SEGMENTS_TORECLAIM
+  * segments, the next pass picks the rest. 4) A DB gets garbage in its big
+  * log with GC disabled, the append clocks, the garbage and the victim order
+  * of its segments are the same after the DB is reopened.
+**/
+
+#include "arg_parser.h"
+#include <btree/btree.h>
+#include <btree/conf.h>
+#include <btree/gc.h>
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uthash.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+#define TEST_LOG_CLOCK 100
+#define TEST_NUM_ORDERED_SEGMENTS 6
+#define TEST_TAIL_SEGMENT 8
+#define TEST_NUM_CAPPED_SEGMENTS (SEGMENTS_TORECLAIM + 10)
+/*big KVs go to the big log*/
+#define TEST_NUM_KEYS 20000
+#define TEST_VALUE_SIZE 1500
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+static uint64_t get_segment_dev_offt(uint32_t segment_id)
+{
+	return (uint64_t)(segment_id + 1) * SEGMENT_SIZE;
+}
+
+static struct large_log_segment_gc_entry *find_segment(struct db_descriptor *db_desc, uint64_t segment_dev_offt)
+{
+	struct large_log_segment_gc_entry *segment = NULL;
+	HASH_FIND(hh, db_desc->segment_ht, &segment_dev_offt, sizeof(segment_dev_offt), segment);
+	return segment;
+}
+
+/*Adds garbage to a segment the way compactions do*/
+static void add_garbage(struct db_descriptor *db_desc, uint32_t segment_id, uint32_t garbage_bytes)
+{
+	struct large_log_segment_gc_entry *segment = find_segment(db_desc, get_segment_dev_offt(segment_id));
+	MUTEX_LOCK(&db_desc->segment_ht_lock);
+	segment->garbage_bytes += garbage_bytes;
+	gc_update_victim(db_desc, segment);
+	MUTEX_UNLOCK(&db_desc->segment_ht_lock);
+}
+
+static void add_segment(struct db_descriptor *db_desc, uint32_t segment_id, uint32_t append_clock,
+			double garbage_fraction)
+{
+	gc_add_log_segment(db_desc, get_segment_dev_offt(segment_id), append_clock);
+	add_garbage(db_desc, segment_id, garbage_fraction * SEGMENT_SIZE);
+}
+
+static void check_victims(struct db_descriptor *db_desc, const uint32_t *segment_ids, uint32_t num_segments,
+			  const char *phase)
+{
+	uint64_t victims[SEGMENTS_TORECLAIM];
+	uint32_t num_victims = gc_pick_victims(db_desc, victims);
+	if (num_victims != num_segments) {
+		log_fatal("GC picked %u victims instead of %u %s", num_victims, num_segments, phase);
+		_exit(EXIT_FAILURE);
+	}
+	for (uint32_t i = 0; i < num_victims; ++i) {
+		if (victims[i] != get_segment_dev_offt(segment_ids[i])) {
+			log_fatal("GC picked segment %lu instead of segment %u at position %u %s",
+				  victims[i] / SEGMENT_SIZE - 1, segment_ids[i], i, phase);
+			_exit(EXIT_FAILURE);
+		}
+		if (!find_segment(db_desc, victims[i])->segment_moved) {
+			log_fatal("Victim %u is not marked moved %s", segment_ids[i], phase);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void test_victim_order(void)
+{
+	struct db_descriptor *db_desc = calloc(1UL, sizeof(struct db_descriptor));
+	MUTEX_INIT(&db_desc->segment_ht_lock, NULL);
+	db_desc->big_log.size = (uint64_t)TEST_LOG_CLOCK * SEGMENT_SIZE;
+	db_desc->big_log.tail_dev_offt = get_segment_dev_offt(TEST_TAIL_SEGMENT);
+
+	/*age and garbage trade off, segment 3 is the oldest and goes before younger segments with more garbage*/
+	add_segment(db_desc, 1, TEST_LOG_CLOCK - 1, 0.9);
+	add_segment(db_desc, 2, TEST_LOG_CLOCK - 10, 0.5);
+	add_segment(db_desc, 3, 0, 0.2);
+	add_segment(db_desc, 4, TEST_LOG_CLOCK - 50, 0.5);
+	add_segment(db_desc, 5, TEST_LOG_CLOCK - 40, 0.9);
+	add_segment(db_desc, 6, TEST_LOG_CLOCK - 5, 0.12);
+	/*the tail would go second*/
+	add_segment(db_desc, TEST_TAIL_SEGMENT, TEST_LOG_CLOCK - 30, 0.99);
+	/*segment 6 moves up as its garbage grows*/
+	add_garbage(db_desc, 6, 0.83 * SEGMENT_SIZE);
+	/*segment 7 has the best age but a byte less garbage than the threshold*/
+	uint32_t threshold_bytes = GC_SEGMENT_THRESHOLD * SEGMENT_SIZE;
+	if (threshold_bytes < GC_SEGMENT_THRESHOLD * SEGMENT_SIZE)
+		++threshold_bytes;
+	gc_add_log_segment(db_desc, get_segment_dev_offt(7), 0);
+	add_garbage(db_desc, 7, threshold_bytes - 1);
+
+	uint32_t order[TEST_NUM_ORDERED_SEGMENTS] = { 5, 4, 3, 6, 2, 1 };
+	check_victims(db_desc, order, TEST_NUM_ORDERED_SEGMENTS, "by cost-benefit");
+	check_victims(db_desc, NULL, 0, "while the tail is written");
+
+	/*segment 7 reaches the threshold and the log moves past the tail*/
+	add_garbage(db_desc, 7, 1);
+	db_desc->big_log.tail_dev_offt = get_segment_dev_offt(TEST_TAIL_SEGMENT + 1);
+	uint32_t tail_order[2] = { TEST_TAIL_SEGMENT, 7 };
+	check_victims(db_desc, tail_order, 2, "after the tail moved");
+
+	/*older segments go first, a pass takes at most SEGMENTS_TORECLAIM of them*/
+	db_desc->big_log.size = (uint64_t)(2 * TEST_LOG_CLOCK + TEST_NUM_CAPPED_SEGMENTS) * SEGMENT_SIZE;
+	uint32_t capped_order[TEST_NUM_CAPPED_SEGMENTS];
+	for (uint32_t i = 0; i < TEST_NUM_CAPPED_SEGMENTS; ++i) {
+		uint32_t segment_id = 2 * TEST_LOG_CLOCK + i;
+		add_segment(db_desc, segment_id, TEST_LOG_CLOCK + i, 0.5);
+		capped_order[i] = segment_id;
+	}
+	check_victims(db_desc, capped_order, SEGMENTS_TORECLAIM, "in the first capped pass");
+	check_victims(db_desc, &capped_order[SEGMENTS_TORECLAIM], TEST_NUM_CAPPED_SEGMENTS - SEGMENTS_TORECLAIM,
+		      "in the second capped pass");
+
+	struct large_log_segment_gc_entry *segment = NULL;
+	struct large_log_segment_gc_entry *tmp = NULL;
+	HASH_ITER(hh, db_desc->segment_ht, segment, tmp)
+	{
+		HASH_DEL(db_desc->segment_ht, segment);
+		free(segment);
+	}
+	gc_destroy_victims(db_desc);
+	pthread_mutex_destroy(&db_desc->segment_ht_lock);
+	free(db_desc);
+	log_info("Victims are picked in cost-benefit order");
+}
+
+static void put_keys(par_handle handle, char version)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	memset(value_buf, version, TEST_VALUE_SIZE);
+	for (uint32_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		snprintf(key_buf, sizeof(key_buf), "gc_victims_%08u", i);
+		struct par_key_value kv = { .k.data = key_buf,
+					    .k.size = strlen(key_buf) + 1,
+					    .v.val_buffer = value_buf,
+					    .v.val_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_put(handle, &kv, &error_message);
+		if (error_message) {
+			log_fatal("Put failed: %s", error_message);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+static par_handle open_db(par_db_options *db_options)
+{
+	const char *error_message = NULL;
+	par_handle handle = par_open(db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	return handle;
+}
+
+static void test_victims_after_reopen(char *path)
+{
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "gc_victims.db",
+				      .options = par_get_default_options() };
+	par_handle handle = open_db(&db_options);
+
+	/*the compaction drops the first version of every key, so the old segments of the log hold garbage*/
+	put_keys(handle, 'A');
+	put_keys(handle, 'B');
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+
+	/*the pass only claims the victims in memory, GC is disabled so they are not moved*/
+	struct db_descriptor *db_desc = ((db_handle *)handle)->db_desc;
+	uint32_t log_clock = gc_get_log_clock(db_desc);
+	uint64_t victims[SEGMENTS_TORECLAIM];
+	uint32_t append_clocks[SEGMENTS_TORECLAIM];
+	uint32_t garbage_bytes[SEGMENTS_TORECLAIM];
+	uint32_t num_victims = gc_pick_victims(db_desc, victims);
+	if (!num_victims) {
+		log_fatal("The big log has no GC victims");
+		_exit(EXIT_FAILURE);
+	}
+	for (uint32_t i = 0; i < num_victims; ++i) {
+		struct large_log_segment_gc_entry *segment = find_segment(db_desc, victims[i]);
+		append_clocks[i] = segment->append_clock;
+		garbage_bytes[i] = segment->garbage_bytes;
+	}
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	db_options.create_flag = PAR_DONOT_CREATE_DB;
+	handle = open_db(&db_options);
+	db_desc = ((db_handle *)handle)->db_desc;
+
+	if (gc_get_log_clock(db_desc) != log_clock) {
+		log_fatal("Log clock is %u instead of %u after reopen", gc_get_log_clock(db_desc), log_clock);
+		_exit(EXIT_FAILURE);
+	}
+	for (uint32_t i = 0; i < num_victims; ++i) {
+		struct large_log_segment_gc_entry *segment = find_segment(db_desc, victims[i]);
+		if (!segment || segment->append_clock != append_clocks[i] ||
+		    segment->garbage_bytes != garbage_bytes[i]) {
+			log_fatal("Segment %lu lost its append clock %u or its garbage %u after reopen", victims[i],
+				  append_clocks[i], garbage_bytes[i]);
+			_exit(EXIT_FAILURE);
+		}
+	}
+	uint64_t recovered_victims[SEGMENTS_TORECLAIM];
+	if (gc_pick_victims(db_desc, recovered_victims) != num_victims ||
+	    memcmp(victims, recovered_victims, num_victims * sizeof(uint64_t))) {
+		log_fatal("GC picks its victims in another order after reopen");
+		_exit(EXIT_FAILURE);
+	}
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	log_info("%u victims keep their order after reopen", num_victims);
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_gc_victims.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	/*the victims of the test are picked only by the test*/
+	disable_gc();
+	test_victim_order();
+	test_victims_after_reopen(get_option(options, 1));
+	log_info("GC victims test passed");
+	return EXIT_SUCCESS;
+}
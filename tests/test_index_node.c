@@ -16,7 +16,9 @@
   * This test takes as input the volume path and tests the following
   * scenarions: 1) Insert all pivots in ascending order and verify correctness.
   * 2) Insert all pivots in descending order and verify correctness. 3) Split
-  * index_node and check correctness for its children.
+  * index_node and check correctness for its children. 4) Append shortest
+  * separator pivots as compaction does, seal the node, and verify that the
+  * prefix compressed, Eytzinger searched node routes lookups as before.
 **/
 
 #include "arg_parser.h"
@@ -179,6 +181,62 @@ static uint32_t insert_and_verify_pivots(db_handle *handle, unsigned char *alpha
 	return num_node_keys;
 }
 
+static void append_seal_and_verify_pivots(void)
+{
+	struct index_node *node = NULL;
+	struct index_node *sealed_node = NULL;
+	posix_memalign((void **)&node, 4096, index_node_get_size());
+	posix_memalign((void **)&sealed_node, 4096, index_node_get_size());
+	index_init_node(DO_NOT_ADD_GUARD, node, internalNode);
+	index_set_immutable(node);
+	index_add_guard(node, PIVOT_BASE);
+	index_set_height(node, 1);
+
+	struct pivot_key **pivot = calloc(MAX_NODE_KEYS_NUM, sizeof(struct pivot_key *));
+	uint32_t num_node_keys = 0;
+	for (num_node_keys = 0; num_node_keys < MAX_NODE_KEYS_NUM; ++num_node_keys) {
+		char left_key[MAX_PIVOT_KEY_SIZE];
+		char right_key[MAX_PIVOT_KEY_SIZE];
+		int left_key_size = sprintf(left_key, "userkey%010uZZZZZZZZZZ", 2 * num_node_keys);
+		int right_key_size = sprintf(right_key, "userkey%010uAAAAAAAAAA", 2 * num_node_keys + 1);
+
+		pivot[num_node_keys] = calloc(1, sizeof(struct pivot_key) + MAX_PIVOT_KEY_SIZE);
+		index_fill_shortest_separator(pivot[num_node_keys], left_key, left_key_size, right_key,
+					      right_key_size);
+		if (pivot[num_node_keys]->size >= right_key_size) {
+			log_fatal("Separator of size %d is not shorter than the right key", pivot[num_node_keys]->size);
+			_exit(EXIT_FAILURE);
+		}
+
+		struct pivot_pointer right_child = { .child_offt = (uint64_t)PIVOT_BASE + num_node_keys + 1 };
+		struct insert_pivot_req ins_pivot_req = { .node = node,
+							  .key = pivot[num_node_keys],
+							  .right_child = &right_child };
+		if (!index_append_pivot(&ins_pivot_req))
+			break;
+	}
+
+	memcpy(sealed_node, node, index_node_get_size());
+	index_seal_node(sealed_node);
+	log_info("Appended %u separator pivots, verifying sealed node...", num_node_keys);
+	for (uint32_t i = 0; i < num_node_keys; ++i) {
+		uint64_t expected_value = index_binary_search(node, pivot[i], INDEX_KEY_TYPE);
+		uint64_t child_offt = index_binary_search(sealed_node, pivot[i], INDEX_KEY_TYPE);
+		if (child_offt != expected_value || child_offt != PIVOT_BASE + i + 1) {
+			log_fatal("i = %u Child offt corrupted shoud be %lu but its value is %lu", i, expected_value,
+				  child_offt);
+			_exit(EXIT_FAILURE);
+		}
+	}
+	log_info("Sealed node success!");
+
+	for (uint32_t i = 0; i <= num_node_keys && i < MAX_NODE_KEYS_NUM; ++i)
+		free(pivot[i]);
+	free(pivot);
+	free(sealed_node);
+	free(node);
+}
+
 int main(int argc, char *argv[])
 {
 	int help_flag = 0;
@@ -211,5 +269,6 @@ int main(int argc, char *argv[])
 		alphabet[i] = letter++;
 
 	insert_and_verify_pivots(handle, alphabet, ALPHABET_SIZE);
+	append_seal_and_verify_pivots();
 	free(alphabet);
 }
@@ -0,0 +1,98 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks the limiter that paces the background I/O of a DB: 1) A
+  * limited rate delays requests by the time the rate needs for their bytes
+  * while an unlimited one never delays them. 2) Slow gets make auto tuning
+  * throttle background I/O and fast ones lift the throttling again.
+**/
+
+#include <assert.h>
+#include <btree/io_limiter.h>
+#include <log.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_RATE (32UL * 1024 * 1024)
+#define TEST_REQUEST_SIZE (2UL * 1024 * 1024)
+#define TEST_NUM_REQUESTS 8
+#define TEST_TARGET_LATENCY_USEC 100
+
+static uint64_t request_all(struct io_limiter *limiter)
+{
+	uint64_t start = io_limiter_get_usec();
+	for (int i = 0; i < TEST_NUM_REQUESTS; ++i)
+		io_limiter_request(limiter, TEST_REQUEST_SIZE);
+	return io_limiter_get_usec() - start;
+}
+
+static void pace_requests_and_verify(void)
+{
+	struct io_limiter *limiter = io_limiter_create(TEST_RATE, 0);
+	uint64_t expected_usec = TEST_NUM_REQUESTS * TEST_REQUEST_SIZE * 1000000UL / TEST_RATE;
+	uint64_t elapsed_usec = request_all(limiter);
+	/*the bucket starts empty so it grants no burst*/
+	if (elapsed_usec < expected_usec - expected_usec / 10) {
+		log_fatal("Requests took %lu usec instead of at least %lu", elapsed_usec, expected_usec);
+		_exit(EXIT_FAILURE);
+	}
+
+	io_limiter_set_rate(limiter, 0);
+	assert(0 == io_limiter_get_rate(limiter));
+	elapsed_usec = request_all(limiter);
+	if (elapsed_usec > expected_usec / 10) {
+		log_fatal("Unlimited requests took %lu usec", elapsed_usec);
+		_exit(EXIT_FAILURE);
+	}
+	io_limiter_destroy(limiter);
+}
+
+static void report_latency_for_a_period(struct io_limiter *limiter, uint64_t latency_usec)
+{
+	for (int i = 0; i < 16; ++i)
+		io_limiter_report_latency(limiter, latency_usec);
+	usleep(IO_LIMITER_TUNE_USEC);
+}
+
+static void tune_rate_and_verify(void)
+{
+	struct io_limiter *limiter = io_limiter_create(0, TEST_TARGET_LATENCY_USEC);
+	request_all(limiter);
+	report_latency_for_a_period(limiter, 10 * TEST_TARGET_LATENCY_USEC);
+	/*the first request of the next period retunes the rate*/
+	io_limiter_request(limiter, 1);
+	uint64_t rate = io_limiter_get_rate(limiter);
+	if (0 == rate || rate < IO_LIMITER_MIN_RATE) {
+		log_fatal("Slow gets left background I/O at rate %lu", rate);
+		_exit(EXIT_FAILURE);
+	}
+
+	report_latency_for_a_period(limiter, TEST_TARGET_LATENCY_USEC / 10);
+	io_limiter_request(limiter, 1);
+	rate = io_limiter_get_rate(limiter);
+	if (rate) {
+		log_fatal("Fast gets kept background I/O throttled at rate %lu", rate);
+		_exit(EXIT_FAILURE);
+	}
+	io_limiter_destroy(limiter);
+}
+
+int main(void)
+{
+	pace_requests_and_verify();
+	tune_rate_and_verify();
+	log_info("I/O limiter test passed");
+	return 0;
+}
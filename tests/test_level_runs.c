@@ -0,0 +1,270 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks lazy leveling with LEVEL_RUNS = 3: 1) A base load is
+  * compacted to the last level, so L1 gathers several runs. 2) Each round
+  * overwrites and deletes keys and is flushed into a new L1 run, keys are
+  * overwritten and deleted in several runs and some deleted keys are put
+  * again. The fourth flush merges the runs of L1 into the next level. The last
+  * round stays in L0. 3) After each round gets and a full scan return the
+  * newest version of every key and no deleted key, and again after
+  * par_compact_range and after the DB is reopened.
+**/
+
+#include "arg_parser.h"
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+/*the base load overflows L1 so that it reaches a deeper level*/
+#define TEST_NUM_KEYS 300000
+#define TEST_VALUE_SIZE 32
+#define TEST_LEVEL_RUNS 3
+#define TEST_NUM_ROUNDS 5
+/*rounds update a fraction of the keys so that their L0 tree is not full*/
+#define TEST_STRIDE 128
+#define TEST_DELETED_KEY -1
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+static void fill_key(char *key_buf, uint64_t key_id)
+{
+	snprintf(key_buf, 32, "runs_key_%012lu", key_id);
+}
+
+static bool is_put_in_round(uint64_t key_id, int round)
+{
+	return 0 == key_id % TEST_STRIDE || (uint64_t)round == key_id % TEST_STRIDE;
+}
+
+/*Rounds delete keys put in their own run, in older runs and in the base load, some are put again later*/
+static bool is_deleted_in_round(uint64_t key_id, int round)
+{
+	uint64_t slot = key_id % TEST_STRIDE;
+	return slot == (uint64_t)round + 8 || (round >= 3 && slot == (uint64_t)round - 2) ||
+	       (2 == round && TEST_STRIDE / 2 == key_id % (2 * TEST_STRIDE));
+}
+
+/*Version of the key after the rounds up to last_round, TEST_DELETED_KEY if it is deleted*/
+static int get_expected_version(uint64_t key_id, int last_round)
+{
+	int version = 0;
+	for (int round = 1; round <= last_round; ++round) {
+		if (is_put_in_round(key_id, round))
+			version = round;
+		if (is_deleted_in_round(key_id, round))
+			version = TEST_DELETED_KEY;
+	}
+	return version;
+}
+
+static void put_key(par_handle handle, uint64_t key_id, int version)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	fill_key(key_buf, key_id);
+	memset(value_buf, 'A' + version, TEST_VALUE_SIZE);
+	struct par_key_value kv = { .k.data = key_buf,
+				    .k.size = strlen(key_buf) + 1,
+				    .v.val_buffer = value_buf,
+				    .v.val_size = TEST_VALUE_SIZE };
+	const char *error_message = NULL;
+	par_put(handle, &kv, &error_message);
+	if (error_message) {
+		log_fatal("Put failed: %s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void run_round(par_handle handle, int round)
+{
+	char key_buf[32];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		if (is_put_in_round(i, round))
+			put_key(handle, i, round);
+	}
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		if (!is_deleted_in_round(i, round))
+			continue;
+		fill_key(key_buf, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		const char *error_message = NULL;
+		par_delete(handle, &key, &error_message);
+		if (error_message) {
+			log_fatal("Delete failed: %s", error_message);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void verify_gets(par_handle handle, int last_round)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		int version = get_expected_version(i, last_round);
+		fill_key(key_buf, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		struct par_value value = { .val_buffer = value_buf, .val_buffer_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_get(handle, &key, &value, &error_message);
+		if (TEST_DELETED_KEY == version) {
+			if (!error_message) {
+				log_fatal("Deleted key %s is still there after round %d", key_buf, last_round);
+				_exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+		if (error_message || value.val_size != TEST_VALUE_SIZE || value_buf[0] != 'A' + version) {
+			log_fatal("Key %s has not version %d after round %d", key_buf, version, last_round);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void verify_scan(par_handle handle, int last_round)
+{
+	const char *error_message = NULL;
+	par_scanner scanner = par_init_scanner(handle, NULL, PAR_FETCH_FIRST, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	char key_buf[32];
+	uint64_t key_id = 0;
+	for (; par_is_valid(scanner); par_get_next(scanner), ++key_id) {
+		while (key_id < TEST_NUM_KEYS && TEST_DELETED_KEY == get_expected_version(key_id, last_round))
+			++key_id;
+		fill_key(key_buf, key_id);
+		struct par_key key = par_get_key(scanner);
+		struct par_value value = par_get_value(scanner);
+		int version = get_expected_version(key_id, last_round);
+		if (key_id >= TEST_NUM_KEYS || key.size != strlen(key_buf) + 1 || memcmp(key.data, key_buf, key.size)) {
+			log_fatal("Scan returned %.*s instead of %s after round %d", key.size, key.data, key_buf,
+				  last_round);
+			_exit(EXIT_FAILURE);
+		}
+		if (value.val_size != TEST_VALUE_SIZE || value.val_buffer[0] != 'A' + version) {
+			log_fatal("Scan returned an old version of %s after round %d", key_buf, last_round);
+			_exit(EXIT_FAILURE);
+		}
+	}
+	par_close_scanner(scanner);
+	while (key_id < TEST_NUM_KEYS && TEST_DELETED_KEY == get_expected_version(key_id, last_round))
+		++key_id;
+	if (key_id != TEST_NUM_KEYS) {
+		log_fatal("Scan stopped at key %lu after round %d", key_id, last_round);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+static par_handle open_db(par_db_options *db_options)
+{
+	const char *error_message = NULL;
+	db_options->options[LEVEL_RUNS].value = TEST_LEVEL_RUNS;
+	par_handle handle = par_open(db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	return handle;
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_level_runs.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "level_runs.db",
+				      .options = par_get_default_options() };
+	par_handle handle = open_db(&db_options);
+
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i)
+		put_key(handle, i, 0);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	verify_gets(handle, 0);
+
+	for (int round = 1; round <= TEST_NUM_ROUNDS; ++round) {
+		run_round(handle, round);
+		/*L1 is tiered above the base load, each flush adds a run to it*/
+		if (round < TEST_NUM_ROUNDS) {
+			par_flush(handle);
+			wait_for_compactions(handle);
+		}
+		verify_gets(handle, round);
+		verify_scan(handle, round);
+	}
+
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	verify_gets(handle, TEST_NUM_ROUNDS);
+	verify_scan(handle, TEST_NUM_ROUNDS);
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	db_options.create_flag = PAR_DONOT_CREATE_DB;
+	handle = open_db(&db_options);
+	verify_gets(handle, TEST_NUM_ROUNDS);
+	verify_scan(handle, TEST_NUM_ROUNDS);
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("Level runs test passed");
+	return EXIT_SUCCESS;
+}
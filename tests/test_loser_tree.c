@@ -0,0 +1,199 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * Merge microbenchmark for the tournament tree that scanners and compactions
+  * use. For 2 up to HEAP_SIZE runs of the same device level it merges sorted
+  * in place KVs whose keys repeat across runs the way compaction does: pop the
+  * smallest key and refill from its run. It verifies that keys come out in
+  * order with only the version of the newest run not marked as duplicate, that
+  * each output costs at most log2(k) key comparisons, and reports the
+  * comparisons per output and the merge throughput.
+**/
+
+#include <assert.h>
+#include <btree/kv_pairs.h>
+#include <log.h>
+#include <scanner/min_max_heap.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_KEY_SPACE (1U << 20)
+#define TEST_KEY_SIZE 20
+#define TEST_LEVEL_ID 1
+
+struct test_run {
+	char *kvs;
+	uint32_t *key_ids;
+	uint32_t num_kvs;
+	uint32_t position;
+};
+
+static uint32_t kv_record_size(void)
+{
+	return get_kv_metadata_size() + TEST_KEY_SIZE;
+}
+
+/*Every key lands in 1 of k runs on average so many keys have older versions*/
+static int in_run(uint32_t key_id, uint32_t run, uint32_t num_runs)
+{
+	uint32_t hash = key_id * 2654435761U + run * 2246822519U;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352dU;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bU;
+	hash ^= hash >> 16;
+	return hash % num_runs == 0;
+}
+
+static void create_runs(struct test_run *runs, uint32_t num_runs, int8_t *newest_run, uint8_t *num_versions)
+{
+	char key[TEST_KEY_SIZE + 1];
+	for (uint32_t run = 0; run < num_runs; ++run) {
+		runs[run].kvs = malloc((size_t)TEST_KEY_SPACE * kv_record_size());
+		runs[run].key_ids = malloc(TEST_KEY_SPACE * sizeof(uint32_t));
+		runs[run].num_kvs = 0;
+		runs[run].position = 0;
+		for (uint32_t key_id = 0; key_id < TEST_KEY_SPACE; ++key_id) {
+			if (!in_run(key_id, run, num_runs))
+				continue;
+			struct kv_splice *kv =
+				(struct kv_splice *)&runs[run].kvs[(size_t)runs[run].num_kvs * kv_record_size()];
+			snprintf(key, sizeof(key), "%0*u", TEST_KEY_SIZE, key_id);
+			set_key(kv, key, TEST_KEY_SIZE);
+			set_value_size(kv, 0);
+			runs[run].key_ids[runs[run].num_kvs++] = key_id;
+			newest_run[key_id] = run;
+			++num_versions[key_id];
+		}
+	}
+}
+
+static void fill_heap_node(struct test_run *runs, uint32_t run, struct sh_heap_node *node)
+{
+	memset(node, 0x00, sizeof(*node));
+	node->KV = &runs[run].kvs[(size_t)runs[run].position * kv_record_size()];
+	node->kv_size = kv_record_size();
+	node->level_id = TEST_LEVEL_ID;
+	node->active_tree = run;
+	node->type = KV_FORMAT;
+	node->cat = SMALL_INPLACE;
+}
+
+static double elapsed_sec(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void merge_runs_and_verify(uint32_t num_runs)
+{
+	struct test_run *runs = calloc(num_runs, sizeof(struct test_run));
+	int8_t *newest_run = malloc(TEST_KEY_SPACE);
+	memset(newest_run, 0xFF, TEST_KEY_SPACE);
+	uint8_t *num_versions = calloc(TEST_KEY_SPACE, sizeof(uint8_t));
+	create_runs(runs, num_runs, newest_run, num_versions);
+
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct sh_heap *heap = sh_alloc_heap();
+	sh_init_heap(heap, 0, MIN_HEAP);
+	struct sh_heap_node node;
+	for (uint32_t run = 0; run < num_runs; ++run) {
+		if (!runs[run].num_kvs)
+			continue;
+		fill_heap_node(runs, run, &node);
+		sh_insert_heap_node(heap, &node);
+	}
+
+	uint64_t num_outputs = 0;
+	uint64_t num_keys = 0;
+	int64_t last_key_id = -1;
+	uint32_t versions_seen = 0;
+	while (sh_remove_top(heap, &node)) {
+		struct test_run *run = &runs[node.active_tree];
+		uint32_t key_id = run->key_ids[run->position];
+		if ((int64_t)key_id < last_key_id) {
+			log_fatal("Key %u came out after key %ld", key_id, last_key_id);
+			_exit(EXIT_FAILURE);
+		}
+		versions_seen = (int64_t)key_id == last_key_id ? versions_seen + 1 : 1;
+		last_key_id = key_id;
+
+		int newest = node.active_tree == newest_run[key_id];
+		if (newest == node.duplicate || (newest && versions_seen != num_versions[key_id])) {
+			log_fatal("Version %u of key %u from run %u has duplicate %u, %u versions from run %d expected",
+				  versions_seen, key_id, node.active_tree, node.duplicate, num_versions[key_id],
+				  newest_run[key_id]);
+			_exit(EXIT_FAILURE);
+		}
+		num_keys += newest;
+		++num_outputs;
+
+		if (++run->position < run->num_kvs) {
+			fill_heap_node(runs, node.active_tree, &node);
+			sh_insert_heap_node(heap, &node);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	uint64_t num_kvs = 0;
+	uint64_t num_distinct_keys = 0;
+	for (uint32_t run = 0; run < num_runs; ++run)
+		num_kvs += runs[run].num_kvs;
+	for (uint32_t key_id = 0; key_id < TEST_KEY_SPACE; ++key_id)
+		num_distinct_keys += num_versions[key_id] > 0;
+	if (num_outputs != num_kvs || num_keys != num_distinct_keys) {
+		log_fatal("Merged %lu KVs and %lu keys instead of %lu and %lu", num_outputs, num_keys, num_kvs,
+			  num_distinct_keys);
+		_exit(EXIT_FAILURE);
+	}
+
+	uint32_t depth = 0;
+	while ((1U << depth) < num_runs)
+		++depth;
+	if (heap->num_comparisons > num_outputs * depth + num_runs) {
+		log_fatal("Merging %u runs took %lu comparisons for %lu outputs", num_runs, heap->num_comparisons,
+			  num_outputs);
+		_exit(EXIT_FAILURE);
+	}
+
+	double secs = elapsed_sec(&start, &end);
+	log_info("Merged %u runs: %lu KVs %lu duplicates %.2f comparisons per KV (log2(k) = %u) %.2f MKVs/s",
+		 num_runs, num_outputs, num_outputs - num_keys, (double)heap->num_comparisons / num_outputs, depth,
+		 num_outputs / secs / 1e6);
+
+	sh_destroy_heap(heap);
+	for (uint32_t run = 0; run < num_runs; ++run) {
+		free(runs[run].kvs);
+		free(runs[run].key_ids);
+	}
+	free(runs);
+	free(newest_run);
+	free(num_versions);
+}
+
+int main(void)
+{
+	for (uint32_t num_runs = 2; num_runs <= HEAP_SIZE; num_runs *= 2)
+		merge_runs_and_verify(num_runs);
+	merge_runs_and_verify(HEAP_SIZE - 3);
+	log_info("Tournament tree merge test passed");
+	return 0;
+}
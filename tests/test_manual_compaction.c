@@ -0,0 +1,210 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks the maintenance API: 1) par_flush compacts the L0 trees
+  * into L1 even though they are not full, and reports the progress of the
+  * compactions until they complete. 2) par_compact_range pushes a key range
+  * down to the last level. Every key stays readable after both. 3) Keys
+  * deleted with par_delete and par_single_delete stay deleted once their
+  * tombstones are compacted to the last level. 4) Key ranges below and above
+  * the compacted keys move down without merging, both the levels they leave
+  * and the levels they join have index node roots.
+**/
+
+#include "arg_parser.h"
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+#define TEST_NUM_KEYS 200000
+#define TEST_VALUE_SIZE 64
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+#define TEST_KEY_PREFIX "manual_key"
+/*prefixes that sort before and after TEST_KEY_PREFIX*/
+#define TEST_LOW_KEY_PREFIX "low_key"
+#define TEST_HIGH_KEY_PREFIX "top_key"
+
+static void fill_key(char *key_buf, const char *prefix, uint64_t key_id)
+{
+	snprintf(key_buf, 32, "%s_%012lu", prefix, key_id);
+}
+
+static void insert_keys(par_handle handle, const char *prefix, uint64_t first_key, uint64_t num_keys)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	for (uint64_t i = first_key; i < first_key + num_keys; ++i) {
+		fill_key(key_buf, prefix, i);
+		memset(value_buf, 'a' + i % 26, TEST_VALUE_SIZE);
+		struct par_key_value kv = { .k.data = key_buf,
+					    .k.size = strlen(key_buf) + 1,
+					    .v.val_buffer = value_buf,
+					    .v.val_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_put(handle, &kv, &error_message);
+		if (error_message) {
+			log_fatal("Put failed: %s", error_message);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*Deletes the first half of the keys, which were put once, half of them with single deletes*/
+static void delete_keys(par_handle handle)
+{
+	char key_buf[32];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS / 2; ++i) {
+		fill_key(key_buf, TEST_KEY_PREFIX, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		const char *error_message = NULL;
+		if (i < TEST_NUM_KEYS / 4)
+			par_delete(handle, &key, &error_message);
+		else
+			par_single_delete(handle, &key, &error_message);
+		if (error_message) {
+			log_fatal("Delete failed: %s", error_message);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void verify_keys(par_handle handle, const char *prefix, uint64_t first_key, uint64_t num_keys)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	for (uint64_t i = first_key; i < num_keys; ++i) {
+		fill_key(key_buf, prefix, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		struct par_value value = { .val_buffer = value_buf, .val_buffer_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_get(handle, &key, &value, &error_message);
+		if (error_message || value.val_size != TEST_VALUE_SIZE || value_buf[0] != (char)('a' + i % 26)) {
+			log_fatal("Key %s is lost or corrupted", key_buf);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*Waits for the requested compactions and returns how many completed*/
+static uint32_t wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return progress.completed;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_manual_compaction.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "manual_compaction.db",
+				      .options = par_get_default_options() };
+	par_handle handle = par_open(&db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	insert_keys(handle, TEST_KEY_PREFIX, 0, TEST_NUM_KEYS);
+	par_flush(handle);
+	uint32_t completed = wait_for_compactions(handle);
+	if (0 == completed) {
+		log_fatal("Flush compacted no L0 tree");
+		return EXIT_FAILURE;
+	}
+	verify_keys(handle, TEST_KEY_PREFIX, 0, TEST_NUM_KEYS);
+
+	/*a second batch leaves data in L0 and L1 above the last level*/
+	insert_keys(handle, TEST_KEY_PREFIX, TEST_NUM_KEYS / 2, TEST_NUM_KEYS);
+	char start_buf[32];
+	char end_buf[32];
+	fill_key(start_buf, TEST_KEY_PREFIX, TEST_NUM_KEYS / 2);
+	fill_key(end_buf, TEST_KEY_PREFIX, TEST_NUM_KEYS);
+	struct par_key start = { .data = start_buf, .size = strlen(start_buf) + 1 };
+	struct par_key end = { .data = end_buf, .size = strlen(end_buf) + 1 };
+	par_compact_range(handle, &start, &end);
+	if (wait_for_compactions(handle) <= completed) {
+		log_fatal("Range compaction compacted nothing");
+		return EXIT_FAILURE;
+	}
+	verify_keys(handle, TEST_KEY_PREFIX, 0, TEST_NUM_KEYS + TEST_NUM_KEYS / 2);
+
+	delete_keys(handle);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	for (uint64_t i = 0; i < TEST_NUM_KEYS / 2; ++i) {
+		fill_key(start_buf, TEST_KEY_PREFIX, i);
+		start.size = strlen(start_buf) + 1;
+		if (PAR_KEY_NOT_FOUND != par_exists(handle, &start)) {
+			log_fatal("Deleted key %s is still there", start_buf);
+			return EXIT_FAILURE;
+		}
+	}
+	verify_keys(handle, TEST_KEY_PREFIX, TEST_NUM_KEYS / 2, TEST_NUM_KEYS + TEST_NUM_KEYS / 2);
+
+	/*the ranges do not overlap the last level, so they are moved down level by level with their index roots*/
+	insert_keys(handle, TEST_LOW_KEY_PREFIX, 0, TEST_NUM_KEYS);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	verify_keys(handle, TEST_LOW_KEY_PREFIX, 0, TEST_NUM_KEYS);
+	verify_keys(handle, TEST_KEY_PREFIX, TEST_NUM_KEYS / 2, TEST_NUM_KEYS + TEST_NUM_KEYS / 2);
+
+	insert_keys(handle, TEST_HIGH_KEY_PREFIX, 0, TEST_NUM_KEYS);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	verify_keys(handle, TEST_HIGH_KEY_PREFIX, 0, TEST_NUM_KEYS);
+	verify_keys(handle, TEST_LOW_KEY_PREFIX, 0, TEST_NUM_KEYS);
+	verify_keys(handle, TEST_KEY_PREFIX, TEST_NUM_KEYS / 2, TEST_NUM_KEYS + TEST_NUM_KEYS / 2);
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("Manual compaction test passed");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks that compactions rewrite only the partitions of a device
+  * level that their source overlaps: 1) A base load is flushed to L1 with a
+  * small partition_size, so L1 is cut into several partitions. 2) Each round
+  * updates a narrow key range in L0 and flushes it to L1. The partitions of
+  * L1 outside the range must be kept with their segments, the ones it
+  * overlaps are rewritten. The rounds update different ranges, so a later
+  * round reuses the segments that the previous one freed. 3) All the keys
+  * return their latest version after each round and after the DB is reopened.
+**/
+
+#include "arg_parser.h"
+#include <btree/btree.h>
+#include <btree/segment_allocator.h>
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+/*the base load stays below the target size of L1*/
+#define TEST_NUM_KEYS 20000
+#define TEST_VALUE_SIZE 100
+#define TEST_PARTITION_SIZE (256 * 1024UL)
+#define TEST_NUM_ROUNDS 3
+#define TEST_RANGE_SIZE 100
+/*a narrow range overlaps a partition or two at a boundary*/
+#define TEST_MAX_REWRITTEN_PARTITIONS 2
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+static void fill_key(char *key_buf, uint64_t key_id)
+{
+	snprintf(key_buf, 32, "partition_key_%012lu", key_id);
+}
+
+/*Round r updates the keys of the r-th range, spread over the key space*/
+static uint64_t get_range_start(int round)
+{
+	return (uint64_t)round * TEST_NUM_KEYS / (TEST_NUM_ROUNDS + 1);
+}
+
+static int get_expected_version(uint64_t key_id, int last_round)
+{
+	for (int round = last_round; round > 0; --round) {
+		if (key_id >= get_range_start(round) && key_id < get_range_start(round) + TEST_RANGE_SIZE)
+			return round;
+	}
+	return 0;
+}
+
+static void put_key(par_handle handle, uint64_t key_id, int version)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	fill_key(key_buf, key_id);
+	memset(value_buf, 'A' + version, TEST_VALUE_SIZE);
+	struct par_key_value kv = { .k.data = key_buf,
+				    .k.size = strlen(key_buf) + 1,
+				    .v.val_buffer = value_buf,
+				    .v.val_size = TEST_VALUE_SIZE };
+	const char *error_message = NULL;
+	par_put(handle, &kv, &error_message);
+	if (error_message) {
+		log_fatal("Put failed: %s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void verify_keys(par_handle handle, int last_round, const char *phase)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		int version = get_expected_version(i, last_round);
+		fill_key(key_buf, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		struct par_value value = { .val_buffer = value_buf, .val_buffer_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_get(handle, &key, &value, &error_message);
+		if (error_message || value.val_size != TEST_VALUE_SIZE || value_buf[0] != 'A' + version) {
+			log_fatal("Key %s has not version %d %s", key_buf, version, phase);
+			_exit(EXIT_FAILURE);
+		}
+	}
+	log_info("Keys are correct %s", phase);
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+/*Copies the partition table of L1, the compaction that replaces L1 frees it*/
+static void get_L1_partitions(par_handle handle, struct level_partition_table *partitions)
+{
+	struct level_descriptor *level = &((db_handle *)handle)->db_desc->levels[1];
+	struct node_header *root = level->root_w[0] ? level->root_w[0] : level->root_r[0];
+	struct level_partition_table *table = seg_get_partition_table(root);
+	if (!table || table->num_partitions < 2 * TEST_MAX_REWRITTEN_PARTITIONS) {
+		log_fatal("L1 has %u partitions", table ? table->num_partitions : 0);
+		_exit(EXIT_FAILURE);
+	}
+	memcpy(partitions, table, sizeof(*partitions));
+}
+
+/*Partitions of the new L1 that kept the segments and the root of a partition of the old one*/
+static uint32_t count_kept_partitions(const struct level_partition_table *old_partitions,
+				      const struct level_partition_table *new_partitions)
+{
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < new_partitions->num_partitions; ++i) {
+		const struct level_partition *partition = &new_partitions->partitions[i];
+		for (uint32_t j = 0; j < old_partitions->num_partitions; ++j) {
+			if (partition->root_offt == old_partitions->partitions[j].root_offt &&
+			    partition->first_segment_offt == old_partitions->partitions[j].first_segment_offt) {
+				++kept;
+				break;
+			}
+		}
+	}
+	return kept;
+}
+
+static par_handle open_db(par_db_options *db_options)
+{
+	const char *error_message = NULL;
+	db_options->options[PARTITION_SIZE].value = TEST_PARTITION_SIZE;
+	par_handle handle = par_open(db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	return handle;
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_partitions.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "partitions.db",
+				      .options = par_get_default_options() };
+	par_handle handle = open_db(&db_options);
+
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i)
+		put_key(handle, i, 0);
+	par_flush(handle);
+	wait_for_compactions(handle);
+	verify_keys(handle, 0, "after the base load");
+
+	struct level_partition_table old_partitions;
+	struct level_partition_table new_partitions;
+	get_L1_partitions(handle, &old_partitions);
+	for (int round = 1; round <= TEST_NUM_ROUNDS; ++round) {
+		for (uint64_t i = get_range_start(round); i < get_range_start(round) + TEST_RANGE_SIZE; ++i)
+			put_key(handle, i, round);
+		par_flush(handle);
+		wait_for_compactions(handle);
+
+		get_L1_partitions(handle, &new_partitions);
+		uint32_t kept = count_kept_partitions(&old_partitions, &new_partitions);
+		log_info("Round %d kept %u of %u partitions", round, kept, old_partitions.num_partitions);
+		if (kept + TEST_MAX_REWRITTEN_PARTITIONS < old_partitions.num_partitions ||
+		    kept == new_partitions.num_partitions) {
+			log_fatal("Round %d kept %u of %u partitions for a narrow update", round, kept,
+				  old_partitions.num_partitions);
+			return EXIT_FAILURE;
+		}
+		verify_keys(handle, round, "after a round");
+		old_partitions = new_partitions;
+	}
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	db_options.create_flag = PAR_DONOT_CREATE_DB;
+	handle = open_db(&db_options);
+	verify_keys(handle, TEST_NUM_ROUNDS, "after reopen");
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("Partitions test passed");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,267 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks par_delete_range end to end: 1) A base load is compacted
+  * to a device level and some keys are updated in L0. 2) par_delete_range
+  * deletes a range that spans both, then keys inside the range are put again.
+  * 3) Gets and a full scan skip the deleted keys and return the keys put after
+  * the delete. 4) The DB is reopened, so the range delete is replayed from the
+  * L0 log, and the keys are checked again. 5) par_flush carries the range
+  * tombstone to L1 and par_compact_range merges it with the keys it deletes,
+  * the keys are checked after each and after another reopen. A range with its
+  * start after its end is rejected.
+**/
+
+#include "arg_parser.h"
+#include <log.h>
+#include <parallax/parallax.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define MAX_REGIONS 128
+/*the base load overflows L0 so that it reaches a device level*/
+#define TEST_NUM_KEYS 200000
+#define TEST_VALUE_SIZE 32
+#define TEST_RANGE_START 50000
+#define TEST_RANGE_END 150000
+/*keys updated in L0 before the delete and put again inside the range after it*/
+#define TEST_UPDATE_STRIDE 4
+#define TEST_REPUT_STRIDE 16
+#define TEST_DELETED_KEY -1
+/*compactions of the test complete well within this*/
+#define TEST_TIMEOUT_SEC 120
+
+static void fill_key(char *key_buf, uint64_t key_id)
+{
+	snprintf(key_buf, 32, "range_key_%012lu", key_id);
+}
+
+/*Version of the key after the range delete and the puts that follow it, TEST_DELETED_KEY if it is deleted*/
+static int get_expected_version(uint64_t key_id)
+{
+	if (key_id >= TEST_RANGE_START && key_id < TEST_RANGE_END)
+		return 0 == key_id % TEST_REPUT_STRIDE ? 2 : TEST_DELETED_KEY;
+	return 0 == key_id % TEST_UPDATE_STRIDE ? 1 : 0;
+}
+
+static void put_key(par_handle handle, uint64_t key_id, int version)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	fill_key(key_buf, key_id);
+	memset(value_buf, 'A' + version, TEST_VALUE_SIZE);
+	struct par_key_value kv = { .k.data = key_buf,
+				    .k.size = strlen(key_buf) + 1,
+				    .v.val_buffer = value_buf,
+				    .v.val_size = TEST_VALUE_SIZE };
+	const char *error_message = NULL;
+	par_put(handle, &kv, &error_message);
+	if (error_message) {
+		log_fatal("Put failed: %s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static const char *delete_range(par_handle handle, uint64_t start_id, uint64_t end_id)
+{
+	char start_buf[32];
+	char end_buf[32];
+	fill_key(start_buf, start_id);
+	fill_key(end_buf, end_id);
+	struct par_key start = { .data = start_buf, .size = strlen(start_buf) + 1 };
+	struct par_key end = { .data = end_buf, .size = strlen(end_buf) + 1 };
+	const char *error_message = NULL;
+	par_delete_range(handle, &start, &end, &error_message);
+	return error_message;
+}
+
+static void verify_gets(par_handle handle, const char *phase)
+{
+	char key_buf[32];
+	char value_buf[TEST_VALUE_SIZE];
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i) {
+		int version = get_expected_version(i);
+		fill_key(key_buf, i);
+		struct par_key key = { .data = key_buf, .size = strlen(key_buf) + 1 };
+		struct par_value value = { .val_buffer = value_buf, .val_buffer_size = TEST_VALUE_SIZE };
+		const char *error_message = NULL;
+		par_get(handle, &key, &value, &error_message);
+		if (TEST_DELETED_KEY == version) {
+			if (!error_message) {
+				log_fatal("Key %s of the deleted range is still there %s", key_buf, phase);
+				_exit(EXIT_FAILURE);
+			}
+			continue;
+		}
+		if (error_message || value.val_size != TEST_VALUE_SIZE || value_buf[0] != 'A' + version) {
+			log_fatal("Key %s has not version %d %s", key_buf, version, phase);
+			_exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void verify_scan(par_handle handle, const char *phase)
+{
+	const char *error_message = NULL;
+	par_scanner scanner = par_init_scanner(handle, NULL, PAR_FETCH_FIRST, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	char key_buf[32];
+	uint64_t key_id = 0;
+	for (; par_is_valid(scanner); par_get_next(scanner), ++key_id) {
+		while (key_id < TEST_NUM_KEYS && TEST_DELETED_KEY == get_expected_version(key_id))
+			++key_id;
+		fill_key(key_buf, key_id);
+		struct par_key key = par_get_key(scanner);
+		struct par_value value = par_get_value(scanner);
+		if (key_id >= TEST_NUM_KEYS || key.size != strlen(key_buf) + 1 || memcmp(key.data, key_buf, key.size)) {
+			log_fatal("Scan returned %.*s instead of %s %s", key.size, key.data, key_buf, phase);
+			_exit(EXIT_FAILURE);
+		}
+		if (value.val_size != TEST_VALUE_SIZE || value.val_buffer[0] != 'A' + get_expected_version(key_id)) {
+			log_fatal("Scan returned an old version of %s %s", key_buf, phase);
+			_exit(EXIT_FAILURE);
+		}
+	}
+	par_close_scanner(scanner);
+	while (key_id < TEST_NUM_KEYS && TEST_DELETED_KEY == get_expected_version(key_id))
+		++key_id;
+	if (key_id != TEST_NUM_KEYS) {
+		log_fatal("Scan stopped at key %lu %s", key_id, phase);
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void verify_keys(par_handle handle, const char *phase)
+{
+	verify_gets(handle, phase);
+	verify_scan(handle, phase);
+	log_info("Keys are correct %s", phase);
+}
+
+static void wait_for_compactions(par_handle handle)
+{
+	struct par_compaction_progress progress = { 0 };
+	for (uint32_t i = 0; i < TEST_TIMEOUT_SEC * 10; ++i) {
+		par_get_compaction_progress(handle, &progress);
+		if (0 == progress.pending)
+			return;
+		usleep(100000);
+	}
+	log_fatal("%u manual compactions still pending", progress.pending);
+	_exit(EXIT_FAILURE);
+}
+
+static par_handle open_db(par_db_options *db_options)
+{
+	const char *error_message = NULL;
+	par_handle handle = par_open(db_options, &error_message);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	return handle;
+}
+
+static par_handle reopen_db(par_handle handle, par_db_options *db_options)
+{
+	const char *error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		_exit(EXIT_FAILURE);
+	}
+	db_options->create_flag = PAR_DONOT_CREATE_DB;
+	return open_db(db_options);
+}
+
+int main(int argc, char *argv[])
+{
+	int help_flag = 0;
+	struct wrap_option options[] = {
+		{ { "help", no_argument, &help_flag, 1 }, "Prints valid arguments for test_range_delete.", NULL,
+		  INTEGER },
+		{ { "file", required_argument, 0, 'a' },
+		  "--file=path to file of db, parameter that specifies the target where parallax is going to run.",
+		  NULL,
+		  STRING },
+		{ { 0, 0, 0, 0 }, "End of arguments", NULL, INTEGER }
+	};
+	unsigned options_len = (sizeof(options) / sizeof(struct wrap_option));
+	arg_parse(argc, argv, options, options_len);
+	arg_print_options(help_flag, options, options_len);
+
+	char *path = get_option(options, 1);
+	const char *error_message = par_format(path, MAX_REGIONS);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	par_db_options db_options = { .volume_name = path,
+				      .create_flag = PAR_CREATE_DB,
+				      .db_name = "range_delete.db",
+				      .options = par_get_default_options() };
+	par_handle handle = open_db(&db_options);
+
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; ++i)
+		put_key(handle, i, 0);
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+
+	/*the range covers keys of the active L0 tree and of the device level*/
+	for (uint64_t i = 0; i < TEST_NUM_KEYS; i += TEST_UPDATE_STRIDE)
+		put_key(handle, i, 1);
+
+	if (!delete_range(handle, TEST_RANGE_END, TEST_RANGE_START)) {
+		log_fatal("Range delete with its start after its end succeeded");
+		return EXIT_FAILURE;
+	}
+	error_message = delete_range(handle, TEST_RANGE_START, TEST_RANGE_END);
+	if (error_message) {
+		log_fatal("Range delete failed: %s", error_message);
+		return EXIT_FAILURE;
+	}
+
+	for (uint64_t i = TEST_RANGE_START; i < TEST_RANGE_END; i += TEST_REPUT_STRIDE)
+		put_key(handle, i, 2);
+	verify_keys(handle, "after the range delete");
+
+	/*L0 is not flushed on close, the range delete is replayed from its log*/
+	handle = reopen_db(handle, &db_options);
+	verify_keys(handle, "after the range delete is replayed");
+
+	par_flush(handle);
+	wait_for_compactions(handle);
+	verify_keys(handle, "after the range tombstone is flushed");
+
+	par_compact_range(handle, NULL, NULL);
+	wait_for_compactions(handle);
+	verify_keys(handle, "after the range tombstone is compacted");
+
+	handle = reopen_db(handle, &db_options);
+	verify_keys(handle, "after the compacted DB is reopened");
+
+	error_message = par_close(handle);
+	if (error_message) {
+		log_fatal("%s", error_message);
+		return EXIT_FAILURE;
+	}
+	log_info("Range delete test passed");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+// Copyright [2021] [FORTH-ICS]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+/**
+  * This test checks the range tombstones of the trees: 1) Overlapping and
+  * touching ranges coalesce into a sorted list of disjoint ranges that hold
+  * their start keys but not their end keys. 2) Ranges delete only the keys of
+  * older trees and levels. 3) A list restored from its serialized form holds
+  * the same ranges.
+**/
+
+#include <assert.h>
+#include <btree/conf.h>
+#include <btree/range_tombstone.h>
+#include <log.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void add_range(struct range_tombstones *rts, const char *start, const char *end)
+{
+	rt_add(rts, start, strlen(start), end, strlen(end));
+}
+
+static void check_key(const struct range_tombstones *rts, const char *key, bool covered)
+{
+	if (rt_covers(rts, key, strlen(key)) != covered) {
+		log_fatal("Key %s should %sbe covered", key, covered ? "" : "not ");
+		_exit(EXIT_FAILURE);
+	}
+}
+
+static void check_ranges(const struct range_tombstones *rts)
+{
+	/*[b, d) and [c, f) coalesce, [f, g) touches them, [k, m) stays apart*/
+	assert(rts->num_tombstones == 2);
+	check_key(rts, "a", false);
+	check_key(rts, "b", true);
+	check_key(rts, "b0", true);
+	check_key(rts, "e", true);
+	check_key(rts, "f", true);
+	check_key(rts, "fz", true);
+	check_key(rts, "g", false);
+	check_key(rts, "j", false);
+	check_key(rts, "k", true);
+	check_key(rts, "m", false);
+	/*shorter keys go first on equal prefixes*/
+	check_key(rts, "", false);
+	check_key(rts, "l999", true);
+}
+
+static void coalesce_and_verify(struct range_tombstones *rts)
+{
+	add_range(rts, "k", "m");
+	add_range(rts, "c", "f");
+	add_range(rts, "b", "d");
+	add_range(rts, "f", "g");
+	check_ranges(rts);
+
+	/*a range inside an existing one changes nothing*/
+	add_range(rts, "c", "e");
+	check_ranges(rts);
+	log_info("Coalesced ranges test passed");
+}
+
+static void rank_and_verify(struct range_tombstones *rts)
+{
+	uint8_t active_tree = 1;
+	/*L0 trees are newer than device levels, the active tree is the newest of them*/
+	for (uint8_t tree_id = 0; tree_id < NUM_TREES_PER_LEVEL; ++tree_id) {
+		uint32_t rank = rt_get_tree_rank(active_tree, 0, tree_id);
+		assert(tree_id == active_tree || rt_get_tree_rank(active_tree, 0, active_tree) > rank);
+		assert(rank > rt_get_tree_rank(active_tree, 1, tree_id));
+	}
+	/*the tree after the active one is the oldest of L0*/
+	assert(rt_get_tree_rank(active_tree, 0, active_tree + 1) < rt_get_tree_rank(active_tree, 0, active_tree - 1));
+	/*newer runs take larger tree ids and deeper levels are older*/
+	assert(rt_get_tree_rank(active_tree, 1, 1) > rt_get_tree_rank(active_tree, 1, 0));
+	assert(rt_get_tree_rank(active_tree, 1, 0) > rt_get_tree_rank(active_tree, 2, NUM_TREES_PER_LEVEL - 1));
+
+	struct rt_ranked_list lists[1] = { { .list = rts, .rank = rt_get_tree_rank(active_tree, 1, 0) } };
+	assert(rt_is_deleted(lists, 1, rt_get_tree_rank(active_tree, 2, 0), "c", 1));
+	assert(!rt_is_deleted(lists, 1, rt_get_tree_rank(active_tree, 2, 0), "h", 1));
+	/*ranges never delete the keys of their own tree or of newer ones*/
+	assert(!rt_is_deleted(lists, 1, rt_get_tree_rank(active_tree, 1, 0), "c", 1));
+	assert(!rt_is_deleted(lists, 1, rt_get_tree_rank(active_tree, 0, active_tree), "c", 1));
+	log_info("Ranked ranges test passed");
+}
+
+static void serialize_and_verify(struct range_tombstones *rts)
+{
+	char buf[4096];
+	uint32_t size = rt_serialize(rts, buf, sizeof(buf));
+	assert(size > 0);
+	/*lists that do not fit are not written*/
+	assert(0 == rt_serialize(rts, buf, size - 1));
+
+	struct range_tombstones *restored = rt_deserialize(buf, size);
+	assert(restored);
+	check_ranges(restored);
+	rt_destroy(restored);
+
+	memset(buf, 0x00, sizeof(buf));
+	assert(NULL == rt_deserialize(buf, sizeof(buf)));
+	log_info("Serialized ranges test passed");
+}
+
+int main(void)
+{
+	struct range_tombstones *rts = rt_create();
+	coalesce_and_verify(rts);
+	rank_and_verify(rts);
+	serialize_and_verify(rts);
+	rt_destroy(rts);
+	log_info("Range tombstones test passed");
+	return 0;
+}